@@ -7,9 +7,11 @@
 #include "AssignConfidenceApplication.h"
 #include "ComputeQValues.h"
 #include "io/MatchCollectionParser.h"
+#include "io/PSMBatch.h"
 #include "PosteriorEstimator.h"
 #include "util/FileUtils.h"
 #include "util/Params.h"
+#include "util/ParallelSort.h"
 #include "util/StringUtils.h"
 
 #include <map>
@@ -151,7 +153,7 @@ int AssignConfidenceApplication::main(const vector<string>& input_files) {
 
   bool ascending, distinct_matches;
   MatchCollectionParser parser;
-  map<string, FLOAT_T> BestPeptideScore;
+  PeptideScoreMap BestPeptideScore;
 
   bool avgTdc = estimation_method == TDC_METHOD;
   for (vector<string>::const_iterator iter = input_files.begin(); iter != input_files.end(); ++iter) {
@@ -166,9 +168,9 @@ int AssignConfidenceApplication::main(const vector<string>& input_files) {
 
     check_target_decoy_files(target_path, decoy_path);
 
-    if (!FileUtils::Exists(target_path)) {
+    if (!FileUtils::Exists(target_path) && !PSMBatch::published(target_path)) {
       carp(CARP_FATAL, "Target file %s not found", target_path.c_str());
-    } else if (!FileUtils::Exists(decoy_path)) {
+    } else if (!FileUtils::Exists(decoy_path) && !PSMBatch::published(decoy_path)) {
       if (estimation_method == MIXMAX_METHOD) {
         carp(CARP_FATAL, "Cannot find file %s. Decoy file from separate target-decoy search is "
                          "required for mix-max q-value calculation", decoy_path.c_str());
@@ -454,23 +456,19 @@ int AssignConfidenceApplication::main(const vector<string>& input_files) {
       // Find and keep the best score for each decoy peptide.
       if (estimation_method == PEPTIDE_LEVEL_METHOD) {
         FLOAT_T score = match->getScore(score_type);
-        string peptideStr = getPeptideSeq(match);
-
-        FLOAT_T bestScore;
-        try {
-          bestScore = BestPeptideScore.at(peptideStr);
-          if (bestScore != score) {  //not the best scoring peptide
-            if (is_decoy) {
-              num_decoy_peptide_skipped++;
-            } else {
-              num_target_peptide_skipped++;              
-            }
-            continue;
+        PeptideScoreMap::iterator best = BestPeptideScore.find(getPeptideSeq(match));
+
+        if (best == BestPeptideScore.end()) {
+          carp(CARP_DEBUG, "Error in peptide-level filtering");
+        } else if (best->second != score) {  //not the best scoring peptide
+          if (is_decoy) {
+            num_decoy_peptide_skipped++;
           } else {
-            BestPeptideScore.at(peptideStr) += ascending ? -1.0 : 1.0;  //make sure only one best scoring peptide reported.
+            num_target_peptide_skipped++;              
           }
-        } catch (const out_of_range& oor) {
-          carp(CARP_DEBUG, "Error in peptide-level filtering");
+          continue;
+        } else {
+          best->second += ascending ? -1.0 : 1.0;  //make sure only one best scoring peptide reported.
         }
       }
 
@@ -615,11 +613,7 @@ int AssignConfidenceApplication::main(const vector<string>& input_files) {
   case PEPTIDE_LEVEL_METHOD:
     {
       target_scores = target_matches->extractScores(score_type);
-      vector<FLOAT_T> decoy_scores;
-      for (map<int, MatchCollection*>::const_iterator i = decoy_matches.begin(); i != decoy_matches.end(); i++) {
-        vector<FLOAT_T> curScores = i->second->extractScores(score_type);
-        copy(curScores.begin(), curScores.end(), back_inserter(decoy_scores));
-      }
+      vector<FLOAT_T> decoy_scores = extractDecoyScores(decoy_matches, score_type);
       carp(CARP_INFO, "There are %d target and %d decoy PSMs for q-value computation.",
            target_scores.size(), decoy_scores.size());
       qvalues = compute_decoy_qvalues_tdc(target_scores, decoy_scores, ascending, 1.0);
@@ -628,11 +622,7 @@ int AssignConfidenceApplication::main(const vector<string>& input_files) {
   case MIXMAX_METHOD:
     {
       target_scores = target_matches->extractScores(score_type);
-      vector<FLOAT_T> decoy_scores;
-      for (map<int, MatchCollection*>::const_iterator i = decoy_matches.begin(); i != decoy_matches.end(); i++) {
-        vector<FLOAT_T> curScores = i->second->extractScores(score_type);
-        copy(curScores.begin(), curScores.end(), back_inserter(decoy_scores));
-      }
+      vector<FLOAT_T> decoy_scores = extractDecoyScores(decoy_matches, score_type);
       carp(CARP_INFO, "There are %d target and %d decoy PSMs for q-value computation.",
            target_scores.size(), decoy_scores.size());
       qvalues = compute_decoy_qvalues_mixmax(target_scores, decoy_scores, ascending, Params::GetDouble("pi-zero"));
@@ -680,9 +670,8 @@ int AssignConfidenceApplication::main(const vector<string>& input_files) {
       if (match->getScore(QVALUE_TDC) > qValueThreshold) {
         break;
       }
-      spectrum_flag_->insert(make_pair(pair<string, unsigned int>(
-        match->getSpectrum()->getFullFilename(),
-        match->getSpectrum()->getFirstScan() * 10 + match->getCharge()), true));
+      spectrum_flag_->set(match->getSpectrum()->getFullFilename(),
+                          match->getSpectrum()->getFirstScan(), match->getCharge());
 
       match->setDatabaseIndexName(index_name_);
 
@@ -701,6 +690,34 @@ int AssignConfidenceApplication::main(const vector<string>& input_files) {
 } // Main
 
 
+/**
+ * \returns The scores of all decoy collections in one vector.
+ */
+vector<FLOAT_T> AssignConfidenceApplication::extractDecoyScores(
+  const map<int, MatchCollection*>& decoy_matches,
+  SCORER_TYPE_T score_type
+) {
+  size_t total = 0;
+  for (map<int, MatchCollection*>::const_iterator i = decoy_matches.begin(); i != decoy_matches.end(); i++) {
+    total += i->second->getMatchTotal();
+  }
+  vector<FLOAT_T> decoy_scores;
+  decoy_scores.reserve(total);
+  for (map<int, MatchCollection*>::const_iterator i = decoy_matches.begin(); i != decoy_matches.end(); i++) {
+    vector<FLOAT_T> curScores = i->second->extractScores(score_type);
+    decoy_scores.insert(decoy_scores.end(), curScores.begin(), curScores.end());
+  }
+  return decoy_scores;
+}
+
+/**
+ * \returns The number of threads to sort scores with.
+ */
+int AssignConfidenceApplication::numThreads() {
+  int num_threads = Params::GetInt("num-threads");
+  return num_threads > 0 ? num_threads : boost::thread::hardware_concurrency();
+}
+
 /**
 * Find the best-scoring match for each peptide in a given collection.
 * Only consider the top-ranked PSM per spectrum.
@@ -713,7 +730,7 @@ void AssignConfidenceApplication::identify_best_psm_per_peptide(
 ) {
   /* Instantiate a hash table.  key = peptide; value = maximal xcorr
      for that peptide. */
-  map<string, FLOAT_T> best_score_per_peptide;
+  PeptideScoreMap best_score_per_peptide;
 
   // Store in the hash the best score per peptide.
   MatchIterator* match_iterator 
@@ -726,7 +743,7 @@ void AssignConfidenceApplication::identify_best_psm_per_peptide(
       char *peptide = match->getModSequenceStrWithSymbols();
       FLOAT_T this_score = match->getScore(score_type);
 
-      map<string, FLOAT_T>::iterator map_position 
+      PeptideScoreMap::iterator map_position 
         = best_score_per_peptide.find(peptide);
 
       if (map_position == best_score_per_peptide.end()) {
@@ -734,7 +751,7 @@ void AssignConfidenceApplication::identify_best_psm_per_peptide(
       } else {
         // FIXME: Need a generic compare operator for score_type.
         if (map_position->second < this_score) {
-          best_score_per_peptide[peptide] = this_score;
+          map_position->second = this_score;
         }
       }
       free(peptide);
@@ -752,14 +769,14 @@ void AssignConfidenceApplication::identify_best_psm_per_peptide(
       char* peptide = match->getModSequenceStrWithSymbols();
       FLOAT_T this_score = match->getScore(score_type);
 
-      map<string, FLOAT_T>::iterator map_position 
+      PeptideScoreMap::iterator map_position 
         = best_score_per_peptide.find(peptide);
 
       if (map_position->second == this_score) {
         match->setBestPerPeptide();
         
         // Prevent ties from causing two peptides to be best.
-        best_score_per_peptide[peptide] = HUGE_VAL;
+        map_position->second = HUGE_VAL;
       }
       
       free(peptide);
@@ -816,14 +833,17 @@ AssignConfidenceApplication::AtdcScoreSet::AtdcScoreSet(
     }
   }
 
+  numDecoySets_ = decoyScores.size();
+  targetScores_.reserve(targetScores.size());
+  decoyScores_.reserve(targetScores.size() * numDecoySets_);
   for (size_t i = 0; i < targetScores.size(); i++) {
     FLOAT_T targetScore = ascending ? targetScores[i] : -targetScores[i];
-    if (i > 0 && targetScore < scores_.back().first) {
+    if (i > 0 && targetScore < targetScores_.back()) {
       carp(CARP_FATAL, "internal error; unsorted scores were passed into AtdcScoreSet");
     }
-    scores_.push_back(make_pair(targetScore, vector<FLOAT_T>(decoyScores.size(), 0)));
-    for (size_t j = 0; j < decoyScores.size(); j++) {
-      scores_.back().second[j] = ascending ? decoyScores[j][i] : -decoyScores[j][i];
+    targetScores_.push_back(targetScore);
+    for (size_t j = 0; j < numDecoySets_; j++) {
+      decoyScores_.push_back(ascending ? decoyScores[j][i] : -decoyScores[j][i]);
     }
   }
 }
@@ -850,9 +870,9 @@ void AssignConfidenceApplication::AtdcScoreSet::getScores(
   }
 
   if (ascending) {
-    sort(targetScores.begin(), targetScores.end(), sortScoresAsc);
+    ParallelSort::Sort(targetScores, sortScoresAsc, numThreads());
   } else {
-    sort(targetScores.begin(), targetScores.end(), sortScoresDesc);
+    ParallelSort::Sort(targetScores, sortScoresDesc, numThreads());
   }
 
   map< boost::tuple<int, int, int>, pair<size_t, size_t> > idxMap; // <file, scan, charge> -> <idx, decoys found>
@@ -899,8 +919,8 @@ void AssignConfidenceApplication::AtdcScoreSet::getScores(
 }
 
 vector<FLOAT_T> AssignConfidenceApplication::AtdcScoreSet::fdps() const {
-  const size_t numScores = scores_.size();
-  const size_t numDecoySets = scores_.front().second.size();
+  const size_t numScores = targetScores_.size();
+  const size_t numDecoySets = numDecoySets_;
   const FLOAT_T bc1 = -1/(FLOAT_T)numDecoySets;
 
   vector<size_t> optIdxCnt(numScores, 0);
@@ -910,8 +930,8 @@ vector<FLOAT_T> AssignConfidenceApplication::AtdcScoreSet::fdps() const {
     vector<int> ntds(numScores, 0);
     vector<int> ndds(numScores, 0);
     for (size_t j = 0; j < numScores; j++) {
-      FLOAT_T scoreTarget = scores_[j].first;
-      FLOAT_T scoreDecoy = scores_[j].second[i];
+      FLOAT_T scoreTarget = targetScores_[j];
+      FLOAT_T scoreDecoy = decoyScores_[j * numDecoySets + i];
       bool targetBetter = scoreTarget != scoreDecoy ? scoreTarget < scoreDecoy : myrandom_limit(2) == 0;
       if (targetBetter) {
         optIdxCnt[j]++;
@@ -1015,12 +1035,15 @@ vector<FLOAT_T> AssignConfidenceApplication::AtdcScoreSet::fdps() const {
 
 void AssignConfidenceApplication::AtdcScoreSet::histBin(vector<int>& hist, FLOAT_T x) const {
   // the value x is in the nth bin if edges[n] < x <= edges[n+1]
-  // edges are [-inf, <target scores...>]
-  for (size_t i = 0; i < scores_.size(); i++) {
-    if (x <= scores_[i].first) {
-      hist[i]++;
-      return;
-    }
+  // edges are [-inf, <target scores...>], so the bin is that of the first
+  // target score not below x
+  if (isnan(x)) {
+    return;
+  }
+  vector<FLOAT_T>::const_iterator i =
+    lower_bound(targetScores_.begin(), targetScores_.end(), x);
+  if (i != targetScores_.end()) {
+    hist[i - targetScores_.begin()]++;
   }
 }
 
@@ -1077,11 +1100,11 @@ vector<FLOAT_T> AssignConfidenceApplication::compute_decoy_qvalues_tdc(
 
   // Sort both sets of scores.
   if (ascending) {
-    sort(target_scores.begin(), target_scores.end(), Match::ScoreLess);
-    sort(decoy_scores.begin(), decoy_scores.end(), Match::ScoreLess);
+    ParallelSort::Sort(target_scores, Match::ScoreLess, numThreads());
+    ParallelSort::Sort(decoy_scores, Match::ScoreLess, numThreads());
   } else {
-    sort(target_scores.begin(), target_scores.end(), Match::ScoreGreater);
-    sort(decoy_scores.begin(), decoy_scores.end(), Match::ScoreGreater);
+    ParallelSort::Sort(target_scores, Match::ScoreGreater, numThreads());
+    ParallelSort::Sort(decoy_scores, Match::ScoreGreater, numThreads());
   }
 
   // Compute false discovery rate for each target score.
@@ -1164,11 +1187,11 @@ vector<FLOAT_T> AssignConfidenceApplication::compute_decoy_qvalues_mixmax(
 
   //Sort decoy and target stores
   if (ascending) {
-    sort(target_scores.begin(), target_scores.end(), greater<FLOAT_T>());
-    sort(decoy_scores.begin(), decoy_scores.end(), greater<FLOAT_T>());
+    ParallelSort::Sort(target_scores, greater<FLOAT_T>(), numThreads());
+    ParallelSort::Sort(decoy_scores, greater<FLOAT_T>(), numThreads());
   } else {
-    sort(target_scores.begin(), target_scores.end());
-    sort(decoy_scores.begin(), decoy_scores.end());
+    ParallelSort::Sort(target_scores, numThreads());
+    ParallelSort::Sort(decoy_scores, numThreads());
   }
 
   //histogram of the target scores.
@@ -1242,7 +1265,7 @@ vector<FLOAT_T> AssignConfidenceApplication::compute_decoy_qvalues_mixmax(
 
 void AssignConfidenceApplication::peptide_level_filtering(
   MatchCollection* match_collection,
-  map<string, FLOAT_T>* BestPeptideScore, 
+  PeptideScoreMap* BestPeptideScore, 
   SCORER_TYPE_T score_type,
   bool ascending) {
 
@@ -1251,17 +1274,14 @@ void AssignConfidenceApplication::peptide_level_filtering(
     while (temp_iter->hasNext()) {
       Crux::Match* match = temp_iter->next();
       FLOAT_T score = match->getScore(score_type);
-      string peptideStr = getPeptideSeq(match);
-
-      FLOAT_T bestScore = 0.0;
-      try {
-        bestScore = BestPeptideScore->at(peptideStr);
-      } catch (const out_of_range& oor) {
-        BestPeptideScore->insert(make_pair(peptideStr, score));
+      pair<PeptideScoreMap::iterator, bool> inserted = BestPeptideScore->insert(
+        make_pair(getPeptideSeq(match), score));
+      if (inserted.second) {
         continue;
       }
+      FLOAT_T bestScore = inserted.first->second;
       if ((ascending && bestScore > score) || (!ascending && score > bestScore)) {
-        BestPeptideScore->at(peptideStr) = score;
+        inserted.first->second = score;
       }
     }
     delete temp_iter;
@@ -1280,11 +1300,11 @@ string AssignConfidenceApplication::getPeptideSeq(Match* match) {
   return peptideSeq;
 }
 
-map<pair<string, unsigned int>, bool>* AssignConfidenceApplication::getSpectrumFlag() {
+SpectrumFlags* AssignConfidenceApplication::getSpectrumFlag() {
   return spectrum_flag_;
 }
 
-void AssignConfidenceApplication::setSpectrumFlag(map<pair<string, unsigned int>, bool>* spectrum_flag) {
+void AssignConfidenceApplication::setSpectrumFlag(SpectrumFlags* spectrum_flag) {
   spectrum_flag_ = spectrum_flag;
 }
 
@@ -1421,6 +1441,7 @@ vector<string> AssignConfidenceApplication::getOptions() const {
     "list-of-files",
     "combine-charge-states",
     "combine-modified-peptides",
+    "num-threads",
     "fileroot"
   };
   return vector<string>(arr, arr + sizeof(arr) / sizeof(string));
@@ -21,8 +21,10 @@
 #include "model/MatchCollection.h"
 #include "io/OutputFiles.h"
 #include "model/Peptide.h"
+#include "SpectrumFlags.h"
 #include "boost/tuple/tuple.hpp" // This will be <tuple> once we move to C++11.
 #include "boost/tuple/tuple_comparison.hpp"
+#include "boost/unordered_map.hpp"
 
 /**
  * Legal values for the --estimation-method option.
@@ -40,7 +42,7 @@ typedef enum _estimation_method ESTIMATION_METHOD_T;
 
 class AssignConfidenceApplication : public CruxApplication {
  protected:
-  map<pair<string, unsigned int>, bool>* spectrum_flag_;  // this variable is used in Cascade Search, this is an idicator 
+  SpectrumFlags* spectrum_flag_;  // this variable is used in Cascade Search, this is an idicator 
   unsigned int iteration_cnt_;
   OutputFiles* output_;
   unsigned int accepted_psms_;
@@ -73,12 +75,16 @@ class AssignConfidenceApplication : public CruxApplication {
       const boost::tuple<FLOAT_T, int, int, int>& x,
       const boost::tuple<FLOAT_T, int, int, int>& y);
 
-    std::vector< std::pair<FLOAT_T, std::vector<FLOAT_T> > > scores_; // <target score, [decoy scores]>
+    // Target scores in ascending order, and the decoy scores of each
+    // target, numDecoySets_ at a time, in the same order.
+    std::vector<FLOAT_T> targetScores_;
+    std::vector<FLOAT_T> decoyScores_;
+    size_t numDecoySets_;
   };
 
  public:
-  map<pair<string, unsigned int>, bool>* getSpectrumFlag();
-  void setSpectrumFlag(map<pair<string, unsigned int>, bool>* spectrum_flag);
+  SpectrumFlags* getSpectrumFlag();
+  void setSpectrumFlag(SpectrumFlags* spectrum_flag);
   void setIterationCnt(unsigned int iteration_cnt);
   void setOutput(OutputFiles *output);
   unsigned int getAcceptedPSMs();
@@ -163,15 +169,24 @@ class AssignConfidenceApplication : public CruxApplication {
     int      num_pvals,
     FLOAT_T  pi_zero);
 
+  /**
+   * Best score of each peptide, keyed by its sequence.
+   */
+  typedef boost::unordered_map<std::string, FLOAT_T> PeptideScoreMap;
+
   void peptide_level_filtering(
     MatchCollection* match_collection,
-    std::map<string, FLOAT_T>* BestPeptideScore,
+    PeptideScoreMap* BestPeptideScore,
     SCORER_TYPE_T score_type,
     bool ascending);
   
   void identify_best_psm_per_peptide
     (MatchCollection* all_matches,
     SCORER_TYPE_T score_type);
+  static std::vector<FLOAT_T> extractDecoyScores(
+    const std::map<int, MatchCollection*>& decoy_matches,
+    SCORER_TYPE_T score_type);
+  static int numThreads();
   static void convert_fdr_to_qvalue(
     std::vector<FLOAT_T>& qvalues); ///< Come in as FDRs, go out as q-values.
 
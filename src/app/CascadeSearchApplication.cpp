@@ -6,6 +6,8 @@
 #include "io/OutputFiles.h"
 #include "AssignConfidenceApplication.h"
 #include "TideSearchApplication.h"
+#include "SpectrumFlags.h"
+#include "tide/spectrum_collection.h"
 #include "util/Params.h"
 #include "util/StringUtils.h"
 #include "util/FileUtils.h"
@@ -31,7 +33,9 @@ CascadeSearchApplication::~CascadeSearchApplication() {
  * main method for CascadeSearchApplication
  */
 int CascadeSearchApplication::main(int argc, char** argv) {
-  map<pair<string, unsigned int>, bool>* spectrum_flag = new map<pair<string, unsigned int>, bool>;
+  SpectrumFlags* spectrum_flag = new SpectrumFlags();
+  // Spectra are read once and searched against every database.
+  map<string, SpectrumCollection*> spectra;
 
   carp(CARP_INFO, "Running cascade-search...");
 
@@ -40,15 +44,18 @@ int CascadeSearchApplication::main(int argc, char** argv) {
   vector<string> database_indices = StringUtils::Split(database_string, ',');
   OutputFiles* output = new OutputFiles(this);
 
-  int return_code;
+  int return_code = 0;
   for (unsigned int cascade_cnt = 0; cascade_cnt < database_indices.size(); ++cascade_cnt) {
 
-    //carry out tide-search
+    //carry out tide-search, passing its PSMs to assign-confidence in memory;
+    //they are never formatted as text (see keepResultsInMemory)
     TideSearchApplication TideSearchProgram;
     TideSearchProgram.setSpectrumFlag(spectrum_flag);
+    TideSearchProgram.keepSpectra(&spectra);
+    TideSearchProgram.keepResultsInMemory(false);
     return_code = TideSearchProgram.main(Params::GetStrings("tide spectra file"), database_indices[cascade_cnt]);
     if (return_code != 0) {
-      return return_code;
+      break;
     }
 
     //pass the output from Tide-Search to Assign-Confidence
@@ -65,7 +72,7 @@ int CascadeSearchApplication::main(int argc, char** argv) {
 
     return_code = AssignConfidenceProgram.main(bridge_file_name);
     if (return_code != 0) {
-      return return_code;
+      break;
     }
     spectrum_flag = AssignConfidenceProgram.getSpectrumFlag();
 
@@ -84,9 +91,13 @@ int CascadeSearchApplication::main(int argc, char** argv) {
     carp(CARP_INFO, "Finished cascade-search of database %d.\n", cascade_cnt + 1);
 
   }
+  for (map<string, SpectrumCollection*>::iterator i = spectra.begin(); i != spectra.end(); ++i) {
+    delete i->second;
+  }
+  delete spectrum_flag;
   delete output;
 
-  return 0;
+  return return_code;
 }
 
 /**
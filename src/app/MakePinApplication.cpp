@@ -201,6 +201,7 @@ vector<string> MakePinApplication::getOptions() const {
     "fileroot",
     "filestem-prefixes",
     "max-charge-feature",
+    "num-threads",
     "output-dir",
     "output-file",
     "overwrite",
@@ -16,6 +16,7 @@
 #include "io/PMCDelimitedFileWriter.h"
 #include "io/PMCPepXMLWriter.h"
 #include "io/PMCSQTWriter.h"
+#include "io/PSMBatchFile.h"
 #include "io/PSMReader.h"
 #include "io/PSMWriter.h"
 #include "io/SQTReader.h"
@@ -39,12 +40,14 @@ void PSMConvertApplication::convertFile(string input_format, string output_forma
   }
   
   bool isTabDelimited = false;
-  PSMReader* reader;
+  PSMReader* reader = NULL; // binary files are parsed without one
   
   if (input_format != "auto") {
     if (input_format == "tsv") {
       reader = new MatchFileReader(input_file.c_str(), data);
       isTabDelimited = true;
+    } else if (input_format == "psm") {
+      isTabDelimited = true;
     } else if (input_format == "html") {
       carp(CARP_FATAL, "HTML format has not been implemented yet");
     } else if (input_format == "sqt") {
@@ -56,13 +59,15 @@ void PSMConvertApplication::convertFile(string input_format, string output_forma
     } else if (input_format == "mzidentml") {
       reader = new MzIdentMLReader(input_file.c_str(), data);
     } else {
-      carp(CARP_FATAL, "Invalid input format. Valid formats are: tsv, html, "
+      carp(CARP_FATAL, "Invalid input format. Valid formats are: tsv, psm, html, "
            "sqt, pin, pepxml, mzidentml.");
     }
   } else {
     if (StringUtils::IEndsWith(input_file, ".txt")) {
       reader = new MatchFileReader(input_file.c_str(), data);
       isTabDelimited = true;
+    } else if (StringUtils::IEndsWith(input_file, PSMBatchFile::EXTENSION)) {
+      isTabDelimited = true;
     } else if (StringUtils::IEndsWith(input_file, ".html")) {
       carp(CARP_FATAL, "HTML format has not been implemented yet");
     } else if (StringUtils::IEndsWith(input_file, ".sqt")) {
@@ -75,13 +80,17 @@ void PSMConvertApplication::convertFile(string input_format, string output_forma
       reader = new MzIdentMLReader(input_file.c_str(), data);
     } else {
       carp(CARP_FATAL, "Could not determine input format, "
-           "Please name your files ending with .txt, .html, .sqt, .pin, "
+           "Please name your files ending with .txt, .psm, .html, .sqt, .pin, "
            ".xml, .mzid or use the --input-format option to "
            "specify file type");
     }
   }
   
-  MatchCollection* collection = reader->parse();
+  MatchCollection* collection = reader != NULL ?
+    reader->parse() : MatchFileReader::parse(input_file, data, NULL);
+  if (collection == NULL) {
+    carp(CARP_FATAL, "Failed to parse %s.", input_file.c_str());
+  }
   
   if (!isTabDelimited) {
     collection->setHasDistinctMatches(distinct_matches);
@@ -195,6 +195,13 @@ int PipelineApplication::runSearch(
   if (comet) {
     return ((CometApplication*)app)->main(spectra);
   }
+  // Tab-delimited results are passed to the post-processor in memory,
+  // saving the time to write and parse them again.
+  if (Params::GetString("post-processor") != "none" &&
+      StringUtils::IEndsWith(resultsFiles->front(), ".txt")) {
+    ((TideSearchApplication*)app)->keepResultsInMemory(
+      Params::GetBool("write-search-results"));
+  }
   return ((TideSearchApplication*)app)->main(spectra);
 }
 
@@ -273,7 +280,8 @@ vector<string> PipelineApplication::getOptions() const {
   string arr[] = {
     "bullseye",
     "search-engine",
-    "post-processor"
+    "post-processor",
+    "write-search-results"
   };
   vector<string> options(arr, arr + sizeof(arr) / sizeof(string));
 
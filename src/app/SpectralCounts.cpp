@@ -444,7 +444,7 @@ FLOAT_T SpectralCounts::sumMatchIntensity(Match* match,
   Spectrum* spectrum = spectra->getSpectrum(scan);
 
   if (spectrum == NULL) {
-    carp(CARP_FATAL, "scan: %d doesn't exist or not found!");
+    carp(CARP_FATAL, "scan: %d doesn't exist or not found!", scan);
     return 0.0;
   }
 
@@ -469,6 +469,7 @@ FLOAT_T SpectralCounts::sumMatchIntensity(Match* match,
     }
   }
   delete ion_series;
+  delete spectrum; // a copy
   free(peptide_seq);
 
   return match_intensity;
@@ -491,8 +492,14 @@ void SpectralCounts::getPeptideScores() {
   Crux::SpectrumCollection* spectra = NULL;
 
   // for SIN, parse out spectrum collection from ms2 fiel
+  // Parsed once here, so that each match's spectrum is looked up by scan
+  // rather than read from the file again.
   if( measure_ == MEASURE_SIN ) {
     spectra = SpectrumCollectionFactory::create(Params::GetString("input-ms2"));
+    if (!spectra->parse()) {
+      carp(CARP_FATAL, "Failed to parse spectra from %s.",
+           Params::GetString("input-ms2").c_str());
+    }
   }
 
   for(set<Match*>::iterator match_it = matches_.begin();
@@ -1076,7 +1083,8 @@ vector<string> SpectralCounts::getOptions() const {
     "custom-threshold-min",
     "mzid-use-pass-threshold",
     "protein-database",
-    "find-peptides"
+    "find-peptides",
+    "num-threads"
   };
   return vector<string>(arr, arr + sizeof(arr) / sizeof(string));
 }
@@ -0,0 +1,84 @@
+/**
+ * \file SpectrumFlags.cpp
+ * \brief Marks the spectrum-charge pairs that cascade-search has already
+ * identified; see SpectrumFlags.h.
+ */
+
+#include <algorithm>
+#include "SpectrumFlags.h"
+#include "tide/spectrum_collection.h"
+
+using namespace std;
+
+SpectrumFlags::SpectrumFlags() {
+}
+
+SpectrumFlags::~SpectrumFlags() {
+}
+
+int SpectrumFlags::addFile(const string& file, const ::SpectrumCollection* spectra) {
+  int index;
+  vector<pair<int, int> > flagged;
+  map<string, int>::const_iterator lookup = file_indices_.find(file);
+  if (lookup == file_indices_.end()) {
+    index = flags_.size();
+    file_indices_[file] = index;
+    flags_.push_back(vector<bool>());
+    positions_.push_back(PositionList());
+  } else {
+    // Pairs are flagged again by scan and charge, in case the spectra are
+    // in another order than when they were flagged.
+    index = lookup->second;
+    for (PositionList::const_iterator i = positions_[index].begin();
+         i != positions_[index].end();
+         ++i) {
+      if (flags_[index][i->second]) {
+        flagged.push_back(i->first);
+      }
+    }
+  }
+
+  const vector<SpectrumCollection::SpecCharge>* spec_charges = spectra->SpecCharges();
+  flags_[index].assign(spec_charges->size(), false);
+  PositionList& positions = positions_[index];
+  positions.clear();
+  positions.reserve(spec_charges->size());
+  for (size_t i = 0; i < spec_charges->size(); i++) {
+    const SpectrumCollection::SpecCharge& sc = (*spec_charges)[i];
+    positions.push_back(make_pair(make_pair(sc.spectrum->SpectrumNumber(), sc.charge), i));
+  }
+  sort(positions.begin(), positions.end());
+  for (vector<pair<int, int> >::const_iterator i = flagged.begin(); i != flagged.end(); ++i) {
+    set(file, i->first, i->second);
+  }
+  return index;
+}
+
+int SpectrumFlags::fileIndex(const string& file) const {
+  map<string, int>::const_iterator lookup = file_indices_.find(file);
+  return lookup != file_indices_.end() ? lookup->second : -1;
+}
+
+bool SpectrumFlags::set(const string& file, int scan, int charge) {
+  int index = fileIndex(file);
+  if (index < 0) {
+    return false;
+  }
+  const PositionList& positions = positions_[index];
+  pair<int, int> key(scan, charge);
+  PositionList::const_iterator i = lower_bound(
+    positions.begin(), positions.end(), make_pair(key, (size_t)0));
+  bool found = false;
+  for (; i != positions.end() && i->first == key; ++i) {
+    flags_[index][i->second] = true;
+    found = true;
+  }
+  return found;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
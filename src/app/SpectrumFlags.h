@@ -0,0 +1,74 @@
+/**
+ * \file SpectrumFlags.h
+ * \brief Marks the spectrum-charge pairs that cascade-search has already
+ * identified, so that later rounds skip them.
+ * Each spectrum file searched by tide-search is registered with the
+ * spectrum-charge pairs it searches, and one bit is kept per pair, in the
+ * order of the file's SpectrumCollection. Search threads test the bits
+ * without locking; they are only set between rounds, by
+ * assign-confidence, which knows a PSM by its file, scan and charge.
+ */
+
+#ifndef SPECTRUMFLAGS_H
+#define SPECTRUMFLAGS_H
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+class SpectrumCollection;
+
+class SpectrumFlags {
+
+ public:
+  SpectrumFlags();
+  ~SpectrumFlags();
+
+  /**
+   * Registers the spectrum-charge pairs of spectra, which were read from
+   * file. Pairs flagged for an earlier collection of the same file stay
+   * flagged.
+   * \returns The index of the file, for isSet().
+   */
+  int addFile(const std::string& file, const ::SpectrumCollection* spectra);
+
+  /**
+   * \returns The index of a registered file, or -1.
+   */
+  int fileIndex(const std::string& file) const;
+
+  /**
+   * \returns Whether the sc_index-th spectrum-charge pair of a registered
+   * file is flagged.
+   */
+  bool isSet(int file, size_t sc_index) const {
+    return flags_[file][sc_index];
+  }
+
+  /**
+   * Flags the spectrum-charge pairs of file with the given scan and charge.
+   * \returns Whether the file had any.
+   */
+  bool set(const std::string& file, int scan, int charge);
+
+ protected:
+  /**
+   * The pairs of a file as ((scan, charge), pair index), sorted so that
+   * those with the same scan and charge are found by binary search.
+   */
+  typedef std::vector<std::pair<std::pair<int, int>, size_t> > PositionList;
+
+  std::map<std::string, int> file_indices_;
+  std::vector<std::vector<bool> > flags_;
+  std::vector<PositionList> positions_;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
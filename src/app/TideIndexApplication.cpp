@@ -1,5 +1,8 @@
 #include <cstdio>
 #include <fstream>
+#define NO_BOOST_DATE_TIME_INLINE
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include "io/carp.h"
 #include "util/CarpStreamBuf.h"
 #include "util/AminoAcidUtil.h"
@@ -10,6 +13,7 @@
 #include "TideIndexApplication.h"
 #include "TideMatchSet.h"
 #include "app/tide/modifications.h"
+#include "app/tide/mapped_peptide_index.h"
 #include "app/tide/records_to_vector-inl.h"
 #include "ParamMedicApplication.h"
 
@@ -19,7 +23,8 @@
 
 extern void AddTheoreticalPeaks(const vector<const pb::Protein*>& proteins,
                                 const string& input_filename,
-                                const string& output_filename);
+                                const string& output_filename,
+                                bool store_peaks);
 extern void AddMods(HeadedRecordReader* reader,
                     string out_file,
                     string tmpDir,                    
@@ -29,6 +34,7 @@ extern void AddMods(HeadedRecordReader* reader,
 DECLARE_int32(max_mods);
 DECLARE_int32(min_mods);
 DECLARE_int32(modsoutputter_file_threshold);
+DECLARE_int32(mods_memory_mb);
 
 TideIndexApplication::TideIndexApplication() {
 }
@@ -67,6 +73,7 @@ int TideIndexApplication::main(
   FLAGS_max_mods = Params::GetInt("max-mods");
   FLAGS_min_mods = Params::GetInt("min-mods");
   FLAGS_modsoutputter_file_threshold = Params::GetInt("modsoutputter-threshold");
+  FLAGS_mods_memory_mb = Params::GetInt("modsoutputter-memory");
   bool allowDups = Params::GetBool("allow-dups");
   if (FLAGS_min_mods > FLAGS_max_mods) {
     carp(CARP_FATAL, "The value for 'min-mods' cannot be greater than the value "
@@ -111,11 +118,18 @@ int TideIndexApplication::main(
 
   var_mod_table.SerializeUniqueDeltas();
 
+  // Precomputed theoretical peaks are binned the way tide-search will bin
+  // them; otherwise the bin settings don't matter here.
+  bool precompute_peaks = Params::GetBool("precompute-peaks");
+  double bin_width = precompute_peaks ?
+    Params::GetDouble("mz-bin-width") : MassConstants::bin_width_;
+  double bin_offset = precompute_peaks ?
+    Params::GetDouble("mz-bin-offset") : MassConstants::bin_offset_;
   if (!MassConstants::Init(var_mod_table.ParsedModTable(), 
     var_mod_table.ParsedNtpepModTable(), 
     var_mod_table.ParsedCtpepModTable(),
     var_mod_table.ParsedNtproModTable(),
-    var_mod_table.ParsedCtproModTable(), MassConstants::bin_width_, MassConstants::bin_offset_)) {
+    var_mod_table.ParsedCtproModTable(), bin_width, bin_offset)) {
     carp(CARP_FATAL, "Error in MassConstants::Init");
   }
 
@@ -132,6 +146,7 @@ int TideIndexApplication::main(
   string out_proteins = FileUtils::Join(index, "protix");
   string out_peptides = FileUtils::Join(index, "pepix");
   string out_aux = FileUtils::Join(index, "auxlocs");
+  string out_mapped = FileUtils::Join(index, MappedPeptideIndex::kFileName);
   string modless_peptides = out_peptides + ".nomods.tmp";
   string peakless_peptides = out_peptides + ".nopeaks.tmp";
   ofstream* out_target_list = NULL;
@@ -165,6 +180,11 @@ int TideIndexApplication::main(
                        "different index name");
     }
   }
+  // A mapped index from an earlier run describes a pepix that is about to be
+  // replaced; it is written again below if --mmap-index is set.
+  if (FileUtils::Exists(out_mapped)) {
+    FileUtils::Remove(out_mapped);
+  }
 
   // Start tide-index
   carp(CARP_INFO, "Reading %s and computing unmodified peptides...",
@@ -326,7 +346,14 @@ int TideIndexApplication::main(
   }
 
   carp(CARP_INFO, "Precomputing theoretical spectra...");
-  AddTheoreticalPeaks(proteins, peakless_peptides, out_peptides);
+  AddTheoreticalPeaks(proteins, peakless_peptides, out_peptides, precompute_peaks);
+
+  if (Params::GetBool("mmap-index")) {
+    carp(CARP_INFO, "Writing mapped peptide index...");
+    if (!MappedPeptideIndex::Write(out_peptides, out_mapped)) {
+      carp(CARP_FATAL, "Error writing %s", out_mapped.c_str());
+    }
+  }
 
   // Clean up
   for (vector<const pb::Protein*>::iterator i = proteins.begin();
@@ -404,17 +431,23 @@ vector<string> TideIndexApplication::getOptions() const {
     "min-mass",
     "min-mods",
     "missed-cleavages",
+    "mmap-index",
     "mod-precision",
     "mods-spec",
+    "modsoutputter-memory",
+    "mz-bin-offset",
+    "mz-bin-width",
     "nterm-peptide-mods-spec",
     "nterm-protein-mods-spec",
     "auto-modifications",
     "auto-modifications-spectra",
     "num-decoys-per-target",
+    "num-threads",
     "output-dir",
     "overwrite",
     "parameter-file",
     "peptide-list",
+    "precompute-peaks",
     "seed",
     "temp-dir",
     "verbosity"
@@ -486,49 +519,91 @@ void TideIndexApplication::fastaToPb(
   int curProtein = -1;
   vector< pair< ProteinInfo, vector<PeptideInfo> > > cleavedPeptideInfo;
   set<string> setTargets, setDecoys;
-  map<const string*, TargetInfo> targetInfo;
+  // TargetInfo of the first occurrence of each element of setTargets, in
+  // the same order
+  vector<TargetInfo> targetInfo;
 
-  // Iterate over all proteins in FASTA file
-  unsigned int targetsGenerated = 0, decoysGenerated = 0;
+  // Read all proteins, then cleave them and compute peptide masses on
+  // several threads. Everything else is done in protein order afterwards,
+  // so the index does not depend on the number of threads.
   while (GeneratePeptides::getNextProtein(fastaStream, &proteinName, proteinSequence)) {
     outProteinSequences.push_back(proteinSequence);
     cleavedPeptideInfo.push_back(make_pair(
       ProteinInfo(proteinName, proteinSequence), vector<PeptideInfo>()));
-    const ProteinInfo& proteinInfo = cleavedPeptideInfo.back().first;
-    vector<PeptideInfo>& cleavedPeptides = cleavedPeptideInfo.back().second;
+    proteinSequence = new string;
+  }
+  delete proteinSequence;
+
+  int numThreads = Params::GetInt("num-threads");
+  if (numThreads < 1) {
+    numThreads = boost::thread::hardware_concurrency();
+  }
+  numThreads = max(1, min(numThreads, (int)cleavedPeptideInfo.size()));
+  vector< vector<FLOAT_T> > peptideMasses(cleavedPeptideInfo.size());
+  DigestOptions options;
+  options.enzyme = enzyme;
+  options.digestion = digestion;
+  options.missedCleavages = missedCleavages;
+  options.minLength = minLength;
+  options.maxLength = maxLength;
+  options.massType = massType;
+  get_mass_amino_acid('A', massType); // amino acid masses are set up lazily
+  invalidPepCnt += digestProteinsOnThreads(&cleavedPeptideInfo, &peptideMasses,
+                                           numThreads, &options);
+
+  // Deduplicate the targets on several threads while the proteins are
+  // written below. Each thread takes a contiguous range of proteins, with
+  // about the same number of peptides, and keeps the first occurrence of each
+  // sequence in it; merging the ranges in order then gives the first
+  // occurrence over the whole FASTA file, as a serial pass would.
+  vector< map<string, TargetInfo> > rangeTargets;
+  boost::thread_group targetThreads;
+  if (!allowDups && decoyType != NO_DECOYS) {
+    size_t totalPeptides = 0;
+    for (size_t p = 0; p < cleavedPeptideInfo.size(); p++) {
+      totalPeptides += cleavedPeptideInfo[p].second.size();
+    }
+    rangeTargets.resize(numThreads);
+    size_t begin = 0, peptidesSoFar = 0;
+    for (int t = 0; t < numThreads; t++) {
+      size_t end = begin;
+      size_t target = totalPeptides * (t + 1) / numThreads;
+      while (end < cleavedPeptideInfo.size() &&
+             (t == numThreads - 1 || peptidesSoFar < target)) {
+        peptidesSoFar += cleavedPeptideInfo[end++].second.size();
+      }
+      targetThreads.create_thread(boost::bind(&TideIndexApplication::collectTargets,
+        &cleavedPeptideInfo, &peptideMasses, begin, end, minMass, maxMass,
+        &rangeTargets[t]));
+      begin = end;
+    }
+  }
+
+  // Iterate over all proteins in FASTA file
+  unsigned int targetsGenerated = 0, decoysGenerated = 0;
+  for (size_t p = 0; p < cleavedPeptideInfo.size(); p++) {
+    const ProteinInfo& proteinInfo = cleavedPeptideInfo[p].first;
+    const vector<PeptideInfo>& cleavedPeptides = cleavedPeptideInfo[p].second;
+    proteinSequence = outProteinSequences[p];
     // Write pb::Protein
-    writePbProtein(proteinWriter, ++curProtein, proteinName, *proteinSequence);
-    cleavedPeptides = GeneratePeptides::cleaveProtein(
-      *proteinSequence, enzyme, digestion, missedCleavages, minLength, maxLength);
+    writePbProtein(proteinWriter, ++curProtein, proteinInfo.name, *proteinSequence);
     // Iterate over all generated peptides for this protein
-    for (vector<PeptideInfo>::iterator i = cleavedPeptides.begin();
-         i != cleavedPeptides.end(); ) {
-      FLOAT_T pepMass = calcPepMassTide(&(*i), massType, &proteinInfo);
-      if (pepMass < 0.0) {
-        // Sequence contained some invalid character
-        carp(CARP_DEBUG, "Ignoring invalid sequence <%s>", i->Sequence().c_str());
-        ++invalidPepCnt;
-        i = cleavedPeptides.erase(i);
-        continue;
-      } else if (pepMass < minMass || pepMass > maxMass) {
+    for (size_t i = 0; i < cleavedPeptides.size(); i++) {
+      FLOAT_T pepMass = peptideMasses[p][i];
+      if (pepMass < minMass || pepMass > maxMass) {
         // Skip to next peptide if not in mass range
-        ++i;
         continue;
       }
       // Add target to heap
-      TideIndexPeptide pepTarget(pepMass, i->Length(), proteinSequence, curProtein, i->Position());
+      const PeptideInfo& peptide = cleavedPeptides[i];
+      TideIndexPeptide pepTarget(pepMass, peptide.Length(), proteinSequence, curProtein, peptide.Position());
       outPeptideHeap.push_back(pepTarget);
       push_heap(outPeptideHeap.begin(), outPeptideHeap.end(), greater<TideIndexPeptide>());
-      if (!allowDups && decoyType != NO_DECOYS) {
-        const string* setTarget = &*(setTargets.insert(i->Sequence()).first);
-        targetInfo.insert(make_pair(setTarget, TargetInfo(proteinInfo, i->Position(), pepMass)));
-      }
       ++targetsGenerated;
-      ++i;
     }
-    proteinSequence = new string;
   }
-  delete proteinSequence;
+  targetThreads.join_all();
+  mergeTargets(&rangeTargets, &setTargets, &targetInfo);
   if (targetsGenerated == 0) {
     carp(CARP_FATAL, "No target sequences generated.  Is \'%s\' a FASTA file?",
          fasta.c_str());
@@ -545,43 +620,50 @@ void TideIndexApplication::fastaToPb(
     if (decoyFasta) {
       carp(CARP_INFO, "Writing reverse-protein fasta and decoys...");
     }
-    for (vector< pair< ProteinInfo, vector<PeptideInfo> > >::const_iterator i =
-         cleavedPeptideInfo.begin(); i != cleavedPeptideInfo.end(); ++i) {
-      string decoyProtein = *(i->first.sequence);
-      reverse(decoyProtein.begin(), decoyProtein.end());
+    // Reverse and digest all proteins on several threads first, then write
+    // the decoys in protein order
+    vector<string> decoyProteins(cleavedPeptideInfo.size());
+    vector< pair< ProteinInfo, vector<PeptideInfo> > > cleavedReverseInfo;
+    cleavedReverseInfo.reserve(cleavedPeptideInfo.size());
+    for (size_t p = 0; p < cleavedPeptideInfo.size(); p++) {
+      decoyProteins[p].assign(cleavedPeptideInfo[p].first.sequence->rbegin(),
+                              cleavedPeptideInfo[p].first.sequence->rend());
+      cleavedReverseInfo.push_back(make_pair(
+        ProteinInfo(cleavedPeptideInfo[p].first.name, &decoyProteins[p]),
+        vector<PeptideInfo>()));
+    }
+    vector< vector<FLOAT_T> > decoyMasses(cleavedReverseInfo.size());
+    invalidPepCnt += digestProteinsOnThreads(&cleavedReverseInfo, &decoyMasses,
+                                             numThreads, &options);
+    for (size_t p = 0; p < cleavedReverseInfo.size(); p++) {
+      const ProteinInfo& decoyProteinInfo = cleavedReverseInfo[p].first;
+      const vector<PeptideInfo>& cleavedReverse = cleavedReverseInfo[p].second;
       if (decoyFasta) {
-        (*decoyFasta) << ">"<< decoyPrefix << i->first.name << endl
-                      << decoyProtein << endl;
+        (*decoyFasta) << ">"<< decoyPrefix << decoyProteinInfo.name << endl
+                      << *decoyProteinInfo.sequence << endl;
       }
-      vector<PeptideInfo> cleavedReverse = GeneratePeptides::cleaveProtein(
-        decoyProtein, enzyme, digestion, missedCleavages, minLength, maxLength);
       // Iterate over all generated peptides for this protein
-      for (vector<PeptideInfo>::iterator j = cleavedReverse.begin();
-           j != cleavedReverse.end();
-           ++j) {
-        FLOAT_T pepMass = calcPepMassTide(&(*j), massType, &(i->first));
-        if (pepMass < 0.0) {
-          // Sequence contained some invalid character
-          carp(CARP_DEBUG, "Ignoring invalid sequence in decoy fasta <%s>",
-               j->Sequence().c_str());
-          ++invalidPepCnt;
-          continue;
-        } else if (pepMass < minMass || pepMass > maxMass) {
+      for (size_t i = 0; i < cleavedReverse.size(); i++) {
+        const PeptideInfo& peptide = cleavedReverse[i];
+        FLOAT_T pepMass = decoyMasses[p][i];
+        if (pepMass < minMass || pepMass > maxMass) {
           // Skip to next peptide if not in mass range
           continue;
-        } else if (!allowDups && setTargets.find(j->Sequence()) != setTargets.end()) {
+        }
+        const string sequence = peptide.Sequence();
+        if (!allowDups && setTargets.find(sequence) != setTargets.end()) {
           // Sequence already exists as a target
           continue;
         }
-        string* decoySequence = new string(j->Sequence());
+        string* decoySequence = new string(sequence);
         outProteinSequences.push_back(decoySequence);
 
         // Write pb::Protein
-        writeDecoyPbProtein(++curProtein, ProteinInfo(i->first.name, &decoyProtein),
-                            *decoySequence, j->Position(), proteinWriter);
+        writeDecoyPbProtein(++curProtein, decoyProteinInfo, *decoySequence,
+                            peptide.Position(), proteinWriter);
         // Add decoy to heap
-        TideIndexPeptide pepDecoy(pepMass, j->Length(), decoySequence,
-          curProtein, (j->Position() > 0) ? 1 : 0, 0);
+        TideIndexPeptide pepDecoy(pepMass, peptide.Length(), decoySequence,
+          curProtein, (peptide.Position() > 0) ? 1 : 0, 0);
         outPeptideHeap.push_back(pepDecoy);
         push_heap(outPeptideHeap.begin(), outPeptideHeap.end(),
           greater<TideIndexPeptide>());
@@ -589,30 +671,28 @@ void TideIndexApplication::fastaToPb(
       }
     }
   } else if (!allowDups) {
+    // Shuffled decoys are drawn from the one --seed random number stream in
+    // the order of setTargets, so they are generated on this thread only.
+    vector<TargetInfo>::const_iterator targetLookup = targetInfo.begin();
     for (set<string>::const_iterator i = setTargets.begin();
          i != setTargets.end();
-         ++i) {
+         ++i, ++targetLookup) {
       const string* setTarget = &*i;
-      const map<const string*, TargetInfo>::iterator targetLookup =
-        targetInfo.find(setTarget);
-      const ProteinInfo& proteinInfo = (targetLookup->second.proteinInfo);
-      const int startLoc = targetLookup->second.start;
-      FLOAT_T pepMass = targetLookup->second.mass;
+      const ProteinInfo& proteinInfo = targetLookup->proteinInfo;
+      const int startLoc = targetLookup->start;
+      FLOAT_T pepMass = targetLookup->mass;
       generateDecoys(numDecoys, *setTarget, targetToDecoy, &setTargets, &setDecoys, decoyType, allowDups,
                      failedDecoyCnt, decoysGenerated, curProtein, proteinInfo, startLoc, proteinWriter,
                      pepMass, outPeptideHeap, outProteinSequences);
     }
   } else { // allow dups
-    for (vector<pair<ProteinInfo, vector<PeptideInfo> > >::const_iterator i = cleavedPeptideInfo.begin();
-         i != cleavedPeptideInfo.end();
-         ++i) {
-      const ProteinInfo& proteinInfo = i->first;
-      for (vector<PeptideInfo>::const_iterator j = i->second.begin();
-           j != i->second.end();
-           ++j) {
-        const string setTarget = j->Sequence();
-        const int startLoc = j->Position();
-        FLOAT_T pepMass = calcPepMassTide(&(*j), massType, &proteinInfo);
+    for (size_t p = 0; p < cleavedPeptideInfo.size(); p++) {
+      const ProteinInfo& proteinInfo = cleavedPeptideInfo[p].first;
+      const vector<PeptideInfo>& cleavedPeptides = cleavedPeptideInfo[p].second;
+      for (size_t i = 0; i < cleavedPeptides.size(); i++) {
+        const string setTarget = cleavedPeptides[i].Sequence();
+        const int startLoc = cleavedPeptides[i].Position();
+        FLOAT_T pepMass = peptideMasses[p][i];
         generateDecoys(numDecoys, setTarget, targetToDecoy, NULL, NULL, decoyType, allowDups, failedDecoyCnt,
                        decoysGenerated, curProtein, proteinInfo, startLoc, proteinWriter,
                        pepMass, outPeptideHeap, outProteinSequences);
@@ -649,6 +729,116 @@ void TideIndexApplication::fastaToPb(
   }
 }
 
+void TideIndexApplication::digestProteins(
+  vector< pair< ProteinInfo, vector<GeneratePeptides::CleavedPeptide> > >* cleavedPeptideInfo,
+  vector< vector<FLOAT_T> >* peptideMasses,
+  size_t first,
+  size_t numThreads,
+  const DigestOptions* options,
+  unsigned int* invalidPepCnt
+) {
+  for (size_t p = first; p < cleavedPeptideInfo->size(); p += numThreads) {
+    const ProteinInfo& proteinInfo = (*cleavedPeptideInfo)[p].first;
+    vector<GeneratePeptides::CleavedPeptide>& cleavedPeptides = (*cleavedPeptideInfo)[p].second;
+    vector<FLOAT_T>& masses = (*peptideMasses)[p];
+    cleavedPeptides = GeneratePeptides::cleaveProtein(
+      *proteinInfo.sequence, options->enzyme, options->digestion,
+      options->missedCleavages, options->minLength, options->maxLength);
+    masses.reserve(cleavedPeptides.size());
+    for (vector<GeneratePeptides::CleavedPeptide>::iterator i = cleavedPeptides.begin();
+         i != cleavedPeptides.end(); ) {
+      FLOAT_T pepMass = calcPepMassTide(&(*i), options->massType, &proteinInfo);
+      if (pepMass < 0.0) {
+        // Sequence contained some invalid character
+        carp(CARP_DEBUG, "Ignoring invalid sequence <%s>", i->Sequence().c_str());
+        ++*invalidPepCnt;
+        i = cleavedPeptides.erase(i);
+        continue;
+      }
+      masses.push_back(pepMass);
+      ++i;
+    }
+  }
+}
+
+unsigned int TideIndexApplication::digestProteinsOnThreads(
+  vector< pair< ProteinInfo, vector<GeneratePeptides::CleavedPeptide> > >* cleavedPeptideInfo,
+  vector< vector<FLOAT_T> >* peptideMasses,
+  int numThreads,
+  const DigestOptions* options
+) {
+  vector<unsigned int> threadInvalidPepCnt(numThreads, 0);
+  boost::thread_group threadgroup;
+  for (int t = 1; t < numThreads; t++) {
+    threadgroup.create_thread(boost::bind(&TideIndexApplication::digestProteins,
+      cleavedPeptideInfo, peptideMasses, t, numThreads, options,
+      &threadInvalidPepCnt[t]));
+  }
+  digestProteins(cleavedPeptideInfo, peptideMasses, 0, numThreads, options,
+                 &threadInvalidPepCnt[0]);
+  threadgroup.join_all();
+  unsigned int invalidPepCnt = 0;
+  for (int t = 0; t < numThreads; t++) {
+    invalidPepCnt += threadInvalidPepCnt[t];
+  }
+  return invalidPepCnt;
+}
+
+void TideIndexApplication::collectTargets(
+  const vector< pair< ProteinInfo, vector<GeneratePeptides::CleavedPeptide> > >* cleavedPeptideInfo,
+  const vector< vector<FLOAT_T> >* peptideMasses,
+  size_t begin,
+  size_t end,
+  FLOAT_T minMass,
+  FLOAT_T maxMass,
+  map<string, TargetInfo>* targets
+) {
+  for (size_t p = begin; p < end; p++) {
+    const ProteinInfo& proteinInfo = (*cleavedPeptideInfo)[p].first;
+    const vector<GeneratePeptides::CleavedPeptide>& cleavedPeptides = (*cleavedPeptideInfo)[p].second;
+    for (size_t i = 0; i < cleavedPeptides.size(); i++) {
+      FLOAT_T pepMass = (*peptideMasses)[p][i];
+      if (pepMass < minMass || pepMass > maxMass) {
+        continue;
+      }
+      // insert keeps the first occurrence
+      targets->insert(make_pair(cleavedPeptides[i].Sequence(),
+        TargetInfo(proteinInfo, cleavedPeptides[i].Position(), pepMass)));
+    }
+  }
+}
+
+void TideIndexApplication::mergeTargets(
+  vector< map<string, TargetInfo> >* rangeTargets,
+  set<string>* setTargets,
+  vector<TargetInfo>* targetInfo
+) {
+  vector<TargetCursor> heap;
+  for (size_t r = 0; r < rangeTargets->size(); r++) {
+    if (!(*rangeTargets)[r].empty()) {
+      TargetCursor cursor = { (*rangeTargets)[r].begin(), r };
+      heap.push_back(cursor);
+    }
+  }
+  make_heap(heap.begin(), heap.end(), LaterTargetCursor());
+  while (!heap.empty()) {
+    pop_heap(heap.begin(), heap.end(), LaterTargetCursor());
+    TargetCursor& cursor = heap.back();
+    map<string, TargetInfo>& targets = (*rangeTargets)[cursor.range];
+    if (setTargets->empty() || *setTargets->rbegin() != cursor.next->first) {
+      setTargets->insert(setTargets->end(), cursor.next->first);
+      targetInfo->push_back(cursor.next->second);
+    }
+    // Free each range's copy as soon as it has been merged
+    targets.erase(cursor.next++);
+    if (cursor.next == targets.end()) {
+      heap.pop_back();
+    } else {
+      push_heap(heap.begin(), heap.end(), LaterTargetCursor());
+    }
+  }
+}
+
 void TideIndexApplication::writePeptidesAndAuxLocs(
   vector<TideIndexPeptide>& peptideHeap,
   const string& peptidePbFile,
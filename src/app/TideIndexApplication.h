@@ -161,6 +161,21 @@ class TideIndexApplication : public CruxApplication {
       : proteinInfo(protein), start(startLoc), mass(pepMass) {}
   };
 
+  // Position in one range's targets during mergeTargets
+  struct TargetCursor {
+    std::map<std::string, TargetInfo>::iterator next;
+    size_t range;
+  };
+
+  // Orders cursors for a min-heap by sequence, then by range, so the earliest
+  // range supplies a sequence that occurs in several
+  struct LaterTargetCursor {
+    bool operator()(const TargetCursor& x, const TargetCursor& y) const {
+      int cmp = x.next->first.compare(y.next->first);
+      return cmp != 0 ? cmp > 0 : x.range > y.range;
+    }
+  };
+
   static void fastaToPb(
     const std::string& commandLine,
     const ENZYME_T enzyme,
@@ -181,6 +196,71 @@ class TideIndexApplication : public CruxApplication {
     std::ofstream* decoyFasta
   );
 
+  struct DigestOptions {
+    ENZYME_T enzyme;
+    DIGEST_T digestion;
+    int missedCleavages;
+    int minLength;
+    int maxLength;
+    MASS_TYPE_T massType;
+  };
+
+  /**
+   * Cleaves every numThreads-th protein of cleavedPeptideInfo, starting at
+   * first, and puts the Tide mass of each of its peptides in the same place
+   * of peptideMasses, dropping peptides with unrecognized residues. fastaToPb
+   * runs one of these per thread.
+   */
+  static void digestProteins(
+    std::vector< std::pair< ProteinInfo,
+      std::vector<GeneratePeptides::CleavedPeptide> > >* cleavedPeptideInfo,
+    std::vector< std::vector<FLOAT_T> >* peptideMasses,
+    size_t first,
+    size_t numThreads,
+    const DigestOptions* options,
+    unsigned int* invalidPepCnt
+  );
+
+  /**
+   * Runs digestProteins on numThreads threads and returns the number of
+   * peptides dropped for unrecognized residues.
+   */
+  static unsigned int digestProteinsOnThreads(
+    std::vector< std::pair< ProteinInfo,
+      std::vector<GeneratePeptides::CleavedPeptide> > >* cleavedPeptideInfo,
+    std::vector< std::vector<FLOAT_T> >* peptideMasses,
+    int numThreads,
+    const DigestOptions* options
+  );
+
+  /**
+   * Collects the distinct sequences of the peptides of proteins [begin, end)
+   * of cleavedPeptideInfo that are within the mass range, each with its
+   * first occurrence. fastaToPb runs one of these per range of proteins, on
+   * separate threads, and merges the results.
+   */
+  static void collectTargets(
+    const std::vector< std::pair< ProteinInfo,
+      std::vector<GeneratePeptides::CleavedPeptide> > >* cleavedPeptideInfo,
+    const std::vector< std::vector<FLOAT_T> >* peptideMasses,
+    size_t begin,
+    size_t end,
+    FLOAT_T minMass,
+    FLOAT_T maxMass,
+    std::map<std::string, TargetInfo>* targets
+  );
+
+  /**
+   * Merges the targets collected by collectTargets for consecutive ranges of
+   * proteins into setTargets, in sequence order, and appends the TargetInfo
+   * of the earliest occurrence of each to targetInfo. Empties rangeTargets.
+   */
+  static void mergeTargets(
+    std::vector< std::map<std::string, TargetInfo> >* rangeTargets,
+    std::set<std::string>* setTargets,
+    std::vector<TargetInfo>* targetInfo
+  );
+
   static void writePeptidesAndAuxLocs(
     std::vector<TideIndexPeptide>& peptideHeap, // will be destroyed.
     const std::string& peptidePbFile,
@@ -9,23 +9,28 @@
 
 #include <fstream>
 #include <iomanip>
+#include <sstream>
 
 #include "TideIndexApplication.h"
 #include "TideMatchSet.h"
 #include "TideSearchApplication.h"
+#include "util/MathUtil.h"
 #include "util/Params.h"
 #include "util/StringUtils.h"
 
 string TideMatchSet::CleavageType;
 char TideMatchSet::match_collection_loc_[] = {0};
 char TideMatchSet::decoy_match_collection_loc_[] = {0};
+TideMatchSet::PeptideColumnsShard TideMatchSet::peptide_columns_[kPeptideColumnsShards];
 
 TideMatchSet::TideMatchSet(Arr* matches, double max_mz)
-  : matches_(matches), max_mz_(max_mz), exact_pval_search_(false), elution_window_(0) {
+  : matches_(matches), max_mz_(max_mz), exact_pval_search_(false), elution_window_(0),
+    target_batch_(NULL), decoy_batch_(NULL) {
 }
 
 TideMatchSet::TideMatchSet(Peptide* peptide, double max_mz)
-  : peptide_(peptide), max_mz_(max_mz), exact_pval_search_(false), elution_window_(0) {
+  : peptide_(peptide), max_mz_(max_mz), exact_pval_search_(false), elution_window_(0),
+    target_batch_(NULL), decoy_batch_(NULL) {
 }
 
 TideMatchSet::~TideMatchSet() {
@@ -54,7 +59,7 @@ void TideMatchSet::report(
   int charge;
   double score;
   double d_cn = 0.0;
-  int nHit = peptide_->spectrum_matches_array.size();
+  int nHit = peptide_->spectrum_matches_array.size(); // hits kept
 
   if (nHit < top_matches) {
       top_matches = nHit;
@@ -88,7 +93,7 @@ void TideMatchSet::report(
     }
     peptide_->spectrum_matches_array[cnt].score1_ = score;
     peptide_->spectrum_matches_array[cnt].d_cn_ = d_cn;
-    peptide_->spectrum_matches_array[cnt].score3_ = nHit;
+    peptide_->spectrum_matches_array[cnt].score3_ = peptide_->num_hits;
   }
   //smoothing primary scores in the elution window, only in DIA mode.
   if (elution_window_ > 0) {
@@ -263,8 +268,8 @@ void TideMatchSet::writeToFile(
  * This is for writing tab-delimited only
  */
 void TideMatchSet::report(
-  ofstream* target_file,  ///< target file to write to
-  ofstream* decoy_file, ///< decoy file to write to
+  ostream* target_file,  ///< target stream to write to
+  ostream* decoy_file, ///< decoy stream to write to
   int top_n,  ///< number of matches to report
   int decoys_per_target,
   const string& spectrum_filename, ///< name of spectrum file
@@ -274,8 +279,7 @@ void TideMatchSet::report(
   const ProteinVec& proteins,  ///< proteins corresponding with peptides
   const vector<const pb::AuxLocation*>& locations,  ///< auxiliary locations
   bool compute_sp, ///< whether to compute sp or not
-  bool highScoreBest, //< indicates semantics of score magnitude
-  boost::mutex * rwlock
+  bool highScoreBest //< indicates semantics of score magnitude
 ) {
   if (matches_->empty()) {
     return;
@@ -300,17 +304,141 @@ void TideMatchSet::report(
   }
   writeToFile(target_file, top_n, decoys_per_target, targets, spectrum_filename, spectrum, charge,
               peptides, proteins, locations, delta_cn_map, delta_lcn_map,
-              compute_sp ? &sp_map : NULL, rwlock);
+              compute_sp ? &sp_map : NULL);
   writeToFile(decoy_file, top_n, decoys_per_target, decoys, spectrum_filename, spectrum, charge,
               peptides, proteins, locations, delta_cn_map, delta_lcn_map,
-              compute_sp ? &sp_map : NULL, rwlock);
+              compute_sp ? &sp_map : NULL);
+  addToBatch(target_batch_, top_n, decoys_per_target, targets, spectrum_filename, spectrum,
+             charge, peptides, proteins, locations, delta_cn_map, delta_lcn_map,
+             compute_sp ? &sp_map : NULL);
+  addToBatch(decoy_batch_, top_n, decoys_per_target, decoys, spectrum_filename, spectrum,
+             charge, peptides, proteins, locations, delta_cn_map, delta_lcn_map,
+             compute_sp ? &sp_map : NULL);
 }
 
+/**
+ * The cells of a match, as writeRows hands them over. A number comes with
+ * the digits it is written with: decimals if fixed, significant digits
+ * otherwise.
+ */
+class TideMatchSet::RowSink {
+ public:
+  virtual ~RowSink() {}
+  virtual void beginRow() = 0;
+  virtual void number(MATCH_COLUMNS_T col, double value, int digits, bool fixed) = 0;
+  virtual void integer(MATCH_COLUMNS_T col, long value) = 0;
+  // a number that has already been formatted, as text
+  virtual void formatted(MATCH_COLUMNS_T col, double value, const string& text) = 0;
+  virtual void text(MATCH_COLUMNS_T col, const string& value) = 0;
+  virtual void empty(MATCH_COLUMNS_T col) = 0;
+  virtual void endRow() = 0;
+};
+
+/**
+ * Writes the cells as a line of a tab-delimited file.
+ */
+class TideMatchSet::TextRowSink : public TideMatchSet::RowSink {
+ public:
+  explicit TextRowSink(ostream* out) : out_(out), first_(true) {}
+
+  void beginRow() {
+    first_ = true;
+  }
+
+  void number(MATCH_COLUMNS_T col, double value, int digits, bool fixed) {
+    separate();
+    streamsize precision = out_->precision(digits);
+    ios_base::fmtflags flags = out_->flags();
+    if (fixed) {
+      out_->setf(ios_base::fixed, ios_base::floatfield);
+    } else {
+      out_->unsetf(ios_base::floatfield);
+    }
+    *out_ << value;
+    out_->flags(flags);
+    out_->precision(precision);
+  }
+
+  void integer(MATCH_COLUMNS_T col, long value) {
+    separate();
+    *out_ << value;
+  }
+
+  void formatted(MATCH_COLUMNS_T col, double value, const string& text) {
+    separate();
+    *out_ << text;
+  }
+
+  void text(MATCH_COLUMNS_T col, const string& value) {
+    separate();
+    *out_ << value;
+  }
+
+  void empty(MATCH_COLUMNS_T col) {
+    separate();
+  }
+
+  void endRow() {
+    *out_ << endl;
+  }
+
+ protected:
+  ostream* out_;
+  bool first_;
+
+  void separate() {
+    if (!first_) {
+      *out_ << '\t';
+    }
+    first_ = false;
+  }
+};
+
+/**
+ * Adds the cells as a row of a batch. Numbers are rounded to the digits
+ * they would be written with, so that the batch holds the values a
+ * post-processor reading the file would see.
+ */
+class TideMatchSet::BatchRowSink : public TideMatchSet::RowSink {
+ public:
+  explicit BatchRowSink(PSMBatch* batch) : batch_(batch) {}
+
+  void beginRow() {
+    batch_->addEmptyRow();
+  }
+
+  void number(MATCH_COLUMNS_T col, double value, int digits, bool fixed) {
+    batch_->setNumber(col, fixed ? MathUtil::Round(value, digits)
+                                 : MathUtil::RoundSignificant(value, max(digits, 1)));
+  }
+
+  void integer(MATCH_COLUMNS_T col, long value) {
+    batch_->setNumber(col, (double)value);
+  }
+
+  void formatted(MATCH_COLUMNS_T col, double value, const string& text) {
+    batch_->setNumber(col, value);
+  }
+
+  void text(MATCH_COLUMNS_T col, const string& value) {
+    batch_->setText(col, value);
+  }
+
+  void empty(MATCH_COLUMNS_T col) {
+  }
+
+  void endRow() {
+  }
+
+ protected:
+  PSMBatch* batch_;
+};
+
 /**
  * Helper function for tab delimited report function
  */
 void TideMatchSet::writeToFile(
-  ofstream* file,
+  ostream* file,
   int top_n,
   int decoys_per_target,
   const vector<Arr::iterator>& vec,
@@ -322,18 +450,64 @@ void TideMatchSet::writeToFile(
   const vector<const pb::AuxLocation*>& locations,
   const map<Arr::iterator, FLOAT_T>& delta_cn_map,
   const map<Arr::iterator, FLOAT_T>& delta_lcn_map,
-  const map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_map,
-  boost::mutex * rwlock
+  const map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_map
 ) {
   if (!file || vec.empty()) {
     return;
   }
+  TextRowSink sink(file);
+  writeRows(&sink, top_n, decoys_per_target, vec, spectrum_filename, spectrum, charge,
+            peptides, proteins, locations, delta_cn_map, delta_lcn_map, sp_map);
+}
 
+/**
+ * Helper function for adding to a batch the matches writeToFile writes
+ */
+void TideMatchSet::addToBatch(
+  PSMBatch* batch,
+  int top_n,
+  int decoys_per_target,
+  const vector<Arr::iterator>& vec,
+  const string& spectrum_filename,
+  const Spectrum* spectrum,
+  int charge,
+  const ActivePeptideQueue* peptides,
+  const ProteinVec& proteins,
+  const vector<const pb::AuxLocation*>& locations,
+  const map<Arr::iterator, FLOAT_T>& delta_cn_map,
+  const map<Arr::iterator, FLOAT_T>& delta_lcn_map,
+  const map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_map
+) {
+  if (!batch || vec.empty()) {
+    return;
+  }
+  BatchRowSink sink(batch);
+  writeRows(&sink, top_n, decoys_per_target, vec, spectrum_filename, spectrum, charge,
+            peptides, proteins, locations, delta_cn_map, delta_lcn_map, sp_map);
+}
+
+void TideMatchSet::writeRows(
+  RowSink* sink,
+  int top_n,
+  int decoys_per_target,
+  const vector<Arr::iterator>& vec,
+  const string& spectrum_filename,
+  const Spectrum* spectrum,
+  int charge,
+  const ActivePeptideQueue* peptides,
+  const ProteinVec& proteins,
+  const vector<const pb::AuxLocation*>& locations,
+  const map<Arr::iterator, FLOAT_T>& delta_cn_map,
+  const map<Arr::iterator, FLOAT_T>& delta_lcn_map,
+  const map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_map
+) {
   int massPrecision = Params::GetInt("mass-precision");
   int precision = Params::GetInt("precision");
 
   const bool concat = Params::GetBool("concat");
   const bool brief = Params::GetBool("brief-output");
+  const bool file_column = Params::GetBool("file-column");
+  const bool tailor = Params::GetBool("use-tailor-calibration");
   const int concatDistinctMatches = peptides->ActiveTargets() + peptides->ActiveDecoys();
   map<int, int> decoyWriteCount;
 
@@ -359,169 +533,119 @@ void TideMatchSet::writeToFile(
       }
       rank = ++(j->second);
     }
-    const pb::Protein* protein = proteins[peptide->FirstLocProteinId()];
-    int pos = peptide->FirstLocPos();
-    string proteinNames = getProteinName(*protein,
-      (!protein->has_target_pos()) ? pos : protein->target_pos());
-    string flankingAAs, n_term, c_term;
-    getFlankingAAs(peptide, protein, pos, &n_term, &c_term);
-    flankingAAs = n_term + c_term;
-
-    // look for other locations
-    if (peptide->HasAuxLocationsIndex()) {
-      const pb::AuxLocation* aux = locations[peptide->AuxLocationsIndex()];
-      for (int j = 0; j < aux->location_size(); j++) {
-        const pb::Location& location = aux->location(j);
-        protein = proteins[location.protein_id()];
-        pos = location.pos();
-        proteinNames += "," + getProteinName(*protein,
-          (!protein->has_target_pos()) ? pos : protein->target_pos());
-        getFlankingAAs(peptide, protein, pos, &n_term, &c_term);
-        flankingAAs += "," + n_term + c_term;
-      }
-    }
-
-    Crux::Peptide cruxPep = getCruxPeptide(peptide);
+    boost::shared_ptr<const PeptideColumns> columns =
+      getPeptideColumns(peptide, proteins, locations);
     const SpScorer::SpScoreData* sp_data = sp_map ? &(sp_map->at(i).first) : NULL;
 
-    rwlock->lock();
-    if (Params::GetBool("file-column")) {
-      *file << spectrum_filename << '\t';
+    sink->beginRow();
+    if (file_column) {
+      sink->text(FILE_COL, spectrum_filename);
     }
-    *file << spectrum->SpectrumNumber() << '\t'
-          << charge << '\t';
+    sink->integer(SCAN_COL, spectrum->SpectrumNumber());
+    sink->integer(CHARGE_COL, charge);
     if (!brief) {
-      *file << StringUtils::ToString(spectrum->PrecursorMZ(), massPrecision) 
-            << '\t'
-            << StringUtils::ToString((spectrum->PrecursorMZ() - MASS_PROTON) 
-                                     * charge, massPrecision)
-            << '\t'
-            << StringUtils::ToString(cruxPep.calcModifiedMass(), massPrecision)
-            << '\t'
-            << delta_cn_map.at(i) << '\t'
-            << delta_lcn_map.at(i) << '\t';
+      sink->number(SPECTRUM_PRECURSOR_MZ_COL, spectrum->PrecursorMZ(), massPrecision, true);
+      sink->number(SPECTRUM_NEUTRAL_MASS_COL, (spectrum->PrecursorMZ() - MASS_PROTON) * charge,
+                   massPrecision, true);
+      sink->formatted(PEPTIDE_MASS_COL, columns->mass, columns->modified_mass);
+      // delta cn and delta lcn have the default formatting of a stream
+      sink->number(DELTA_CN_COL, delta_cn_map.at(i), 6, false);
+      sink->number(DELTA_LCN_COL, delta_lcn_map.at(i), 6, false);
       if (sp_map) {
-        *file << StringUtils::ToString(sp_data->sp_score, precision) << '\t'
-              << sp_map->at(i).second << '\t';
+        sink->number(SP_SCORE_COL, sp_data->sp_score, precision, true);
+        sink->integer(SP_RANK_COL, sp_map->at(i).second);
       }
     }
 
     // Use scientific notation for exact p-value, but not refactored XCorr.
-    // Second argument to StringUtils::ToString determines number of decimals
+    MATCH_COLUMNS_T rank_col = XCORR_RANK_COL;
     switch (cur_score_function_) {
     case XCORR_SCORE:
       if (exact_pval_search_) {
-        *file << StringUtils::ToString(i->xcorr_pval, precision, false) << '\t';
+        sink->number(EXACT_PVALUE_COL, i->xcorr_pval, precision, false);
         if (!brief) {
-          *file << StringUtils::ToString(i->xcorr_score, precision, true) << '\t';
+          sink->number(REFACTORED_SCORE_COL, i->xcorr_score, precision, true);
         }
       } else {
-        *file << StringUtils::ToString(i->xcorr_score, precision, true) << '\t';
+        sink->number(XCORR_SCORE_COL, i->xcorr_score, precision, true);
       }
       //Added for tailor score calibration method by AKF
-      if (Params::GetBool("use-tailor-calibration")){
-        *file << StringUtils::ToString(i->tailor, precision, true) << '\t';
+      if (tailor) {
+        sink->number(TAILOR_COL, i->tailor, precision, true);
       }
       break;
     case RESIDUE_EVIDENCE_MATRIX:
       if (exact_pval_search_) {
-        *file << StringUtils::ToString(i->resEv_pval, precision, false) << '\t';
+        sink->number(RESIDUE_PVALUE_COL, i->resEv_pval, precision, false);
         if (!brief) {
-          *file << StringUtils::ToString(i->resEv_score, 1, true) << '\t';
+          sink->integer(RESIDUE_EVIDENCE_COL, i->resEv_score);
         }
       } else {
-        *file << StringUtils::ToString(i->resEv_score, 1, true) << '\t';
+        sink->integer(RESIDUE_EVIDENCE_COL, i->resEv_score);
       }
+      rank_col = RESIDUE_RANK_COL;
       break;
     case BOTH_SCORE:
       if (!brief) {
-        *file << StringUtils::ToString(i->xcorr_pval, precision, false) << '\t';
-        *file << StringUtils::ToString(i->xcorr_score, precision, true) << '\t';
-        *file << StringUtils::ToString(i->resEv_pval, precision, false) << '\t';
-        *file << StringUtils::ToString(i->resEv_score, 1, true) << '\t';
+        sink->number(EXACT_PVALUE_COL, i->xcorr_pval, precision, false);
+        sink->number(REFACTORED_SCORE_COL, i->xcorr_score, precision, true);
+        sink->number(RESIDUE_PVALUE_COL, i->resEv_pval, precision, false);
+        sink->integer(RESIDUE_EVIDENCE_COL, i->resEv_score);
       }
-      *file << StringUtils::ToString(i->combinedPval, precision, false) << '\t';
+      sink->number(BOTH_PVALUE_COL, i->combinedPval, precision, false);
+      rank_col = BOTH_PVALUE_RANK;
       break;
     }
 
     if (!brief) {
-      *file << rank << '\t';
+      sink->integer(rank_col, rank);
       if (sp_map) {
-        *file << sp_data->matched_ions << '\t'
-              << sp_data->total_ions << '\t';
+        sink->integer(BY_IONS_MATCHED_COL, sp_data->matched_ions);
+        sink->integer(BY_IONS_TOTAL_COL, sp_data->total_ions);
       }
 
-      if (Params::GetBool("concat")) {
-        *file << concatDistinctMatches << '\t';
+      if (concat) {
+        sink->integer(DISTINCT_MATCHES_SPECTRUM_COL, concatDistinctMatches);
       } else {
-        *file << (!peptide->IsDecoy() ? peptides->ActiveTargets() : peptides->ActiveDecoys()) << '\t';
+        sink->integer(DISTINCT_MATCHES_SPECTRUM_COL, !peptide->IsDecoy() ?
+                      peptides->ActiveTargets() : peptides->ActiveDecoys());
       }
     }
 
-    *file << cruxPep.getModifiedSequenceWithMasses();
+    sink->text(SEQUENCE_COL, columns->modified_sequence);
     if (!brief) {
-      *file << '\t'
-            << cruxPep.getModsString() << '\t'
-            << CleavageType << '\t'
-            << proteinNames << '\t'
-            << flankingAAs;
-      if (peptide->IsDecoy()) {
-        *file << "\tdecoy";
-      } else {
-        *file << "\ttarget";
-      }
-      if (peptide->IsDecoy() && !TideSearchApplication::proteinLevelDecoys()) {
-        // write target sequence
-        const string& residues = protein->residues();
-        *file  << '\t' 
-               << residues.substr(residues.length() - peptide->Len());
-      } else if (Params::GetBool("concat") && !TideSearchApplication::proteinLevelDecoys()) {
-        *file  << '\t' 
-               << cruxPep.getUnshuffledSequence();
+      sink->text(MODIFICATIONS_COL, columns->mods);
+      sink->text(CLEAVAGE_TYPE_COL, CleavageType);
+      sink->text(PROTEIN_ID_COL, columns->protein_names);
+      sink->text(FLANKING_AA_COL, columns->flanking_aas);
+      sink->text(TARGET_DECOY_COL, peptide->IsDecoy() ? "decoy" : "target");
+      if (columns->has_original_sequence) {
+        // target sequence of a decoy, or unshuffled sequence under concat
+        sink->text(ORIGINAL_TARGET_SEQUENCE_COL, columns->original_sequence);
       }
       if (decoys_per_target > 1) {
         if (peptide->IsDecoy()) {
-          *file << '\t'
-                << peptide->DecoyIdx();
+          sink->integer(DECOY_INDEX_COL, peptide->DecoyIdx());
         } else if (concat) {
-          *file << '\t';
+          sink->empty(DECOY_INDEX_COL);
         }
       }
     }
-    *file << endl;
-    rwlock->unlock();
+    sink->endRow();
   }
 }
 
 /**
- * Helper function to print column header.
+ * Columns of tab delimited file
  */
-void TideMatchSet::colPrint(
-  bool* printTab,
-  ofstream* file,
-  const char* myString
-) {
-  if (*printTab) {
-    *file << '\t';
-  }
-  *file << myString;
-  *printTab = true;
-}
-
-/**
- * Write headers for tab delimited file
- */
-void TideMatchSet::writeHeaders(
-  ofstream* file, 
+vector<int> TideMatchSet::headerColumns(
   bool decoyFile, 
   bool multiDecoy, 
   bool sp
 ) {
-  if (!file) {
-    return;
-  }
   bool concat = Params::GetBool("concat");
   bool brief = Params::GetBool("brief-output");
+  vector<int> columns;
 
   const int headers[] = {
     FILE_COL, SCAN_COL, CHARGE_COL, SPECTRUM_PRECURSOR_MZ_COL, SPECTRUM_NEUTRAL_MASS_COL,
@@ -532,7 +656,6 @@ void TideMatchSet::writeHeaders(
     DECOY_INDEX_COL
   };
   size_t numHeaders = sizeof(headers) / sizeof(int);
-  bool writtenHeader = false;
   for (size_t i = 0; i < numHeaders; ++i) {
     int header = headers[i];
     if (!sp &&
@@ -554,58 +677,55 @@ void TideMatchSet::writeHeaders(
     if (header == XCORR_SCORE_COL) {
       if (Params::GetString("score-function") == "xcorr") {
         if (Params::GetBool("exact-p-value")) {
-          colPrint(&writtenHeader, file, get_column_header(EXACT_PVALUE_COL));
+          columns.push_back(EXACT_PVALUE_COL);
           if (!brief) {
-            colPrint(&writtenHeader, file, get_column_header(REFACTORED_SCORE_COL));
+            columns.push_back(REFACTORED_SCORE_COL);
           }
         } else {
-          colPrint(&writtenHeader, file, get_column_header(XCORR_SCORE_COL));
+          columns.push_back(XCORR_SCORE_COL);
         }
         //Added for tailor score calibration method by AKF
         if (Params::GetBool("use-tailor-calibration")) {
-          colPrint(&writtenHeader, file, get_column_header(TAILOR_COL));
+          columns.push_back(TAILOR_COL);
         }
         if (!brief) {
-          colPrint(&writtenHeader, file, get_column_header(XCORR_RANK_COL));
+          columns.push_back(XCORR_RANK_COL);
         }
       } else if (Params::GetString("score-function") == "residue-evidence") {
         if (Params::GetBool("exact-p-value")) {
-          colPrint(&writtenHeader, file, get_column_header(RESIDUE_PVALUE_COL));
+          columns.push_back(RESIDUE_PVALUE_COL);
           if (!brief) {
-            colPrint(&writtenHeader, file, get_column_header(RESIDUE_EVIDENCE_COL));
+            columns.push_back(RESIDUE_EVIDENCE_COL);
           }
         } else {
-          colPrint(&writtenHeader, file, get_column_header(RESIDUE_EVIDENCE_COL));
+          columns.push_back(RESIDUE_EVIDENCE_COL);
         }
-        colPrint(&writtenHeader, file, get_column_header(RESIDUE_RANK_COL));
+        columns.push_back(RESIDUE_RANK_COL);
       } else if (Params::GetString("score-function") == "both") {
         if (!brief) {
-          colPrint(&writtenHeader, file, get_column_header(EXACT_PVALUE_COL));
-          colPrint(&writtenHeader, file, get_column_header(REFACTORED_SCORE_COL));
-          colPrint(&writtenHeader, file, get_column_header(RESIDUE_PVALUE_COL));
-          colPrint(&writtenHeader, file, get_column_header(RESIDUE_EVIDENCE_COL));
+          columns.push_back(EXACT_PVALUE_COL);
+          columns.push_back(REFACTORED_SCORE_COL);
+          columns.push_back(RESIDUE_PVALUE_COL);
+          columns.push_back(RESIDUE_EVIDENCE_COL);
         }
-        colPrint(&writtenHeader, file, get_column_header(BOTH_PVALUE_COL));
+        columns.push_back(BOTH_PVALUE_COL);
         if (!brief) {
-          colPrint(&writtenHeader, file, get_column_header(BOTH_PVALUE_RANK));
+          columns.push_back(BOTH_PVALUE_RANK);
         }
       }
 
       if ( (Params::GetInt("elution-window-size") > 0) && (!brief) ) {
-        colPrint(&writtenHeader, file, get_column_header(ELUTION_WINDOW_COL));
+        columns.push_back(ELUTION_WINDOW_COL);
       }
       continue;
     }
 
     if ( (header == DISTINCT_MATCHES_SPECTRUM_COL) && (!brief) ){
       if (Params::GetBool("peptide-centric-search")) {
-        colPrint(&writtenHeader, file, 
-                 get_column_header(DISTINCT_MATCHES_PEPTIDE_COL));
-        colPrint(&writtenHeader, file, 
-                 get_column_header(DISTINCT_MATCHES_SPECTRUM_COL));
+        columns.push_back(DISTINCT_MATCHES_PEPTIDE_COL);
+        columns.push_back(DISTINCT_MATCHES_SPECTRUM_COL);
       } else {
-        colPrint(&writtenHeader, file, 
-                 get_column_header(DISTINCT_MATCHES_SPECTRUM_COL));
+        columns.push_back(DISTINCT_MATCHES_SPECTRUM_COL);
       }
       continue;
     }
@@ -615,8 +735,30 @@ void TideMatchSet::writeHeaders(
          (header == CHARGE_COL) || 
          (header == SEQUENCE_COL) ||
          (!brief) ) {
-      colPrint(&writtenHeader, file, get_column_header(header));
+      columns.push_back(header);
+    }
+  }
+  return columns;
+}
+
+/**
+ * Write headers for tab delimited file
+ */
+void TideMatchSet::writeHeaders(
+  ofstream* file, 
+  bool decoyFile, 
+  bool multiDecoy, 
+  bool sp
+) {
+  if (!file) {
+    return;
+  }
+  vector<int> columns = headerColumns(decoyFile, multiDecoy, sp);
+  for (size_t i = 0; i < columns.size(); ++i) {
+    if (i > 0) {
+      *file << '\t';
     }
+    *file << get_column_header(columns[i]);
   }
   *file << endl;
 }
@@ -643,6 +785,80 @@ Crux::Peptide TideMatchSet::getCruxPeptide(const Peptide* peptide) {
   return Crux::Peptide(peptide->Seq(), term, getMods(peptide));
 }
 
+boost::shared_ptr<const TideMatchSet::PeptideColumns> TideMatchSet::getPeptideColumns(
+  const Peptide* peptide,
+  const ProteinVec& proteins,
+  const vector<const pb::AuxLocation*>& locations
+) {
+  PeptideColumnsShard& shard = peptide_columns_[
+    (unsigned int)peptide->Id() % kPeptideColumnsShards];
+  {
+    boost::mutex::scoped_lock lock(shard.mutex);
+    map<int, boost::shared_ptr<const PeptideColumns> >::const_iterator i =
+      shard.columns.find(peptide->Id());
+    if (i != shard.columns.end()) {
+      return i->second;
+    }
+  }
+
+  // Formatted outside the lock; another thread formatting the same peptide
+  // at the same time produces the same columns.
+  PeptideColumns* columns = new PeptideColumns();
+  const pb::Protein* protein = proteins[peptide->FirstLocProteinId()];
+  int pos = peptide->FirstLocPos();
+  columns->protein_names = getProteinName(*protein,
+    (!protein->has_target_pos()) ? pos : protein->target_pos());
+  string n_term, c_term;
+  getFlankingAAs(peptide, protein, pos, &n_term, &c_term);
+  columns->flanking_aas = n_term + c_term;
+
+  // look for other locations
+  if (peptide->HasAuxLocationsIndex()) {
+    const pb::AuxLocation* aux = locations[peptide->AuxLocationsIndex()];
+    for (int j = 0; j < aux->location_size(); j++) {
+      const pb::Location& location = aux->location(j);
+      protein = proteins[location.protein_id()];
+      pos = location.pos();
+      columns->protein_names += "," + getProteinName(*protein,
+        (!protein->has_target_pos()) ? pos : protein->target_pos());
+      getFlankingAAs(peptide, protein, pos, &n_term, &c_term);
+      columns->flanking_aas += "," + n_term + c_term;
+    }
+  }
+
+  Crux::Peptide cruxPep = getCruxPeptide(peptide);
+  int massPrecision = Params::GetInt("mass-precision");
+  columns->mass = MathUtil::Round(cruxPep.calcModifiedMass(), massPrecision);
+  columns->modified_mass = StringUtils::ToString(cruxPep.calcModifiedMass(), massPrecision);
+  columns->modified_sequence = cruxPep.getModifiedSequenceWithMasses();
+  columns->mods = cruxPep.getModsString();
+  columns->has_original_sequence = false;
+  if (peptide->IsDecoy() && !TideSearchApplication::proteinLevelDecoys()) {
+    // target sequence, from the last location's protein
+    const string& residues = protein->residues();
+    columns->original_sequence = residues.substr(residues.length() - peptide->Len());
+    columns->has_original_sequence = true;
+  } else if (Params::GetBool("concat") && !TideSearchApplication::proteinLevelDecoys()) {
+    columns->original_sequence = cruxPep.getUnshuffledSequence();
+    columns->has_original_sequence = true;
+  }
+
+  boost::shared_ptr<const PeptideColumns> result(columns);
+  boost::mutex::scoped_lock lock(shard.mutex);
+  if (shard.columns.size() >= kPeptideColumnsShardSize) {
+    shard.columns.clear(); // bounds memory; popular peptides come back
+  }
+  shard.columns.insert(make_pair(peptide->Id(), result));
+  return result;
+}
+
+void TideMatchSet::clearPeptideColumns() {
+  for (int i = 0; i < kPeptideColumnsShards; ++i) {
+    boost::mutex::scoped_lock lock(peptide_columns_[i].mutex);
+    peptide_columns_[i].columns.clear();
+  }
+}
+
 vector<Crux::Modification> TideMatchSet::getMods(const Peptide* peptide) {
   vector<Crux::Modification> modVector;
   string seq(peptide->Seq());
@@ -695,8 +911,28 @@ void TideMatchSet::gatherTargetsAndDecoys(
   const bool concat = Params::GetBool("concat");
   const int gatherSize = top_n + 1;
 
+  // Only the best few matches are gathered, so stop popping the heap once
+  // every target and decoy slot that can be filled has been.
+  size_t targetsWanted = 0, decoysWanted = 0;
+  {
+    map<int, int> decoyCount;
+    for (Arr::iterator i = matches_->begin(); i != matches_->end(); ++i) {
+      const Peptide& peptide = *(peptides->GetPeptide(i->rank));
+      if (concat || !peptide.IsDecoy()) {
+        ++targetsWanted;
+      } else {
+        ++decoyCount[peptide.DecoyIdx()];
+      }
+    }
+    targetsWanted = min(targetsWanted, (size_t)gatherSize);
+    for (map<int, int>::const_iterator j = decoyCount.begin(); j != decoyCount.end(); ++j) {
+      decoysWanted += min(j->second, gatherSize);
+    }
+  }
+
   // decoys but not concat, populate targets and decoys
-  for (Arr::iterator i = matches_->end(); i != matches_->begin(); ) {
+  for (Arr::iterator i = matches_->end(); i != matches_->begin() &&
+       (targetsOut.size() < targetsWanted || decoysOut.size() < decoysWanted); ) {
     switch (cur_score_function_) {
     case XCORR_SCORE:
       if (exact_pval_search_) {
@@ -2,6 +2,7 @@
 #define TIDE_MATCH_SET_H
 
 #define  NO_BOOST_DATE_TIME_INLINE
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 #include <vector>
 #include "raw_proteins.pb.h"
@@ -12,6 +13,7 @@
 #include "tide/sp_scorer.h"
 #include "tide/spectrum_collection.h"
 
+#include "io/PSMBatch.h"
 #include "model/Modification.h"
 #include "model/PostProcessProtein.h"
 
@@ -25,6 +27,10 @@ class TideMatchSet {
   bool exact_pval_search_;
   int elution_window_;
   SCORE_FUNCTION_T cur_score_function_;
+  // If set, spectrum centric matches are also added to these batches, with
+  // the columns of the corresponding files (see headerColumns).
+  PSMBatch* target_batch_;
+  PSMBatch* decoy_batch_;
 
   typedef pair<int, int> Pair2;
   typedef FixedCapacityArray<Pair2> Arr2;
@@ -72,11 +78,12 @@ class TideMatchSet {
   );
 
   /**
-   * Write spectrum centric to output files
+   * Write spectrum centric to output files. The streams are private to the
+   * calling thread (see ThreadedFileWriter), so no locking is needed.
    */
   void report(
-    ofstream* target_file,  ///< target file to write to
-    ofstream* decoy_file, ///< decoy file to write to
+    ostream* target_file,  ///< target stream to write to
+    ostream* decoy_file, ///< decoy stream to write to
     int top_n,  ///< number of matches to report
     int decoys_per_target,
     const string& spectrum_filename, ///< name of spectrum file
@@ -86,16 +93,18 @@ class TideMatchSet {
     const ProteinVec& proteins, ///< proteins corresponding with peptides
     const vector<const pb::AuxLocation*>& locations,  ///< auxiliary locations
     bool compute_sp, ///< whether to compute sp or not
-    bool highScoreBest, //< indicates semantics of score magnitude
-    boost::mutex * rwlock
+    bool highScoreBest //< indicates semantics of score magnitude
   );
 
-  static void colPrint(
-    bool* printTab,
-    ofstream* file,
-    const char* myString
+  /**
+   * Returns the columns of a tab delimited results file, in order.
+   */
+  static vector<int> headerColumns(
+    bool decoyFile,
+    bool multiDecoy,
+    bool sp
   );
- 
+
   static void writeHeaders(
     ofstream* file,
     bool decoyFile,
@@ -104,6 +113,12 @@ class TideMatchSet {
   );
 
   static void initModMap(const pb::ModTable& modTable, ModPosition position);
+
+  /**
+   * Forgets the cached peptide columns; called whenever a new index is
+   * loaded, since they are keyed by peptide id.
+   */
+  static void clearPeptideColumns();
   static std::vector<Crux::Modification> getMods(const Peptide* peptide);
 
   static string CleavageType;
@@ -173,7 +188,27 @@ class TideMatchSet {
    * Helper function for tab delimited report function
    */
   void writeToFile(
-    ofstream* file,
+    ostream* file,
+    int top_n,
+    int decoys_per_target,
+    const vector<Arr::iterator>& vec,
+    const string& spectrum_filename,
+    const Spectrum* spectrum,
+    int charge,
+    const ActivePeptideQueue* peptides,
+    const ProteinVec& proteins,
+    const vector<const pb::AuxLocation*>& locations,
+    const map<Arr::iterator, FLOAT_T>& delta_cn_map,
+    const map<Arr::iterator, FLOAT_T>& delta_lcn_map,
+    const map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_map
+  );
+
+  /**
+   * Adds the same matches as writeToFile to a batch, with each number
+   * rounded as it is written to the file
+   */
+  void addToBatch(
+    PSMBatch* batch,
     int top_n,
     int decoys_per_target,
     const vector<Arr::iterator>& vec,
@@ -185,11 +220,71 @@ class TideMatchSet {
     const vector<const pb::AuxLocation*>& locations,
     const map<Arr::iterator, FLOAT_T>& delta_cn_map,
     const map<Arr::iterator, FLOAT_T>& delta_lcn_map,
-    const map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_map,
-    boost::mutex * rwlock
+    const map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_map
   );
 
-  Crux::Peptide getCruxPeptide(const Peptide* peptide);
+  // Receivers of the cells of a match (defined in TideMatchSet.cpp)
+  class RowSink;
+  class TextRowSink;
+  class BatchRowSink;
+
+  /**
+   * Hands the cells of each match to sink, in the order of headerColumns.
+   * writeToFile and addToBatch both go through here, so that a file and a
+   * batch of the same matches hold the same values.
+   */
+  void writeRows(
+    RowSink* sink,
+    int top_n,
+    int decoys_per_target,
+    const vector<Arr::iterator>& vec,
+    const string& spectrum_filename,
+    const Spectrum* spectrum,
+    int charge,
+    const ActivePeptideQueue* peptides,
+    const ProteinVec& proteins,
+    const vector<const pb::AuxLocation*>& locations,
+    const map<Arr::iterator, FLOAT_T>& delta_cn_map,
+    const map<Arr::iterator, FLOAT_T>& delta_lcn_map,
+    const map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_map
+  );
+
+  static Crux::Peptide getCruxPeptide(const Peptide* peptide);
+
+  /**
+   * The columns of a match that depend only on its peptide, formatted once
+   * per peptide and shared by all of its matches (see getPeptideColumns).
+   */
+  struct PeptideColumns {
+    double mass;           // rounded to mass-precision
+    string modified_mass;  // at mass-precision
+    string modified_sequence;
+    string mods;
+    string protein_names;
+    string flanking_aas;
+    bool has_original_sequence;
+    string original_sequence; // target sequence of a decoy, or unshuffled
+                              // sequence under concat
+  };
+
+  /**
+   * Returns the formatted columns of peptide, from the cache if they have
+   * been formatted before. The cache is split into shards by peptide id,
+   * each with its own lock, so that threads rarely wait for each other.
+   */
+  static boost::shared_ptr<const PeptideColumns> getPeptideColumns(
+    const Peptide* peptide,
+    const ProteinVec& proteins,
+    const vector<const pb::AuxLocation*>& locations
+  );
+
+  struct PeptideColumnsShard {
+    boost::mutex mutex;
+    map<int, boost::shared_ptr<const PeptideColumns> > columns;
+  };
+  static const int kPeptideColumnsShards = 64;
+  static const size_t kPeptideColumnsShardSize = 16384; // entries per shard
+  static PeptideColumnsShard peptide_columns_[kPeptideColumnsShards];
 
   void gatherTargetsAndDecoys(
     const ActivePeptideQueue* peptides,
@@ -5,11 +5,14 @@
 #include "io/carp.h"
 #include "parameter.h"
 #include "io/SpectrumRecordWriter.h"
+#include "io/SpectrumRecordSpectrumCollection.h"
+#include "io/PSMBatchFile.h"
 #include "TideIndexApplication.h"
 #include "TideSearchApplication.h"
 #include "ParamMedicApplication.h"
 #include "PSMConvertApplication.h"
 #include "tide/mass_constants.h"
+#include "tide/score_kernel.h"
 #include "TideMatchSet.h"
 #include "util/Params.h"
 #include "util/FileUtils.h"
@@ -34,9 +37,13 @@ const double TideSearchApplication::XCORR_SCALING = 100000000.0;
  * number" (10000) divided by the EVIDENCE_SCALE_INT (defined in
  * tide/spectrum_preprocess2.cc). */
 const double TideSearchApplication::RESCALE_FACTOR = 20.0;
+const size_t TideSearchApplication::ROWS_PER_FLUSH = 16384;
 
 TideSearchApplication::TideSearchApplication():
-  exact_pval_search_(false), remove_index_(""), spectrum_flag_(NULL) {
+  exact_pval_search_(false), remove_index_(""), spectrum_flag_(NULL),
+  spectrum_cache_(NULL),
+  batch_results_(false), write_batched_results_(true),
+  target_batch_(NULL), decoy_batch_(NULL), target_binary_(NULL), decoy_binary_(NULL) {
 }
 
 TideSearchApplication::~TideSearchApplication() {
@@ -46,6 +53,15 @@ TideSearchApplication::~TideSearchApplication() {
   }
 }
 
+void TideSearchApplication::keepResultsInMemory(bool write_files) {
+  batch_results_ = true;
+  write_batched_results_ = write_files;
+}
+
+void TideSearchApplication::keepSpectra(map<string, SpectrumCollection*>* cache) {
+  spectrum_cache_ = cache;
+}
+
 int TideSearchApplication::main(int argc, char** argv) {
   return main(Params::GetStrings("tide spectra file"));
 }
@@ -72,6 +88,10 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
   }
   carp(CARP_INFO, "Number of Threads: %d", NUM_THREADS);
 
+  // Must be chosen before any peptide queue is built.
+  ScoreKernel::Init(Params::GetString("scoring-kernel"));
+  carp(CARP_INFO, "Scoring kernel: %s", ScoreKernel::Name());
+
   const string index = input_index;
   string peptides_file = FileUtils::Join(index, "pepix");
   string proteins_file = FileUtils::Join(index, "protix");
@@ -250,13 +270,42 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
   }
   carp(CARP_DEBUG, "Read %d auxiliary locations.", locations.size());
 
+  // With a shared peptide queue the index is decoded once for all threads.
+  bool shared_queue = Params::GetBool("shared-peptide-queue") && NUM_THREADS > 1;
+  if (shared_queue && (exact_pval_search_ || curScoreFunction != XCORR_SCORE)) {
+    carp(CARP_INFO, "shared-peptide-queue is only supported for XCorr scoring "
+                    "without exact p-values; each thread will read the index.");
+    shared_queue = false;
+  }
+
+  // If tide-index also wrote the peptides in mapped form (see --mmap-index),
+  // and that file is up to date, read the peptides from it in place.
+  MappedPeptideIndex* mapped_index = NULL;
+  string mapped_file = FileUtils::Join(index, MappedPeptideIndex::kFileName);
+  if (FileUtils::Exists(mapped_file)) {
+    mapped_index = new MappedPeptideIndex(mapped_file);
+    if (mapped_index->Matches(peptides_file)) {
+      carp(CARP_INFO, "Reading peptides from %s.", mapped_file.c_str());
+    } else {
+      carp(CARP_WARNING, "%s does not match %s and will be ignored.",
+           mapped_file.c_str(), peptides_file.c_str());
+      delete mapped_index;
+      mapped_index = NULL;
+    }
+  }
+  int num_readers = mapped_index ? 0 : shared_queue ? 1 : NUM_THREADS;
+
   // Read peptides index file
   pb::Header peptides_header;
 
   vector<HeadedRecordReader*> peptide_reader;
-  for (int i = 0; i < NUM_THREADS; i++) {
+  for (int i = 0; i < num_readers; i++) {
     peptide_reader.push_back(new HeadedRecordReader(peptides_file, &peptides_header));
   }
+  if (mapped_index) {
+    // Only the header is needed from pepix.
+    HeadedRecordReader header_reader(peptides_file, &peptides_header);
+  }
 
   if ((peptides_header.file_type() != pb::Header::PEPTIDES) ||
       !peptides_header.has_peptides_header()) {
@@ -277,12 +326,28 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
       &pepHeader.nterm_mods(), &pepHeader.cterm_mods(),
       &pepHeader.nprotterm_mods(), &pepHeader.cprotterm_mods(),
       bin_width_, bin_offset_);
+
+  // Theoretical peaks stored in the index can stand in for computed ones if
+  // they were binned the same way.
+  bool stored_peaks = false;
+  if (pepHeader.has_peaks_bin_width()) {
+    stored_peaks = pepHeader.peaks_bin_width() == MassConstants::bin_width_ &&
+                   pepHeader.peaks_bin_offset() == MassConstants::bin_offset_;
+    if (stored_peaks) {
+      carp(CARP_INFO, "Using theoretical peaks stored in the index.");
+    } else {
+      carp(CARP_INFO, "The index holds theoretical peaks for mz-bin-width %g "
+           "and mz-bin-offset %g; computing them instead.",
+           pepHeader.peaks_bin_width(), pepHeader.peaks_bin_offset());
+    }
+  }
   ModificationDefinition::ClearAll();
   TideMatchSet::initModMap(pepHeader.mods(), ANY);
   TideMatchSet::initModMap(pepHeader.nterm_mods(), PEPTIDE_N);
   TideMatchSet::initModMap(pepHeader.cterm_mods(), PEPTIDE_C);
   TideMatchSet::initModMap(pepHeader.nprotterm_mods(), PROTEIN_N);
   TideMatchSet::initModMap(pepHeader.cprotterm_mods(), PROTEIN_C);
+  TideMatchSet::clearPeptideColumns();
 
   ofstream* target_file = NULL;
   ofstream* decoy_file = NULL;
@@ -291,18 +356,63 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
   stringstream ss;
   ss << Params::GetString("enzyme") << '-' << Params::GetString("digestion");
   TideMatchSet::CleavageType = ss.str();
+
+  // Results are handed over in memory as a PSMBatch with the columns of
+  // the file, which then need not be written (see keepResultsInMemory).
+  // The binary results file is written from the same rows as they come in.
+  bool batch_results = batch_results_ && !Params::GetBool("peptide-centric-search");
+  bool binary_output = Params::GetBool("binary-output");
+  if (binary_output && Params::GetBool("peptide-centric-search")) {
+    carp(CARP_WARNING, "Binary output is not available for peptide-centric "
+         "search; only the tab-delimited results will be written.");
+    binary_output = false;
+  }
+  // The tab-delimited file is written for txt-output, whether or not there
+  // is a binary file, and for the formats converted from it.
+  bool txt_output = Params::GetBool("txt-output");
+  bool write_files = ((!batch_results || write_batched_results_) && txt_output) ||
+    Params::GetBool("pin-output") || Params::GetBool("pepxml-output") ||
+    Params::GetBool("mzid-output") || Params::GetBool("sqt-output");
+  if (!write_files && !batch_results && !binary_output) {
+    carp(CARP_WARNING, "txt-output is F and no other output format is "
+         "requested; no search results will be written.");
+  }
+  string target_file_name, decoy_file_name;
+  string target_binary_name, decoy_binary_name;
   if (!Params::GetBool("concat")) {
-    string target_file_name = make_file_path("tide-search.target.txt");
-    target_file = create_stream_in_path(target_file_name.c_str(), NULL, overwrite);
-    output_file_name_ = target_file_name;
+    target_file_name = make_file_path("tide-search.target.txt");
+    target_binary_name = make_file_path("tide-search.target" + PSMBatchFile::EXTENSION);
     if (HAS_DECOYS) {
-      string decoy_file_name = make_file_path("tide-search.decoy.txt");
-      decoy_file = create_stream_in_path(decoy_file_name.c_str(), NULL, overwrite);
+      decoy_file_name = make_file_path("tide-search.decoy.txt");
+      decoy_binary_name = make_file_path("tide-search.decoy" + PSMBatchFile::EXTENSION);
     }
   } else {
-    string concat_file_name = make_file_path("tide-search.txt");
-    target_file = create_stream_in_path(concat_file_name.c_str(), NULL, overwrite);
-    output_file_name_ = concat_file_name;
+    target_file_name = make_file_path("tide-search.txt");
+    target_binary_name = make_file_path("tide-search" + PSMBatchFile::EXTENSION);
+  }
+  output_file_name_ = write_files || batch_results ? target_file_name : target_binary_name;
+  if (write_files) {
+    target_file = create_stream_in_path(target_file_name.c_str(), NULL, overwrite);
+    if (!decoy_file_name.empty()) {
+      decoy_file = create_stream_in_path(decoy_file_name.c_str(), NULL, overwrite);
+    }
+  }
+  if (batch_results) {
+    target_batch_ = new PSMBatch(
+      TideMatchSet::headerColumns(false, decoysPerTarget > 1, compute_sp));
+    if (!decoy_file_name.empty()) {
+      decoy_batch_ = new PSMBatch(
+        TideMatchSet::headerColumns(true, decoysPerTarget > 1, compute_sp));
+    }
+  }
+  if (binary_output) {
+    carp(CARP_INFO, "Writing binary results to %s.", target_binary_name.c_str());
+    target_binary_ = new PSMBatchFile::Writer(target_binary_name,
+      TideMatchSet::headerColumns(false, decoysPerTarget > 1, compute_sp), overwrite);
+    if (!decoy_binary_name.empty()) {
+      decoy_binary_ = new PSMBatchFile::Writer(decoy_binary_name,
+        TideMatchSet::headerColumns(true, decoysPerTarget > 1, compute_sp), overwrite);
+    }
   }
 
   if (target_file) {
@@ -310,32 +420,67 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
     TideMatchSet::writeHeaders(decoy_file, true, decoysPerTarget > 1, compute_sp);
   }
 
-  vector<InputFile> sr = getInputFiles(input_files);
+  // Each spectrum file is converted if necessary and read on a background
+  // thread while the previous one is searched, so that only the first
+  // file's preparation holds up the search.
+  // store-spectra names a single file, so it can only hold the conversion
+  // of a single input; that is checked here, before any thread starts.
+  if (input_files.size() > 1 && !Params::GetString("store-spectra").empty()) {
+    for (vector<string>::const_iterator f = input_files.begin(); f != input_files.end(); ++f) {
+      if (!findPreloaded(*f) && !SpectrumRecordSpectrumCollection::IsSpectrumRecordFile(*f)) {
+        carp(CARP_FATAL, "Cannot use store-spectra option with multiple input "
+                         "spectrum files");
+      }
+    }
+  }
+  PreparedInput next_input;
+  if (!input_files.empty()) {
+    prepareInput(input_files[0], &next_input);
+  }
 
   // Loop through spectrum files
-  for (vector<InputFile>::const_iterator f = sr.begin(); f != sr.end(); f++) {
-    if (!peptide_reader[0]) {
-      for (int i = 0; i < NUM_THREADS; i++) {
+  for (size_t input_idx = 0; input_idx < input_files.size(); input_idx++) {
+    PreparedInput input = next_input;
+    const InputFile* f = &input.File;
+    boost::thread* prepare_thread = NULL;
+    if (input_idx + 1 < input_files.size()) {
+      prepare_thread = new boost::thread(boost::bind(
+        &TideSearchApplication::prepareInput, this,
+        input_files[input_idx + 1], &next_input));
+    }
+
+    if (!peptide_reader.empty() && !peptide_reader[0]) {
+      for (int i = 0; i < num_readers; i++) {
         peptide_reader[i] = new HeadedRecordReader(peptides_file, &peptides_header);
       }
     }
 
+    SharedPeptideQueue* shared_peptide_queue = NULL;
+    if (shared_queue && mapped_index) {
+      shared_peptide_queue = new SharedPeptideQueue(mapped_index, proteins,
+                                                    NUM_THREADS);
+    } else if (shared_queue) {
+      shared_peptide_queue = new SharedPeptideQueue(peptide_reader[0]->Reader(),
+                                                    proteins, NUM_THREADS);
+    }
+    if (shared_peptide_queue) {
+      shared_peptide_queue->SetStoredPeaks(stored_peaks);
+    }
     vector<ActivePeptideQueue*> active_peptide_queue;
     for (int i = 0; i < NUM_THREADS; i++) {
-      active_peptide_queue.push_back(new ActivePeptideQueue(peptide_reader[i]->Reader(), proteins));
+      if (shared_peptide_queue) {
+        active_peptide_queue.push_back(new ActivePeptideQueue(shared_peptide_queue, i, proteins));
+      } else if (mapped_index) {
+        active_peptide_queue.push_back(new ActivePeptideQueue(mapped_index, proteins));
+      } else {
+        active_peptide_queue.push_back(new ActivePeptideQueue(peptide_reader[i]->Reader(), proteins));
+      }
       active_peptide_queue[i]->SetBinSize(bin_width_, bin_offset_);
+      active_peptide_queue[i]->SetStoredPeaks(stored_peaks);
     }
 
     string spectra_file = f->SpectrumRecords;
-    SpectrumCollection* spectra = NULL;
-    map<string, SpectrumCollection*>::iterator spectraIter = spectra_.find(spectra_file);
-    if (spectraIter == spectra_.end()) {
-      carp(CARP_INFO, "Reading spectrum file %s.", spectra_file.c_str());
-      spectra = loadSpectra(spectra_file);
-      carp(CARP_INFO, "Read %d spectra.", spectra->Size());
-    } else {
-      spectra = spectraIter->second;
-    }
+    SpectrumCollection* spectra = input.Spectra;
 
     double highest_mz = spectra->FindHighestMZ();
     unsigned int spectrum_num = spectra->SpecCharges()->size();
@@ -349,6 +494,8 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
     carp(CARP_INFO, "Starting search.");
     if (spectrum_flag_ == NULL) {
       resetMods();
+    } else {
+      spectrum_flag_->addFile(f->OriginalName, spectra);
     }
     search(f->OriginalName, spectra->SpecCharges(), active_peptide_queue, proteins,
            locations, Params::GetDouble("precursor-window"),
@@ -362,7 +509,7 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
            pepHeader.mods(), pepHeader.nterm_mods(), pepHeader.cterm_mods(),
            decoysPerTarget, &negative_isotope_errors);
 
-    if (spectraIter == spectra_.end()) {
+    if (input.OwnsSpectra && !spectrum_cache_) {
       delete spectra;
     }
     // convert tab delimited to other file formats.
@@ -377,11 +524,23 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
     // Clean up
     for (int i = 0; i < NUM_THREADS; i++) {
       delete active_peptide_queue[i];
+    }
+    delete shared_peptide_queue;
+    for (int i = 0; i < num_readers; i++) {
       delete peptide_reader[i];
       peptide_reader[i] = NULL;
     }
 
+    if (prepare_thread) {
+      prepare_thread->join();
+      delete prepare_thread;
+    }
+    // Cached only now, as prepareInput() looks in the cache.
+    if (input.OwnsSpectra && spectrum_cache_) {
+      (*spectrum_cache_)[input_files[input_idx]] = spectra;
+    }
   } // End of spectrum file loop
+  delete mapped_index;
 
   for (ProteinVec::iterator i = proteins.begin(); i != proteins.end(); ++i) {
     delete *i;
@@ -392,6 +551,31 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
       delete decoy_file;
     }
   }
+  if (target_binary_) {
+    target_binary_->close();
+    delete target_binary_;
+    target_binary_ = NULL;
+  }
+  if (decoy_binary_) {
+    decoy_binary_->close();
+    delete decoy_binary_;
+    decoy_binary_ = NULL;
+  }
+  if (target_batch_ && batch_results) {
+    carp(CARP_INFO, "Keeping %d target PSMs in memory for post-processing.",
+         (int)target_batch_->size());
+    PSMBatch::publish(target_file_name, target_batch_);
+    target_batch_ = NULL;
+  }
+  if (decoy_batch_ && batch_results) {
+    carp(CARP_INFO, "Keeping %d decoy PSMs in memory for post-processing.",
+         (int)decoy_batch_->size());
+    PSMBatch::publish(decoy_file_name, decoy_batch_);
+    decoy_batch_ = NULL;
+  }
+  delete target_batch_;
+  delete decoy_batch_;
+  target_batch_ = decoy_batch_ = NULL;
   delete[] aaFreqN;
   delete[] aaFreqI;
   delete[] aaFreqC;
@@ -429,43 +613,68 @@ vector<int> TideSearchApplication::getNegativeIsotopeErrors() const {
   return negative_isotope_errors;
 }
 
-vector<TideSearchApplication::InputFile> TideSearchApplication::getInputFiles(
-  const vector<string>& filepaths
+SpectrumCollection* TideSearchApplication::findPreloaded(const string& filepath) const {
+  map<string, SpectrumCollection*>::const_iterator preloaded = spectra_.find(filepath);
+  if (preloaded != spectra_.end()) {
+    return preloaded->second;
+  }
+  if (spectrum_cache_) {
+    preloaded = spectrum_cache_->find(filepath);
+    if (preloaded != spectrum_cache_->end()) {
+      return preloaded->second;
+    }
+  }
+  return NULL;
+}
+
+void TideSearchApplication::prepareInput(
+  const string& filepath,
+  PreparedInput* out
 ) const {
-  // Try to read all spectrum files as spectrumrecords, convert those that fail
-  vector<InputFile> input_sr;
-  for (vector<string>::const_iterator f = filepaths.begin(); f != filepaths.end(); f++) {
-    SpectrumCollection spectra;
-    pb::Header spectrum_header;
-    string spectrumrecords = *f;
-    bool keepSpectrumrecords = true;
-    if (!spectra.ReadSpectrumRecords(spectrumrecords, &spectrum_header)) {
-      // Failed, try converting to spectrumrecords file
-      carp(CARP_INFO, "Converting %s to spectrumrecords format", f->c_str());
-      carp(CARP_INFO, "Elapsed time starting conversion: %.3g s", wall_clock() / 1e6);
-      spectrumrecords = Params::GetString("store-spectra");
-      keepSpectrumrecords = !spectrumrecords.empty();
-      if (!keepSpectrumrecords) {
-        spectrumrecords = make_file_path(FileUtils::BaseName(*f) + ".spectrumrecords.tmp");
-      } else if (filepaths.size() > 1) {
-        carp(CARP_FATAL, "Cannot use store-spectra option with multiple input "
-                         "spectrum files");
-      }
-      carp(CARP_DEBUG, "New spectrumrecords filename: %s", spectrumrecords.c_str());
-      if (!SpectrumRecordWriter::convert(*f, spectrumrecords)) {
-        carp(CARP_FATAL, "Error converting %s to spectrumrecords format", f->c_str());
-      }
-      carp(CARP_DEBUG, "Reading converted spectrum file %s", spectrumrecords.c_str());
-      // Re-read converted file as spectrumrecords file
-      if (!spectra.ReadSpectrumRecords(spectrumrecords, &spectrum_header)) {
-        carp(CARP_DEBUG, "Deleting %s", spectrumrecords.c_str());
-        FileUtils::Remove(spectrumrecords);
-        carp(CARP_FATAL, "Error reading spectra file %s", spectrumrecords.c_str());
-      }
+  SpectrumCollection* preloaded = findPreloaded(filepath);
+  if (preloaded) {
+    out->File = InputFile(filepath, filepath, true);
+    out->Spectra = preloaded;
+    out->OwnsSpectra = false;
+    return;
+  }
+  // Files that are not spectrumrecords, as told by their first bytes, are
+  // converted first
+  SpectrumCollection* spectra = new SpectrumCollection();
+  pb::Header spectrum_header;
+  string spectrumrecords = filepath;
+  bool keepSpectrumrecords = true;
+  if (SpectrumRecordSpectrumCollection::IsSpectrumRecordFile(filepath)) {
+    carp(CARP_INFO, "Reading spectrum file %s.", filepath.c_str());
+    if (!spectra->ReadSpectrumRecords(spectrumrecords, &spectrum_header)) {
+      carp(CARP_FATAL, "Error reading spectrum file %s", filepath.c_str());
+    }
+  } else {
+    delete spectra;
+    carp(CARP_INFO, "Converting %s to spectrumrecords format", filepath.c_str());
+    carp(CARP_INFO, "Elapsed time starting conversion: %.3g s", wall_clock() / 1e6);
+    spectrumrecords = Params::GetString("store-spectra");
+    keepSpectrumrecords = !spectrumrecords.empty();
+    if (!keepSpectrumrecords) {
+      spectrumrecords = make_file_path(FileUtils::BaseName(filepath) + ".spectrumrecords.tmp");
+    }
+    carp(CARP_DEBUG, "New spectrumrecords filename: %s", spectrumrecords.c_str());
+    if (!SpectrumRecordWriter::convert(filepath, spectrumrecords)) {
+      carp(CARP_FATAL, "Error converting %s to spectrumrecords format", filepath.c_str());
+    }
+    carp(CARP_DEBUG, "Reading converted spectrum file %s", spectrumrecords.c_str());
+    spectra = new SpectrumCollection();
+    if (!spectra->ReadSpectrumRecords(spectrumrecords, &spectrum_header)) {
+      carp(CARP_DEBUG, "Deleting %s", spectrumrecords.c_str());
+      FileUtils::Remove(spectrumrecords);
+      carp(CARP_FATAL, "Error reading spectra file %s", spectrumrecords.c_str());
     }
-    input_sr.push_back(InputFile(*f, spectrumrecords, keepSpectrumrecords));
   }
-  return input_sr;
+  sortSpectra(spectra);
+  carp(CARP_INFO, "Read %d spectra from %s.", spectra->Size(), filepath.c_str());
+  out->File = InputFile(filepath, spectrumrecords, keepSpectrumrecords);
+  out->Spectra = spectra;
+  out->OwnsSpectra = true;
 }
 
 SpectrumCollection* TideSearchApplication::loadSpectra(const string& file) {
@@ -474,12 +683,16 @@ SpectrumCollection* TideSearchApplication::loadSpectra(const string& file) {
   if (!spectra->ReadSpectrumRecords(file, &header)) {
     carp(CARP_FATAL, "Error reading spectrum file %s", file.c_str());
   }
+  sortSpectra(spectra);
+  return spectra;
+}
+
+void TideSearchApplication::sortSpectra(SpectrumCollection* spectra) {
   if (string_to_window_type(Params::GetString("precursor-window-type")) != WINDOW_MZ) {
     spectra->Sort();
   } else {
     spectra->Sort<ScSortByMz>(ScSortByMz(Params::GetDouble("precursor-window")));
   }
-  return spectra;
 }
 
 void TideSearchApplication::search(void* threadarg) {
@@ -504,7 +717,11 @@ void TideSearchApplication::search(void* threadarg) {
   ofstream* decoy_file = my_data->decoy_file;
   bool compute_sp = my_data->compute_sp;
   int64_t thread_num = my_data->thread_num;
-  int64_t num_threads = my_data->num_threads;
+  // Spectrum-centric results are formatted into this thread's own buffers.
+  ThreadedFileWriter* target_writer = my_data->target_writer;
+  ThreadedFileWriter* decoy_writer = my_data->decoy_writer;
+  ostream* target_buffer = target_writer ? target_writer->buffer(thread_num) : NULL;
+  ostream* decoy_buffer = decoy_writer ? decoy_writer->buffer(thread_num) : NULL;
   int nAA = my_data->nAA;
   double* aaFreqN = my_data->aaFreqN;
   double* aaFreqI = my_data->aaFreqI;
@@ -526,25 +743,75 @@ void TideSearchApplication::search(void* threadarg) {
   double bin_width = my_data->bin_width;
   double bin_offset = my_data->bin_offset;
   bool exact_pval_search = my_data->exact_pval_search;
-  map<pair<string, unsigned int>, bool>* spectrum_flag = my_data->spectrum_flag;
+  SpectrumFlags* spectrum_flag = my_data->spectrum_flag;
+  int flag_file = spectrum_flag ? spectrum_flag->fileIndex(spectrum_filename) : -1;
 
   int* sc_index = my_data->sc_index;
   int* total_candidate_peptides = my_data->total_candidate_peptides;
 
-  // params
-  bool peptide_centric = Params::GetBool("peptide-centric-search");
-  bool use_neutral_loss_peaks = Params::GetBool("use-neutral-loss-peaks");
-  bool use_flanking_peaks = Params::GetBool("use-flanking-peaks");
-  int max_charge = Params::GetInt("max-precursor-charge");
+  // Parameters are read once, here, and buffers are reused throughout; see
+  // SearchContext.
+  SearchContext context;
+  my_data->context = &context;
+  context.peptide_centric = Params::GetBool("peptide-centric-search");
+  context.use_tailor_calibration = Params::GetBool("use-tailor-calibration");
   // Added by Andy Lin on 2/9/2016
   // Determines which score function to use for scoring PSMs and store in SCORE_FUNCTION enum
-  SCORE_FUNCTION_T curScoreFunction = string_to_score_function_type(Params::GetString("score-function"));
+  context.score_function = string_to_score_function_type(Params::GetString("score-function"));
+  context.max_charge = Params::GetInt("max-precursor-charge");
+  context.fragment_tolerance = Params::GetDouble("fragment-tolerance");
+  context.evidence_granularity = Params::GetInt("evidence-granularity");
+  context.max_precursor_mass_bin = floor(MaxBin::Global().CacheBinEnd() + 50.0);
+  if (context.score_function != XCORR_SCORE) {
+    for (size_t i = 0; i < aaMassDouble.size(); i++) {
+      context.aa_mass_int.push_back(MassConstants::mass2bin(aaMassDouble[i]));
+    }
+  }
+  bool peptide_centric = context.peptide_centric;
+  bool use_neutral_loss_peaks = Params::GetBool("use-neutral-loss-peaks");
+  bool use_flanking_peaks = Params::GetBool("use-flanking-peaks");
+  int max_charge = context.max_charge;
+  SCORE_FUNCTION_T curScoreFunction = context.score_function;
+  vector<double>* min_mass = &context.min_mass;
+  vector<double>* max_mass = &context.max_mass;
+  vector<bool>* candidatePeptideStatus = &context.candidatePeptideStatus;
+  ScoreCountWorkspace& workspace = context.workspace;
+  if (target_batch_ || target_binary_) {
+    context.target_rows = new PSMBatch(target_batch_ ?
+      target_batch_->columns() : target_binary_->columns());
+  }
+  if (decoy_batch_ || decoy_binary_) {
+    context.decoy_rows = new PSMBatch(decoy_batch_ ?
+      decoy_batch_->columns() : decoy_binary_->columns());
+  }
 
   // This is the main search loop.
   ObservedPeakSet observed(bin_width, bin_offset,
                            use_neutral_loss_peaks,
                            use_flanking_peaks);
 
+  // With spectrum blocking, XCorr spectra wait in the context's block, each
+  // preprocessed into its own ObservedPeakSet, until searchBlock() scores
+  // them together.
+  int spectrum_block = min(Params::GetInt("spectrum-block-size"),
+                           (int)ScoreKernel::kMaxBlock);
+  if (context.use_tailor_calibration) {
+    spectrum_block = 1; // the Tailor quantile depends on the exact window
+  }
+  context.spectrum_block = spectrum_block;
+  if (spectrum_block > 1) {
+    context.block.resize(spectrum_block);
+    for (int i = 0; i < spectrum_block; ++i) {
+      context.observed_block.push_back(new ObservedPeakSet(bin_width, bin_offset,
+                                                           use_neutral_loss_peaks,
+                                                           use_flanking_peaks));
+    }
+    if (!ScoreKernel::Compiled()) {
+      context.interleaved_caches.resize(
+        (size_t)MaxBin::Global().CacheBinEnd() * NUM_PEAK_TYPES * spectrum_block);
+    }
+  }
+
   // Keep track of observed peaks that get filtered out in various ways.
   long int num_range_skipped = 0;
   long int num_precursors_skipped = 0;
@@ -555,9 +822,14 @@ void TideSearchApplication::search(void* threadarg) {
   FLOAT_T sc_total = (FLOAT_T)spec_charges->size();
   int print_interval = Params::GetInt("print-search-progress");
 
-  for (vector<SpectrumCollection::SpecCharge>::const_iterator sc = spec_charges->begin()+thread_num;
-       sc < spec_charges->begin() + (spec_charges->size());
-       sc = sc + num_threads) {
+  // Spectrum-charge pairs are claimed in chunks; see nextSpecCharge().
+  int sc_pos = -1;
+  int chunk_end = -1;
+  my_data->stats->start_time = wall_clock();
+  for (vector<SpectrumCollection::SpecCharge>::const_iterator sc =
+         spec_charges->begin() + nextSpecCharge(threadarg, &sc_pos, &chunk_end);
+       sc < spec_charges->end();
+       sc = spec_charges->begin() + nextSpecCharge(threadarg, &sc_pos, &chunk_end)) {
     locks_array[LOCK_REPORTING]->lock();
     ++(*sc_index);
     if (print_interval > 0 && *sc_index > 0 && *sc_index % print_interval == 0) {
@@ -572,16 +844,8 @@ void TideSearchApplication::search(void* threadarg) {
     int charge = sc->charge;
 
     int scan_num = spectrum->SpectrumNumber();
-    if (spectrum_flag != NULL) {
-      locks_array[LOCK_CASCADE]->lock();
-      map<pair<string, unsigned int>, bool>::iterator spectrum_id;
-      spectrum_id = spectrum_flag->find(pair<string, unsigned int>(
-        spectrum_filename, scan_num * 10 + charge));
-      if (spectrum_id != spectrum_flag->end()) {
-        locks_array[LOCK_CASCADE]->unlock();
-        continue;
-      }
-      locks_array[LOCK_CASCADE]->unlock();
+    if (flag_file >= 0 && spectrum_flag->isSet(flag_file, sc - spec_charges->begin())) {
+      continue;
     }
 
     if (precursor_mz < spectrum_min_mz || precursor_mz > spectrum_max_mz ||
@@ -592,10 +856,40 @@ void TideSearchApplication::search(void* threadarg) {
     }
     // The active peptide queue holds the candidate peptides for spectrum.
     // Calculate and set the window, depending on the window type.
-    vector<double>* min_mass = new vector<double>();
-    vector<double>* max_mass = new vector<double>();
-    vector<bool>* candidatePeptideStatus = new vector<bool>();
     double min_range, max_range;
+    if (curScoreFunction == XCORR_SCORE && !exact_pval_search_ && spectrum_block > 1) {
+      BlockedSpecCharge& next = context.block[context.block_size];
+      next.min_mass.clear();
+      next.max_mass.clear();
+      computeWindow(*sc, window_type, precursor_window, max_charge,
+                    negative_isotope_errors, &next.min_mass, &next.max_mass,
+                    &min_range, &max_range);
+      // Only neighbours whose windows overlap share much of their candidates.
+      if (context.block_size > 0) {
+        const BlockedSpecCharge& last = context.block[context.block_size - 1];
+        if (min_range > last.max_range || max_range < last.min_range) {
+          searchBlock(threadarg, target_buffer, decoy_buffer);
+        }
+      }
+      // Flushing empties the block, so this window may move to the front.
+      BlockedSpecCharge& blocked = context.block[context.block_size];
+      if (&blocked != &next) {
+        swap(blocked.min_mass, next.min_mass);
+        swap(blocked.max_mass, next.max_mass);
+      }
+      blocked.sc = &*sc;
+      blocked.min_range = min_range;
+      blocked.max_range = max_range;
+      context.observed_block[context.block_size]->PreprocessSpectrum(
+        *spectrum, charge, &num_range_skipped, &num_precursors_skipped,
+        &num_isotopes_skipped, &num_retained);
+      if (++context.block_size == spectrum_block) {
+        searchBlock(threadarg, target_buffer, decoy_buffer);
+      }
+      continue;
+    }
+    min_mass->clear();
+    max_mass->clear();
     computeWindow(*sc, window_type, precursor_window, max_charge,
                   negative_isotope_errors, min_mass, max_mass, &min_range, &max_range);
 
@@ -618,7 +912,8 @@ void TideSearchApplication::search(void* threadarg) {
       locks_array[LOCK_CANDIDATES]->unlock();
 
       int candidatePeptideStatusSize = candidatePeptideStatus->size();
-      TideMatchSet::Arr2 match_arr2(candidatePeptideStatusSize); // Scored peptides will go here.
+      TideMatchSet::Arr2& match_arr2 = context.match_arr2; // Scored peptides will go here.
+      match_arr2.Reserve(candidatePeptideStatusSize);
 
       // Programs for taking the dot-product with the observed spectrum are laid
       // out in memory managed by the active_peptide_queue, one program for each
@@ -627,62 +922,9 @@ void TideSearchApplication::search(void* threadarg) {
       collectScoresCompiled(active_peptide_queue, spectrum, observed, &match_arr2,
                             candidatePeptideStatusSize, charge);
 
-      // matches will arrange the results in a heap by score, return the top
-      // few, and recover the association between counter and peptide. We output
-      // the top matches.
-      if (peptide_centric) {
-        deque<Peptide*>::const_iterator iter_ = active_peptide_queue->iter_;
-        TideMatchSet::Arr2::iterator it = match_arr2.begin();
-        for (; it != match_arr2.end(); ++iter_, ++it) {
-          int peptide_idx = candidatePeptideStatusSize - (it->second);
-          if ((*candidatePeptideStatus)[peptide_idx]) {
-            (*iter_)->AddHit(spectrum, it->first, 0.0, it->second, charge);
-          }
-        }
-      } else {  //spectrum centric match report.
-        //Implementation of the Tailor score calibration method, by AKF
-        double quantile_score = 1.0;
-        if (Params::GetBool("use-tailor-calibration")){
-          vector<double> scores;
-          double quantile_th = 0.01;
-          // Collect the scores for the score tail distribution
-          for (TideMatchSet::Arr2::iterator it = match_arr2.begin();
-            it != match_arr2.end();
-            ++it) {
-            scores.push_back((double)(it->first / XCORR_SCALING));
-          }
-          sort(scores.begin(), scores.end(), greater<double>());  //sort in decreasing order
-          int quantile_pos = (int)(quantile_th*(double)scores.size()+0.5);
-
-          if (quantile_pos < 3)
-            quantile_pos = 3;
-          quantile_score = scores[quantile_pos]+5.0; // Make sure scores positive
-        }  //End of Tailor
-        TideMatchSet::Arr match_arr(nCandPeptide);
-        for (TideMatchSet::Arr2::iterator it = match_arr2.begin();
-             it != match_arr2.end();
-             ++it) {
-          int peptide_idx = candidatePeptideStatusSize - (it->second);
-          if ((*candidatePeptideStatus)[peptide_idx]) {
-            TideMatchSet::Scores curScore;
-            curScore.xcorr_score = (double)(it->first / XCORR_SCALING);
-            curScore.rank = it->second;
-            //Added for tailor score calibration method by AKF
-            if (Params::GetBool("use-tailor-calibration")){
-              curScore.tailor = ((double)(it->first / XCORR_SCALING) + 5.0) / quantile_score;
-            }            
-            match_arr.push_back(curScore);
-          }
-        }
-
-        TideMatchSet matches(&match_arr, highest_mz);
-        matches.exact_pval_search_ = exact_pval_search;
-        matches.cur_score_function_ = curScoreFunction;
-
-        matches.report(target_file, decoy_file, top_matches, numDecoys, spectrum_filename,
-                       spectrum, charge, active_peptide_queue, proteins,
-                       locations, compute_sp, true, locks_array[LOCK_RESULTS]);
-      }  //end peptide_centric == false
+      reportXCorrMatches(threadarg, spectrum, charge, &match_arr2,
+                         *candidatePeptideStatus, nCandPeptide,
+                         target_buffer, decoy_buffer);
     } else { //This runs curScoreFunction=BOTH_SCORE, curScoreFunction=RESIUDUE_EVIDENCE_MATRIX, and xcorr p-val
 
       int nCandPeptide = active_peptide_queue->SetActiveRangeBIons(min_mass, max_mass, min_range, max_range, candidatePeptideStatus);
@@ -698,16 +940,10 @@ void TideSearchApplication::search(void* threadarg) {
       //TODO so this includes ALL amino acids seen (including modified, NTerm mod, CTerm Mod)
       //as a result -- we will look for NTerm mod amino acids throughout spectrum instead of
       //just amino acids without NTerm mod
-      vector<int> aaMassInt;
-      if (curScoreFunction != XCORR_SCORE) {
-        for (int i = 0; i < aaMassDouble.size(); i++) {
-          int tmpMass = MassConstants::mass2bin(aaMassDouble[i]);
-          aaMassInt.push_back(tmpMass);
-        }
-      }
-      int maxPrecurMassBin = floor(MaxBin::Global().CacheBinEnd() + 50.0);
-      double fragTol = Params::GetDouble("fragment-tolerance");
-      int granularityScale = Params::GetInt("evidence-granularity");
+      vector<int>& aaMassInt = context.aa_mass_int;
+      int maxPrecurMassBin = context.max_precursor_mass_bin;
+      double fragTol = context.fragment_tolerance;
+      int granularityScale = context.evidence_granularity;
 
       //TODO look at this
       int minDeltaMass;
@@ -720,7 +956,8 @@ void TideSearchApplication::search(void* threadarg) {
         maxDeltaMass = aaMassInt[nAARes - 1];
       }
 
-      TideMatchSet::Arr match_arr(nCandPeptide); // scored peptides will go here.
+      TideMatchSet::Arr& match_arr = context.match_arr; // scored peptides will go here.
+      match_arr.Reserve(nCandPeptide);
 
       // iterators needed at multiple places in following code
       deque<Peptide*>::const_iterator iter_ = active_peptide_queue->iter_;
@@ -742,10 +979,10 @@ void TideSearchApplication::search(void* threadarg) {
        * Ported to and integrated with Tide by Andy Lin, Nov 2016
        */
       int peidx, pe, ma;
-      vector<int> pepMassInt;
-      pepMassInt.reserve(nCandPeptide);
-      vector<int> pepMassIntUnique;
-      pepMassIntUnique.reserve(nCandPeptide);
+      vector<int>& pepMassInt = workspace.pepMassInt;
+      pepMassInt.resize(nCandPeptide);
+      vector<int>& pepMassIntUnique = workspace.pepMassIntUnique;
+      pepMassIntUnique.clear();
 
       //For each candidate peptide, determine which discretized mass bin it is in
       //pepMassInt contains the corresponding mass bin for each candidate peptide
@@ -754,10 +991,18 @@ void TideSearchApplication::search(void* threadarg) {
       int nPepMassIntUniq = (int)pepMassIntUnique.size();
 
       //XCORR
-      vector< vector<int> > evidenceObs(nPepMassIntUniq, vector<int>(maxPrecurMassBin, 0));
-      int* scoreOffsetObs = new int[nPepMassIntUniq];
-      double** pValueScoreObs = new double*[nPepMassIntUniq];
-      int* intensArrayTheor = new int [maxPrecurMassBin]; // initialized later in loop
+      vector< vector<int> >& evidenceObs = workspace.evidenceObs;
+      evidenceObs.resize(nPepMassIntUniq);
+      vector<int>& scoreOffsetObs = workspace.scoreOffsetObs;
+      scoreOffsetObs.resize(nPepMassIntUniq);
+      vector<vector<double> >& pValueScoreObs = workspace.pValueScoreObs;
+      if ((int)pValueScoreObs.size() < nPepMassIntUniq) {
+        pValueScoreObs.resize(nPepMassIntUniq);
+      }
+      if ((int)workspace.intensArrayTheor.size() < maxPrecurMassBin) {
+        workspace.intensArrayTheor.assign(maxPrecurMassBin, 0);
+      }
+      int* intensArrayTheor = &workspace.intensArrayTheor[0];
       //END XCORR
 
       //RES-EV
@@ -765,14 +1010,21 @@ void TideSearchApplication::search(void* threadarg) {
       //nPepMassIntUniq: number of mass bins candidate are in
       //nAARes: number of amino acids
       //maxPrecurMassBin: max number of mass bins
-      vector<vector<vector<double> > > residueEvidenceMatrix(nPepMassIntUniq,
-	      vector<vector<double> >(nAARes, vector<double>(maxPrecurMassBin, 0)));
+      //Each is cleared below before it is filled in.
+      vector<vector<vector<double> > >& residueEvidenceMatrix = workspace.residueEvidence;
+      if (curScoreFunction != XCORR_SCORE) {
+        residueEvidenceMatrix.resize(nPepMassIntUniq);
+      }
 
       //Stores the score offset needed calculating res-ev p-values
-      vector<int> scoreResidueOffsetObs(maxPrecurMassBin, -1);
+      vector<int>& scoreResidueOffsetObs = workspace.scoreResidueOffsetObs;
+      scoreResidueOffsetObs.assign(nPepMassIntUniq, -1);
 
       //For each mass bin, a vector hold the p-values for each corresponding res-ev score
-      vector<vector<double> > pValuesResidueObs(maxPrecurMassBin);
+      vector<vector<double> >& pValuesResidueObs = workspace.pValuesResidueObs;
+      if ((int)pValuesResidueObs.size() < nPepMassIntUniq) {
+        pValuesResidueObs.resize(nPepMassIntUniq);
+      }
 
       //TODO assumption is that there is one nterm mod per peptide
       int nTermMassBin;
@@ -798,7 +1050,9 @@ void TideSearchApplication::search(void* threadarg) {
         cTermMass = MassConstants::mono_oh;
       }
 
-      map<int, bool> calcDPMatrix; //for each precursor mass bin, bool determines whether to calc DP matrix
+      //for each candidate mass bin, whether to calc DP matrix
+      vector<char>& calcDPMatrix = workspace.calcDPMatrix;
+      calcDPMatrix.assign(nPepMassIntUniq, false);
       //END RES-EV
 
       //Create a residue evidence matrix and evidence vector
@@ -823,20 +1077,39 @@ void TideSearchApplication::search(void* threadarg) {
           // aaMassDouble contains amino acids masses in float form
           // aaMass contains amino acid asses in integer form
           // precursorMass is the neutral mass
-          observed.CreateResidueEvidenceMatrix(*spectrum, charge, maxPrecurMassBin, precursorMass,
-                                               nAARes, aaMassDouble, fragTol, granularityScale,
-                                               nTermMass, cTermMass,&num_range_skipped, 
-                                               &num_precursors_skipped, &num_isotopes_skipped, &num_retained,
-                                               residueEvidenceMatrix[pe]);
-          vector<vector<double> > curResidueEvidenceMatrix = residueEvidenceMatrix[pe];
+          //The matrix does not depend on the candidate mass, so it is built
+          //once, into the slot of the heaviest mass (pepMassIntUnique is
+          //sorted), and each lighter mass takes a prefix of it
+          vector<vector<double> >& fullMatrix = residueEvidenceMatrix[nPepMassIntUniq - 1];
+          if (pe == 0) {
+            fullMatrix.resize(nAARes);
+            for (int i = 0; i < nAARes; i++) {
+              fullMatrix[i].assign(maxPrecurMassBin, 0);
+            }
+            long int range_skipped = 0, precursors_skipped = 0;
+            long int isotopes_skipped = 0, retained = 0;
+            observed.CreateResidueEvidenceMatrix(*spectrum, charge, maxPrecurMassBin, precursorMass,
+                                                 nAARes, aaMassDouble, fragTol, granularityScale,
+                                                 nTermMass, cTermMass, &range_skipped,
+                                                 &precursors_skipped, &isotopes_skipped, &retained,
+                                                 fullMatrix);
+            //Peaks are counted once per mass bin, as when a matrix was built for each
+            num_range_skipped += range_skipped * nPepMassIntUniq;
+            num_precursors_skipped += precursors_skipped * nPepMassIntUniq;
+            num_isotopes_skipped += isotopes_skipped * nPepMassIntUniq;
+            num_retained += retained * nPepMassIntUniq;
+          }
 
           //Get rid of values larger than curPepMassInt
           int curPepMassInt = pepMassIntUnique[pe];
-          for (int i = 0; i < curResidueEvidenceMatrix.size(); i++) {
-            curResidueEvidenceMatrix[i].resize(curPepMassInt);
+          residueEvidenceMatrix[pe].resize(nAARes);
+          for (int i = 0; i < nAARes; i++) {
+            if (pe < nPepMassIntUniq - 1) {
+              residueEvidenceMatrix[pe][i].assign(fullMatrix[i].begin(),
+                fullMatrix[i].begin() + min(curPepMassInt, (int)fullMatrix[i].size()));
+            }
+            residueEvidenceMatrix[pe][i].resize(curPepMassInt);
           }
-          residueEvidenceMatrix[pe] = curResidueEvidenceMatrix;
-          calcDPMatrix[curPepMassInt] = false;
         }
         //END RES-Ev
       }
@@ -846,8 +1119,10 @@ void TideSearchApplication::search(void* threadarg) {
       //based upon the residue evidence matrix and the theoretical spectrum
       int scoreResidueEvidence;
       int scoreRefactInt;
-      vector<int> resEvScores;
-      vector<int> xcorrScores;
+      vector<int>& resEvScores = workspace.resEvScores;
+      resEvScores.clear();
+      vector<int>& xcorrScores = workspace.xcorrScores;
+      xcorrScores.clear();
       pe = 0;
       for (peidx = 0; peidx < candidatePeptideStatusSize; peidx++) {
         if ((*candidatePeptideStatus)[peidx]) {
@@ -863,20 +1138,23 @@ void TideSearchApplication::search(void* threadarg) {
 
           //XCORR
           // score XCorr for target peptide with integerized evidenceObs array
+          // Each theoretical peak counts once however often it is listed;
+          // intensArrayTheor marks those seen and is cleared afterwards.
           if (curScoreFunction != RESIDUE_EVIDENCE_MATRIX) {
-            for (ma = 0; ma < maxPrecurMassBin; ma++) {
-              intensArrayTheor[ma] = 0;
-            }
-
+            const vector<int>& curEvidenceObs = evidenceObs[pepMassIntIdx];
+            scoreRefactInt = 0;
             for (vector<unsigned int>::const_iterator iter_uint = iter1_->unordered_peak_list_.begin();
                  iter_uint != iter1_->unordered_peak_list_.end();
                  iter_uint++) {
-              intensArrayTheor[*iter_uint] = 1;
+              if (!intensArrayTheor[*iter_uint]) {
+                intensArrayTheor[*iter_uint] = 1;
+                scoreRefactInt += curEvidenceObs[*iter_uint];
+              }
             }
-
-            scoreRefactInt = 0;
-            for (ma = 0; ma < maxPrecurMassBin; ma++) {
-              scoreRefactInt += evidenceObs[pepMassIntIdx][ma] * intensArrayTheor[ma];
+            for (vector<unsigned int>::const_iterator iter_uint = iter1_->unordered_peak_list_.begin();
+                 iter_uint != iter1_->unordered_peak_list_.end();
+                 iter_uint++) {
+              intensArrayTheor[*iter_uint] = 0;
             }
             xcorrScores.push_back(scoreRefactInt);
           }
@@ -884,21 +1162,14 @@ void TideSearchApplication::search(void* threadarg) {
 
           //RES-EV
           if (curScoreFunction != XCORR_SCORE) {
-            vector<vector<double> > curResidueEvidenceMatrix = residueEvidenceMatrix[pepMassIntIdx];
+            const vector<vector<double> >& curResidueEvidenceMatrix = residueEvidenceMatrix[pepMassIntIdx];
             Peptide* curPeptide = (*iter_);
 
-            vector<unsigned int> intensArrayTheorResEv;
-            for (vector<unsigned int>::const_iterator iter_uint = iter1_->unordered_peak_list_.begin();
-                 iter_uint != iter1_->unordered_peak_list_.end();
-                 iter_uint++) {
-              intensArrayTheorResEv.push_back(*iter_uint);
-            }
-
-            scoreResidueEvidence = calcResEvScore(curResidueEvidenceMatrix,intensArrayTheorResEv,aaMassDouble,curPeptide);
+            scoreResidueEvidence = calcResEvScore(curResidueEvidenceMatrix,iter1_->unordered_peak_list_,aaMassDouble,curPeptide);
             resEvScores.push_back(scoreResidueEvidence);
 
             if (scoreResidueEvidence > 0) { // if > 0, set bool to true to create DP matrix
-              calcDPMatrix[curPepMassInt] = true;
+              calcDPMatrix[pepMassIntIdx] = true;
             }
           }
           //END RES-EV
@@ -929,7 +1200,8 @@ void TideSearchApplication::search(void* threadarg) {
 
           // estimate maxScore and minScore
           int maxNResidue = (int)floor((double)pepMaInt / (double)minDeltaMass);
-          vector<int> sortEvidenceObs(evidenceObs[pe].begin(), evidenceObs[pe].end());
+          vector<int>& sortEvidenceObs = workspace.sortEvidenceObs;
+          sortEvidenceObs.assign(evidenceObs[pe].begin(), evidenceObs[pe].end());
           std::sort(sortEvidenceObs.begin(), sortEvidenceObs.end(), greater<int>());
           int maxScore = 0;
           int minScore = 0;
@@ -944,12 +1216,12 @@ void TideSearchApplication::search(void* threadarg) {
           int bottomRowBuffer = maxEvidence + 1;
           int topRowBuffer = -minEvidence;
           int nRowDynProg = bottomRowBuffer - minScore + 1 + maxScore + topRowBuffer;
-          pValueScoreObs[pe] = new double[nRowDynProg];
+          pValueScoreObs[pe].resize(nRowDynProg);
 
           scoreOffsetObs[pe] = calcScoreCount(maxPrecurMassBin, &evidenceObs[pe][0], pepMaInt,
                                maxEvidence, minEvidence, maxScore, minScore,
                                nAA, aaFreqN, aaFreqI, aaFreqC, aaMass,
-                               pValueScoreObs[pe]);
+                               &pValueScoreObs[pe][0], &workspace);
         }
       }
       //END XCORR
@@ -957,15 +1229,28 @@ void TideSearchApplication::search(void* threadarg) {
       //RES-EV
       //Create dyanamic programming matrix if there is a res-ev score greater than 0
       //and if user specified as a score function either 'residue-evidence matrix' or 'both'
+      //As the residue evidence matrices of lighter masses are prefixes of
+      //those of heavier ones, so are their dynamic programming matrices: the
+      //matrix is filled in once, for the heaviest mass that needs it, and
+      //the score counts of lighter masses are read off its columns
       if (curScoreFunction != XCORR_SCORE) {
-        for (pe=0 ; pe<nPepMassIntUniq ; pe++) {
+        int dpMassIdx = -1;
+        for (pe = 0; pe < nPepMassIntUniq; pe++) {
+          if (calcDPMatrix[pe]) {
+            dpMassIdx = pe;
+          }
+        }
+        for (int dpStep = 0; dpStep <= dpMassIdx; dpStep++) {
+          //the heaviest mass first, then the others in order
+          pe = dpStep == 0 ? dpMassIdx : dpStep - 1;
           int curPepMassInt = pepMassIntUnique[pe];
-          if (calcDPMatrix[curPepMassInt] == false) {
+          if (!calcDPMatrix[pe]) {
             continue;
           }
 
-          vector<vector<double> > curResidueEvidenceMatrix = residueEvidenceMatrix[pe];
-          vector<int> maxColEvidence(curPepMassInt,0);
+          vector<vector<double> >& curResidueEvidenceMatrix = residueEvidenceMatrix[pe];
+          vector<int>& maxColEvidence = workspace.maxColEvidence;
+          maxColEvidence.assign(curPepMassInt, 0);
 
           //maxColEvidence is edited by reference
           int maxEvidence = getMaxColEvidence(curResidueEvidenceMatrix,maxColEvidence,curPepMassInt);
@@ -978,13 +1263,19 @@ void TideSearchApplication::search(void* threadarg) {
           }
 
           int scoreOffset;
-          vector<double> scoreResidueCount;
+          vector<double>& scoreResidueCount = pValuesResidueObs[pe];
 
-          calcResidueScoreCount(nAARes,curPepMassInt,curResidueEvidenceMatrix,aaMassInt,
-                                dAAFreqN, dAAFreqI, dAAFreqC,nTermMassBin,cTermMassBin,
-                                minDeltaMass,maxDeltaMass,maxEvidence,maxScore,
-                                scoreResidueCount,scoreOffset);
-          scoreResidueOffsetObs[curPepMassInt] = scoreOffset;
+          if (pe == dpMassIdx) {
+            calcResidueScoreCount(nAARes,curPepMassInt,curResidueEvidenceMatrix,aaMassInt,
+                                  dAAFreqN, dAAFreqI, dAAFreqC,nTermMassBin,cTermMassBin,
+                                  minDeltaMass,maxDeltaMass,maxEvidence,maxScore,
+                                  scoreResidueCount,scoreOffset,&workspace);
+          } else {
+            readResidueScoreCount(nAARes,curPepMassInt,aaMassInt,dAAFreqC,cTermMassBin,
+                                  maxDeltaMass,maxEvidence,maxScore,
+                                  scoreResidueCount,scoreOffset,&workspace);
+          }
+          scoreResidueOffsetObs[pe] = scoreOffset;
 
           double totalCount = 0;
           for (int i=scoreOffset ; i<scoreResidueCount.size() ; i++) {
@@ -997,7 +1288,6 @@ void TideSearchApplication::search(void* threadarg) {
             //Avoid potential underflow
             scoreResidueCount[i] = exp(log(scoreResidueCount[i]) - log(totalCount));
           }
-          pValuesResidueObs[curPepMassInt] = scoreResidueCount;
         }
       }
       //END RES-EV
@@ -1034,9 +1324,9 @@ void TideSearchApplication::search(void* threadarg) {
           //RES-EV
           if (curScoreFunction != XCORR_SCORE) {
             scoreResidueEvidence = resEvScores[pe];
-            if (calcDPMatrix[curPepMassInt]) {
-              scoreCountIdx = scoreResidueEvidence + scoreResidueOffsetObs[curPepMassInt];
-              pValue_resEv = pValuesResidueObs[curPepMassInt][scoreCountIdx];
+            if (calcDPMatrix[pepMassIntIdx]) {
+              scoreCountIdx = scoreResidueEvidence + scoreResidueOffsetObs[pepMassIntIdx];
+              pValue_resEv = pValuesResidueObs[pepMassIntIdx][scoreCountIdx];
             } else {
               pValue_resEv = 1.0;
             }
@@ -1079,16 +1369,6 @@ void TideSearchApplication::search(void* threadarg) {
         ++iter1_;
       }
 
-      //clean up
-      if (curScoreFunction != RESIDUE_EVIDENCE_MATRIX) {
-        for (pe = 0; pe < nPepMassIntUniq; pe++) {
-          delete [] pValueScoreObs[pe];
-        }
-      }
-      delete [] scoreOffsetObs;
-      delete [] pValueScoreObs;
-      delete [] intensArrayTheor;
-
       if (!peptide_centric) {
         // below text is copied from text above in the exact-p-value XCORR case
         // matches will arrange the results in a heap by score, return the top
@@ -1097,21 +1377,40 @@ void TideSearchApplication::search(void* threadarg) {
         TideMatchSet matches(&match_arr, highest_mz);
         matches.exact_pval_search_ = exact_pval_search_;
         matches.cur_score_function_ = curScoreFunction;
+        matches.target_batch_ = context.target_rows;
+        matches.decoy_batch_ = context.decoy_rows;
 
         if (curScoreFunction == RESIDUE_EVIDENCE_MATRIX && exact_pval_search_ == false) {
-          matches.report(target_file, decoy_file, top_matches, numDecoys, spectrum_filename,
+          matches.report(target_buffer, decoy_buffer, top_matches, numDecoys, spectrum_filename,
                          spectrum, charge, active_peptide_queue, proteins,
-                         locations, compute_sp, true, locks_array[LOCK_RESULTS]);
+                         locations, compute_sp, true);
         } else {
-          matches.report(target_file, decoy_file, top_matches, numDecoys, spectrum_filename,
+          matches.report(target_buffer, decoy_buffer, top_matches, numDecoys, spectrum_filename,
                          spectrum, charge, active_peptide_queue, proteins,
-                         locations, compute_sp, false, locks_array[LOCK_RESULTS]);
+                         locations, compute_sp, false);
+        }
+        if (target_writer) {
+          target_writer->commit(thread_num);
         }
+        if (decoy_writer) {
+          decoy_writer->commit(thread_num);
+        }
+        flushRows(&context, false);
       } //end peptide_centric == false
     }
-    delete min_mass;
-    delete max_mass;
-    delete candidatePeptideStatus;
+  }
+  if (context.block_size > 0) {
+    searchBlock(threadarg, target_buffer, decoy_buffer);
+  }
+  flushRows(&context, true);
+  active_peptide_queue->Finish();
+  my_data->stats->finish_time = wall_clock();
+
+  if (peptide_centric) {
+    locks_array[LOCK_REPORTING]->lock();
+    carp(CARP_INFO, "[Thread %d]: Peptide-centric hits took at most %.1f MB.",
+         thread_num, active_peptide_queue->PeakHitBytes() / 1048576.0);
+    locks_array[LOCK_REPORTING]->unlock();
   }
 
   if (!Params::GetBool("skip-preprocessing")) {
@@ -1141,6 +1440,226 @@ void TideSearchApplication::search(void* threadarg) {
   }
 }
 
+void TideSearchApplication::reportXCorrMatches(
+  void* threadarg,
+  Spectrum* spectrum,
+  int charge,
+  TideMatchSet::Arr2* match_arr2,
+  const vector<bool>& candidatePeptideStatus,
+  int nCandPeptide,
+  ostream* target_buffer,
+  ostream* decoy_buffer
+) {
+  struct thread_data *my_data = (struct thread_data *) threadarg;
+  ActivePeptideQueue* active_peptide_queue = my_data->active_peptide_queue;
+  SearchContext* context = my_data->context;
+  bool peptide_centric = context->peptide_centric;
+  bool exact_pval_search = my_data->exact_pval_search;
+  int candidatePeptideStatusSize = candidatePeptideStatus.size();
+  double highest_mz = my_data->highest_mz;
+  int top_matches = my_data->top_matches;
+  int numDecoys = my_data->decoysPerTarget;
+  const string& spectrum_filename = my_data->spectrum_filename;
+  ProteinVec& proteins = my_data->proteins;
+  vector<const pb::AuxLocation*>& locations = my_data->locations;
+  bool compute_sp = my_data->compute_sp;
+  ThreadedFileWriter* target_writer = my_data->target_writer;
+  ThreadedFileWriter* decoy_writer = my_data->decoy_writer;
+  int64_t thread_num = my_data->thread_num;
+
+  // matches will arrange the results in a heap by score, return the top
+  // few, and recover the association between counter and peptide. We output
+  // the top matches.
+  if (peptide_centric) {
+    deque<Peptide*>::const_iterator iter_ = active_peptide_queue->iter_;
+    TideMatchSet::Arr2::iterator it = match_arr2->begin();
+    for (; it != match_arr2->end(); ++iter_, ++it) {
+      int peptide_idx = candidatePeptideStatusSize - (it->second);
+      if (candidatePeptideStatus[peptide_idx]) {
+        active_peptide_queue->AddHit(*iter_, spectrum, it->first, it->second, charge);
+      }
+    }
+  } else {  //spectrum centric match report.
+    //Implementation of the Tailor score calibration method, by AKF
+    double quantile_score = 1.0;
+    if (context->use_tailor_calibration) {
+      vector<double>& scores = context->tailor_scores;
+      scores.clear();
+      double quantile_th = 0.01;
+      // Collect the scores for the score tail distribution
+      for (TideMatchSet::Arr2::iterator it = match_arr2->begin();
+        it != match_arr2->end();
+        ++it) {
+        scores.push_back((double)(it->first / XCORR_SCALING));
+      }
+      int quantile_pos = (int)(quantile_th*(double)scores.size()+0.5);
+
+      if (quantile_pos < 3)
+        quantile_pos = 3;
+      if (quantile_pos >= (int)scores.size())
+        quantile_pos = scores.size() - 1;
+      // Only the score at quantile_pos in decreasing order is needed.
+      nth_element(scores.begin(), scores.begin() + quantile_pos, scores.end(),
+                  greater<double>());
+      quantile_score = scores[quantile_pos]+5.0; // Make sure scores positive
+    }  //End of Tailor
+    TideMatchSet::Arr& match_arr = context->match_arr;
+    match_arr.Reserve(nCandPeptide);
+    for (TideMatchSet::Arr2::iterator it = match_arr2->begin();
+         it != match_arr2->end();
+         ++it) {
+      int peptide_idx = candidatePeptideStatusSize - (it->second);
+      if (candidatePeptideStatus[peptide_idx]) {
+        TideMatchSet::Scores curScore;
+        curScore.xcorr_score = (double)(it->first / XCORR_SCALING);
+        curScore.rank = it->second;
+        //Added for tailor score calibration method by AKF
+        if (context->use_tailor_calibration) {
+          curScore.tailor = ((double)(it->first / XCORR_SCALING) + 5.0) / quantile_score;
+        }            
+        match_arr.push_back(curScore);
+      }
+    }
+
+    TideMatchSet matches(&match_arr, highest_mz);
+    matches.exact_pval_search_ = exact_pval_search;
+    matches.cur_score_function_ = XCORR_SCORE;
+    matches.target_batch_ = context->target_rows;
+    matches.decoy_batch_ = context->decoy_rows;
+
+    matches.report(target_buffer, decoy_buffer, top_matches, numDecoys, spectrum_filename,
+                   spectrum, charge, active_peptide_queue, proteins,
+                   locations, compute_sp, true);
+    if (target_writer) {
+      target_writer->commit(thread_num);
+    }
+    if (decoy_writer) {
+      decoy_writer->commit(thread_num);
+    }
+    flushRows(context, false);
+  }  //end peptide_centric == false
+}
+
+void TideSearchApplication::flushRows(SearchContext* context, bool all) {
+  PSMBatch* rows[] = {context->target_rows, context->decoy_rows};
+  PSMBatch* batches[] = {target_batch_, decoy_batch_};
+  PSMBatchFile::Writer* binaries[] = {target_binary_, decoy_binary_};
+  for (int i = 0; i < 2; i++) {
+    if (rows[i] && rows[i]->size() > 0 && (all || rows[i]->size() >= ROWS_PER_FLUSH)) {
+      if (batches[i]) {
+        batches[i]->append(*rows[i]);
+      }
+      if (binaries[i]) {
+        binaries[i]->add(*rows[i]);
+      }
+      rows[i]->clear();
+    }
+  }
+}
+
+void TideSearchApplication::searchBlock(
+  void* threadarg,
+  ostream* target_buffer,
+  ostream* decoy_buffer
+) {
+  struct thread_data *my_data = (struct thread_data *) threadarg;
+  ActivePeptideQueue* active_peptide_queue = my_data->active_peptide_queue;
+  vector<boost::mutex*>& locks_array = my_data->locks_array;
+  SearchContext* context = my_data->context;
+  vector<BlockedSpecCharge>* block = &context->block;
+  const vector<ObservedPeakSet*>& observed = context->observed_block;
+  TideMatchSet::Arr2* match_arrs = context->block_match_arrs;
+  int n = context->block_size;
+
+  // One window covers the candidates of every spectrum in the block.
+  vector<double>& min_mass = context->block_min_mass;
+  vector<double>& max_mass = context->block_max_mass;
+  min_mass.assign(1, (*block)[0].min_mass.front());
+  max_mass.assign(1, (*block)[0].max_mass.back());
+  double min_range = (*block)[0].min_range;
+  double max_range = (*block)[0].max_range;
+  for (int k = 1; k < n; ++k) {
+    const BlockedSpecCharge& b = (*block)[k];
+    min_mass[0] = min(min_mass[0], b.min_mass.front());
+    max_mass[0] = max(max_mass[0], b.max_mass.back());
+    min_range = min(min_range, b.min_range);
+    max_range = max(max_range, b.max_range);
+  }
+  vector<bool>& candidatePeptideStatus = context->candidatePeptideStatus;
+  if (active_peptide_queue->SetActiveRange(&min_mass, &max_mass, min_range, max_range,
+                                           &candidatePeptideStatus) > 0) {
+    int candidatePeptideStatusSize = candidatePeptideStatus.size();
+    pair<int, int>* results[ScoreKernel::kMaxBlock];
+    int charges[ScoreKernel::kMaxBlock];
+    for (int k = 0; k < n; ++k) {
+      match_arrs[k].Reserve(candidatePeptideStatusSize);
+      results[k] = match_arrs[k].data();
+      charges[k] = (*block)[k].sc->charge;
+    }
+    if (ScoreKernel::Compiled()) {
+      // The programs cannot read interleaved caches, so they are run once
+      // per spectrum; the window's programs stay in cache between runs.
+      for (int k = 0; k < n; ++k) {
+        collectScoresCompiled(active_peptide_queue, (*block)[k].sc->spectrum,
+                              *observed[k], &match_arrs[k],
+                              candidatePeptideStatusSize, charges[k]);
+      }
+    } else {
+      int cache_size = MaxBin::Global().CacheBinEnd() * NUM_PEAK_TYPES;
+      int* caches = &context->interleaved_caches[0];
+      for (int k = 0; k < n; ++k) {
+        const int* cache = observed[k]->GetCache();
+        for (int i = 0; i < cache_size; ++i) {
+          caches[(size_t)i * n + k] = cache[i];
+        }
+      }
+      ScoreKernel::ScoreBlock(caches, n, charges, active_peptide_queue->iter_,
+                              candidatePeptideStatusSize, results);
+      for (int k = 0; k < n; ++k) {
+        match_arrs[k].set_size(candidatePeptideStatusSize);
+      }
+    }
+
+    // Each spectrum reports only its own candidates within the window.
+    for (int k = 0; k < n; ++k) {
+      BlockedSpecCharge& b = (*block)[k];
+      int nCandPeptide = active_peptide_queue->SetActiveStatus(
+        &b.min_mass, &b.max_mass, &candidatePeptideStatus);
+      if (nCandPeptide == 0) {
+        continue;
+      }
+      locks_array[LOCK_CANDIDATES]->lock();
+      *(my_data->total_candidate_peptides) += nCandPeptide;
+      locks_array[LOCK_CANDIDATES]->unlock();
+      reportXCorrMatches(threadarg, b.sc->spectrum, b.sc->charge, &match_arrs[k],
+                         candidatePeptideStatus, nCandPeptide,
+                         target_buffer, decoy_buffer);
+    }
+  }
+  context->block_size = 0;
+}
+
+int TideSearchApplication::nextSpecCharge(void* threadarg, int* sc_pos, int* chunk_end) {
+  struct thread_data *my_data = (struct thread_data *) threadarg;
+  int num_sc = (int)my_data->spec_charges->size();
+
+  if (++(*sc_pos) < *chunk_end) {
+    return *sc_pos;
+  }
+  my_data->locks_array[LOCK_SCHEDULE]->lock();
+  *sc_pos = *(my_data->sc_next);
+  *(my_data->sc_next) = min(*sc_pos + my_data->chunk_size, num_sc);
+  *chunk_end = *(my_data->sc_next);
+  my_data->locks_array[LOCK_SCHEDULE]->unlock();
+
+  if (*sc_pos >= num_sc) {
+    return num_sc;
+  }
+  ++my_data->stats->chunks;
+  my_data->stats->spec_charges += *chunk_end - *sc_pos;
+  return *sc_pos;
+}
+
 void TideSearchApplication::search(
   const string& spectrum_filename,
   const vector<SpectrumCollection::SpecCharge>* spec_charges,
@@ -1190,6 +1709,21 @@ void TideSearchApplication::search(
   int* total_candidate_peptides = new int(0);
   FLOAT_T sc_total = (FLOAT_T)spec_charges->size();
 
+  // Threads claim chunks of consecutive spectrum-charge pairs as they become
+  // idle. Small chunks balance the load; the cap keeps the threads' mass
+  // ranges close together.
+  int* sc_next = new int(0);
+  int chunk_size = (int)spec_charges->size() / (NUM_THREADS * 64);
+  chunk_size = max(1, min(chunk_size, 64));
+  vector<thread_stats> stats(NUM_THREADS);
+
+  // Threads format spectrum-centric results into private buffers; a single
+  // writer thread per file appends them.
+  ThreadedFileWriter* target_writer = target_file ?
+    new ThreadedFileWriter(target_file, NUM_THREADS) : NULL;
+  ThreadedFileWriter* decoy_writer = decoy_file ?
+    new ThreadedFileWriter(decoy_file, NUM_THREADS) : NULL;
+
   if (peptide_centric == false) {
     elution_window = 0;
   }
@@ -1224,11 +1758,12 @@ void TideSearchApplication::search(
       thread_data_array.push_back(thread_data(spectrum_filename, spec_charges, active_peptide_queue[i],
       proteins, locations, precursor_window, window_type, spectrum_min_mz,
       spectrum_max_mz, min_scan, max_scan, min_peaks, search_charge, top_matches,
-      highest_mz, target_file, decoy_file, compute_sp,
+      highest_mz, target_file, decoy_file, target_writer, decoy_writer, compute_sp,
       i, NUM_THREADS, nAA, aaFreqN, aaFreqI, aaFreqC, aaMass,
       nAARes, &dAAFreqN, &dAAFreqI, &dAAFreqC, &dAAMass,
       &mod_table, &nterm_mod_table, &cterm_mod_table, numDecoys, locks_array, //TODO do I need to delete pointer somewhere?
-      bin_width_, bin_offset_, exact_pval_search_, spectrum_flag_, sc_index, total_candidate_peptides, negative_isotope_errors));
+      bin_width_, bin_offset_, exact_pval_search_, spectrum_flag_, sc_index, total_candidate_peptides, negative_isotope_errors,
+      sc_next, chunk_size, &stats[i]));
   }
 
   boost::thread_group threadgroup;
@@ -1245,6 +1780,21 @@ void TideSearchApplication::search(
   // Join threads
   threadgroup.join_all();
 
+  // Everything must be on disk before the results are converted.
+  delete target_writer;
+  delete decoy_writer;
+
+  double all_finished = 0;
+  for (int i = 0; i < NUM_THREADS; i++) {
+    all_finished = max(all_finished, stats[i].finish_time);
+  }
+  for (int i = 0; i < NUM_THREADS; i++) {
+    carp(CARP_INFO, "[Thread %d]: Searched %d spectrum-charge combinations in %d chunks, "
+         "busy %.2f s, idle %.2f s.", i, stats[i].spec_charges, stats[i].chunks,
+         (stats[i].finish_time - stats[i].start_time) / 1e6,
+         (all_finished - stats[i].finish_time) / 1e6);
+  }
+
   carp(CARP_INFO, "Time per spectrum-charge combination: %lf s.", wall_clock() / (1e6*sc_total));
   carp(CARP_INFO, "Average number of candidates per spectrum-charge combination: %lf ",
                   (*total_candidate_peptides) / sc_total);
@@ -1253,6 +1803,7 @@ void TideSearchApplication::search(
   }
   delete sc_index;
   delete total_candidate_peptides;
+  delete sc_next;
 
 }
 
@@ -1270,6 +1821,13 @@ void TideSearchApplication::collectScoresCompiled(
   if (!active_peptide_queue->HasNext()) {
     return;
   }
+  if (!ScoreKernel::Compiled()) {
+    ScoreKernel::Score(observed.GetCache(), active_peptide_queue->iter_,
+                       queue_size, charge, match_arr->data());
+    match_arr->set_size(queue_size);
+    return;
+  }
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64)
   // prog gets the address of the dot-product program for the first peptide
   // in the active queue.
   const void* prog = active_peptide_queue->NextPeptide()->Prog(charge);
@@ -1364,6 +1922,9 @@ void TideSearchApplication::collectScoresCompiled(
                          "D" (results)
   );
 #endif
+#else
+  carp(CARP_FATAL, "Compiled scoring programs require an x86 processor.");
+#endif
 
   // match_arr is filled by the compiled programs, not by calls to
   // push_back(). We have to set the final size explicitly.
@@ -1525,6 +2086,7 @@ vector<string> TideSearchApplication::getOptions() const {
   string arr[] = {
     "auto-mz-bin-width",
     "auto-precursor-window",
+    "binary-output",
     "compute-sp",
     "concat",
     "deisotope",
@@ -1546,6 +2108,9 @@ vector<string> TideSearchApplication::getOptions() const {
     "parameter-file",
     "peptide-centric-search",
     "score-function",
+    "scoring-kernel",
+    "shared-peptide-queue",
+    "spectrum-block-size",
     "fragment-tolerance",
     "evidence-granularity",
     "pepxml-output",
@@ -1597,6 +2162,13 @@ vector< pair<string, string> > TideSearchApplication::getOutputs() const {
   outputs.push_back(make_pair("tide-search.decoy.txt",
     "a tab-delimited text file containing the decoy PSMs. This file will only "
     "be created if the index was created with decoys."));
+  outputs.push_back(make_pair("tide-search.target.psm",
+    "a binary file containing the same target PSMs as tide-search.target.txt, "
+    "which psm-convert, assign-confidence and make-pin can read in its place. "
+    "This file will only be created if --binary-output is T."));
+  outputs.push_back(make_pair("tide-search.decoy.psm",
+    "a binary file containing the decoy PSMs. This file will only be created "
+    "if --binary-output is T and the index was created with decoys."));
   outputs.push_back(make_pair("tide-search.params.txt",
     "a file containing the name and value of all parameters/options for the "
     "current operation. Not all parameters in the file may have been used in "
@@ -1615,6 +2187,25 @@ COMMAND_T TideSearchApplication::getCommand() const {
   return TIDE_SEARCH_COMMAND;
 }
 
+/* Adds scale times in[0, n) to out[0, n). The two ranges are columns of a
+ * score count matrix and never overlap, which lets the compiler vectorize
+ * the loop. Each element receives its terms in the same order as the
+ * row-by-row loops this replaced did, so counts are unchanged.
+ */
+static void addScaledColumn(
+  double* __restrict out,
+  const double* __restrict in,
+  double scale,
+  int n
+) {
+  for (int i = 0; i < n; i++) {
+    out[i] += in[i] * scale;
+  }
+}
+
+// Element (row, col) of a score count matrix stored column after column.
+#define DYN_PROG(row, col) dynProgArray[(size_t)(col) * nRow + (row)]
+
 /* Calculates counts of peptides with various XCorr scores, given a preprocessed
  * MS2 spectrum, using dynamic programming.
  * Written by Jeff Howbert, October, 2012 (as function calcScoreCount).
@@ -1633,7 +2224,8 @@ int TideSearchApplication::calcScoreCount(
   double* aaFreqI,
   double* aaFreqC,
   int* aaMass,
-  double* pValueScoreObs
+  double* pValueScoreObs,
+  ScoreCountWorkspace* workspace
 ) {
   const int nDeltaMass = nAA;
   int minDeltaMass = aaMass[0];
@@ -1645,8 +2237,6 @@ int TideSearchApplication::calcScoreCount(
   int ma;
   int evidence;
   int de;
-  int evidenceRow;
-  double sumScore;
 
   int bottomRowBuffer = maxEvidence + 1;
   int topRowBuffer = -minEvidence;
@@ -1664,69 +2254,52 @@ int TideSearchApplication::calcScoreCount(
   int initCountRow = bottomRowBuffer - minScore;
   int initCountCol = maxDeltaMass + colStart;
 
-  double** dynProgArray = new double*[nRow];
-  for (row = 0; row < nRow; row++) {
-    dynProgArray[row] = new double[nCol];
-    for (col = 0; col < nCol; col++) {
-      dynProgArray[row][col] = 0.0;
-    }
-  }
-  double* scoreCountBinAdjust = 0;
-  scoreCountBinAdjust = new double[nRow];
-  for (row = 0; row < nRow; row++) {
-    scoreCountBinAdjust[row] = 0.0;
-  }
+  // The matrix is stored one column after another, so that each step below
+  // reads and writes whole runs of adjacent rows.
+  workspace->dynProg.assign((size_t)nRow * nCol, 0.0);
+  double* dynProgArray = &workspace->dynProg[0];
+  workspace->binAdjust.assign(nRow, 0.0);
+  double* scoreCountBinAdjust = &workspace->binAdjust[0];
+  int nRowScore = rowLast - rowFirst + 1;
 
-  dynProgArray[initCountRow][initCountCol] = 1.0; // initial count of peptides with mass = 1
-  vector<int> deltaMassCol(nDeltaMass);
+  // initial count of peptides with mass = 1
+  DYN_PROG(initCountRow, initCountCol) = 1.0;
   // populate matrix with scores for first (i.e. N-terminal) amino acid in sequence
   for (de = 0; de < nDeltaMass; de++) {
     ma = aaMass[de];
     row = initCountRow + evidenceObs[ma + colStart];
     col = initCountCol + ma;
     if (col <= maxDeltaMass + colLast) {
-      dynProgArray[row][col] += dynProgArray[initCountRow][initCountCol] * aaFreqN[de];
+      DYN_PROG(row, col) += DYN_PROG(initCountRow, initCountCol) * aaFreqN[de];
     }
   }
   // set to zero now that score counts for first amino acid are in matrix
-  dynProgArray[initCountRow][initCountCol] = 0.0;
+  DYN_PROG(initCountRow, initCountCol) = 0.0;
   // populate matrix with score counts for non-terminal amino acids in sequence
   for (ma = colFirst; ma < colLast; ma++) {
     col = maxDeltaMass + ma;
     evidence = evidenceObs[ma];
     for (de = 0; de < nDeltaMass; de++) {
-      deltaMassCol[de] = col - aaMass[de];
-    }
-    for (row = rowFirst; row <= rowLast; row++) {
-      evidenceRow = row - evidence;
-      sumScore = dynProgArray[row][col];
-      for (de = 0; de < nDeltaMass; de++) {
-        sumScore += dynProgArray[evidenceRow][deltaMassCol[de]] * aaFreqI[de];
-      }
-      dynProgArray[row][col] = sumScore;
+      addScaledColumn(&DYN_PROG(rowFirst, col),
+                      &DYN_PROG(rowFirst - evidence, col - aaMass[de]),
+                      aaFreqI[de], nRowScore);
     }
   }
   // populate matrix with score counts for last (i.e. C-terminal) amino acid in sequence
   ma = colLast;
   col = maxDeltaMass + ma;
-  evidence = 0; // no evidence should be added for last amino acid in sequence
+  // no evidence should be added for last amino acid in sequence
+  fill(&DYN_PROG(rowFirst, col), &DYN_PROG(rowFirst, col) + nRowScore, 0.0);
   for (de = 0; de < nDeltaMass; de++) {
-    deltaMassCol[de] = col - aaMass[de];
-  }
-  for (row = rowFirst; row <= rowLast; row++) {
-    evidenceRow = row - evidence;
-    sumScore = 0.0;
-    for (de = 0; de < nDeltaMass; de++) {
-      sumScore += dynProgArray[evidenceRow][deltaMassCol[de]] * aaFreqC[de];  // C-terminal residue
-    }
-    dynProgArray[row][col] = sumScore;
+    addScaledColumn(&DYN_PROG(rowFirst, col), &DYN_PROG(rowFirst, col - aaMass[de]),
+                    aaFreqC[de], nRowScore);  // C-terminal residue
   }
 
   int colScoreCount = maxDeltaMass + colLast;
   double totalCount = 0.0;
   for (row = 0; row < nRow; row++) {
     // at this point pValueScoreObs just holds counts from last column of dynamic programming array
-    pValueScoreObs[row] = dynProgArray[row][colScoreCount];
+    pValueScoreObs[row] = DYN_PROG(row, colScoreCount);
     totalCount += pValueScoreObs[row];
     scoreCountBinAdjust[row] = pValueScoreObs[row] / 2.0;
   }
@@ -1742,13 +2315,6 @@ int TideSearchApplication::calcScoreCount(
     pValueScoreObs[row] = exp(log(pValueScoreObs[row]) - logTotalCount);
   }
 
-  // clean up
-  for (row = 0; row < nRow; row++) {
-    delete [] dynProgArray[row];
-  }
-  delete [] dynProgArray;
-  delete [] scoreCountBinAdjust;
-
   return scoreOffsetObs;
 }
 
@@ -1785,7 +2351,8 @@ void TideSearchApplication::calcResidueScoreCount (
   int maxEvidence,
   int maxScore,
   vector<double>& scoreCount, //this is returned for later use
-  int& scoreOffset //this is returned for later use
+  int& scoreOffset, //this is returned for later use
+  ScoreCountWorkspace* workspace
 ) {
   int minEvidence  = 0;
   int minScore     = 0;
@@ -1793,10 +2360,7 @@ void TideSearchApplication::calcResidueScoreCount (
   int row;
   int col;
   int ma;
-  int evid;
   int de;
-  int evidRow;
-  double sumScore;
 
   int bottomRowBuffer = maxEvidence;
   int topRowBuffer = -minEvidence;
@@ -1819,19 +2383,14 @@ void TideSearchApplication::calcResidueScoreCount (
   initCountRow = initCountRow - 1;
   initCountCol = initCountCol - 1;
 
-  double** dynProgArray = 0;
-  dynProgArray = new double*[nRow];
-  for (row = 0; row < nRow; row++) {
-    dynProgArray[row] = new double[nCol];
-    for (col = 0; col < nCol; col++) {
-      dynProgArray[row][col] = 0.0;
-    }
-  }
+  // The matrix is stored one column after another; see calcScoreCount().
+  workspace->dynProg.assign((size_t)nRow * nCol, 0.0);
+  double* dynProgArray = &workspace->dynProg[0];
+  int nRowScore = rowLast - rowFirst + 1;
 
   // initial count of peptides with mass = nTermMass
-  dynProgArray[initCountRow][initCountCol] = 1.0;
+  DYN_PROG(initCountRow, initCountCol) = 1.0;
 
-  int* aaMassCol = new int[nAa];
   // populate matrix with scores for first (i.e. N-terminal) amino acid in sequence
   for (de = 0; de < nAa; de++) {
     ma = aaMass[de];
@@ -1849,29 +2408,22 @@ void TideSearchApplication::calcResidueScoreCount (
 
 //    if ( col <= maxAaMass + colLast ) { //original
     if (col <= maxAaMass + colLast && col >= initCountCol) { //TODO not sure if below or above is correct
-      //dynProgArray[ row ][ col ] += dynProgArray[ initCountRow ][ initCountCol ];
-      dynProgArray[row][col] += dynProgArray[initCountRow][initCountCol] * aaFreqN[de];
+      DYN_PROG(row, col) += DYN_PROG(initCountRow, initCountCol) * aaFreqN[de];
     }
   }
 
   //set to zero now that score counts for first amino acid are in matrix
-  dynProgArray[initCountRow][initCountCol] = 0.0;
+  DYN_PROG(initCountRow, initCountCol) = 0.0;
 
   // populate matrix with score counts for non-terminal amino acids in sequence
   for (ma = colFirst; ma < colLast; ma++) {
     col = maxAaMass + ma;
-
     for (de = 0; de < nAa; de++) {
-      aaMassCol[de] = col - aaMass[de];
-    }
-    for (row = rowFirst; row <= rowLast; row++) {
-      sumScore = dynProgArray[row][col];
-      for (de = 0; de < nAa; de++) {
-        evidRow = row - residueEvidenceMatrix[de][ma];
-        //sumScore += dynProgArray[ evidRow ][ aaMassCol[ de ] ];
-        sumScore += dynProgArray[evidRow][aaMassCol[de]] * aaFreqI[de];
-      }
-      dynProgArray[row][col] = sumScore;
+      // residue evidence has been rounded to whole numbers
+      int evid = (int)residueEvidenceMatrix[de][ma];
+      addScaledColumn(&DYN_PROG(rowFirst, col),
+                      &DYN_PROG(rowFirst - evid, col - aaMass[de]),
+                      aaFreqI[de], nRowScore);
     }
   }
 
@@ -1880,35 +2432,66 @@ void TideSearchApplication::calcResidueScoreCount (
   col = maxAaMass + ma;
 
   //no evidence should be added for last amino acid in sequence
-  evid = 0;
+  fill(&DYN_PROG(rowFirst, col), &DYN_PROG(rowFirst, col) + nRowScore, 0.0);
   for (de = 0; de < nAa; de++) {
-    aaMassCol[de] = col - aaMass[de];
-  }
-  for (row = rowFirst; row <= rowLast; row++) {
-    evidRow = row - evid;
-    sumScore = 0.0;
-    for (de = 0; de < nAa; de++) {
-      //sumScore += dynProgArray[ evidRow ][ aaMassCol[ de ] ];
-      sumScore += dynProgArray[evidRow][aaMassCol[de]] * aaFreqC[de];
-    }
-    dynProgArray[row][col] = sumScore;
+    addScaledColumn(&DYN_PROG(rowFirst, col), &DYN_PROG(rowFirst, col - aaMass[de]),
+                    aaFreqC[de], nRowScore);
   }
 
   int colScoreCount = maxAaMass + colLast;
-  scoreCount.resize(nRow);
-  for (int row = 0; row < nRow; row++) {
-    scoreCount[row] = dynProgArray[row][colScoreCount];
-  }
+  scoreCount.assign(&DYN_PROG(0, colScoreCount), &DYN_PROG(0, colScoreCount) + nRow);
   scoreOffset = initCountRow;
 
-  // clean up
-  for (int row = 0; row < nRow; row++) {
-    delete [] dynProgArray[row];
-  }
-  delete [] dynProgArray;
-  delete [] aaMassCol;
+  // for readResidueScoreCount()
+  workspace->dynProgRows = nRow;
+  workspace->dynProgScoreZeroRow = initCountRow;
 }
 
+/*
+ * Gives the same score counts as calcResidueScoreCount() for a lighter
+ * candidate mass than the one it was last called for, whose residue
+ * evidence matrix is a prefix of the one it was called with, by reading
+ * them off the dynamic programming matrix it left in workspace.
+ *
+ * Columns before this mass's C-terminal column are the same in both
+ * matrices, and so are rows for scores from 0 to this mass's maxScore:
+ * evidence is never negative, so higher scores do not feed into them. Only
+ * the C-terminal step is repeated here, with the rows of the stored matrix
+ * shifted by the difference in maxEvidence.
+ */
+void TideSearchApplication::readResidueScoreCount(
+  int nAa,
+  int pepMassInt,
+  vector<int>& aaMass,
+  const vector<double>& aaFreqC,
+  int cTermMass, //this is cTermMassBin
+  int maxAaMass,
+  int maxEvidence,
+  int maxScore,
+  vector<double>& scoreCount, //this is returned for later use
+  int& scoreOffset, //this is returned for later use
+  ScoreCountWorkspace* workspace
+) {
+  // as in calcResidueScoreCount(), zero-based
+  int nRow = maxEvidence + 1 + maxScore;
+  int rowFirst = maxEvidence;
+  int nRowScore = maxScore + 1;
+  int col = maxAaMass + pepMassInt - cTermMass - 1;
+  int rowShift = workspace->dynProgScoreZeroRow - rowFirst;
+  const double* dynProgArray = &workspace->dynProg[0];
+
+  scoreCount.assign(nRow, 0.0);
+  for (int de = 0; de < nAa; de++) {
+    addScaledColumn(&scoreCount[rowFirst],
+                    dynProgArray + (size_t)(col - aaMass[de]) * workspace->dynProgRows
+                                 + rowFirst + rowShift,
+                    aaFreqC[de], nRowScore);
+  }
+  scoreOffset = rowFirst;
+}
+
+#undef DYN_PROG
+
 void TideSearchApplication::processParams() {
   const string index = Params::GetString("tide database");
   if (!FileUtils::Exists(index)) {
@@ -1992,7 +2575,7 @@ void TideSearchApplication::processParams() {
   }
 }
 
-void TideSearchApplication::setSpectrumFlag(map<pair<string, unsigned int>, bool>* spectrum_flag) {
+void TideSearchApplication::setSpectrumFlag(SpectrumFlags* spectrum_flag) {
   spectrum_flag_ = spectrum_flag;
 }
 
@@ -12,6 +12,10 @@
 #include "spectrum.pb.h"
 #include "tide/theoretical_peak_set.h"
 #include "tide/max_mz.h"
+#include "tide/score_kernel.h"
+#include "io/PSMBatchFile.h"
+#include "io/ThreadedFileWriter.h"
+#include "SpectrumFlags.h"
 
 using namespace std;
 
@@ -19,10 +23,9 @@ using namespace std;
  * Locks for multi-threading in Tide.
  */
 enum _tide_search_lock {
-  LOCK_RESULTS,       // Results file output
-  LOCK_CASCADE,       // Only used by cascade-search on spectrum_flag (map)
   LOCK_CANDIDATES,    // Updating # of candidate peptides
   LOCK_REPORTING,     // Updating sc_index and reporting progress
+  LOCK_SCHEDULE,      // Claiming the next chunk of spectrum-charge pairs
   NUMBER_LOCK_TYPES   // always keep this last so the value
                       // changes as cmds are added
 };
@@ -68,36 +71,76 @@ private:
     std::string OriginalName;
     std::string SpectrumRecords;
     bool Keep;
+    InputFile(): Keep(true) {}
     InputFile(const std::string& name,
               const std::string& spectrumrecords,
               bool keep):
       OriginalName(name), SpectrumRecords(spectrumrecords), Keep(keep) {}
   };
 
+  /**
+   * An input file ready to be searched: converted to spectrumrecords if
+   * necessary, with its spectra read and sorted (or found in spectra_).
+   */
+  struct PreparedInput {
+    InputFile File;
+    SpectrumCollection* Spectra;
+    bool OwnsSpectra;
+    PreparedInput(): Spectra(NULL), OwnsSpectra(false) {}
+  };
+
   /**
   brief This variable is used with Cascade Search.
-  This map contains a flag for each spectrum whether
-  a spectrum has not been identified in a prior cycle (0) or not (1).
-  The spectrum ID is a pair containing the ordinal number of the
-  input file in the first component and a scanId-charge-state in the second component.
-  The scanID and the charge state is combined into a single number
-  as scanID*10 + charge_state. Charge state is required to be less than 10.
+  It flags the spectrum-charge pairs identified in a prior cycle, which
+  are not searched again; see SpectrumFlags.
   */
-  map<pair<string, unsigned int>, bool>* spectrum_flag_;
+  SpectrumFlags* spectrum_flag_;
+  // Set by keepSpectra(); see there.
+  std::map<std::string, SpectrumCollection*>* spectrum_cache_;
   string output_file_name_;
 
+  // Set by keepResultsInMemory(); see there.
+  bool batch_results_;
+  bool write_batched_results_;
+  // Spectrum-centric results, filled in during the search if batch_results_
+  PSMBatch* target_batch_;
+  PSMBatch* decoy_batch_;
+  // Binary results files, written during the search if binary-output
+  PSMBatchFile::Writer* target_binary_;
+  PSMBatchFile::Writer* decoy_binary_;
+
   static bool HAS_DECOYS;
   static bool PROTEIN_LEVEL_DECOYS;
 
   vector<int> getNegativeIsotopeErrors() const;
-  vector<InputFile> getInputFiles(const vector<string>& filepaths) const;
+  /**
+   * Prepares filepath for searching (see PreparedInput). main() runs this on
+   * a background thread for the next input file while the current one is
+   * being searched.
+   */
+  void prepareInput(const string& filepath, PreparedInput* out) const;
+  /**
+   * \returns The spectra of filepath if they were given to main() or are
+   * cached from an earlier search, or NULL.
+   */
+  SpectrumCollection* findPreloaded(const string& filepath) const;
   static SpectrumCollection* loadSpectra(const std::string& file);
+  static void sortSpectra(SpectrumCollection* spectra);
 
   /**
    * Function that contains the search algorithm and performs the search
    */
   void search(void *threadarg);
 
+  /**
+   * Returns the index of the next spectrum-charge pair for a thread to search.
+   * When the thread's current chunk is used up, the next chunk is claimed from
+   * the queue shared by all threads. Chunks are handed out in order of neutral
+   * mass, so each thread's active peptide queue only moves forward. Returns
+   * the number of spectrum-charge pairs once all chunks have been claimed.
+   */
+  int nextSpecCharge(void* threadarg, int* sc_pos, int* chunk_end);
+
   /**
     * Calls search(threadarg), and if threading, creates threads calling
     * search(threadarg)
@@ -146,6 +189,45 @@ private:
     vector<int>* negative_isotope_errors
   );
 
+  /**
+   * A spectrum-charge pair waiting in a block for searchBlock(), with the
+   * mass ranges computed for it by computeWindow().
+   */
+  struct BlockedSpecCharge {
+    const SpectrumCollection::SpecCharge* sc;
+    vector<double> min_mass;
+    vector<double> max_mass;
+    double min_range;
+    double max_range;
+    BlockedSpecCharge() : sc(NULL), min_range(0), max_range(0) {}
+  };
+
+  /**
+   * XCorr-scores the spectra of the thread's block against a single window
+   * of candidate peptides covering all of them, then reports each
+   * spectrum's matches and empties the block (see --spectrum-block-size).
+   */
+  void searchBlock(
+    void* threadarg,
+    ostream* target_buffer,
+    ostream* decoy_buffer
+  );
+
+  /**
+   * Reports the XCorr scores in match_arr2 for spectrum, of the peptides of
+   * the active window marked in candidatePeptideStatus.
+   */
+  void reportXCorrMatches(
+    void* threadarg,
+    Spectrum* spectrum,
+    int charge,
+    TideMatchSet::Arr2* match_arr2,
+    const vector<bool>& candidatePeptideStatus,
+    int nCandPeptide,
+    ostream* target_buffer,
+    ostream* decoy_buffer
+  );
+
   void collectScoresCompiled(
     ActivePeptideQueue* active_peptide_queue,
     const Spectrum* spectrum,
@@ -217,6 +299,24 @@ private:
 
   int main(const vector<string>& input_files, const string input_index);
 
+  /**
+   * Makes main() keep the tab-delimited results in PSMBatch objects, which
+   * it publishes under the paths of the results files for a post-processor
+   * run in the same process. The search fills the batches directly, with
+   * numbers as doubles, so no text is formatted for them. The files
+   * themselves are written only if write_files is true or another output
+   * format is converted from them. Peptide-centric results are always
+   * written to files.
+   */
+  void keepResultsInMemory(bool write_files);
+
+  /**
+   * Makes main() look for the spectra of each input file in cache before
+   * reading them, and add those it reads, so that several searches of the
+   * same files read them once. The caller owns the cached collections.
+   */
+  void keepSpectra(std::map<std::string, SpectrumCollection*>* cache);
+
   static bool proteinLevelDecoys();
 
   /**
@@ -251,6 +351,109 @@ private:
 
   virtual COMMAND_T getCommand() const;
 
+  /**
+   * Load-balance statistics for one search thread.
+   */
+  struct thread_stats {
+    int chunks;
+    int spec_charges;
+    double start_time;
+    double finish_time;
+    thread_stats() : chunks(0), spec_charges(0), start_time(0), finish_time(0) {}
+  };
+
+  /**
+   * Storage that one search thread reuses from spectrum to spectrum when
+   * computing exact p-values, rather than allocating it for each one.
+   */
+  struct ScoreCountWorkspace {
+    vector<double> dynProg;   // score count matrix, one column after another
+    vector<double> binAdjust; // half of each row's count
+    vector<vector<int> > evidenceObs;                 // per candidate mass bin
+    vector<vector<vector<double> > > residueEvidence; // per candidate mass bin
+    vector<int> intensArrayTheor; // all zero between uses
+    // Per spectrum-charge pair; indexed by candidate, or by unique candidate
+    // mass bin
+    vector<int> pepMassInt;         // per candidate
+    vector<int> pepMassIntUnique;
+    vector<int> xcorrScores;        // per candidate
+    vector<int> resEvScores;        // per candidate
+    vector<int> scoreOffsetObs;
+    vector<vector<double> > pValueScoreObs;
+    vector<int> sortEvidenceObs;
+    vector<char> calcDPMatrix;      // whether to fill in the residue evidence DP
+    vector<int> scoreResidueOffsetObs;
+    vector<vector<double> > pValuesResidueObs;
+    vector<int> maxColEvidence;
+    int dynProgRows;         // rows of dynProg, by calcResidueScoreCount()
+    int dynProgScoreZeroRow; // its row for a score of 0
+  };
+
+  /**
+   * What search() keeps for its thread: parameters read once when the
+   * thread starts, rather than looked up for every spectrum, and buffers
+   * reused from one spectrum-charge pair to the next, so that the search
+   * loop does not allocate.
+   */
+  struct SearchContext {
+    // Parameters
+    bool peptide_centric;
+    bool use_tailor_calibration;
+    SCORE_FUNCTION_T score_function;
+    int max_charge;
+    double fragment_tolerance;  // exact p-values and residue evidence
+    int evidence_granularity;
+    int max_precursor_mass_bin;
+    vector<int> aa_mass_int;    // aaMass of the residue evidence, in bins
+
+    // Candidate window of the current spectrum-charge pair
+    vector<double> min_mass;
+    vector<double> max_mass;
+    vector<bool> candidatePeptideStatus;
+
+    // Scores of the current spectrum-charge pair
+    TideMatchSet::Arr2 match_arr2;
+    TideMatchSet::Arr match_arr;
+    vector<double> tailor_scores;
+
+    // Spectrum blocking; block holds block_size pairs, each preprocessed into
+    // the ObservedPeakSet of the same index
+    int spectrum_block;
+    vector<BlockedSpecCharge> block;
+    int block_size;
+    vector<ObservedPeakSet*> observed_block;
+    vector<int> interleaved_caches;
+    vector<double> block_min_mass;
+    vector<double> block_max_mass;
+    TideMatchSet::Arr2 block_match_arrs[ScoreKernel::kMaxBlock];
+
+    ScoreCountWorkspace workspace;
+
+    // Spectrum-centric results of the thread, if they are kept in batches
+    // or written to binary files; they are moved to the shared batches and
+    // the files a chunk at a time (see flushRows)
+    PSMBatch* target_rows;
+    PSMBatch* decoy_rows;
+
+    SearchContext() : block_size(0), target_rows(NULL), decoy_rows(NULL) {}
+    ~SearchContext() {
+      for (size_t i = 0; i < observed_block.size(); ++i) {
+        delete observed_block[i];
+      }
+      delete target_rows;
+      delete decoy_rows;
+    }
+  };
+
+  /**
+   * Appends the rows in the context's batches to the shared batches and
+   * binary files, once there are at least ROWS_PER_FLUSH of them, or
+   * whatever there is if all is set. Each append takes the shared batch's
+   * or file's lock once.
+   */
+  void flushRows(SearchContext* context, bool all);
+  static const size_t ROWS_PER_FLUSH;
+
   /**
    * Struct holding necessary information for each thread to run.
    */
@@ -273,6 +476,8 @@ private:
     double highest_mz;
     ofstream* target_file;
     ofstream* decoy_file;
+    ThreadedFileWriter* target_writer;
+    ThreadedFileWriter* decoy_writer;
     bool compute_sp;
     int64_t thread_num;
     int64_t num_threads;
@@ -294,10 +499,14 @@ private:
     double bin_width;
     double bin_offset;
     bool exact_pval_search;
-    map<pair<string, unsigned int>, bool>* spectrum_flag;
+    SpectrumFlags* spectrum_flag;
     int* sc_index;
     int* total_candidate_peptides;
     vector<int>* negative_isotope_errors;
+    int* sc_next;
+    int chunk_size;
+    thread_stats* stats;
+    SearchContext* context; // set by search()
 
     thread_data (const string& spectrum_filename_, const vector<SpectrumCollection::SpecCharge>* spec_charges_,
             ActivePeptideQueue* active_peptide_queue_, ProteinVec proteins_,
@@ -305,24 +514,26 @@ private:
             WINDOW_TYPE_T window_type_, double spectrum_min_mz_, double spectrum_max_mz_,
             int min_scan_, int max_scan_, int min_peaks_, int search_charge_, int top_matches_,
             double highest_mz_, ofstream* target_file_,
-            ofstream* decoy_file_, bool compute_sp_, int64_t thread_num_, int64_t num_threads_, int nAA_,
+            ofstream* decoy_file_, ThreadedFileWriter* target_writer_, ThreadedFileWriter* decoy_writer_, bool compute_sp_, int64_t thread_num_, int64_t num_threads_, int nAA_,
             double* aaFreqN_, double* aaFreqI_, double* aaFreqC_, int* aaMass_, int nAARes_,
             const vector<double>* dAAFreqN_, const vector<double>* dAAFreqI_,
             const vector<double>* dAAFreqC_, const vector<double>* dAAMass_,
             const pb::ModTable* mod_table_, const pb::ModTable* nterm_mod_table_, const pb::ModTable* cterm_mod_table_, const int decoysPerTarget_,
             vector<boost::mutex*> locks_array_, double bin_width_, double bin_offset_, bool exact_pval_search_,
-            map<pair<string, unsigned int>, bool>* spectrum_flag_, int* sc_index_, int* total_candidate_peptides_,
-            vector<int>* negative_isotope_errors_) :
+            SpectrumFlags* spectrum_flag_, int* sc_index_, int* total_candidate_peptides_,
+            vector<int>* negative_isotope_errors_, int* sc_next_, int chunk_size_, thread_stats* stats_) :
             spectrum_filename(spectrum_filename_), spec_charges(spec_charges_), active_peptide_queue(active_peptide_queue_),
             proteins(proteins_), locations(locations_), precursor_window(precursor_window_), window_type(window_type_),
             spectrum_min_mz(spectrum_min_mz_), spectrum_max_mz(spectrum_max_mz_), min_scan(min_scan_), max_scan(max_scan_),
             min_peaks(min_peaks_), search_charge(search_charge_), top_matches(top_matches_), highest_mz(highest_mz_),
-            target_file(target_file_), decoy_file(decoy_file_), compute_sp(compute_sp_),
+            target_file(target_file_), decoy_file(decoy_file_),
+            target_writer(target_writer_), decoy_writer(decoy_writer_), compute_sp(compute_sp_),
             thread_num(thread_num_), num_threads(num_threads_), nAA(nAA_), aaFreqN(aaFreqN_), aaFreqI(aaFreqI_), aaFreqC(aaFreqC_),
             aaMass(aaMass_), nAARes(nAARes_), dAAFreqN(dAAFreqN_), dAAFreqI(dAAFreqI_), dAAFreqC(dAAFreqC_), dAAMass(dAAMass_),
             mod_table(mod_table_), nterm_mod_table(nterm_mod_table_), cterm_mod_table(cterm_mod_table_), decoysPerTarget(decoysPerTarget_),
             locks_array(locks_array_), bin_width(bin_width_), bin_offset(bin_offset_), exact_pval_search(exact_pval_search_),
-            spectrum_flag(spectrum_flag_), sc_index(sc_index_), total_candidate_peptides(total_candidate_peptides_), negative_isotope_errors(negative_isotope_errors_) {}
+            spectrum_flag(spectrum_flag_), sc_index(sc_index_), total_candidate_peptides(total_candidate_peptides_), negative_isotope_errors(negative_isotope_errors_),
+            sc_next(sc_next_), chunk_size(chunk_size_), stats(stats_), context(NULL) {}
   };
 
   int calcScoreCount(
@@ -338,7 +549,8 @@ private:
     double* aaFreqI,
     double* aaFreqC,
     int* aaMass,
-    double* pValueScoreObs
+    double* pValueScoreObs,
+    ScoreCountWorkspace* workspace
   );
 
   void calcResidueScoreCount (
@@ -356,7 +568,22 @@ private:
     int maxEvidence,
     int maxScore,
     vector<double>& scoreCount, //this is returned for later use
-    int& scoreOffSet //this is returned for later use
+    int& scoreOffSet, //this is returned for later use
+    ScoreCountWorkspace* workspace
+  );
+
+  void readResidueScoreCount(
+    int nAa,
+    int pepMassInt,
+    vector<int>& aaMass,
+    const vector<double>& aaFreqC,
+    int cTermMass,
+    int maxAaMass,
+    int maxEvidence,
+    int maxScore,
+    vector<double>& scoreCount, //this is returned for later use
+    int& scoreOffSet, //this is returned for later use
+    ScoreCountWorkspace* workspace
   );
 
   double calcCombinedPval( //calculates combined p-value
@@ -367,7 +594,7 @@ private:
 
   int factorial(int n);
 
-  void setSpectrumFlag(map<pair<string, unsigned int>, bool>* spectrum_flag);
+  void setSpectrumFlag(SpectrumFlags* spectrum_flag);
   virtual void processParams();
   string getOutputFileName();
 };
@@ -9,29 +9,276 @@
 #include "records_to_vector-inl.h"
 #include "theoretical_peak_set.h"
 #include "compiler.h"
+#include "score_kernel.h"
 #include "app/TideMatchSet.h"
 #include <map> //Added by Andy Lin
+#include <algorithm>
+#include <limits>
 #define CHECK(x) GOOGLE_CHECK((x))
 
 DEFINE_int32(fifo_page_size, 1, "Page size for FIFO allocator, in megs");
 
+// Reads the next peptide with mass of at least min_mass into fifo_alloc,
+// skipping any lighter ones, either from mapped (if not NULL) or from reader.
+// Returns NULL at the end of the index.
+static Peptide* ReadPeptide(RecordReader* reader, pb::Peptide* pb_peptide,
+                            const MappedPeptideIndex* mapped,
+                            int64_t* mapped_next, double min_mass,
+                            const vector<const pb::Protein*>& proteins,
+                            FifoAllocator* fifo_alloc) {
+  if (mapped) {
+    if (*mapped_next < mapped->Size() && mapped->Mass(*mapped_next) < min_mass) {
+      *mapped_next = mapped->LowerBound(min_mass);
+    }
+    if (*mapped_next >= mapped->Size()) {
+      return NULL;
+    }
+    return new(fifo_alloc) Peptide(*mapped, (*mapped_next)++, proteins);
+  }
+  while (!reader->Done()) {
+    reader->Read(pb_peptide);
+    if (pb_peptide->mass() < min_mass) {
+      continue;
+    }
+    return new(fifo_alloc) Peptide(*pb_peptide, proteins, fifo_alloc);
+  }
+  return NULL;
+}
+
+// Computes the theoretical peaks of peptide and compiles its programs, or,
+// if ScoreKernel is used instead of compiled programs, keeps the peaks in
+// fifo_alloc. With stored_peaks, the peaks stored in the index are used
+// instead wherever they are exact, taken from pb_peptide or from row
+// mapped_row of mapped, whichever the peptide was read from.
+static void CompilePeptide(Peptide* peptide, bool stored_peaks,
+                           const pb::Peptide& pb_peptide,
+                           const MappedPeptideIndex* mapped, int64_t mapped_row,
+                           ST_TheoreticalPeakSet* workspace,
+                           TheoreticalPeakCompiler* compiler_prog1,
+                           TheoreticalPeakCompiler* compiler_prog2,
+                           FifoAllocator* fifo_alloc) {
+  bool compiled = ScoreKernel::Compiled();
+  if (stored_peaks && peptide->StoredPeaksExact()) {
+    if (mapped && compiled) {
+      peptide->CompileStoredPeaks(*mapped, mapped_row, compiler_prog1, compiler_prog2);
+    } else if (mapped) {
+      peptide->KeepStoredPeaks(*mapped, mapped_row);
+    } else if (compiled) {
+      peptide->CompileStoredPeaks(pb_peptide, compiler_prog1, compiler_prog2);
+    } else {
+      peptide->KeepStoredPeaks(pb_peptide, fifo_alloc);
+    }
+    return;
+  }
+  workspace->Clear();
+  if (compiled) {
+    peptide->ComputeTheoreticalPeaks(workspace, pb_peptide,
+                                     compiler_prog1, compiler_prog2);
+  } else {
+    peptide->ComputeTheoreticalPeaks(workspace, fifo_alloc);
+  }
+}
+
+SharedPeptideQueue::SharedPeptideQueue(RecordReader* reader,
+                                       const vector<const pb::Protein*>&
+                                       proteins,
+                                       int num_threads)
+  : reader_(reader),
+    mapped_(NULL),
+    mapped_next_(0),
+    stored_peaks_(false),
+    proteins_(proteins),
+    theoretical_peak_set_(2000),
+    low_water_(num_threads, -1.0),
+    front_seq_(0),
+    fifo_alloc_peptides_(FLAGS_fifo_page_size << 20, false),
+    fifo_alloc_prog1_(FLAGS_fifo_page_size << 20, ScoreKernel::Compiled()),
+    fifo_alloc_prog2_(FLAGS_fifo_page_size << 20, ScoreKernel::Compiled()) {
+  CHECK(reader_->OK());
+  compiler_prog1_ = new TheoreticalPeakCompiler(&fifo_alloc_prog1_);
+  compiler_prog2_ = new TheoreticalPeakCompiler(&fifo_alloc_prog2_);
+}
+
+SharedPeptideQueue::SharedPeptideQueue(const MappedPeptideIndex* mapped,
+                                       const vector<const pb::Protein*>&
+                                       proteins,
+                                       int num_threads)
+  : reader_(NULL),
+    mapped_(mapped),
+    mapped_next_(0),
+    stored_peaks_(false),
+    proteins_(proteins),
+    theoretical_peak_set_(2000),
+    low_water_(num_threads, -1.0),
+    front_seq_(0),
+    fifo_alloc_peptides_(FLAGS_fifo_page_size << 20, false),
+    fifo_alloc_prog1_(FLAGS_fifo_page_size << 20, ScoreKernel::Compiled()),
+    fifo_alloc_prog2_(FLAGS_fifo_page_size << 20, ScoreKernel::Compiled()) {
+  compiler_prog1_ = new TheoreticalPeakCompiler(&fifo_alloc_prog1_);
+  compiler_prog2_ = new TheoreticalPeakCompiler(&fifo_alloc_prog2_);
+}
+
+SharedPeptideQueue::~SharedPeptideQueue() {
+  fifo_alloc_peptides_.ReleaseAll();
+  fifo_alloc_prog1_.ReleaseAll();
+  fifo_alloc_prog2_.ReleaseAll();
+
+  delete compiler_prog1_;
+  delete compiler_prog2_;
+}
+
+bool SharedPeptideQueue::ReadNext(double low_water) {
+  // Peptides below low_water are skipped: no thread needs them any more.
+  Peptide* peptide = ReadPeptide(reader_, &current_pb_peptide_, mapped_,
+                                 &mapped_next_, low_water, proteins_,
+                                 &fifo_alloc_peptides_);
+  if (peptide == NULL) {
+    return false;
+  }
+  queue_.push_back(peptide);
+  // Unlike ActivePeptideQueue, compile right away: another thread may
+  // already be scoring against the programs that precede this one.
+  CompilePeptide(peptide, stored_peaks_, current_pb_peptide_, mapped_,
+                 mapped_next_ - 1, &theoretical_peak_set_,
+                 compiler_prog1_, compiler_prog2_, &fifo_alloc_peptides_);
+  return true;
+}
+
+void SharedPeptideQueue::Extend(int thread_idx, double min_range,
+                                double max_range, int min_candidates,
+                                deque<Peptide*>* local, int64_t* next_seq) {
+  boost::mutex::scoped_lock lock(mutex_);
+
+  low_water_[thread_idx] = min_range;
+  double low_water = *min_element(low_water_.begin(), low_water_.end());
+
+  // Drop whatever every thread has moved beyond.
+  if (low_water >= 0) {
+    bool dropped = false;
+    while (!queue_.empty() && queue_.front()->Mass() < low_water) {
+      queue_.pop_front();
+      ++front_seq_;
+      dropped = true;
+    }
+    if (queue_.empty()) {
+      fifo_alloc_peptides_.ReleaseAll();
+      fifo_alloc_prog1_.ReleaseAll();
+      fifo_alloc_prog2_.ReleaseAll();
+    } else if (dropped) {
+      Peptide* peptide = queue_.front();
+      fifo_alloc_peptides_.Release(peptide);
+      peptide->ReleaseFifo(&fifo_alloc_prog1_, &fifo_alloc_prog2_);
+    }
+  }
+  if (*next_seq < front_seq_) {
+    // Everything skipped over is lighter than min_range.
+    *next_seq = front_seq_;
+  }
+
+  if (!local->empty() && local->back()->Mass() > max_range &&
+      local->size() >= min_candidates) {
+    return;
+  }
+  while (true) {
+    size_t pos = *next_seq - front_seq_;
+    if (pos == queue_.size() && !ReadNext(low_water)) {
+      break;
+    }
+    Peptide* peptide = queue_[pos];
+    ++*next_seq;
+    if (peptide->Mass() < min_range) {
+      continue;
+    }
+    local->push_back(peptide);
+    if (peptide->Mass() > max_range && local->size() > min_candidates) {
+      break;
+    }
+  }
+}
+
+void SharedPeptideQueue::Retire(int thread_idx) {
+  boost::mutex::scoped_lock lock(mutex_);
+  low_water_[thread_idx] = numeric_limits<double>::max();
+}
+
 ActivePeptideQueue::ActivePeptideQueue(RecordReader* reader,
                                        const vector<const pb::Protein*>&
                                        proteins)
   : reader_(reader),
+    mapped_(NULL),
+    mapped_next_(0),
+    stored_peaks_(false),
     proteins_(proteins),
     theoretical_peak_set_(2000),   // probably overkill, but no harm
     theoretical_b_peak_set_(200),  // probably overkill, but no harm
     active_targets_(0), active_decoys_(0),
-    fifo_alloc_peptides_(FLAGS_fifo_page_size << 20),
-    fifo_alloc_prog1_(FLAGS_fifo_page_size << 20),
-    fifo_alloc_prog2_(FLAGS_fifo_page_size << 20) {
+    fifo_alloc_peptides_(FLAGS_fifo_page_size << 20, false),
+    fifo_alloc_prog1_(FLAGS_fifo_page_size << 20, ScoreKernel::Compiled()),
+    fifo_alloc_prog2_(FLAGS_fifo_page_size << 20, ScoreKernel::Compiled()) {
   CHECK(reader_->OK());
   compiler_prog1_ = new TheoreticalPeakCompiler(&fifo_alloc_prog1_);
   compiler_prog2_ = new TheoreticalPeakCompiler(&fifo_alloc_prog2_);
   peptide_centric_ = false;
   elution_window_ = 0;
+  hit_bytes_ = peak_hit_bytes_ = 0;
+  exact_pval_search_ = false;
+  use_tailor_calibration_ = Params::GetBool("use-tailor-calibration");
+  shared_ = NULL;
+  shared_thread_idx_ = 0;
+  shared_next_seq_ = 0;
+}
+
+ActivePeptideQueue::ActivePeptideQueue(const MappedPeptideIndex* mapped,
+                                       const vector<const pb::Protein*>&
+                                       proteins)
+  : reader_(NULL),
+    mapped_(mapped),
+    mapped_next_(0),
+    stored_peaks_(false),
+    shared_(NULL),
+    shared_thread_idx_(0),
+    shared_next_seq_(0),
+    proteins_(proteins),
+    theoretical_peak_set_(2000),
+    theoretical_b_peak_set_(200),
+    active_targets_(0), active_decoys_(0),
+    fifo_alloc_peptides_(FLAGS_fifo_page_size << 20, false),
+    fifo_alloc_prog1_(FLAGS_fifo_page_size << 20, ScoreKernel::Compiled()),
+    fifo_alloc_prog2_(FLAGS_fifo_page_size << 20, ScoreKernel::Compiled()) {
+  compiler_prog1_ = new TheoreticalPeakCompiler(&fifo_alloc_prog1_);
+  compiler_prog2_ = new TheoreticalPeakCompiler(&fifo_alloc_prog2_);
+  peptide_centric_ = false;
+  elution_window_ = 0;
+  hit_bytes_ = peak_hit_bytes_ = 0;
   exact_pval_search_ = false;
+  use_tailor_calibration_ = Params::GetBool("use-tailor-calibration");
+}
+
+ActivePeptideQueue::ActivePeptideQueue(SharedPeptideQueue* shared,
+                                       int thread_idx,
+                                       const vector<const pb::Protein*>&
+                                       proteins)
+  : reader_(NULL),
+    mapped_(NULL),
+    mapped_next_(0),
+    stored_peaks_(false),
+    shared_(shared),
+    shared_thread_idx_(thread_idx),
+    shared_next_seq_(0),
+    proteins_(proteins),
+    theoretical_peak_set_(2000),
+    theoretical_b_peak_set_(200),
+    active_targets_(0), active_decoys_(0),
+    fifo_alloc_peptides_(FLAGS_fifo_page_size << 20, false),
+    fifo_alloc_prog1_(FLAGS_fifo_page_size << 20, ScoreKernel::Compiled()),
+    fifo_alloc_prog2_(FLAGS_fifo_page_size << 20, ScoreKernel::Compiled()) {
+  compiler_prog1_ = new TheoreticalPeakCompiler(&fifo_alloc_prog1_);
+  compiler_prog2_ = new TheoreticalPeakCompiler(&fifo_alloc_prog2_);
+  peptide_centric_ = false;
+  elution_window_ = 0;
+  hit_bytes_ = peak_hit_bytes_ = 0;
+  exact_pval_search_ = false;
+  use_tailor_calibration_ = Params::GetBool("use-tailor-calibration");
 }
 
 ActivePeptideQueue::~ActivePeptideQueue() {
@@ -49,10 +296,21 @@ ActivePeptideQueue::~ActivePeptideQueue() {
 // Compute the theoretical peaks of the peptide in the "back" of the queue
 // (i.e. the one most recently read from disk -- the heaviest).
 void ActivePeptideQueue::ComputeTheoreticalPeaksBack() {
-  theoretical_peak_set_.Clear();
   Peptide* peptide = queue_.back();
-  peptide->ComputeTheoreticalPeaks(&theoretical_peak_set_, current_pb_peptide_,
-                                   compiler_prog1_, compiler_prog2_);
+  CompilePeptide(peptide, stored_peaks_, current_pb_peptide_, mapped_,
+                 mapped_next_ - 1, &theoretical_peak_set_,
+                 compiler_prog1_, compiler_prog2_, &fifo_alloc_peptides_);
+}
+
+Peptide* ActivePeptideQueue::ReadPeptide(double min_mass) {
+  return ::ReadPeptide(reader_, &current_pb_peptide_, mapped_, &mapped_next_,
+                       min_mass, proteins_, &fifo_alloc_peptides_);
+}
+
+void ActivePeptideQueue::Finish() {
+  if (shared_) {
+    shared_->Retire(shared_thread_idx_);
+  }
 }
 
 bool ActivePeptideQueue::isWithinIsotope(vector<double>* min_mass, vector<double>* max_mass, double mass, int* isotope_idx) {
@@ -68,8 +326,9 @@ bool ActivePeptideQueue::isWithinIsotope(vector<double>* min_mass, vector<double
 }
 
 int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>* max_mass, double min_range, double max_range, vector<bool>* candidatePeptideStatus) {
+  candidatePeptideStatus->clear();
   int min_candidates = 0;  //Added for tailor score calibration method by AKF
-  if (Params::GetBool("use-tailor-calibration")){
+  if (use_tailor_calibration_){
     min_candidates = 30;
   }
   //min_range and max_range have been introduced to fix a bug
@@ -83,14 +342,16 @@ int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>*
   while (!queue_.empty() && queue_.front()->Mass() < min_range) {
     Peptide* peptide = queue_.front();
     //print hits in peptide-centric search
-    ReportPeptideHits(peptide);
-    peptide->spectrum_matches_array.clear();
-    vector<Peptide::spectrum_matches>().swap(peptide->spectrum_matches_array);
+    ReleasePeptideHits(peptide);
     // would delete peptide's underlying pb::Peptide;
     queue_.pop_front();
 //    delete peptide;
   }
-  if (queue_.empty()) {
+  if (shared_) {
+    // The shared queue owns the peptides; it also decides when to read more.
+    shared_->Extend(shared_thread_idx_, min_range, max_range, min_candidates,
+                    &queue_, &shared_next_seq_);
+  } else if (queue_.empty()) {
     //cerr << "Releasing All\n";
     fifo_alloc_peptides_.ReleaseAll();
     fifo_alloc_prog1_.ReleaseAll();
@@ -112,19 +373,16 @@ int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>*
   // fifo_alloc_peptides_.
   bool done = false;
   //Modified for tailor score calibration method by AKF
-  if (queue_.empty() || queue_.back()->Mass() <= max_range || queue_.size() < min_candidates) {
+  if (shared_) {
+    done = queue_.empty();
+  } else if (queue_.empty() || queue_.back()->Mass() <= max_range || queue_.size() < min_candidates) {
     if (!queue_.empty()) {
       ComputeTheoreticalPeaksBack();
     }
-    while (!(done = reader_->Done())) {
-      // read all peptides lighter than max_range
-      reader_->Read(&current_pb_peptide_);
-      if (current_pb_peptide_.mass() < min_range) {
-        // we would delete current_pb_peptide_;
-        continue; // skip peptides that fall below min_range
-      }
-      Peptide* peptide = new(&fifo_alloc_peptides_)
-        Peptide(current_pb_peptide_, proteins_, &fifo_alloc_peptides_);
+    // read all peptides lighter than max_range, skipping those that fall
+    // below min_range
+    Peptide* peptide;
+    while ((peptide = ReadPeptide(min_range)) != NULL) {
       queue_.push_back(peptide);
       //Modified for tailor score calibration method by AKF
       if (peptide->Mass() > max_range && queue_.size() > min_candidates) {
@@ -132,6 +390,7 @@ int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>*
       }
       ComputeTheoreticalPeaksBack();
     }
+    done = peptide == NULL;
   }
   // by now, if not EOF, then the last (and only the last) enqueued
   // peptide is too heavy
@@ -146,19 +405,19 @@ int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>*
   iter_ = queue_.begin();
   while (iter_ != queue_.end() && (*iter_)->Mass() < min_mass->front()) {
     ++iter_;
-    if (Params::GetBool("use-tailor-calibration")){ //Added by AKF
+    if (use_tailor_calibration_){ //Added by AKF
       candidatePeptideStatus->push_back(false);  
     }
   }
   end_ = iter_;
-  if (Params::GetBool("use-tailor-calibration")){ //Added by AKF
+  if (use_tailor_calibration_){ //Added by AKF
     iter_ = queue_.begin();
   }
-  int* isotope_idx = new int(0);
+  int isotope_idx = 0;
   int active = 0;
   active_targets_ = active_decoys_ = 0;
   while (end_ != queue_.end() && (*end_)->Mass() < max_mass->back() ){
-    if (isWithinIsotope(min_mass, max_mass, (*end_)->Mass(), isotope_idx)) {
+    if (isWithinIsotope(min_mass, max_mass, (*end_)->Mass(), &isotope_idx)) {
       ++active;
       candidatePeptideStatus->push_back(true);
       if (!(*end_)->IsDecoy()) {
@@ -171,14 +430,13 @@ int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>*
     }
     ++end_;
   }
-  delete isotope_idx;
   if (active == 0) {
     return 0;
   }
   //Added for tailor score calibration method by AKF
-  if (Params::GetBool("use-tailor-calibration")){
+  if (use_tailor_calibration_){
     while (end_ != queue_.end()) {  //Added by AKF
-      if ((*end_)->Prog(1) == NULL || candidatePeptideStatus->size() >= min_candidates-1) {
+      if (!(*end_)->Scorable() || candidatePeptideStatus->size() >= min_candidates-1) {
         break;
       }
       candidatePeptideStatus->push_back(false);
@@ -189,6 +447,26 @@ int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>*
 
 }
 
+int ActivePeptideQueue::SetActiveStatus(vector<double>* min_mass, vector<double>* max_mass, vector<bool>* candidatePeptideStatus) {
+  candidatePeptideStatus->clear();
+  int isotope_idx = 0;
+  int active = 0;
+  active_targets_ = active_decoys_ = 0;
+  for (deque<Peptide*>::const_iterator i = iter_; i != end_; ++i) {
+    bool candidate = isWithinIsotope(min_mass, max_mass, (*i)->Mass(), &isotope_idx);
+    candidatePeptideStatus->push_back(candidate);
+    if (candidate) {
+      ++active;
+      if (!(*i)->IsDecoy()) {
+        ++active_targets_;
+      } else {
+        ++active_decoys_;
+      }
+    }
+  }
+  return active;
+}
+
 // Compute the b ion only theoretical peaks of the peptide in the "back" of the queue
 // (i.e. the one most recently read from disk -- the heaviest).
 void ActivePeptideQueue::ComputeBTheoreticalPeaksBack() {
@@ -200,15 +478,14 @@ void ActivePeptideQueue::ComputeBTheoreticalPeaksBack() {
 
 int ActivePeptideQueue::SetActiveRangeBIons(vector<double>* min_mass, vector<double>* max_mass, double min_range, double max_range, vector<bool>* candidatePeptideStatus) {
     exact_pval_search_ = true;
+  candidatePeptideStatus->clear();
   // queue front() is lightest; back() is heaviest
 
   // delete anything already loaded that falls below min_range
   while (!queue_.empty() && queue_.front()->Mass() < min_range) {
     Peptide* peptide = queue_.front();
     // would delete peptide's underlying pb::Peptide;
-    ReportPeptideHits(peptide);
-    peptide->spectrum_matches_array.clear();
-    vector<Peptide::spectrum_matches>().swap(peptide->spectrum_matches_array);
+    ReleasePeptideHits(peptide);
     queue_.pop_front();
     b_ion_queue_.pop_front();
 //    delete peptide;
@@ -225,23 +502,19 @@ int ActivePeptideQueue::SetActiveRangeBIons(vector<double>* min_mass, vector<dou
   // max_range. For each new enqueued peptide compute the corresponding
   // theoretical peaks. Data associated with each peptide is allocated by
   // fifo_alloc_peptides_.
-  bool done;
+  bool done = false;
   if (queue_.empty() || queue_.back()->Mass() <= max_range) {
-    while (!(done = reader_->Done())) {
-      // read all peptides lighter than max_range
-      reader_->Read(&current_pb_peptide_);
-      if (current_pb_peptide_.mass() < min_range) {
-        // we would delete current_pb_peptide_;
-        continue; // skip peptides that fall below min_range
-      }
-      Peptide* peptide = new(&fifo_alloc_peptides_)
-        Peptide(current_pb_peptide_, proteins_, &fifo_alloc_peptides_);
+    // read all peptides lighter than max_range, skipping those that fall
+    // below min_range
+    Peptide* peptide;
+    while ((peptide = ReadPeptide(min_range)) != NULL) {
       queue_.push_back(peptide);
       ComputeBTheoreticalPeaksBack();
       if (peptide->Mass() > max_range) {
         break;
       }
     }
+    done = peptide == NULL;
   }
   // by now, if not EOF, then the last (and only the last) enqueued
   // peptide is too heavy
@@ -254,13 +527,13 @@ int ActivePeptideQueue::SetActiveRangeBIons(vector<double>* min_mass, vector<dou
     ++iter1_;
   }
 
-  int* isotope_idx = new int(0);
+  int isotope_idx = 0;
   end_ = iter_;
   end1_ = iter1_;
   int active = 0;
   active_targets_ = active_decoys_ = 0;
   while (end_ != queue_.end() && (*end_)->Mass() < max_mass->back() ){
-    if (isWithinIsotope(min_mass, max_mass, (*end_)->Mass(), isotope_idx)) {
+    if (isWithinIsotope(min_mass, max_mass, (*end_)->Mass(), &isotope_idx)) {
       ++active;
       candidatePeptideStatus->push_back(true);
       if (!(*end_)->IsDecoy()) {
@@ -274,7 +547,6 @@ int ActivePeptideQueue::SetActiveRangeBIons(vector<double>* min_mass, vector<dou
     ++end_;
     ++end1_;
   }
-  delete isotope_idx;
   if (active == 0) {
     return 0;
   }
@@ -302,9 +574,9 @@ int ActivePeptideQueue::CountAAFrequency(
     memset(nvAAMassCounterC, 0, MaxModifiedAAMassBin * sizeof(unsigned int));
     memset(nvAAMassCounterI, 0, MaxModifiedAAMassBin * sizeof(unsigned int));
 
-    while (!(reader_->Done())) { // read all peptides in index
-      reader_->Read(&current_pb_peptide_);
-      Peptide* peptide = new(&fifo_alloc_peptides_) Peptide(current_pb_peptide_, proteins_, &fifo_alloc_peptides_);
+    Peptide* peptide;
+    // read all peptides in index
+    while ((peptide = ReadPeptide(-numeric_limits<double>::max())) != NULL) {
 
       vector<double> dAAResidueMass = peptide->getAAMasses(); //retrieves the amino acid masses, modifications included
 
@@ -371,9 +643,9 @@ int ActivePeptideQueue::CountAAFrequencyRes(
   map<double,int> cMap; //Cterm residues
   map<double,int> allMap; //all residues
 
-  while (!(reader_->Done())) { //read all peptides in index
-    reader_->Read(&current_pb_peptide_);
-    Peptide* peptide = new(&fifo_alloc_peptides_) Peptide(current_pb_peptide_, proteins_, &fifo_alloc_peptides_);
+  Peptide* peptide;
+  //read all peptides in index
+  while ((peptide = ReadPeptide(-numeric_limits<double>::max())) != NULL) {
 
     vector<double> dAAResidueMass = peptide->getAAMasses(); //retrieves the amino acid massses, modifications included
 
@@ -430,6 +702,31 @@ int ActivePeptideQueue::CountAAFrequencyRes(
 }
 
 
+void ActivePeptideQueue::AddHit(Peptide* peptide, Spectrum* spectrum,
+                                double score, int rank, int charge) {
+  // The report needs one hit beyond the top matches for delta_cn; with an
+  // elution window, the scores of all hits are smoothed together.
+  int max_hits = elution_window_ > 0 ? 0 : top_matches_ + 1;
+  size_t capacity = peptide->spectrum_matches_array.capacity();
+  peptide->AddHit(spectrum, score, 0.0, rank, charge, max_hits,
+                  exact_pval_search_ ? Peptide::spectrum_matches::compPV :
+                                       Peptide::spectrum_matches::compSC);
+  hit_bytes_ += (peptide->spectrum_matches_array.capacity() - capacity) *
+                sizeof(Peptide::spectrum_matches);
+  peak_hit_bytes_ = max(peak_hit_bytes_, hit_bytes_);
+}
+
+void ActivePeptideQueue::ReleasePeptideHits(Peptide* peptide) {
+  if (!peptide_centric_) {
+    return; // the peptide may be shared with other threads' queues
+  }
+  ReportPeptideHits(peptide);
+  hit_bytes_ -= peptide->spectrum_matches_array.capacity() *
+                sizeof(Peptide::spectrum_matches);
+  vector<Peptide::spectrum_matches>().swap(peptide->spectrum_matches_array);
+  peptide->num_hits = 0;
+}
+
 void ActivePeptideQueue::ReportPeptideHits(Peptide* peptide) {
     if (!peptide_centric_) {
       return;
@@ -13,12 +13,24 @@
 // SetActiveRange() the client may use the iterator interface HasNext() and
 // NextPeptide() to iterate over the window. The client may also use
 // GetPeptide() to get a specific peptide in the window.
+//
+// Instead of a file of peptide records, the peptides may also come from a
+// MappedPeptideIndex (see mapped_peptide_index.h), which is read in place;
+// the first peptide of a new range is then found by binary search rather
+// than by reading past all lighter peptides.
+//
+// Several ActivePeptideQueues may also draw on one SharedPeptideQueue (see
+// below) instead of each reading the index on its own. In that case each
+// ActivePeptideQueue only keeps pointers to peptides owned by the shared
+// queue.
 
 #include <deque>
+#include <boost/thread.hpp>
 #include "peptides.pb.h"
 #include "peptide.h"
 #include "theoretical_peak_set.h"
 #include "fifo_alloc.h"
+#include "mapped_peptide_index.h"
 #include "spectrum_collection.h"
 #include "io/OutputFiles.h"
 
@@ -28,11 +40,85 @@
 
 class TheoreticalPeakCompiler;
 
+// A SharedPeptideQueue decodes the peptide index once on behalf of several
+// search threads. Peptides are read, their theoretical peaks computed and
+// their dot-product programs compiled by whichever thread first needs them;
+// every other thread reuses the result. Each thread registers the lightest
+// mass it still needs (its low-water mark) on every call to Extend(), and a
+// peptide is only released once all threads have moved beyond it. A thread
+// that has finished searching must call Retire(), otherwise it would hold
+// the window in place.
+//
+// Peptides handed out by Extend() are immutable, so threads may score
+// against them without holding the lock.
+class SharedPeptideQueue {
+ public:
+  SharedPeptideQueue(RecordReader* reader,
+                     const vector<const pb::Protein*>& proteins,
+                     int num_threads);
+  SharedPeptideQueue(const MappedPeptideIndex* mapped,
+                     const vector<const pb::Protein*>& proteins,
+                     int num_threads);
+
+  ~SharedPeptideQueue();
+
+  // Appends to local the peptides following *next_seq that thread_idx needs
+  // to cover [min_range, max_range], mirroring the read-ahead rule of
+  // ActivePeptideQueue::SetActiveRange(). *next_seq is the sequence number
+  // of the first peptide this thread has not seen yet.
+  void Extend(int thread_idx, double min_range, double max_range,
+              int min_candidates, deque<Peptide*>* local, int64_t* next_seq);
+
+  // Called by a thread once it will make no further calls to Extend().
+  void Retire(int thread_idx);
+
+  // See ActivePeptideQueue::SetStoredPeaks().
+  void SetStoredPeaks(bool stored_peaks) { stored_peaks_ = stored_peaks; }
+
+ private:
+  // Reads the next peptide at or above low_water onto the back of queue_.
+  // Returns false at end of file. Caller holds mutex_.
+  bool ReadNext(double low_water);
+
+  boost::mutex mutex_;
+  RecordReader* reader_;
+  pb::Peptide current_pb_peptide_;
+  const MappedPeptideIndex* mapped_;
+  int64_t mapped_next_; // next row of mapped_ to read
+  bool stored_peaks_;
+  const vector<const pb::Protein*>& proteins_;
+  ST_TheoreticalPeakSet theoretical_peak_set_;
+
+  // Lightest mass still needed by each thread; -1 until a thread's first
+  // call to Extend().
+  vector<double> low_water_;
+
+  deque<Peptide*> queue_;
+  // Sequence number of queue_.front(), i.e. the number of peptides that
+  // have been dropped from the front so far.
+  int64_t front_seq_;
+
+  FifoAllocator fifo_alloc_peptides_;
+  FifoAllocator fifo_alloc_prog1_;
+  FifoAllocator fifo_alloc_prog2_;
+  TheoreticalPeakCompiler* compiler_prog1_;
+  TheoreticalPeakCompiler* compiler_prog2_;
+};
+
 class ActivePeptideQueue {
  public:
   ActivePeptideQueue(RecordReader* reader,
             const vector<const pb::Protein*>& proteins);
 
+  // Reads peptides in place from mapped, which must outlive the queue.
+  ActivePeptideQueue(const MappedPeptideIndex* mapped,
+            const vector<const pb::Protein*>& proteins);
+
+  // Draws peptides from shared, on behalf of search thread thread_idx.
+  // Only SetActiveRange() is supported in this mode.
+  ActivePeptideQueue(SharedPeptideQueue* shared, int thread_idx,
+            const vector<const pb::Protein*>& proteins);
+
   ~ActivePeptideQueue();
 
   bool isWithinIsotope(vector<double>* min_mass, vector<double>* max_mass, double mass, int* isotope_idx);
@@ -41,6 +127,17 @@ class ActivePeptideQueue {
   int SetActiveRange(vector<double>* min_mass, vector<double>* max_mass, double min_range, double max_range, vector<bool>* candidatePeptideStatus);
   int SetActiveRangeBIons(vector<double>* min_mass, vector<double>* max_mass, double min_range, double max_range, vector<bool>* candidatePeptideStatus);
 
+  // After SetActiveRange() for a window that covers several spectra, marks
+  // in candidatePeptideStatus which peptides of the window are candidates
+  // for the one spectrum with mass ranges min_mass and max_mass, and
+  // recounts ActiveTargets() and ActiveDecoys() for it. Returns the number
+  // of candidates.
+  int SetActiveStatus(vector<double>* min_mass, vector<double>* max_mass, vector<bool>* candidatePeptideStatus);
+
+  // Tells the SharedPeptideQueue, if any, that this thread has finished
+  // searching, so that it no longer holds back the shared window.
+  void Finish();
+
   bool HasNext() const { return iter_ != end_; }
   Peptide* NextPeptide() { return *iter_; }
   const Peptide* GetPeptide(int back_index) const {
@@ -50,6 +147,10 @@ class ActivePeptideQueue {
     theoretical_b_peak_set_.binWidth_ = binWidth;
     theoretical_b_peak_set_.binOffset_ = binOffset;
   }
+  // Tells the queue that the index holds theoretical peaks binned the way
+  // this search bins them (see tide-index --precompute-peaks), so that they
+  // need not be computed again.
+  void SetStoredPeaks(bool stored_peaks) { stored_peaks_ = stored_peaks; }
 
   deque<TheoreticalPeakSetBIons> b_ion_queue_;
   deque<TheoreticalPeakSetBIons>::const_iterator iter1_, end1_;
@@ -64,6 +165,16 @@ class ActivePeptideQueue {
   int ActiveDecoys() const { return active_decoys_; }
 
   void ReportPeptideHits(Peptide* peptide);
+
+  // Adds a peptide-centric hit to peptide. Only as many hits as
+  // ReportPeptideHits() can report are kept, unless an elution window needs
+  // all of them.
+  void AddHit(Peptide* peptide, Spectrum* spectrum, double score, int rank,
+              int charge);
+
+  // Largest number of bytes held at once by the peptide-centric hits of
+  // this queue's peptides.
+  size_t PeakHitBytes() const { return peak_hit_bytes_; }
   void SetOutputs(OutputFiles* output_files, const vector<const pb::AuxLocation*>* locations, int top_matches,
                   bool compute_sp, ofstream* target_file, ofstream* decoy_file, double highest_mz) {
       locations_ = locations;
@@ -97,8 +208,11 @@ class ActivePeptideQueue {
   double highest_mz_;
   Peptide* current_peptide_;
   bool exact_pval_search_;
+  bool use_tailor_calibration_; // use-tailor-calibration, read once
   bool peptide_centric_;
   int elution_window_;
+  size_t hit_bytes_;
+  size_t peak_hit_bytes_;
 
 
 //  Spectrum* spectrum_;
@@ -106,11 +220,26 @@ class ActivePeptideQueue {
 
   // See .cc file.
   void ComputeTheoreticalPeaksBack();
+  // Reports the hits of a peptide leaving the queue and frees them; does
+  // nothing unless the search is peptide-centric.
+  void ReleasePeptideHits(Peptide* peptide);
   void ComputeBTheoreticalPeaksBack();
+  Peptide* ReadPeptide(double min_mass);
 
   RecordReader* reader_;
   pb::Peptide current_pb_peptide_;
 
+  // Set when peptides are read from a MappedPeptideIndex instead of reader_.
+  const MappedPeptideIndex* mapped_;
+  int64_t mapped_next_; // next row of mapped_ to read
+
+  bool stored_peaks_; // see SetStoredPeaks()
+
+  // Set when peptides are drawn from a SharedPeptideQueue; see above.
+  SharedPeptideQueue* shared_;
+  int shared_thread_idx_;
+  int64_t shared_next_seq_;
+
   // All amino acid sequences from which the peptides are drawn.
   const vector<const pb::Protein*>& proteins_; 
 
@@ -139,6 +139,13 @@ class TheoreticalPeakCompiler {
     }
   }
 
+  void AddPositive(const int* peaks, int size) {
+    // Write an add instruction for each of the size sorted entries in peaks.
+    int end = MaxBin::Global().CacheBinEnd() * NUM_PEAK_TYPES;
+    for (int i = 0; i < size && peaks[i] < end; ++i)
+      AddPositive(peaks[i]);
+  }
+
   void AddNegative(const google::protobuf::RepeatedField<int>& peaks) {
     // Write a sub instruction for each entry in peaks.
     int end = MaxBin::Global().CacheBinEnd() * NUM_PEAK_TYPES;
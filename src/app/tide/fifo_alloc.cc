@@ -16,8 +16,9 @@
 // exceed a page's worth. 
 // Pages become available for reuse when all contents are Release()'d.
 //
-// On Linux we use mmap to allocate memory and we mark the page as executable
-// to provide run-time compilation of dot product calculations.
+// On Linux we use mmap to allocate memory and, unless asked not to, we mark
+// the page as executable to provide run-time compilation of dot product
+// calculations.
 
 #include <sys/types.h>
 #ifdef _MSC_VER
@@ -50,14 +51,14 @@ void CheckSentinel(void* p, size_t size) {
     CHECK(((char *) p)[i] == (char) SENTINEL_VALUE);
 }
 
-void* FifoPage::GetPage(size_t size) {
+void* FifoPage::GetPage(size_t size, bool executable) {
   // protections to allow exec (see above)
-  int mmap_prot_mode = PROT_READ | PROT_WRITE | PROT_EXEC;
+  int mmap_prot_mode = PROT_READ | PROT_WRITE | (executable ? PROT_EXEC : 0);
   // for sentinel data before and after
   size_t size_with_sentinels = size + 2 * SENTINEL_DATA_SIZE;
   void* p = mmap(0, size_with_sentinels, mmap_prot_mode, 
                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  if (p == NULL) {
+  if (p == NULL || p == MAP_FAILED) {
     cerr << "Failed to allocate FifoPage of size " << size << ". Aborting\n";
     abort();
   }
@@ -76,11 +77,11 @@ void FifoPage::DeletePage(void* page, size_t size) {
   munmap((char *) page - SENTINEL_DATA_SIZE, size + 2 * SENTINEL_DATA_SIZE);
 }
 #else // MMAP_SENTINEL_CHECK
-void* FifoPage::GetPage(size_t size) {
+void* FifoPage::GetPage(size_t size, bool executable) {
   // protections to allow exec (see above)
-  int mmap_prot_mode = PROT_READ | PROT_WRITE | PROT_EXEC;
+  int mmap_prot_mode = PROT_READ | PROT_WRITE | (executable ? PROT_EXEC : 0);
   void* p = mmap(0, size, mmap_prot_mode, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  if (p == NULL) {
+  if (p == NULL || p == MAP_FAILED) {
     cerr << "Failed to allocate FifoPage of size " << size << ". Aborting\n";
     abort();
   }
@@ -96,7 +97,7 @@ void* FifoAllocator::FallbackNew(size_t amount) {
   // Check if a free page is already in our linked list.
   FifoPage* free_page = current_page_->Next(); 
   if (free_page == first_page_) {  // No free page in linked list
-    FifoPage* new_page = new FifoPage(page_size_);
+    FifoPage* new_page = new FifoPage(page_size_, executable_);
     current_page_->InsertPage(new_page);
     current_page_ = new_page;
   } else {
@@ -10,6 +10,10 @@
 // A page size, S, is supplied to the FifoAllocator constructor.
 // At most 2 * S extra memory will be allocated.
 //
+// Pages are executable, so that generated code can be run from them (see
+// compiler.h), unless the constructor is told otherwise. Some systems
+// refuse to map pages that are both writable and executable.
+//
 // Not thread safe! (TODO 254)
 //
 // Unalloc() allows you to deallocate the most recently allocated pointer.
@@ -35,9 +39,9 @@
 // Used by FifoAllocator; probably not useful alone. See .cc file.
 class FifoPage {
  public:
-  explicit FifoPage(size_t size)
+  FifoPage(size_t size, bool executable)
     : size_(size),
-    page_((char*) GetPage(size)),
+    page_((char*) GetPage(size, executable)),
     end_(page_ + size_),
     next_(this),
     end_used_(page_),
@@ -98,15 +102,16 @@ class FifoPage {
   char* end_used_;
   size_t last_amt_;
 
-  static void* GetPage(size_t size);
+  static void* GetPage(size_t size, bool executable);
   static void DeletePage(void* page, size_t size);
 };
 
 
 class FifoAllocator {
  public:
-  explicit FifoAllocator(size_t page_size) : page_size_(page_size) {
-    current_page_ = new FifoPage(page_size_);
+  explicit FifoAllocator(size_t page_size, bool executable = true)
+    : page_size_(page_size), executable_(executable) {
+    current_page_ = new FifoPage(page_size_, executable_);
     first_page_ = current_page_;
   }
 
@@ -141,6 +146,7 @@ class FifoAllocator {
   void* FallbackNew(size_t amount);
 
   size_t page_size_;
+  bool executable_;
   FifoPage* first_page_;
   FifoPage* current_page_;
 
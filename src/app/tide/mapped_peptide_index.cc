@@ -0,0 +1,254 @@
+// Writing and mapping of the fixed-layout peptide file; see
+// mapped_peptide_index.h for the layout.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef _MSC_VER
+#include <io.h>
+#include "mman.h"
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "records.h"
+#include "peptides.pb.h"
+#include "mapped_peptide_index.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define CHECK(x) GOOGLE_CHECK(x)
+
+const char* MappedPeptideIndex::kFileName = "pepix.mmap";
+
+static const char kMagic[8] = {'T', 'I', 'D', 'E', 'P', 'E', 'P', 'M'};
+static const uint32_t kVersion = 2;
+
+static int64_t FileSize(const string& filename) {
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0) {
+    return -1;
+  }
+  return (int64_t)st.st_size;
+}
+
+// 64-bit FNV-1a.
+static uint64_t Hash(const string& bytes) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < bytes.size(); ++i) {
+    hash = (hash ^ (unsigned char)bytes[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+bool MappedPeptideIndex::StampPepix(const string& pepix_file, Header* header) {
+  struct stat st;
+  if (stat(pepix_file.c_str(), &st) != 0) {
+    return false;
+  }
+  header->pepix_size = (int64_t)st.st_size;
+  header->pepix_mtime = (int64_t)st.st_mtime;
+  pb::Header pepix_header;
+  HeadedRecordReader reader(pepix_file, &pepix_header);
+  if (!reader.OK()) {
+    return false;
+  }
+  header->pepix_header_hash = Hash(pepix_header.SerializeAsString());
+  return true;
+}
+
+void MappedPeptideIndex::ColumnShape(Column c, const Header& header,
+                                     int64_t* count, int64_t* width) {
+  int64_t n = header.num_peptides;
+  switch (c) {
+    case COL_MASS:          *count = n;     *width = sizeof(double); break;
+    case COL_ID:            *count = n;     *width = sizeof(int64_t); break;
+    case COL_MODS_BEGIN:
+    case COL_PEAK1_BEGIN:
+    case COL_PEAK2_BEGIN:   *count = n + 1; *width = sizeof(int64_t); break;
+    case COL_MODS:          *count = header.num_mods;   *width = sizeof(int32_t); break;
+    case COL_PEAK1:         *count = header.num_peaks1; *width = sizeof(int32_t); break;
+    case COL_PEAK2:         *count = header.num_peaks2; *width = sizeof(int32_t); break;
+    default:                *count = n;     *width = sizeof(int32_t); break;
+  }
+}
+
+void MappedPeptideIndex::Layout(Header* header) {
+  int64_t pos = sizeof(Header);
+  for (int c = 0; c < NUM_COLUMNS; ++c) {
+    pos = (pos + 7) & ~(int64_t)7;
+    header->offset[c] = pos;
+    int64_t count, width;
+    ColumnShape((Column)c, *header, &count, &width);
+    pos += count * width;
+  }
+  header->file_size = pos;
+}
+
+bool MappedPeptideIndex::Write(const string& pepix_file,
+                               const string& out_file) {
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.header_size = sizeof(Header);
+  if (!StampPepix(pepix_file, &header)) {
+    return false;
+  }
+
+  // First pass: count everything, so that every column can be placed.
+  pb::Peptide pb_peptide;
+  {
+    HeadedRecordReader reader(pepix_file);
+    CHECK(reader.OK());
+    while (!reader.Done()) {
+      reader.Read(&pb_peptide);
+      ++header.num_peptides;
+      header.num_mods += pb_peptide.modifications_size();
+      header.num_peaks1 += pb_peptide.peak1_size();
+      header.num_peaks2 += pb_peptide.peak2_size();
+    }
+    CHECK(reader.OK());
+  }
+  Layout(&header);
+
+  FILE* out = fopen(out_file.c_str(), "wb");
+  if (!out) {
+    return false;
+  }
+  bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+  fclose(out);
+
+  // Second pass: append to all columns at once, through one stream per
+  // column, each positioned at the start of its column.
+  FILE* col[NUM_COLUMNS];
+  for (int c = 0; c < NUM_COLUMNS; ++c) {
+    col[c] = ok ? fopen(out_file.c_str(), "r+b") : NULL;
+    ok = col[c] && fseek(col[c], header.offset[c], SEEK_SET) == 0;
+  }
+  int64_t mods_end = 0, peak1_end = 0, peak2_end = 0;
+  if (ok) {
+    ok = fwrite(&mods_end, sizeof(int64_t), 1, col[COL_MODS_BEGIN]) == 1 &&
+         fwrite(&peak1_end, sizeof(int64_t), 1, col[COL_PEAK1_BEGIN]) == 1 &&
+         fwrite(&peak2_end, sizeof(int64_t), 1, col[COL_PEAK2_BEGIN]) == 1;
+  }
+  HeadedRecordReader reader(pepix_file);
+  CHECK(reader.OK());
+  while (ok && !reader.Done()) {
+    reader.Read(&pb_peptide);
+    double mass = pb_peptide.mass();
+    int64_t id = pb_peptide.id();
+    int32_t length = pb_peptide.length();
+    int32_t protein_id = pb_peptide.first_location().protein_id();
+    int32_t pos = pb_peptide.first_location().pos();
+    int32_t aux = pb_peptide.has_aux_locations_index() ?
+      pb_peptide.aux_locations_index() : -1;
+    int32_t decoy = pb_peptide.has_decoy_index() ? pb_peptide.decoy_index() : -1;
+    ok = fwrite(&mass, sizeof(mass), 1, col[COL_MASS]) == 1 &&
+         fwrite(&id, sizeof(id), 1, col[COL_ID]) == 1 &&
+         fwrite(&length, sizeof(length), 1, col[COL_LENGTH]) == 1 &&
+         fwrite(&protein_id, sizeof(protein_id), 1, col[COL_PROTEIN_ID]) == 1 &&
+         fwrite(&pos, sizeof(pos), 1, col[COL_POS]) == 1 &&
+         fwrite(&aux, sizeof(aux), 1, col[COL_AUX_LOCATIONS]) == 1 &&
+         fwrite(&decoy, sizeof(decoy), 1, col[COL_DECOY_INDEX]) == 1;
+    for (int i = 0; ok && i < pb_peptide.modifications_size(); ++i) {
+      int32_t mod = pb_peptide.modifications(i);
+      ok = fwrite(&mod, sizeof(mod), 1, col[COL_MODS]) == 1;
+    }
+    // pepix stores each peak as the delta from the previous one.
+    int32_t code = 0;
+    for (int i = 0; ok && i < pb_peptide.peak1_size(); ++i) {
+      code += pb_peptide.peak1(i);
+      ok = fwrite(&code, sizeof(code), 1, col[COL_PEAK1]) == 1;
+    }
+    code = 0;
+    for (int i = 0; ok && i < pb_peptide.peak2_size(); ++i) {
+      code += pb_peptide.peak2(i);
+      ok = fwrite(&code, sizeof(code), 1, col[COL_PEAK2]) == 1;
+    }
+    mods_end += pb_peptide.modifications_size();
+    peak1_end += pb_peptide.peak1_size();
+    peak2_end += pb_peptide.peak2_size();
+    ok = ok &&
+         fwrite(&mods_end, sizeof(int64_t), 1, col[COL_MODS_BEGIN]) == 1 &&
+         fwrite(&peak1_end, sizeof(int64_t), 1, col[COL_PEAK1_BEGIN]) == 1 &&
+         fwrite(&peak2_end, sizeof(int64_t), 1, col[COL_PEAK2_BEGIN]) == 1;
+  }
+  for (int c = 0; c < NUM_COLUMNS; ++c) {
+    if (col[c] && fclose(col[c]) != 0) {
+      ok = false;
+    }
+  }
+  return ok && FileSize(out_file) == header.file_size;
+}
+
+MappedPeptideIndex::MappedPeptideIndex(const string& filename)
+  : base_(NULL), length_bytes_(0), header_(NULL) {
+  int fd = open(filename.c_str(), O_RDONLY | O_BINARY);
+  if (fd < 0) {
+    carp(CARP_FATAL, "Couldn't open file %s for read (errno %d: %s).",
+         filename.c_str(), errno, strerror(errno));
+  }
+  int64_t size = FileSize(filename);
+  if (size < (int64_t)sizeof(Header)) {
+    carp(CARP_FATAL, "%s is not a valid mapped peptide index.", filename.c_str());
+  }
+  length_bytes_ = (size_t)size;
+  void* base = mmap(NULL, length_bytes_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd); // the mapping stays valid
+  if (base == MAP_FAILED) {
+    carp(CARP_FATAL, "Couldn't map %s into memory (errno %d: %s).",
+         filename.c_str(), errno, strerror(errno));
+  }
+  base_ = (const char*) base;
+  header_ = (const Header*) base_;
+
+  Header expected = *header_;
+  Layout(&expected);
+  if (memcmp(header_->magic, kMagic, sizeof(kMagic)) != 0 ||
+      header_->version != kVersion || header_->header_size != sizeof(Header) ||
+      header_->file_size != expected.file_size ||
+      memcmp(header_->offset, expected.offset, sizeof(expected.offset)) != 0 ||
+      size < header_->file_size) {
+    carp(CARP_FATAL, "%s is not a valid mapped peptide index; rerun tide-index.",
+         filename.c_str());
+  }
+
+  mass_ = Col<double>(COL_MASS);
+  id_ = Col<int64_t>(COL_ID);
+  length_ = Col<int32_t>(COL_LENGTH);
+  protein_id_ = Col<int32_t>(COL_PROTEIN_ID);
+  pos_ = Col<int32_t>(COL_POS);
+  aux_locations_ = Col<int32_t>(COL_AUX_LOCATIONS);
+  decoy_index_ = Col<int32_t>(COL_DECOY_INDEX);
+  mods_begin_ = Col<int64_t>(COL_MODS_BEGIN);
+  mods_ = Col<ModCoder::Mod>(COL_MODS);
+  peak1_begin_ = Col<int64_t>(COL_PEAK1_BEGIN);
+  peak1_ = Col<int32_t>(COL_PEAK1);
+  peak2_begin_ = Col<int64_t>(COL_PEAK2_BEGIN);
+  peak2_ = Col<int32_t>(COL_PEAK2);
+}
+
+MappedPeptideIndex::~MappedPeptideIndex() {
+  if (base_) {
+    munmap((void*) base_, length_bytes_);
+  }
+}
+
+bool MappedPeptideIndex::Matches(const string& pepix_file) const {
+  Header current;
+  memset(&current, 0, sizeof(current));
+  return StampPepix(pepix_file, &current) &&
+         current.pepix_size == header_->pepix_size &&
+         current.pepix_mtime == header_->pepix_mtime &&
+         current.pepix_header_hash == header_->pepix_header_hash;
+}
+
+int64_t MappedPeptideIndex::LowerBound(double mass) const {
+  return lower_bound(mass_, mass_ + Size(), mass) - mass_;
+}
@@ -0,0 +1,139 @@
+// MappedPeptideIndex is a fixed-layout alternative to the pepix file of
+// peptide records, meant to be memory-mapped and read in place at search
+// time. Reading pepix means parsing a pb::Peptide per record and copying
+// it; here every field of every peptide sits at a known position, so
+// ActivePeptideQueue can binary-search on mass to the first peptide it
+// needs and construct Peptides straight from the mapping.
+//
+// The file is written by tide-index (see --mmap-index) from the finished
+// pepix, whose peptides are already sorted by mass. It consists of a Header
+// followed by one array ("column") per field, each 8-byte aligned:
+//
+//   mass          double[N]  neutral mass, non-decreasing
+//   id            int64[N]
+//   length        int32[N]
+//   protein_id    int32[N]   first location
+//   pos           int32[N]   first location
+//   aux_locations int32[N]   -1 if the peptide has no aux locations
+//   decoy_index   int32[N]   -1 for targets
+//   mods_begin    int64[N+1] peptide i owns mods[mods_begin[i], mods_begin[i+1])
+//   mods          int32[]    ModCoder::Mod codes
+//   peak1_begin   int64[N+1] as mods_begin, for peak1
+//   peak1         int32[]    charge 1 theoretical peak codes, absolute
+//   peak2_begin   int64[N+1]
+//   peak2         int32[]    charge 2 theoretical peak codes, absolute
+//
+// Peaks are only present if the pepix records carry them (see tide-index
+// --precompute-peaks); otherwise the peak columns are empty.
+//
+// Values are stored in native byte order: the file is a cache of pepix for
+// the machine that searches it, not an interchange format. It records the
+// size and modification time of the pepix it was made from, and a hash of
+// its pb::Header, so that a stale copy is not used.
+
+#ifndef MAPPED_PEPTIDE_INDEX_H
+#define MAPPED_PEPTIDE_INDEX_H
+
+#include <stdint.h>
+#include <string>
+#include "mod_coder.h"
+
+using namespace std;
+
+class MappedPeptideIndex {
+ public:
+  // Name of the file within the index directory.
+  static const char* kFileName;
+
+  // Writes the file for pepix_file to out_file. Returns false on I/O error.
+  static bool Write(const string& pepix_file, const string& out_file);
+
+  // Maps filename into memory; carps fatally if it is not a valid file.
+  explicit MappedPeptideIndex(const string& filename);
+  ~MappedPeptideIndex();
+
+  // True if this file was made from pepix_file as it is now.
+  bool Matches(const string& pepix_file) const;
+
+  int64_t Size() const { return header_->num_peptides; }
+
+  // Index of the first peptide with mass >= mass, or Size() if none.
+  int64_t LowerBound(double mass) const;
+
+  double Mass(int64_t i) const { return mass_[i]; }
+  int64_t Id(int64_t i) const { return id_[i]; }
+  int Length(int64_t i) const { return length_[i]; }
+  int ProteinId(int64_t i) const { return protein_id_[i]; }
+  int Pos(int64_t i) const { return pos_[i]; }
+  int AuxLocationsIndex(int64_t i) const { return aux_locations_[i]; }
+  int DecoyIndex(int64_t i) const { return decoy_index_[i]; }
+  int Mods(int64_t i, const ModCoder::Mod** mods) const {
+    *mods = mods_ + mods_begin_[i];
+    return (int)(mods_begin_[i + 1] - mods_begin_[i]);
+  }
+  bool HasPeaks() const { return header_->num_peaks1 > 0; }
+  int Peaks1(int64_t i, const int** peaks) const {
+    *peaks = peak1_ + peak1_begin_[i];
+    return (int)(peak1_begin_[i + 1] - peak1_begin_[i]);
+  }
+  int Peaks2(int64_t i, const int** peaks) const {
+    *peaks = peak2_ + peak2_begin_[i];
+    return (int)(peak2_begin_[i + 1] - peak2_begin_[i]);
+  }
+
+ private:
+  enum Column {
+    COL_MASS, COL_ID, COL_LENGTH, COL_PROTEIN_ID, COL_POS, COL_AUX_LOCATIONS,
+    COL_DECOY_INDEX, COL_MODS_BEGIN, COL_MODS, COL_PEAK1_BEGIN, COL_PEAK1,
+    COL_PEAK2_BEGIN, COL_PEAK2, NUM_COLUMNS
+  };
+
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    int64_t pepix_size;
+    int64_t pepix_mtime;
+    uint64_t pepix_header_hash;
+    int64_t num_peptides;
+    int64_t num_mods;
+    int64_t num_peaks1;
+    int64_t num_peaks2;
+    int64_t offset[NUM_COLUMNS];
+    int64_t file_size;
+  };
+
+  // Fills in the pepix_ fields of header from pepix_file as it is now.
+  // Returns false if the file cannot be read.
+  static bool StampPepix(const string& pepix_file, Header* header);
+
+  // Number of elements and element size of column c for the given counts.
+  static void ColumnShape(Column c, const Header& header,
+                          int64_t* count, int64_t* width);
+  // Fills in header offsets and file_size from the counts.
+  static void Layout(Header* header);
+
+  template<class T> const T* Col(Column c) const {
+    return (const T*)(base_ + header_->offset[c]);
+  }
+
+  const char* base_;
+  size_t length_bytes_;
+  const Header* header_;
+
+  const double* mass_;
+  const int64_t* id_;
+  const int32_t* length_;
+  const int32_t* protein_id_;
+  const int32_t* pos_;
+  const int32_t* aux_locations_;
+  const int32_t* decoy_index_;
+  const int64_t* mods_begin_;
+  const ModCoder::Mod* mods_;
+  const int64_t* peak1_begin_;
+  const int32_t* peak1_;
+  const int64_t* peak2_begin_;
+  const int32_t* peak2_;
+};
+
+#endif // MAPPED_PEPTIDE_INDEX_H
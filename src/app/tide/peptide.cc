@@ -2,6 +2,7 @@
 
 #include <iostream>
 #include <limits>
+#include <algorithm>
 #include <gflags/gflags.h>
 #include "mass_constants.h"
 #include "max_mz.h"
@@ -207,6 +208,98 @@ void Peptide::ComputeTheoreticalPeaks(ST_TheoreticalPeakSet* workspace,
 #endif
 }
 
+bool Peptide::StoredPeaksExact() const {
+  // AddIons() stops at the first ion heavier than CacheBinEnd(), and every
+  // ion is lighter than the peptide itself.
+  return MaxBin::Global().MaxBinEnd() <= 0 ||
+         Mass() <= MaxBin::Global().CacheBinEnd();
+}
+
+void Peptide::CompileStoredPeaks(const pb::Peptide& pb_peptide,
+                                 TheoreticalPeakCompiler* compiler_prog1,
+                                 TheoreticalPeakCompiler* compiler_prog2) {
+  prog1_ = compiler_prog1->Init(pb_peptide.peak1_size(), 0);
+  compiler_prog1->AddPositive(pb_peptide.peak1());
+  compiler_prog1->Done();
+
+  prog2_ = compiler_prog2->Init(pb_peptide.peak1_size() + pb_peptide.peak2_size(), 0);
+  compiler_prog2->AddPositive(pb_peptide.peak1());
+  compiler_prog2->AddPositive(pb_peptide.peak2());
+  compiler_prog2->Done();
+}
+
+void Peptide::CompileStoredPeaks(const MappedPeptideIndex& index, int64_t i,
+                                 TheoreticalPeakCompiler* compiler_prog1,
+                                 TheoreticalPeakCompiler* compiler_prog2) {
+  const int* peak1;
+  const int* peak2;
+  int num_peak1 = index.Peaks1(i, &peak1);
+  int num_peak2 = index.Peaks2(i, &peak2);
+
+  prog1_ = compiler_prog1->Init(num_peak1, 0);
+  compiler_prog1->AddPositive(peak1, num_peak1);
+  compiler_prog1->Done();
+
+  prog2_ = compiler_prog2->Init(num_peak1 + num_peak2, 0);
+  compiler_prog2->AddPositive(peak1, num_peak1);
+  compiler_prog2->AddPositive(peak2, num_peak2);
+  compiler_prog2->Done();
+}
+
+// Copies into fifo_alloc memory the codes among peaks that lie within the
+// cache, just as TheoreticalPeakCompiler::AddPositive() compiles them.
+static const int* CopyPeaks(const TheoreticalPeakArr& peaks,
+                            FifoAllocator* fifo_alloc, int* size) {
+  int end = MaxBin::Global().CacheBinEnd() * NUM_PEAK_TYPES;
+  int* codes = (int*) fifo_alloc->New(sizeof(int) * peaks.size());
+  *size = 0;
+  for (int i = 0; i < peaks.size(); ++i) {
+    if (peaks[i].Code() < end) {
+      codes[(*size)++] = peaks[i].Code();
+    }
+  }
+  return codes;
+}
+
+static const int* DecodePeaks(const google::protobuf::RepeatedField<int>& peaks,
+                              FifoAllocator* fifo_alloc, int* size) {
+  int end = MaxBin::Global().CacheBinEnd() * NUM_PEAK_TYPES;
+  int* codes = (int*) fifo_alloc->New(sizeof(int) * peaks.size());
+  int total = 0;
+  *size = 0;
+  for (int i = 0; i < peaks.size() && (total += peaks.Get(i)) < end; ++i) {
+    codes[(*size)++] = total;
+  }
+  return codes;
+}
+
+// Number of sorted codes in peaks[0, size) that lie within the cache.
+static int PeaksInCache(const int* peaks, int size) {
+  int end = MaxBin::Global().CacheBinEnd() * NUM_PEAK_TYPES;
+  return lower_bound(peaks, peaks + size, end) - peaks;
+}
+
+void Peptide::ComputeTheoreticalPeaks(ST_TheoreticalPeakSet* workspace,
+                                      FifoAllocator* fifo_alloc) {
+  AddIons<ST_TheoreticalPeakSet>(workspace);
+  const TheoreticalPeakArr* peaks = workspace->GetPeaks();
+  peaks1_ = CopyPeaks(peaks[0], fifo_alloc, &num_peaks1_);
+  peaks2_ = CopyPeaks(peaks[1], fifo_alloc, &num_peaks2_);
+}
+
+void Peptide::KeepStoredPeaks(const pb::Peptide& pb_peptide,
+                              FifoAllocator* fifo_alloc) {
+  peaks1_ = DecodePeaks(pb_peptide.peak1(), fifo_alloc, &num_peaks1_);
+  peaks2_ = DecodePeaks(pb_peptide.peak2(), fifo_alloc, &num_peaks2_);
+}
+
+void Peptide::KeepStoredPeaks(const MappedPeptideIndex& index, int64_t i) {
+  int size = index.Peaks1(i, &peaks1_);
+  num_peaks1_ = PeaksInCache(peaks1_, size);
+  size = index.Peaks2(i, &peaks2_);
+  num_peaks2_ = PeaksInCache(peaks2_, size);
+}
+
 // return the amino acid masses in the current peptide
 vector<double> Peptide::getAAMasses() const {
   vector<double> masses_charge(Len());
@@ -234,17 +327,3 @@ vector<double> Peptide::getAAMasses() const {
   }
   return masses_charge;
 }
-
-// Probably defunct, uses old calling format.
-int NoInlineDotProd(Peptide* peptide, const int* cache, int charge) {
-  const void* prog = peptide->Prog(charge);
-  int result;
-#ifdef _MSC_VER
-  // FIXME CEG add Windows compatible inline assembly
-#else
-  __asm__ __volatile__("call *%[prog]\n"
-                       : "=a" (result)
-                       : "d" (cache), [prog] "abcSD" (prog));
-#endif
-  return result;
-}
@@ -23,6 +23,7 @@
 #ifndef PEPTIDE_H
 #define PEPTIDE_H
 
+#include <algorithm>
 #include <iostream>
 #include <vector>
 #include "raw_proteins.pb.h"
@@ -30,6 +31,7 @@
 #include "theoretical_peak_pair.h"
 #include "fifo_alloc.h"
 #include "mod_coder.h"
+#include "mapped_peptide_index.h"
 #include "sp_scorer.h"
 
 #include "spectrum_collection.h"
@@ -78,7 +80,9 @@ class Peptide {
     has_aux_locations_index_(peptide.has_aux_locations_index()),
     aux_locations_index_(peptide.aux_locations_index()),
     mods_(NULL), num_mods_(0), decoyIdx_(peptide.has_decoy_index() ? peptide.decoy_index() : -1),
-    prog1_(NULL), prog2_(NULL) {
+    prog1_(NULL), prog2_(NULL), peaks1_(NULL), num_peaks1_(0),
+    peaks2_(NULL), num_peaks2_(0) {
+    num_hits = 0;
     // Set residues_ by pointing to the first occurrence in proteins.
     residues_ = proteins[first_loc_protein_id_]->residues().data() 
                     + first_loc_pos_;
@@ -93,6 +97,29 @@ class Peptide {
         mods_[i] = ModCoder::Mod(peptide.modifications(i));
     }
   }
+  // Constructs peptide i of a MappedPeptideIndex. Nothing is copied: mods_
+  // points into the mapping, which must outlive the Peptide. Such Peptides
+  // must be FIFO allocated, so that the destructor never runs.
+  Peptide(const MappedPeptideIndex& index, int64_t i,
+          const vector<const pb::Protein*>& proteins)
+    : len_(index.Length(i)), mass_(index.Mass(i)), id_(index.Id(i)),
+    first_loc_protein_id_(index.ProteinId(i)),
+    first_loc_pos_(index.Pos(i)),
+    protein_length_(proteins[first_loc_protein_id_]->residues().length()),
+    has_aux_locations_index_(index.AuxLocationsIndex(i) >= 0),
+    aux_locations_index_(index.AuxLocationsIndex(i)),
+    mods_(NULL), num_mods_(0), decoyIdx_(index.DecoyIndex(i)),
+    prog1_(NULL), prog2_(NULL), peaks1_(NULL), num_peaks1_(0),
+    peaks2_(NULL), num_peaks2_(0) {
+    num_hits = 0;
+    residues_ = proteins[first_loc_protein_id_]->residues().data()
+                    + first_loc_pos_;
+    const ModCoder::Mod* mods;
+    num_mods_ = index.Mods(i, &mods);
+    if (num_mods_ > 0) {
+      mods_ = const_cast<ModCoder::Mod*>(mods);
+    }
+  }
   class spectrum_matches {
    public:
       spectrum_matches(Spectrum* spectrum, double score1, double score2,
@@ -137,11 +164,27 @@ class Peptide {
       }
   };
   vector<spectrum_matches> spectrum_matches_array;
-  void AddHit(Spectrum* spectrum, double score1, double score2,
-          int score3, int charge) {
+  int num_hits; // hits added, including those no longer kept
 
-    spectrum_matches_array.push_back(spectrum_matches(spectrum,
-                                     score1, score2, score3, charge));
+  // Adds a hit for peptide-centric search. If max_hits > 0, only the
+  // max_hits best hits according to better are kept, as a heap whose front
+  // is the worst of them.
+  void AddHit(Spectrum* spectrum, double score1, double score2,
+          int score3, int charge, int max_hits = 0,
+          bool (*better)(const spectrum_matches&, const spectrum_matches&) =
+            spectrum_matches::compSC) {
+    ++num_hits;
+    spectrum_matches hit(spectrum, score1, score2, score3, charge);
+    if (max_hits <= 0) {
+      spectrum_matches_array.push_back(hit);
+    } else if ((int)spectrum_matches_array.size() < max_hits) {
+      spectrum_matches_array.push_back(hit);
+      push_heap(spectrum_matches_array.begin(), spectrum_matches_array.end(), better);
+    } else if (better(hit, spectrum_matches_array.front())) {
+      pop_heap(spectrum_matches_array.begin(), spectrum_matches_array.end(), better);
+      spectrum_matches_array.back() = hit;
+      push_heap(spectrum_matches_array.begin(), spectrum_matches_array.end(), better);
+    }
   }
 
   // CAUTION: We do NOT expect this destructor to get called when FIFO 
@@ -179,12 +222,47 @@ class Peptide {
                                TheoreticalPeakCompiler* compiler_prog2);
   void ComputeBTheoreticalPeaks(TheoreticalPeakSetBIons* workspace) const;
 
+  // Alternatives to ComputeTheoreticalPeaks() for indexes made with
+  // tide-index --precompute-peaks: the programs are compiled from the peaks
+  // stored with the peptide, either in pb_peptide or in row i of index.
+  // Stored peaks were computed without an m/z limit, so they are only the
+  // same as the computed ones if StoredPeaksExact().
+  bool StoredPeaksExact() const;
+  void CompileStoredPeaks(const pb::Peptide& pb_peptide,
+                          TheoreticalPeakCompiler* compiler_prog1,
+                          TheoreticalPeakCompiler* compiler_prog2);
+  void CompileStoredPeaks(const MappedPeptideIndex& index, int64_t i,
+                          TheoreticalPeakCompiler* compiler_prog1,
+                          TheoreticalPeakCompiler* compiler_prog2);
+
+  // Counterparts of the above for ScoreKernel (see score_kernel.h): rather
+  // than compiling programs, keep the peak codes, in fifo_alloc memory or,
+  // for a MappedPeptideIndex, in place.
+  void ComputeTheoreticalPeaks(ST_TheoreticalPeakSet* workspace,
+                               FifoAllocator* fifo_alloc);
+  void KeepStoredPeaks(const pb::Peptide& pb_peptide, FifoAllocator* fifo_alloc);
+  void KeepStoredPeaks(const MappedPeptideIndex& index, int64_t i);
+
   // Return the appropriate program depending on the precursor charge.
   // TODO 257: fix the unfortunate use of max_charge.
   const void* Prog(int max_charge) const {
     return max_charge <= 2 ? prog1_ : prog2_;
   }
 
+  // The peak codes kept for ScoreKernel. Charge 1 and 2 spectra are scored
+  // against Peaks1(), higher charges against both Peaks1() and Peaks2().
+  int Peaks1(const int** peaks) const {
+    *peaks = peaks1_;
+    return num_peaks1_;
+  }
+  int Peaks2(const int** peaks) const {
+    *peaks = peaks2_;
+    return num_peaks2_;
+  }
+
+  // True once either programs or peak codes are ready for scoring.
+  bool Scorable() const { return prog1_ != NULL || peaks1_ != NULL; }
+
   void ReleaseFifo(FifoAllocator* fifo_alloc_prog1,
        FifoAllocator* fifo_alloc_prog2) {
     // TODO 258: this code should probably move to ActivePeptideQueue
@@ -244,6 +322,11 @@ class Peptide {
 
   void* prog1_;
   void* prog2_;
+
+  const int* peaks1_;
+  int num_peaks1_;
+  const int* peaks2_;
+  int num_peaks2_;
 };
 
 #endif // PEPTIDE_H
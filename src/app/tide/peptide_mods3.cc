@@ -14,6 +14,8 @@
 #include <algorithm>
 #include <numeric>
 #include <gflags/gflags.h>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include "abspath.h"
 #include "records.h"
 #include "records_to_vector-inl.h"
@@ -40,6 +42,8 @@ DEFINE_int32(min_mods, 0,
 DEFINE_int32(modsoutputter_file_threshold, 1000,
   "Maximum number of temporary files that would be opened by ModsOutputter "
   "before switching to ModsOutputterAlt.");
+DEFINE_int32(mods_memory_mb, 1024,
+  "Memory, in MBytes, that ModsOutputterAlt may use to sort modified peptides.");
 
 static string GetTempName(const string& tempDir, int filenum) {
   char buf[64];
@@ -56,6 +60,50 @@ static string GetTempName(const string& tempDir, int filenum) {
 #endif
 }
 
+// Reads a temporary file of peptides sorted by mass and id during a heap
+// merge. Peptides of equal mass and id come out in the order of run, so the
+// merge of stably sorted runs preserves the order of generation.
+class PepReader {
+ public:
+  PepReader(const string& filename, int run = 0)
+    : reader_(filename, FLAGS_buf_size << 10), run_(run) {
+    CHECK(reader_.OK());
+  }
+
+  bool operator<(const PepReader& other) {
+    double mass = current_.mass();
+    double other_mass = other.current_.mass();
+    if (mass < other_mass)
+      return true;
+    if (mass > other_mass)
+      return false;
+    if (current_.id() != other.current_.id())
+      return current_.id() < other.current_.id();
+    return run_ < other.run_;
+  }
+
+  bool Advance() {
+    if (reader_.Done())
+      return false;
+    reader_.Read(&current_);
+    CHECK(reader_.OK());
+    return true;
+  }
+
+  pb::Peptide* Current() { return &current_; }
+
+ private:
+  RecordReader reader_;
+  int run_;
+  pb::Peptide current_;
+};
+
+struct greater_pepreader : public binary_function<PepReader*, PepReader*, bool> {
+  bool operator()(PepReader* x, PepReader* y) {
+    return x != y && *y < *x;
+  }
+};
+
 class IModsOutputter {
  public:
   virtual void Output(pb::Peptide* peptide) = 0;
@@ -149,44 +197,6 @@ class ModsOutputter : public IModsOutputter {
   int numFiles_;
   int64_t modPeptideCnt_;
 
-  class PepReader {
-   public:
-    PepReader(const string& filename)
-      : reader_(filename, FLAGS_buf_size << 10) {
-      CHECK(reader_.OK());
-    }
-
-    bool operator<(const PepReader& other) {
-      double mass = current_.mass();
-      double other_mass = other.current_.mass();
-      if (mass < other_mass)
-        return true;
-      if (mass > other_mass)
-        return false;
-      return current_.id() < other.current_.id();
-    }
-
-    bool Advance() {
-      if (reader_.Done())
-        return false;
-      reader_.Read(&current_);
-      CHECK(reader_.OK());
-      return true;
-    }
-
-    pb::Peptide* Current() { return &current_; }
-
-   private:
-    RecordReader reader_;
-    pb::Peptide current_;
-  };
-
-  struct greater_pepreader : public binary_function<PepReader*, PepReader*, bool> {
-    bool operator()(PepReader* x, PepReader* y) {
-      return x != y && *y < *x;
-    }
-  };
-
   //terminal modifications count as a modification and hence
   //it is taken into account the modification limit.
   void OutputMods(int pos, vector<int>& counts) {
@@ -430,11 +440,15 @@ class ModsOutputter : public IModsOutputter {
   const char* residues_;
 };
 
-// Alternative class to generate modified peptides. Writes to temporary files
-// before merging them. Bins modified peptides by mass, then writes them to the
-// temporary file associated with that bin; the number of temporary files
-// required is therefore bounded by the variance in peptide masses, rather than
-// the number of possible modifications.
+// Alternative class to generate modified peptides, by external merge sort.
+// Modified peptides are collected in memory until half of the memory budget
+// (FLAGS_mods_memory_mb) is used; the batch is then sorted by mass and
+// written to a temporary "run" file on a background thread while the next
+// batch is collected. Finally the runs are merged, at most
+// FLAGS_modsoutputter_file_threshold at a time. Memory use is thus bounded
+// by the budget, and the number of temporary files by the number of
+// peptides divided by the batch size, rather than by the number of possible
+// modifications.
 class ModsOutputterAlt : public IModsOutputter {
  public:
   ModsOutputterAlt(string tmpDir,
@@ -442,7 +456,9 @@ class ModsOutputterAlt : public IModsOutputter {
                    VariableModTable* vmt,
                    HeadedRecordWriter* final_writer)
     : tempDir_(tmpDir), proteins_(proteins), modTable_(vmt),
-      maxMods_(0), writer_(final_writer), totalWritten_(0) {
+      maxMods_(0), writer_(final_writer), totalWritten_(0),
+      runBytes_(0), runLimit_((size_t)max(FLAGS_mods_memory_mb, 2) << 19),
+      sortThread_(NULL), tempCount_(0) {
     modMaxCounts_.clear();
     const vector<int>* maxCounts = vmt->MaxCounts();
     for (char c = 'A'; c <= 'Z'; c++) {
@@ -471,13 +487,6 @@ class ModsOutputterAlt : public IModsOutputter {
   }
 
   ~ModsOutputterAlt() {
-    // delete all temp file writers, since destructor writes end-of-records marker
-    for (map< int, pair<string, RecordWriter*> >::iterator i = tempFiles_.begin();
-         i != tempFiles_.end();
-         i++) {
-      delete i->second.second;
-      i->second.second = NULL;
-    }
     Merge();
     DeleteTempFiles();
   }
@@ -671,19 +680,24 @@ class ModsOutputterAlt : public IModsOutputter {
     return mass;
   }
 
+  // The order of PepReader, which merges the runs.
   struct PbPeptideSort {
     PbPeptideSort() {}
     inline bool operator() (const pb::Peptide& x, const pb::Peptide& y) {
-      return x.mass() < y.mass();
+      if (x.mass() != y.mass())
+        return x.mass() < y.mass();
+      return x.id() < y.id();
     }
   };
 
   void WritePeptide(const pb::Peptide* peptide) {
-    const int factor = 50; // 50 mass range per file
-    RecordWriter* writer = GetTempWriter(int(peptide->mass()) / factor);
-    if (!writer->Write(peptide)) {
-      DeleteTempFiles();
-      carp(CARP_FATAL, "I/O error writing modified peptide");
+    run_.push_back(*peptide);
+    // The heap memory of a message is taken to be twice its serialized size,
+    // to allow for allocation overhead and the spare capacity of repeated
+    // fields; SpaceUsed() would be exact, but goes through reflection.
+    runBytes_ += 2 * peptide->ByteSize();
+    if (run_.capacity() * sizeof(pb::Peptide) + runBytes_ >= runLimit_) {
+      StartRun();
     }
     ++totalWritten_;
     if (get_verbosity_level() >= CARP_DETAILED_DEBUG) {
@@ -692,60 +706,121 @@ class ModsOutputterAlt : public IModsOutputter {
     }
   }
 
-  RecordWriter* GetTempWriter(int writerId) {
-    map< int, pair<string, RecordWriter*> >::const_iterator i = tempFiles_.find(writerId);
-    if (i != tempFiles_.end()) {
-      return i->second.second;
+  // Hands the peptides collected so far to a background thread, which sorts
+  // them and writes them to a new run file.
+  void StartRun() {
+    if (run_.empty()) {
+      return;
     }
+    WaitForRun();
+    sorting_.swap(run_);
+    run_.clear();
+    // The next run will hold about as many peptides as this one, so it need
+    // not grow (and overshoot the budget) on the way.
+    run_.reserve(sorting_.size());
+    runBytes_ = 0;
+    string file = GetTempName(tempDir_, tempCount_++);
+    runFiles_.push_back(file);
+    sortThread_ = new boost::thread(boost::bind(&ModsOutputterAlt::WriteRun, &sorting_, file));
+  }
 
-    string file = GetTempName(tempDir_, tempFiles_.size());
-    RecordWriter* writer = new RecordWriter(file, FLAGS_buf_size << 10);
-    if (!writer->OK()) {
-      DeleteTempFiles();
-      CHECK(writer->OK());
+  void WaitForRun() {
+    if (sortThread_) {
+      sortThread_->join();
+      delete sortThread_;
+      sortThread_ = NULL;
     }
-    tempFiles_[writerId] = make_pair(file, writer);
-    return writer;
   }
 
-  // Combine all temp files into the final file
-  void Merge() {
-    while (!tempFiles_.empty()) {
-      map< int, pair<string, RecordWriter*> >::iterator i = tempFiles_.begin();
-      carp(CARP_DEBUG, "Reading temp file %s (id: %d)", i->second.first.c_str(), i->first);
-      RecordReader reader(i->second.first, FLAGS_buf_size << 10);
-      CHECK(reader.OK());
-      vector<pb::Peptide> peptides;
-      while (!reader.Done()) {
-        peptides.push_back(pb::Peptide());
-        reader.Read(&peptides[peptides.size() - 1]);
-        CHECK(reader.OK());
+  static void WriteRun(vector<pb::Peptide>* peptides, string file) {
+    stable_sort(peptides->begin(), peptides->end(), PbPeptideSort());
+    bool ok;
+    {
+      RecordWriter writer(file, FLAGS_buf_size << 10);
+      ok = writer.OK();
+      for (vector<pb::Peptide>::const_iterator i = peptides->begin();
+           ok && i != peptides->end();
+           ++i) {
+        ok = writer.Write(&*i);
       }
-      DeleteTempFile(i);
-      carp(CARP_DEBUG, "Read %d peptides from temp file, sorting...", peptides.size());
-      std::sort(peptides.begin(), peptides.end(), PbPeptideSort());
-      int64_t id = 0;
-      for (vector<pb::Peptide>::iterator j = peptides.begin(); j != peptides.end(); j++) {
-        j->set_id(id++);
-        writer_->Write(&*j);
-        CHECK(writer_->OK());
+    }
+    if (!ok) {
+      unlink(file.c_str());
+      carp(CARP_FATAL, "I/O error writing modified peptides to %s", file.c_str());
+    }
+    peptides->clear();
+  }
+
+  // Combine all runs into the final file
+  void Merge() {
+    StartRun();
+    WaitForRun();
+    size_t fan_in = max(FLAGS_modsoutputter_file_threshold, 2);
+    while (runFiles_.size() > fan_in) {
+      carp(CARP_DEBUG, "Merging %d runs of modified peptides", runFiles_.size());
+      vector<string> merged;
+      for (size_t i = 0; i < runFiles_.size(); i += fan_in) {
+        vector<string> group(runFiles_.begin() + i,
+                             runFiles_.begin() + min(i + fan_in, runFiles_.size()));
+        if (group.size() == 1) {
+          merged.push_back(group[0]);
+          continue;
+        }
+        string file = GetTempName(tempDir_, tempCount_++);
+        merged.push_back(file);
+        {
+          RecordWriter out(file, FLAGS_buf_size << 10);
+          CHECK(out.OK());
+          MergeRuns(group, &out, false);
+        }
+        for (vector<string>::const_iterator j = group.begin(); j != group.end(); ++j) {
+          unlink(j->c_str());
+        }
       }
+      runFiles_.swap(merged);
     }
+    MergeRuns(runFiles_, writer_, true);
   }
 
-  void DeleteTempFile(map< int, pair<string, RecordWriter*> >::iterator i) {
-    carp(CARP_DEBUG, "Deleting temp file %s", i->second.first.c_str());
-    unlink(i->second.first.c_str());
-    if (i->second.second) {
-      delete i->second.second;
+  // Heap merge of the sorted runs in files, giving the peptides consecutive
+  // ids if set_ids.
+  template<class Writer>
+  static void MergeRuns(const vector<string>& files, Writer* out, bool set_ids) {
+    vector<PepReader*> readers;
+    for (size_t i = 0; i < files.size(); ++i) {
+      PepReader* reader = new PepReader(files[i], i);
+      if (reader->Advance()) {
+        readers.push_back(reader);
+      } else {
+        delete reader;
+      }
+    }
+    make_heap(readers.begin(), readers.end(), greater_pepreader());
+    int64_t id = 0;
+    while (!readers.empty()) {
+      pop_heap(readers.begin(), readers.end(), greater_pepreader());
+      pb::Peptide* current = readers.back()->Current();
+      if (set_ids) {
+        current->set_id(id++);
+      }
+      if (!out->Write(current)) {
+        carp(CARP_FATAL, "I/O error writing modified peptides");
+      }
+      if (readers.back()->Advance()) {
+        push_heap(readers.begin(), readers.end(), greater_pepreader());
+      } else {
+        delete readers.back();
+        readers.pop_back();
+      }
     }
-    tempFiles_.erase(i);
   }
 
   void DeleteTempFiles() {
-    while (!tempFiles_.empty()) {
-      DeleteTempFile(tempFiles_.begin());
+    for (vector<string>::const_iterator i = runFiles_.begin(); i != runFiles_.end(); ++i) {
+      carp(CARP_DEBUG, "Deleting temp file %s", i->c_str());
+      unlink(i->c_str());
     }
+    runFiles_.clear();
   }
 
   string tempDir_;
@@ -754,9 +829,15 @@ class ModsOutputterAlt : public IModsOutputter {
   map<int, int> modMaxCounts_;
   int maxMods_;
   HeadedRecordWriter* writer_;
-
-  map< int, pair<string, RecordWriter*> > tempFiles_; // id -> file, writer (ids must be in ascending order of mass)
   int64_t totalWritten_;
+
+  vector<pb::Peptide> run_;     // peptides not yet handed to StartRun()
+  size_t runBytes_;             // approximate heap memory of the peptides in run_
+  size_t runLimit_;             // half of the memory budget
+  vector<pb::Peptide> sorting_; // run being sorted and written by sortThread_
+  boost::thread* sortThread_;
+  vector<string> runFiles_;     // sorted runs, in order of generation
+  int tempCount_;
 };
 
 void AddMods(HeadedRecordReader* reader,
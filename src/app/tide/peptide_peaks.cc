@@ -16,11 +16,19 @@
 // TODO 248: We're only doing this to guarantee the exact same results as Crux
 // used to return, but perhaps the diffs don't really add useful info, in which 
 // case we could eliminate them.
+//
+// The diffs above are no longer stored. Instead, if store_peaks is set, the
+// complete charge 1 and charge 2 peak sets that are compiled at search time
+// (see TheoreticalPeakSetBYSparse) go into peak1 and peak2, sorted and delta
+// coded, for the current MassConstants bin width and offset. The header
+// records the bin settings so that tide-search can tell whether the stored
+// peaks apply.
 
 #include <stdio.h>
 #include <iostream>
 #include <string>
 #include <vector>
+#include <algorithm>
 #include "records.h"
 #include "peptide.h"
 #include "theoretical_peak_set.h"
@@ -54,9 +62,25 @@ static void AddPeaksToPB(pb::Peptide* peptide, const TheoreticalPeakArr* peaks,
 }
 */
 
+static void AddSortedPeaksToPB(const TheoreticalPeakArr& peaks,
+                               vector<int>* codes,
+                               google::protobuf::RepeatedField<int>* dest) {
+  codes->clear();
+  for (TheoreticalPeakArr::const_iterator i = peaks.begin(); i != peaks.end(); ++i) {
+    codes->push_back(i->Code());
+  }
+  sort(codes->begin(), codes->end());
+  int last_code = 0;
+  for (vector<int>::const_iterator i = codes->begin(); i != codes->end(); ++i) {
+    dest->Add(*i - last_code);
+    last_code = *i;
+  }
+}
+
 void AddTheoreticalPeaks(const vector<const pb::Protein*>& proteins,
 			 const string& input_filename,
-			 const string& output_filename) {
+			 const string& output_filename,
+			 bool store_peaks) {
   pb::Header orig_header, new_header;
   HeadedRecordReader reader(input_filename, &orig_header);
   CHECK(orig_header.file_type() == pb::Header::PEPTIDES);
@@ -66,6 +90,12 @@ void AddTheoreticalPeaks(const vector<const pb::Protein*>& proteins,
   pb::Header_PeptidesHeader* subheader = new_header.mutable_peptides_header();
   subheader->CopyFrom(orig_header.peptides_header());
   subheader->set_has_peaks(true);
+  if (store_peaks) {
+    // Peaks must not be cut off at the m/z limit of some spectrum file.
+    CHECK(MaxBin::Global().MaxBinEnd() <= 0);
+    subheader->set_peaks_bin_width(MassConstants::bin_width_);
+    subheader->set_peaks_bin_offset(MassConstants::bin_offset_);
+  }
   pb::Header_Source* source = new_header.add_source();
   source->mutable_header()->CopyFrom(orig_header);
   source->set_filename(AbsPath(input_filename));
@@ -74,6 +104,8 @@ void AddTheoreticalPeaks(const vector<const pb::Protein*>& proteins,
   CHECK(writer.OK());
 
   pb::Peptide pb_peptide;
+  TheoreticalPeakSetBYSparse workspace(2000);
+  vector<int> codes;
 //  const int workspace_size = 2000; // More than sufficient for theor. peaks.
 //  TheoreticalPeakSetDiff workspace(workspace_size);
   while (!reader.Done()) {
@@ -91,7 +123,16 @@ void AddTheoreticalPeaks(const vector<const pb::Protein*>& proteins,
     AddPeaksToPB(&pb_peptide, &peaks_charge_2, 2, false);
     AddPeaksToPB(&pb_peptide, &negs_charge_1, 1, true);
     AddPeaksToPB(&pb_peptide, &negs_charge_2, 2, true);
-*/    CHECK(writer.Write(&pb_peptide));
+*/
+    if (store_peaks) {
+      Peptide peptide(pb_peptide, proteins);
+      workspace.Clear();
+      peptide.ComputeTheoreticalPeaks(&workspace);
+      const TheoreticalPeakArr* peaks = workspace.GetPeaks();
+      AddSortedPeaksToPB(peaks[0], &codes, pb_peptide.mutable_peak1());
+      AddSortedPeaksToPB(peaks[1], &codes, pb_peptide.mutable_peak2());
+    }
+    CHECK(writer.Write(&pb_peptide));
   }
   CHECK(reader.OK());
 }
@@ -0,0 +1,177 @@
+// Portable dot products of theoretical peaks with an observed spectrum's
+// cache; see score_kernel.h.
+
+#include "io/carp.h"
+#include "peptide.h"
+#include "score_kernel.h"
+
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64)
+#define SCORE_KERNEL_X86
+#endif
+#if defined(SCORE_KERNEL_X86) && (defined(__GNUC__) || defined(__clang__))
+#define SCORE_KERNEL_AVX2
+#include <immintrin.h>
+#endif
+
+#ifdef SCORE_KERNEL_X86
+ScoreKernel::Type ScoreKernel::type_ = ScoreKernel::COMPILED;
+#else
+ScoreKernel::Type ScoreKernel::type_ = ScoreKernel::SIMD;
+#endif
+bool ScoreKernel::avx2_ = false;
+
+typedef unsigned int (*DotFunc)(const int* cache, const int* peaks, int size);
+
+// Unsigned arithmetic, so that overflow wraps around as in the compiled
+// programs.
+static unsigned int DotScalar(const int* cache, const int* peaks, int size) {
+  unsigned int sum0 = 0, sum1 = 0;
+  int i = 0;
+  for (; i + 1 < size; i += 2) {
+    sum0 += (unsigned int) cache[peaks[i]];
+    sum1 += (unsigned int) cache[peaks[i + 1]];
+  }
+  if (i < size) {
+    sum0 += (unsigned int) cache[peaks[i]];
+  }
+  return sum0 + sum1;
+}
+
+#ifdef SCORE_KERNEL_AVX2
+__attribute__((target("avx2")))
+static unsigned int DotAvx2(const int* cache, const int* peaks, int size) {
+  __m256i sum = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 8 <= size; i += 8) {
+    __m256i index = _mm256_loadu_si256((const __m256i*) (peaks + i));
+    sum = _mm256_add_epi32(sum, _mm256_i32gather_epi32(cache, index, 4));
+  }
+  __m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum),
+                               _mm256_extracti128_si256(sum, 1));
+  half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+  half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+  unsigned int total = (unsigned int) _mm_cvtsi128_si32(half);
+  for (; i < size; ++i) {
+    total += (unsigned int) cache[peaks[i]];
+  }
+  return total;
+}
+#endif
+
+typedef void (*DotBlockFunc)(const int* caches, int block, const int* peaks,
+                             int size, unsigned int* sums);
+
+static void DotBlockScalar(const int* caches, int block, const int* peaks,
+                           int size, unsigned int* sums) {
+  for (int k = 0; k < block; ++k) {
+    sums[k] = 0;
+  }
+  for (int i = 0; i < size; ++i) {
+    const int* row = caches + (size_t) peaks[i] * block;
+    for (int k = 0; k < block; ++k) {
+      sums[k] += (unsigned int) row[k];
+    }
+  }
+}
+
+#ifdef SCORE_KERNEL_AVX2
+// For blocks of exactly eight spectra, each peak's values are one vector.
+__attribute__((target("avx2")))
+static void DotBlock8Avx2(const int* caches, int block, const int* peaks,
+                          int size, unsigned int* sums) {
+  __m256i sum = _mm256_setzero_si256();
+  for (int i = 0; i < size; ++i) {
+    __m256i row = _mm256_loadu_si256((const __m256i*) (caches + (size_t) peaks[i] * 8));
+    sum = _mm256_add_epi32(sum, row);
+  }
+  _mm256_storeu_si256((__m256i*) sums, sum);
+}
+#endif
+
+void ScoreKernel::Init(const string& name) {
+  avx2_ = false;
+  if (name == "compiled" || name == "auto") {
+#ifdef SCORE_KERNEL_X86
+    type_ = COMPILED;
+    return;
+#else
+    if (name == "compiled") {
+      carp(CARP_FATAL, "The compiled scoring kernel is only available on x86 "
+                       "processors.");
+    }
+#endif
+  }
+  if (name == "scalar") {
+    type_ = SCALAR;
+  } else if (name == "simd" || name == "auto") {
+    type_ = SIMD;
+#ifdef SCORE_KERNEL_AVX2
+    avx2_ = __builtin_cpu_supports("avx2");
+#endif
+  } else {
+    carp(CARP_FATAL, "Unknown scoring kernel '%s'.", name.c_str());
+  }
+}
+
+const char* ScoreKernel::Name() {
+  switch (type_) {
+    case COMPILED: return "compiled";
+    case SIMD:     return avx2_ ? "simd (AVX2)" : "simd (no AVX2; scalar)";
+    default:       return "scalar";
+  }
+}
+
+void ScoreKernel::Score(const int* cache,
+                        deque<Peptide*>::const_iterator peptide,
+                        int count, int charge, pair<int, int>* results) {
+  DotFunc dot = DotScalar;
+#ifdef SCORE_KERNEL_AVX2
+  if (avx2_) {
+    dot = DotAvx2;
+  }
+#endif
+  // Charge 1 and 2 spectra are scored against the first set of peaks
+  // only, as with Peptide::Prog().
+  bool both = charge > 2;
+  for (int counter = count; counter > 0; --counter, ++peptide, ++results) {
+    const int* peaks;
+    int size = (*peptide)->Peaks1(&peaks);
+    unsigned int score = dot(cache, peaks, size);
+    if (both) {
+      size = (*peptide)->Peaks2(&peaks);
+      score += dot(cache, peaks, size);
+    }
+    results->first = (int) score;
+    results->second = counter;
+  }
+}
+
+void ScoreKernel::ScoreBlock(const int* caches, int block, const int* charges,
+                             deque<Peptide*>::const_iterator peptide, int count,
+                             pair<int, int>** results) {
+  DotBlockFunc dot = DotBlockScalar;
+#ifdef SCORE_KERNEL_AVX2
+  if (avx2_ && block == 8) {
+    dot = DotBlock8Avx2;
+  }
+#endif
+  bool any_both = false;
+  for (int k = 0; k < block; ++k) {
+    any_both = any_both || charges[k] > 2;
+  }
+  unsigned int sums1[kMaxBlock], sums2[kMaxBlock];
+  for (int counter = count, j = 0; counter > 0; --counter, ++peptide, ++j) {
+    const int* peaks;
+    int size = (*peptide)->Peaks1(&peaks);
+    dot(caches, block, peaks, size, sums1);
+    if (any_both) {
+      size = (*peptide)->Peaks2(&peaks);
+      dot(caches, block, peaks, size, sums2);
+    }
+    for (int k = 0; k < block; ++k) {
+      unsigned int score = sums1[k] + (charges[k] > 2 ? sums2[k] : 0);
+      results[k][j].first = (int) score;
+      results[k][j].second = counter;
+    }
+  }
+}
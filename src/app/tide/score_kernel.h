@@ -0,0 +1,67 @@
+// ScoreKernel takes the dot products of candidate peptides' theoretical
+// peaks with the cache of an observed spectrum (see ObservedPeakSet), which
+// is otherwise the job of the x86 programs generated by
+// TheoreticalPeakCompiler (see compiler.h). It works from plain arrays of
+// peak codes kept by each Peptide, so it runs on any processor and needs no
+// executable memory. Where the processor has AVX2, a peptide's peaks are
+// looked up eight at a time with gather instructions; otherwise a scalar
+// loop is used. Sums wrap around just like the 32-bit additions of the
+// generated programs, so scores are identical whichever kernel is used.
+//
+// The kernel is chosen once per process by Init(), before any
+// ActivePeptideQueue is constructed:
+//   compiled  generated x86 programs (only on x86)
+//   simd      ScoreKernel, using AVX2 if the processor has it
+//   scalar    ScoreKernel, without SIMD
+//   auto      compiled on x86, simd elsewhere
+
+#ifndef SCORE_KERNEL_H
+#define SCORE_KERNEL_H
+
+#include <deque>
+#include <string>
+#include <utility>
+
+using namespace std;
+
+class Peptide;
+
+class ScoreKernel {
+ public:
+  // Selects the kernel by name (see above); carps fatally on an unknown or
+  // unavailable one.
+  static void Init(const string& name);
+
+  // True if Peptides are to be compiled into programs rather than keep
+  // their peak codes for Score().
+  static bool Compiled() { return type_ == COMPILED; }
+
+  static const char* Name();
+
+  // Writes to results[0, count) a (score, counter) pair for each of the
+  // count peptides starting at peptide, as the compiled programs do:
+  // counter runs from count down to 1.
+  static void Score(const int* cache,
+                    deque<Peptide*>::const_iterator peptide,
+                    int count, int charge, pair<int, int>* results);
+
+  // Largest number of spectra ScoreBlock() scores at once.
+  static const int kMaxBlock = 16;
+
+  // As Score(), for block spectra at once. caches holds their caches
+  // interleaved, so that entry i of spectrum k is caches[i * block + k];
+  // each peptide's peaks are then read once for all of the spectra, and the
+  // values for one peak are adjacent. Spectrum k has charge charges[k] and
+  // gets its results in results[k].
+  static void ScoreBlock(const int* caches, int block, const int* charges,
+                         deque<Peptide*>::const_iterator peptide, int count,
+                         pair<int, int>** results);
+
+ private:
+  enum Type { COMPILED, SIMD, SCALAR };
+
+  static Type type_;
+  static bool avx2_; // SIMD kernel uses AVX2
+};
+
+#endif // SCORE_KERNEL_H
@@ -7,6 +7,7 @@
 #include <iostream>
 #include <algorithm>
 #include <functional>
+#include <boost/thread/mutex.hpp>
 #include "spectrum.pb.h"
 #include "spectrum_collection.h"
 #include "mass_constants.h"
@@ -51,17 +52,17 @@ int Spectrum::MaxCharge() const {
   return i != charge_states_.end() ? *i : 1;
 }
 
-// Report maximum intensity peak in the given m/z range.
+// Report maximum intensity peak in the given m/z range. Peaks are in
+// increasing order of m/z, so only those within the range are visited.
 double Spectrum::MaxPeakInRange( double min_range, double max_range ) const {
   double return_value = 0.0;
 
-  for (int i = 0; i < this->Size(); ++i) {
-    double mz = peak_m_z_[i];
-    if ( (min_range <= mz) && (mz <= max_range) ) {
-      double intensity = peak_intensity_[i];
-      if (intensity > return_value) {
-        return_value = intensity;
-      }
+  int i = lower_bound(peak_m_z_.begin(), peak_m_z_.end(), min_range)
+    - peak_m_z_.begin();
+  for (; i < this->Size() && peak_m_z_[i] <= max_range; ++i) {
+    double intensity = peak_intensity_[i];
+    if (intensity > return_value) {
+      return_value = intensity;
     }
   }
   return(return_value);
@@ -124,7 +125,7 @@ void Spectrum::SortIfNecessary() {
 
   // TODO: eliminate copy operations
   int size = Size();
-  vector< pair<double, double> > pairs;
+  vector< pair<double, double> > pairs(size);
   for (int i = 0; i < size; ++i)
     pairs[i] = make_pair(peak_m_z_[i], peak_intensity_[i]);
   sort(pairs.begin(), pairs.begin() + size);
@@ -164,6 +165,30 @@ bool Spectrum::Deisotope(int index, double deisotope_threshold) const {
   return false;
 }
 
+// Guards Spectrum::isotope_peaks_ of all spectra. They are computed outside
+// the lock; it is held only to look them up and publish them.
+static boost::mutex isotope_peaks_mutex;
+
+const vector<bool>& Spectrum::IsotopePeaks(double deisotope_threshold) const {
+  {
+    boost::mutex::scoped_lock lock(isotope_peaks_mutex);
+    if (isotope_peaks_) {
+      return *isotope_peaks_;
+    }
+  }
+  // Same cutoff as ObservedPeakSet::PreprocessSpectrum(), for the largest charge.
+  double mass_cut_off = (precursor_m_z_ - MASS_PROTON) * MaxCharge() + MASS_PROTON + 50;
+  boost::shared_ptr<vector<bool> > isotopes(new vector<bool>(Size(), false));
+  for (int i = 0; i < Size() && M_Z(i) < mass_cut_off; ++i) {
+    (*isotopes)[i] = Deisotope(i, deisotope_threshold);
+  }
+  boost::mutex::scoped_lock lock(isotope_peaks_mutex);
+  if (!isotope_peaks_) { // unless another thread got there first
+    isotope_peaks_ = isotopes;
+  }
+  return *isotope_peaks_;
+}
+
 /* Calculates vector of cleavage evidence for an observed spectrum, using XCorr
  * b/y/neutral peak sets and heights.
  *
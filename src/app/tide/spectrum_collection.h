@@ -22,6 +22,7 @@
 
 #include <iostream>
 #include <vector>
+#include <boost/shared_ptr.hpp>
 #include "header.pb.h"
 #include "spectrum.pb.h"
 
@@ -67,6 +68,14 @@ class Spectrum {
 
   bool Deisotope(int index, double deisotope_threshold) const;
 
+  // Which peaks Deisotope() removes, for XCorr preprocessing (see
+  // ObservedPeakSet::PreprocessSpectrum()). Only peaks below the mass cutoff
+  // of the largest charge state are tested; the others are beyond the range
+  // of every charge state. This is computed on first use and then shared by
+  // all of the spectrum's charge states, so deisotope_threshold must not
+  // change between calls. Safe to call from several threads at once.
+  const vector<bool>& IsotopePeaks(double deisotope_threshold) const;
+
   std::vector<double> CreateEvidenceVector(
     double binWidth,
     double binOffset,
@@ -89,6 +98,7 @@ class Spectrum {
     long int* num_retained = NULL) const;
 
   int MaxCharge() const;
+  // Requires peaks in increasing order of m/z, as they are read.
   double MaxPeakInRange( double min_range, double max_range ) const;
   
  private:
@@ -99,6 +109,8 @@ class Spectrum {
 
   vector<double> peak_m_z_;
   vector<double> peak_intensity_;
+
+  mutable boost::shared_ptr<vector<bool> > isotope_peaks_;
 };
 
 class SpectrumCollection {
@@ -127,6 +127,7 @@ class ObservedPeakSet {
     bin_offset_ = bin_offset;
     NL_ = NL; //NL means neutral loss
     FP_ = FP; //FP means flanking peaks
+    ReadParams();
   }
 
   ~ObservedPeakSet() { delete[] peaks_; delete[] cache_; }
@@ -219,6 +220,8 @@ class ObservedPeakSet {
     // In context of this class, peak_type feels like the primary selector.
     return cache_[TheoreticalPeakPair(index, peak_type).Code()];
   }
+  // Reads the preprocessing parameters once, rather than for every spectrum.
+  void ReadParams();
   void MakeInteger();
   void ComputeCache();
   void PreprocessSpectrum(const Spectrum& spectrum, double* intensArrayObs,
@@ -232,6 +235,11 @@ class ObservedPeakSet {
   double bin_width_;
   double bin_offset_;
 
+  bool skip_preprocessing_;
+  bool remove_precursor_;
+  double precursor_tolerance_;
+  double deisotope_threshold_;
+
   MaxBin max_mz_;
   int cache_end_;
 
@@ -79,7 +79,7 @@ void ObservedPeakSet::PreprocessSpectrum(const Spectrum& spectrum, int charge,
 
   memset(peaks_, 0, sizeof(double) * MaxBin::Global().BackgroundBinEnd());
 
-  if (Params::GetBool("skip-preprocessing")) {
+  if (skip_preprocessing_) {
     for (int i = 0; i < spectrum.Size(); ++i) {
       double peak_location = spectrum.M_Z(i);
       if (peak_location >= experimental_mass_cut_off) {
@@ -93,10 +93,13 @@ void ObservedPeakSet::PreprocessSpectrum(const Spectrum& spectrum, int charge,
       }
     }
   } else {
-    bool remove_precursor = Params::GetBool("remove-precursor-peak");
-    double precursor_tolerance = Params::GetDouble("remove-precursor-tolerance");
-    double deisotope_threshold = Params::GetDouble("deisotope");
+    bool remove_precursor = remove_precursor_;
+    double precursor_tolerance = precursor_tolerance_;
+    double deisotope_threshold = deisotope_threshold_;
     int max_charge = spectrum.MaxCharge();
+    // Shared by all charge states, and only needed when deisotoping.
+    const vector<bool>* isotopes = deisotope_threshold != 0.0 ?
+      &spectrum.IsotopePeaks(deisotope_threshold) : NULL;
 
     // Fill peaks
     int largest_mz = 0;
@@ -117,7 +120,7 @@ void ObservedPeakSet::PreprocessSpectrum(const Spectrum& spectrum, int charge,
         continue;
       }
 
-      if (deisotope_threshold != 0.0 && spectrum.Deisotope(i, deisotope_threshold)) {
+      if (isotopes != NULL && (*isotopes)[i]) {
         (*num_isotopes_skipped)++;
         continue;
       }
@@ -199,6 +202,13 @@ inline int round_to_int(double x) {
   return int(x - 0.5);
 }
 
+void ObservedPeakSet::ReadParams() {
+  skip_preprocessing_ = Params::GetBool("skip-preprocessing");
+  remove_precursor_ = Params::GetBool("remove-precursor-peak");
+  precursor_tolerance_ = Params::GetDouble("remove-precursor-tolerance");
+  deisotope_threshold_ = Params::GetDouble("deisotope");
+}
+
 void ObservedPeakSet::MakeInteger() {
   // essentially cheap fixed-point arithmetic for peak intensities
   for(int i = 0; i < max_mz_.BackgroundBinEnd(); i++)
@@ -395,10 +405,10 @@ void ObservedPeakSet::CreateResidueEvidenceMatrix(
   const double maxIntensPerRegion = 50.0;
 
   // Determining max ion mass and max ion intensity
-  bool skipPreprocess = Params::GetBool("skip-preprocessing");
-  bool remove_precursor = !skipPreprocess && Params::GetBool("remove-precursor-peak");
-  double precursorMZExclude = Params::GetDouble("remove-precursor-tolerance");
-  double deisotope_threshold = Params::GetDouble("deisotope");
+  bool skipPreprocess = skip_preprocessing_;
+  bool remove_precursor = !skipPreprocess && remove_precursor_;
+  double precursorMZExclude = precursor_tolerance_;
+  double deisotope_threshold = deisotope_threshold_;
   double maxIonIntens = 0.0;
   double maxIonMass = 0.0;
   set<int> peakSkip;
@@ -33,6 +33,29 @@ bool MSToolkitSpectrumCollection::parse() {
     return false;
   }
 
+  parseSpectra(NULL);
+  is_parsed_ = true;
+
+  return true;
+}
+
+/**
+ * Parses the spectra one at a time, passing each to handler as it is read.
+ * \returns True if the spectra are parsed successfully. False if otherwise.
+ */
+bool MSToolkitSpectrumCollection::parseEach(
+  Crux::SpectrumHandler* handler ///< receives each spectrum -in
+  ) {
+  return parseSpectra(handler);
+}
+
+/**
+ * Parses the spectra in the requested scan range, handing each to handler
+ * or, if handler is NULL, adding it to the collection.
+ */
+bool MSToolkitSpectrumCollection::parseSpectra(
+  Crux::SpectrumHandler* handler ///< receives each spectrum, or NULL -in
+  ) {
   // get a list of scans to include if requested
   string range_string = Params::GetString("scan-number");
   int first_scan;
@@ -59,6 +82,7 @@ bool MSToolkitSpectrumCollection::parse() {
     carp(CARP_FATAL, "MSToolkit: Error reading spectra file: %s", filename_.c_str());
   }
 
+  bool stopped = false;
   while(mst_spectrum->getScanNumber() != 0) {
     // is this a scan to include? if not skip it
     if( mst_spectrum->getScanNumber() < first_scan ) {
@@ -70,11 +94,16 @@ bool MSToolkitSpectrumCollection::parse() {
       break;
     }
     Crux::Spectrum* parsed_spectrum = new Crux::Spectrum();
-    if (parsed_spectrum->parseMstoolkitSpectrum(mst_spectrum, filename_.c_str())) {
-      addSpectrumToEnd(parsed_spectrum);
-      spectraByScan_[first_scan] = parsed_spectrum;
-    } else {
+    if (!parsed_spectrum->parseMstoolkitSpectrum(mst_spectrum, filename_.c_str())) {
+      delete parsed_spectrum;
+    } else if (handler) {
+      stopped = !handler->handle(parsed_spectrum);
       delete parsed_spectrum;
+      if (stopped) {
+        break;
+      }
+    } else {
+      addSpectrumToEnd(parsed_spectrum);
     }
 
     mst_reader->readFile(NULL, *mst_spectrum);
@@ -82,19 +111,27 @@ bool MSToolkitSpectrumCollection::parse() {
   delete mst_spectrum;
   delete mst_reader;
   
-  return true;
+  return !stopped;
 }
 
 /**
  * Parses a single spectrum from a spectrum_collection with first scan
  * number equal to first_scan.  Removes any existing information in
- * the given spectrum. 
+ * the given spectrum. Once the file has been parsed, the spectrum is
+ * copied from the collection; before that, only its scan is read.
  * \returns True if the spectrum was allocated, false on error.
  */
 bool MSToolkitSpectrumCollection::getSpectrum(
   int first_scan,      ///< The first scan of the spectrum to retrieve -in
   Crux::Spectrum* spectrum   ///< Put the spectrum info here
   ) {
+  if (is_parsed_) {
+    if (!SpectrumCollection::getSpectrum(first_scan, spectrum)) {
+      carp(CARP_ERROR, "Spectrum %d does not exist in file", first_scan);
+      return false;
+    }
+    return true;
+  }
   carp(CARP_DEBUG, "Using mstoolkit to parse spectrum");
   MSToolkit::MSReader* mst_reader = new MSToolkit::MSReader();
   MSToolkit::Spectrum* mst_spectrum = new MSToolkit::Spectrum();
@@ -117,29 +154,17 @@ bool MSToolkitSpectrumCollection::getSpectrum(
 
 /**
  * Parses a single spectrum from a spectrum_collection with first scan
- * number equal to first_scan.
+ * number equal to first_scan; see above. The caller owns the spectrum.
  * \returns The spectrum data from file or NULL.
  */
 Crux::Spectrum* MSToolkitSpectrumCollection::getSpectrum(
   int first_scan      ///< The first scan of the spectrum to retrieve -in
   ) {
-  carp(CARP_DEBUG, "Using mstoolkit to parse spectrum");
-  MSToolkit::MSReader* mst_reader = new MSToolkit::MSReader();
-  MSToolkit::Spectrum* mst_spectrum = new MSToolkit::Spectrum();
-  Crux::Spectrum* return_spec = NULL;  
-
-  mst_reader->readFile(filename_.c_str(), *mst_spectrum, first_scan);
-
-  if(mst_spectrum->getScanNumber() != 0) {
-    return_spec = new Crux::Spectrum();
-    return_spec->parseMstoolkitSpectrum(mst_spectrum,
-                                        filename_.c_str()); 
-  } else {
-    carp(CARP_ERROR, "Spectrum %d does not exist in file", first_scan);
+  Crux::Spectrum* return_spec = new Crux::Spectrum();
+  if (!getSpectrum(first_scan, return_spec)) {
+    delete return_spec;
     return_spec = NULL;
   }
-  delete mst_spectrum;
-  delete mst_reader;
   return return_spec;
 }
 
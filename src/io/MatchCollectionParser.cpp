@@ -11,6 +11,7 @@
 #include "PepXMLReader.h"
 #include "SQTReader.h"
 #include "MzIdentMLReader.h"
+#include "PSMBatch.h"
 #include "model/Protein.h"
 #include "model/PostProcessProtein.h"
 #include "util/FileUtils.h"
@@ -176,7 +177,10 @@ MatchCollection* MatchCollectionParser::create(
   if (!fasta_path.empty()) {
     carp(CARP_DEBUG, "fasta path:%s", fasta_path.c_str());
   }
-  if (!FileUtils::Exists(match_path)) {
+  // Results handed over in memory by a search in the same process are read
+  // in place of the file, which may not have been written.
+  PSMBatch* batch = PSMBatch::take(match_path);
+  if (batch == NULL && !FileUtils::Exists(match_path)) {
     carp(CARP_FATAL, "The file %s does not exist. \n", match_path.c_str());
   }
   
@@ -185,7 +189,10 @@ MatchCollection* MatchCollectionParser::create(
   }
   MatchCollection* collection = NULL;
   
-  if (FileUtils::IsDir(match_path)) {
+  if (batch != NULL) {
+    collection = MatchFileReader::parse(batch, database_, decoy_database_);
+    delete batch;
+  } else if (FileUtils::IsDir(match_path)) {
     carp(CARP_FATAL, "Internal error");
   } else if (StringUtils::IEndsWith(match_path, ".xml")) {
     collection = PepXMLReader::parse(match_path, database_, decoy_database_);
@@ -6,6 +6,9 @@
 #include "MatchColumns.h"
 #include "MatchFileReader.h"
 #include "DelimitedFile.h"
+#include "PSMBatch.h"
+#include "PSMBatchFile.h"
+#include "PSMBatchReader.h"
 
 #include "model/MatchCollection.h"
 #include "model/Modification.h"
@@ -15,14 +18,16 @@ using namespace std;
 /**
  * \returns a blank MatchFileReader object
  */
-MatchFileReader::MatchFileReader() : DelimitedFileReader(), PSMReader() {
+MatchFileReader::MatchFileReader()
+  : DelimitedFileReader(), PSMReader(), batch_(NULL), batch_row_(0) {
 }
 
 /**
  * \returns a MatchFileReader object and loads the tab-delimited
  * data specified by file_name.
  */
-MatchFileReader::MatchFileReader(const char* file_name) : DelimitedFileReader(file_name, true) {
+MatchFileReader::MatchFileReader(const char* file_name)
+  : DelimitedFileReader(file_name, true), batch_(NULL), batch_row_(0) {
   parseHeader();
 }
 
@@ -31,25 +36,51 @@ MatchFileReader::MatchFileReader(const char* file_name) : DelimitedFileReader(fi
  * data specified by file_name.
  */
 MatchFileReader::MatchFileReader(const string& file_name)
-  : DelimitedFileReader(file_name, true), PSMReader(file_name) {
+  : DelimitedFileReader(file_name, true), PSMReader(file_name),
+    batch_(NULL), batch_row_(0) {
   parseHeader();
 }
 
 MatchFileReader::MatchFileReader(const string& file_name, Database* database, Database* decoy_database)
-  : DelimitedFileReader(file_name, true), PSMReader(file_name, database, decoy_database) {
+  : DelimitedFileReader(file_name, true), PSMReader(file_name, database, decoy_database),
+    batch_(NULL), batch_row_(0) {
   parseHeader();
 }
 
-MatchFileReader::MatchFileReader(istream* iptr) : DelimitedFileReader(iptr, true, '\t') {
+MatchFileReader::MatchFileReader(istream* iptr)
+  : DelimitedFileReader(iptr, true, '\t'), batch_(NULL), batch_row_(0) {
   parseHeader();
 }
 
+MatchFileReader::MatchFileReader(PSMBatch* batch, Database* database, Database* decoy_database)
+  : DelimitedFileReader(), PSMReader("", database, decoy_database),
+    batch_(batch), batch_row_(0) {
+  for (int idx = 0; idx < NUMBER_MATCH_COLUMNS; idx++) {
+    match_indices_[idx] = batch->hasColumn((MATCH_COLUMNS_T)idx) ? idx : -1;
+  }
+}
+
 /**
  * Destructor
  */
 MatchFileReader::~MatchFileReader() {
 }
 
+bool MatchFileReader::hasNext() {
+  if (batch_) {
+    return batch_row_ < batch_->size();
+  }
+  return DelimitedFileReader::hasNext();
+}
+
+void MatchFileReader::next() {
+  if (batch_) {
+    ++batch_row_;
+    return;
+  }
+  DelimitedFileReader::next();
+}
+
 /**
  * Open a new file from an existing MatchFileReader.
  */
@@ -95,6 +126,9 @@ FLOAT_T MatchFileReader::getFloat(
     carp(CARP_DEBUG, "column \"%s\" not found for getFloat", get_column_header(col_type));
     return -1;
   }
+  if (batch_) {
+    return (FLOAT_T)batch_->getNumber(col_type, batch_row_);
+  }
   return DelimitedFileReader::getFloat(idx);
 }
 
@@ -110,6 +144,9 @@ double MatchFileReader::getDouble(
     carp(CARP_DEBUG, "column \"%s\" not found for getDouble", get_column_header(col_type));
     return -1;
   }
+  if (batch_) {
+    return batch_->getNumber(col_type, batch_row_);
+  }
   return DelimitedFileReader::getDouble(idx);
 }
 
@@ -126,6 +163,10 @@ int MatchFileReader::getInteger(
     carp(CARP_DEBUG, "column \"%s\" not found for getInteger", get_column_header(col_type));
     return -1;
   }
+  if (batch_) {
+    double value = batch_->getNumber(col_type, batch_row_);
+    return value == value ? (int)value : 0; // empty cells are NaN
+  }
   return DelimitedFileReader::getInteger(idx);
 }
 
@@ -141,6 +182,9 @@ string MatchFileReader::getString(
     carp(CARP_DEBUG, "column \"%s\" not found for getString", get_column_header(col_type));
     return "";
   }
+  if (batch_) {
+    return batch_->getText(col_type, batch_row_);
+  }
   return DelimitedFileReader::getString(idx);
 }
 
@@ -151,6 +195,9 @@ bool MatchFileReader::empty(
   if (idx == -1) {
     return true;
   }
+  if (batch_) {
+    return batch_->empty(col_type, batch_row_);
+  }
   return DelimitedFileReader::getString(idx).empty();
 }
 
@@ -165,7 +212,7 @@ void MatchFileReader::getMatchColumnsPresent(
   col_is_present.clear();
 
   // has a header been parsed?
-  if( column_names_.empty() ) {
+  if( column_names_.empty() && !batch_ ) {
     return;
   }
   col_is_present.assign(NUMBER_MATCH_COLUMNS, false);
@@ -175,13 +222,55 @@ void MatchFileReader::getMatchColumnsPresent(
   }
 }
 
+/**
+ * The columns that parse() reads.
+ */
+static const int PARSED_COLUMNS[] = {
+  FILE_COL, SCAN_COL, CHARGE_COL, SPECTRUM_PRECURSOR_MZ_COL, SPECTRUM_NEUTRAL_MASS_COL,
+  DELTA_CN_COL, DELTA_LCN_COL, SP_SCORE_COL, SP_RANK_COL, XCORR_SCORE_COL, XCORR_RANK_COL,
+  EXACT_PVALUE_COL, REFACTORED_SCORE_COL, RESIDUE_PVALUE_COL, RESIDUE_EVIDENCE_COL,
+  RESIDUE_RANK_COL, BOTH_PVALUE_COL, BOTH_PVALUE_RANK, TAILOR_COL, EVALUE_COL,
+  DECOY_XCORR_QVALUE_COL, PERCOLATOR_SCORE_COL, PERCOLATOR_RANK_COL, PERCOLATOR_QVALUE_COL,
+  BY_IONS_MATCHED_COL, BY_IONS_TOTAL_COL, MATCHES_SPECTRUM_COL,
+  DISTINCT_MATCHES_SPECTRUM_COL, SEQUENCE_COL, MODIFICATIONS_COL, CLEAVAGE_TYPE_COL,
+  PROTEIN_ID_COL, FLANKING_AA_COL, INDEX_NAME_COL, DECOY_INDEX_COL
+};
+
 MatchCollection* MatchFileReader::parse(
   const string& file_path,
   Database* database,
   Database* decoy_database) {
+  // Files are read through a PSMBatch, which keeps only the columns parse()
+  // needs; binary files are loaded as they are, tab-delimited ones are
+  // parsed by several threads, and standard input is read a line at a time.
+  if (file_path != "-") {
+    vector<int> columns(PARSED_COLUMNS,
+      PARSED_COLUMNS + sizeof(PARSED_COLUMNS) / sizeof(PARSED_COLUMNS[0]));
+    PSMBatch* batch = PSMBatchFile::read(file_path, columns);
+    if (batch == NULL) {
+      int num_threads = Params::GetInt("num-threads");
+      if (num_threads < 1) {
+        num_threads = boost::thread::hardware_concurrency();
+      }
+      batch = PSMBatchReader::read(file_path, columns,
+                                   Params::GetInt("top-match-in"), num_threads);
+    }
+    if (batch != NULL) {
+      MatchCollection* collection = parse(batch, database, decoy_database);
+      delete batch;
+      return collection;
+    }
+  }
   return MatchFileReader(file_path, database, decoy_database).parse();
 }
 
+MatchCollection* MatchFileReader::parse(
+  PSMBatch* batch,
+  Database* database,
+  Database* decoy_database) {
+  return MatchFileReader(batch, database, decoy_database).parse();
+}
+
 MatchCollection* MatchFileReader::parse() {
   MatchCollection* match_collection = new MatchCollection();
   match_collection->preparePostProcess();
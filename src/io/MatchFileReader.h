@@ -19,6 +19,8 @@
 #include "MatchColumns.h"
 #include "PSMReader.h"
 
+class PSMBatch;
+
 class MatchFileReader: public DelimitedFileReader, public PSMReader {
  protected:
     void parseHeader();
@@ -28,6 +30,9 @@ class MatchFileReader: public DelimitedFileReader, public PSMReader {
 
     int match_indices_[NUMBER_MATCH_COLUMNS];
 
+    PSMBatch* batch_; ///< rows to read instead of a file, if not NULL
+    size_t batch_row_; ///< current row of batch_
+
  public:
    /**
     * \returns a blank MatchFileReader object 
@@ -63,11 +68,31 @@ class MatchFileReader: public DelimitedFileReader, public PSMReader {
       std::istream* iptr
     );
 
+    /**
+     * \returns a MatchFileReader object that reads the rows of the given
+     * batch instead of a file. The batch must outlive the reader.
+     */
+    MatchFileReader(
+      PSMBatch* batch,
+      Database* database,
+      Database* decoy_database = NULL
+    );
+
     /**
      * Destructor
      */
     virtual ~MatchFileReader();
 
+    /**
+     * \returns whether there are more rows to read.
+     */
+    bool hasNext();
+
+    /**
+     * Moves to the next row.
+     */
+    void next();
+
     /**
      * Open a new file from an existing MatchFileReader.
      */
@@ -133,6 +158,16 @@ class MatchFileReader: public DelimitedFileReader, public PSMReader {
       Database* decoy_database
     );
 
+    /**
+     * \returns the matches held by the given batch, as if it had been
+     * written to a file and parsed.
+     */
+    static MatchCollection* parse(
+      PSMBatch* batch,
+      Database* database,
+      Database* decoy_database
+    );
+
     MatchCollection* parse();
 };
 
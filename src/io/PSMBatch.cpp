@@ -0,0 +1,238 @@
+/*************************************************************************
+ * \file PSMBatch.cpp
+ * \brief In-memory table of PSMs; see PSMBatch.h.
+ *************************************************************************/
+
+#include <cmath>
+#include <limits>
+#include "PSMBatch.h"
+#include "util/StringUtils.h"
+
+using namespace std;
+
+map<string, PSMBatch*> PSMBatch::published_;
+boost::mutex PSMBatch::published_mutex_;
+
+static const double EMPTY_CELL = numeric_limits<double>::quiet_NaN();
+
+PSMBatch::Row::Row() {
+  clear();
+}
+
+void PSMBatch::Row::clear() {
+  for (int i = 0; i < NUMBER_MATCH_COLUMNS; i++) {
+    numbers_[i] = EMPTY_CELL;
+  }
+  texts_.clear();
+}
+
+void PSMBatch::Row::setNumber(MATCH_COLUMNS_T col, double value) {
+  numbers_[col] = value;
+}
+
+void PSMBatch::Row::setText(MATCH_COLUMNS_T col, const string& value) {
+  texts_.push_back(make_pair(col, value));
+}
+
+PSMBatch::PSMBatch(const vector<int>& columns)
+  : columns_(columns), size_(0) {
+  for (int i = 0; i < NUMBER_MATCH_COLUMNS; i++) {
+    has_column_[i] = false;
+  }
+  for (vector<int>::const_iterator i = columns.begin(); i != columns.end(); ++i) {
+    has_column_[*i] = true;
+  }
+  pool_.push_back("");
+  pool_index_[""] = 0;
+}
+
+PSMBatch::~PSMBatch() {
+}
+
+void PSMBatch::add(const vector<Row>& rows) {
+  boost::mutex::scoped_lock lock(mutex_);
+  for (vector<Row>::const_iterator row = rows.begin(); row != rows.end(); ++row) {
+    addRow(*row);
+  }
+}
+
+void PSMBatch::add(const Row& row) {
+  boost::mutex::scoped_lock lock(mutex_);
+  addRow(row);
+}
+
+void PSMBatch::append(const PSMBatch& other) {
+  boost::mutex::scoped_lock lock(mutex_);
+  vector<unsigned int> remap(other.pool_.size());
+  for (size_t i = 0; i < other.pool_.size(); i++) {
+    remap[i] = intern(other.pool_[i]);
+  }
+  for (vector<int>::const_iterator i = columns_.begin(); i != columns_.end(); ++i) {
+    MATCH_COLUMNS_T col = (MATCH_COLUMNS_T)*i;
+    if (isTextColumn(col)) {
+      const vector<unsigned int>& from = other.texts_[col];
+      vector<unsigned int>& to = texts_[col];
+      to.reserve(to.size() + from.size());
+      for (vector<unsigned int>::const_iterator j = from.begin(); j != from.end(); ++j) {
+        to.push_back(remap[*j]);
+      }
+    } else {
+      numbers_[col].insert(numbers_[col].end(),
+                           other.numbers_[col].begin(), other.numbers_[col].end());
+    }
+  }
+  size_ += other.size_;
+}
+
+void PSMBatch::addRow(const Row& row) {
+  for (vector<int>::const_iterator i = columns_.begin(); i != columns_.end(); ++i) {
+    MATCH_COLUMNS_T col = (MATCH_COLUMNS_T)*i;
+    if (isTextColumn(col)) {
+      texts_[col].push_back(0);
+    } else {
+      numbers_[col].push_back(row.numbers_[col]);
+    }
+  }
+  for (vector<pair<MATCH_COLUMNS_T, string> >::const_iterator i = row.texts_.begin();
+       i != row.texts_.end();
+       ++i) {
+    if (has_column_[i->first] && isTextColumn(i->first)) {
+      texts_[i->first].back() = intern(i->second);
+    }
+  }
+  ++size_;
+}
+
+void PSMBatch::addEmptyRow() {
+  for (vector<int>::const_iterator i = columns_.begin(); i != columns_.end(); ++i) {
+    MATCH_COLUMNS_T col = (MATCH_COLUMNS_T)*i;
+    if (isTextColumn(col)) {
+      texts_[col].push_back(0);
+    } else {
+      numbers_[col].push_back(EMPTY_CELL);
+    }
+  }
+  ++size_;
+}
+
+void PSMBatch::setNumber(MATCH_COLUMNS_T col, double value) {
+  if (has_column_[col] && !isTextColumn(col)) {
+    numbers_[col].back() = value;
+  }
+}
+
+void PSMBatch::setText(MATCH_COLUMNS_T col, const string& value) {
+  if (has_column_[col] && isTextColumn(col)) {
+    texts_[col].back() = intern(value);
+  }
+}
+
+void PSMBatch::clear() {
+  for (vector<int>::const_iterator i = columns_.begin(); i != columns_.end(); ++i) {
+    numbers_[*i].clear();
+    texts_[*i].clear();
+  }
+  pool_.resize(1);
+  pool_index_.clear();
+  pool_index_[""] = 0;
+  size_ = 0;
+}
+
+unsigned int PSMBatch::intern(const string& text) {
+  boost::unordered_map<string, unsigned int>::const_iterator lookup =
+    pool_index_.find(text);
+  if (lookup != pool_index_.end()) {
+    return lookup->second;
+  }
+  unsigned int index = pool_.size();
+  pool_.push_back(text);
+  pool_index_[text] = index;
+  return index;
+}
+
+size_t PSMBatch::size() const {
+  return size_;
+}
+
+const vector<int>& PSMBatch::columns() const {
+  return columns_;
+}
+
+bool PSMBatch::hasColumn(MATCH_COLUMNS_T col) const {
+  return has_column_[col];
+}
+
+double PSMBatch::getNumber(MATCH_COLUMNS_T col, size_t row) const {
+  if (isTextColumn(col)) {
+    double value = 0;
+    StringUtils::TryFromString(pool_[texts_[col][row]], &value);
+    return value;
+  }
+  return numbers_[col][row];
+}
+
+string PSMBatch::getText(MATCH_COLUMNS_T col, size_t row) const {
+  if (isTextColumn(col)) {
+    return pool_[texts_[col][row]];
+  }
+  double value = numbers_[col][row];
+  return isnan(value) ? "" : StringUtils::ToString(value);
+}
+
+bool PSMBatch::empty(MATCH_COLUMNS_T col, size_t row) const {
+  if (isTextColumn(col)) {
+    return texts_[col][row] == 0;
+  }
+  return isnan(numbers_[col][row]);
+}
+
+bool PSMBatch::isTextColumn(MATCH_COLUMNS_T col) {
+  switch (col) {
+  case FILE_COL:
+  case SEQUENCE_COL:
+  case MODIFICATIONS_COL:
+  case CLEAVAGE_TYPE_COL:
+  case PROTEIN_ID_COL:
+  case FLANKING_AA_COL:
+  case TARGET_DECOY_COL:
+  case ORIGINAL_TARGET_SEQUENCE_COL:
+  case INDEX_NAME_COL:
+    return true;
+  default:
+    return false;
+  }
+}
+
+void PSMBatch::publish(const string& path, PSMBatch* batch) {
+  boost::mutex::scoped_lock lock(published_mutex_);
+  map<string, PSMBatch*>::iterator i = published_.find(path);
+  if (i != published_.end()) {
+    delete i->second;
+    i->second = batch;
+  } else {
+    published_[path] = batch;
+  }
+}
+
+bool PSMBatch::published(const string& path) {
+  boost::mutex::scoped_lock lock(published_mutex_);
+  return published_.find(path) != published_.end();
+}
+
+PSMBatch* PSMBatch::take(const string& path) {
+  boost::mutex::scoped_lock lock(published_mutex_);
+  map<string, PSMBatch*>::iterator i = published_.find(path);
+  if (i == published_.end()) {
+    return NULL;
+  }
+  PSMBatch* batch = i->second;
+  published_.erase(i);
+  return batch;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
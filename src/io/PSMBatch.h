@@ -0,0 +1,139 @@
+/**
+ * \file PSMBatch.h
+ * \brief In-memory table of PSMs, laid out like a tab-delimited results
+ * file but without the text.
+ * A search fills a PSMBatch with the same columns it would write to its
+ * results file and publishes it under that file's path; a MatchFileReader
+ * can then read the batch in place of the file.  Numeric cells are kept
+ * as doubles, one vector per column, and text cells as indices into a
+ * pool of distinct strings, so that peptides and proteins reported for
+ * many spectra are stored once. PSMBatchFile stores a batch on disk in the
+ * same layout.
+ */
+
+#ifndef PSMBATCH_H
+#define PSMBATCH_H
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
+#include "MatchColumns.h"
+
+class PSMBatch {
+
+ public:
+  /**
+   * One PSM as it is filled in by a search thread. Cells that are not set
+   * are empty.
+   */
+  class Row {
+   public:
+    Row();
+    void clear();
+    void setNumber(MATCH_COLUMNS_T col, double value);
+    void setText(MATCH_COLUMNS_T col, const std::string& value);
+
+   protected:
+    friend class PSMBatch;
+    double numbers_[NUMBER_MATCH_COLUMNS];
+    std::vector<std::pair<MATCH_COLUMNS_T, std::string> > texts_;
+  };
+
+  /**
+   * \returns An empty batch with the given columns, in the order they
+   * would appear in the file header.
+   */
+  explicit PSMBatch(const std::vector<int>& columns);
+
+  ~PSMBatch();
+
+  /**
+   * Appends the given rows. May be called from several threads.
+   */
+  void add(const std::vector<Row>& rows);
+  void add(const Row& row);
+
+  /**
+   * Appends the rows of another batch with the same columns.
+   */
+  void append(const PSMBatch& other);
+
+  /**
+   * Starts a new row with every cell empty; setNumber() and setText() fill
+   * in the cells of the last row. Unlike add(), these do not lock: they
+   * are for a batch that belongs to one thread, and is appended to the
+   * shared batch as a whole.
+   */
+  void addEmptyRow();
+  void setNumber(MATCH_COLUMNS_T col, double value);
+  void setText(MATCH_COLUMNS_T col, const std::string& value);
+
+  /**
+   * Removes all rows, and the text they refer to.
+   */
+  void clear();
+
+  size_t size() const;
+  const std::vector<int>& columns() const;
+  bool hasColumn(MATCH_COLUMNS_T col) const;
+
+  /**
+   * \returns The value of a cell. Numeric cells read as text are formatted,
+   * text cells read as numbers are parsed.
+   */
+  double getNumber(MATCH_COLUMNS_T col, size_t row) const;
+  std::string getText(MATCH_COLUMNS_T col, size_t row) const;
+  bool empty(MATCH_COLUMNS_T col, size_t row) const;
+
+  /**
+   * \returns Whether col holds text rather than numbers.
+   */
+  static bool isTextColumn(MATCH_COLUMNS_T col);
+
+  /**
+   * Makes the batch available under the given results file path, and takes
+   * ownership of it. Any batch published earlier under the path is deleted.
+   */
+  static void publish(const std::string& path, PSMBatch* batch);
+
+  /**
+   * \returns Whether a batch has been published under the path.
+   */
+  static bool published(const std::string& path);
+
+  /**
+   * \returns The batch published under the path, or NULL. The caller takes
+   * ownership, and the batch is no longer published.
+   */
+  static PSMBatch* take(const std::string& path);
+
+ protected:
+  friend class PSMBatchFile;
+
+  std::vector<int> columns_;
+  bool has_column_[NUMBER_MATCH_COLUMNS];
+  std::vector<double> numbers_[NUMBER_MATCH_COLUMNS];
+  std::vector<unsigned int> texts_[NUMBER_MATCH_COLUMNS];
+  std::vector<std::string> pool_; ///< distinct text cells; 0 is ""
+  boost::unordered_map<std::string, unsigned int> pool_index_;
+  size_t size_;
+  boost::mutex mutex_;
+
+  void addRow(const Row& row); ///< add() without locking
+  unsigned int intern(const std::string& text);
+
+  static std::map<std::string, PSMBatch*> published_;
+  static boost::mutex published_mutex_;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
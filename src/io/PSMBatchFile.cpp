@@ -0,0 +1,409 @@
+/*************************************************************************
+ * \file PSMBatchFile.cpp
+ * \brief Reads and writes a PSMBatch as a binary file of PSMs; see
+ * PSMBatchFile.h.
+ *************************************************************************/
+
+#include <fstream>
+#include <cmath>
+#include <limits>
+#include "io/carp.h"
+#include "PSMBatchFile.h"
+#include "util/FileUtils.h"
+#include "util/utils.h"
+
+using namespace std;
+
+const string PSMBatchFile::EXTENSION = ".psm";
+const size_t PSMBatchFile::CHUNK_ROWS = 65536;
+
+static const unsigned int PSM_FILE_MAGIC = 0x50534d42u; // "BMSP" on disk
+static const unsigned int PSM_FILE_VERSION = 1;
+
+template<typename T>
+static void writeValue(ostream& out, T value) {
+  out.write((const char*)&value, sizeof(T));
+}
+
+template<typename T>
+static T readValue(istream& in) {
+  T value;
+  if (!in.read((char*)&value, sizeof(T))) {
+    carp(CARP_FATAL, "Unexpected end of binary PSM file.");
+  }
+  return value;
+}
+
+static void writeString(ostream& out, const string& text) {
+  writeValue<unsigned int>(out, text.length());
+  out.write(text.data(), text.length());
+}
+
+static string readString(istream& in) {
+  unsigned int length = readValue<unsigned int>(in);
+  string text(length, '\0');
+  if (length > 0 && !in.read(&text[0], length)) {
+    carp(CARP_FATAL, "Unexpected end of binary PSM file.");
+  }
+  return text;
+}
+
+void PSMBatchFile::write(
+  const string& file_path,
+  const PSMBatch& batch,
+  bool overwrite
+) {
+  Writer writer(file_path, batch.columns_, overwrite);
+  writer.writeChunks(batch);
+  writer.close();
+}
+
+PSMBatchFile::Writer::Writer(
+  const string& file_path,
+  const vector<int>& columns,
+  bool overwrite
+) : file_path_(file_path), pending_(columns), rows_written_(0), closed_(false) {
+  if (FileUtils::Exists(file_path)) {
+    if (!overwrite) {
+      carp(CARP_FATAL, "The file '%s' already exists and cannot be overwritten. "
+           "Use --overwrite T to replace or choose a different output file name",
+           file_path.c_str());
+    }
+    carp(CARP_WARNING, "The file '%s' already exists and will be overwritten.",
+         file_path.c_str());
+  }
+  out_.open(file_path.c_str(), ios::out | ios::binary | ios::trunc);
+  if (!out_.is_open()) {
+    carp(CARP_FATAL, "Failed to create and open file: %s", file_path.c_str());
+  }
+
+  writeValue<unsigned int>(out_, PSM_FILE_MAGIC);
+  writeValue<unsigned int>(out_, PSM_FILE_VERSION);
+  writeValue<unsigned int>(out_, columns.size());
+  for (vector<int>::const_iterator i = columns.begin(); i != columns.end(); ++i) {
+    writeString(out_, get_column_header(*i));
+  }
+  pool_index_[""] = 0; // implied
+}
+
+PSMBatchFile::Writer::~Writer() {
+  if (!closed_) {
+    close();
+  }
+}
+
+void PSMBatchFile::Writer::add(const PSMBatch& rows) {
+  boost::mutex::scoped_lock lock(mutex_);
+  pending_.append(rows);
+  if (pending_.size() >= CHUNK_ROWS) {
+    writeChunks(pending_);
+    pending_.clear();
+  }
+}
+
+void PSMBatchFile::Writer::close() {
+  boost::mutex::scoped_lock lock(mutex_);
+  writeChunks(pending_);
+  pending_.clear();
+  writeValue<unsigned int>(out_, 0);
+  out_.close();
+  closed_ = true;
+
+  if (!out_) {
+    carp(CARP_FATAL, "Error writing to %s", file_path_.c_str());
+  }
+  carp(CARP_DEBUG, "Wrote %d rows of %d columns to %s.",
+       (int)rows_written_, (int)pending_.columns().size(), file_path_.c_str());
+}
+
+const vector<int>& PSMBatchFile::Writer::columns() const {
+  return pending_.columns();
+}
+
+void PSMBatchFile::Writer::writeChunks(const PSMBatch& batch) {
+  for (size_t begin = 0; begin < batch.size_; begin += CHUNK_ROWS) {
+    writeChunk(batch, begin, min(begin + CHUNK_ROWS, batch.size_));
+  }
+}
+
+void PSMBatchFile::Writer::writeChunk(
+  const PSMBatch& batch,
+  size_t begin,
+  size_t end
+) {
+  // Text cells refer to the batch's pool; they are written as indices into
+  // the file's pool, and the strings this chunk is the first to refer to
+  // are written with it.
+  const vector<int>& columns = batch.columns_;
+  boost::unordered_map<unsigned int, unsigned int> remap;
+  vector<const string*> new_strings;
+  for (vector<int>::const_iterator i = columns.begin(); i != columns.end(); ++i) {
+    if (!PSMBatch::isTextColumn((MATCH_COLUMNS_T)*i)) {
+      continue;
+    }
+    const vector<unsigned int>& indices = batch.texts_[*i];
+    for (size_t row = begin; row < end; row++) {
+      unsigned int index = indices[row];
+      if (remap.find(index) != remap.end()) {
+        continue;
+      }
+      const string& text = batch.pool_[index];
+      boost::unordered_map<string, unsigned int>::const_iterator lookup =
+        pool_index_.find(text);
+      if (lookup != pool_index_.end()) {
+        remap[index] = lookup->second;
+      } else {
+        unsigned int file_index = pool_index_.size();
+        pool_index_[text] = file_index;
+        remap[index] = file_index;
+        new_strings.push_back(&text);
+      }
+    }
+  }
+  writeValue<unsigned int>(out_, end - begin);
+  writeValue<unsigned int>(out_, new_strings.size());
+  for (vector<const string*>::const_iterator i = new_strings.begin(); i != new_strings.end(); ++i) {
+    writeString(out_, **i);
+  }
+
+  vector<unsigned int> file_indices(end - begin);
+  for (vector<int>::const_iterator i = columns.begin(); i != columns.end(); ++i) {
+    if (PSMBatch::isTextColumn((MATCH_COLUMNS_T)*i)) {
+      const vector<unsigned int>& indices = batch.texts_[*i];
+      for (size_t row = begin; row < end; row++) {
+        file_indices[row - begin] = remap.find(indices[row])->second;
+      }
+      Encoding encoding = indexEncoding(file_indices, 0, end - begin);
+      writeValue<unsigned char>(out_, encoding);
+      for (size_t row = 0; row < end - begin; row++) {
+        switch (encoding) {
+        case INDEX8_ENCODING: writeValue<unsigned char>(out_, file_indices[row]); break;
+        case INDEX16_ENCODING: writeValue<unsigned short>(out_, file_indices[row]); break;
+        default: writeValue<unsigned int>(out_, file_indices[row]); break;
+        }
+      }
+    } else {
+      const vector<double>& values = batch.numbers_[*i];
+      Encoding encoding = numberEncoding(values, begin, end);
+      writeValue<unsigned char>(out_, encoding);
+      if (encoding == EMPTY_ENCODING) {
+        continue;
+      }
+      for (size_t row = begin; row < end; row++) {
+        switch (encoding) {
+        case INT8_ENCODING: writeValue<signed char>(out_, (signed char)values[row]); break;
+        case INT16_ENCODING: writeValue<short>(out_, (short)values[row]); break;
+        case INT32_ENCODING: writeValue<int>(out_, (int)values[row]); break;
+        case FLOAT_ENCODING: writeValue<float>(out_, (float)values[row]); break;
+        default: writeValue<double>(out_, values[row]); break;
+        }
+      }
+    }
+  }
+  rows_written_ += end - begin;
+}
+
+bool PSMBatchFile::isBinary(const string& file_path) {
+  ifstream in(file_path.c_str(), ios::in | ios::binary);
+  unsigned int magic = 0;
+  return in.read((char*)&magic, sizeof(magic)) && magic == PSM_FILE_MAGIC;
+}
+
+PSMBatch* PSMBatchFile::read(const string& file_path) {
+  vector<int> columns;
+  for (int i = 0; i < NUMBER_MATCH_COLUMNS; i++) {
+    columns.push_back(i);
+  }
+  return read(file_path, columns);
+}
+
+PSMBatch* PSMBatchFile::read(
+  const string& file_path,
+  const vector<int>& columns
+) {
+  ifstream in(file_path.c_str(), ios::in | ios::binary);
+  unsigned int magic = 0;
+  if (!in.read((char*)&magic, sizeof(magic)) || magic != PSM_FILE_MAGIC) {
+    return NULL;
+  }
+  unsigned int version = readValue<unsigned int>(in);
+  if (version != PSM_FILE_VERSION) {
+    carp(CARP_FATAL, "%s is a binary PSM file of version %u, but only version "
+         "%u can be read.", file_path.c_str(), version, PSM_FILE_VERSION);
+  }
+
+  // Columns are matched by their header text, as in a tab-delimited file,
+  // and those not asked for are skipped.
+  bool wanted[NUMBER_MATCH_COLUMNS];
+  for (int i = 0; i < NUMBER_MATCH_COLUMNS; i++) {
+    wanted[i] = false;
+  }
+  for (vector<int>::const_iterator i = columns.begin(); i != columns.end(); ++i) {
+    wanted[*i] = true;
+  }
+  unsigned int num_columns = readValue<unsigned int>(in);
+  vector<int> file_columns;
+  vector<int> batch_columns;
+  for (unsigned int i = 0; i < num_columns; i++) {
+    string name = readString(in);
+    int col = -1;
+    for (int j = 0; j < NUMBER_MATCH_COLUMNS; j++) {
+      if (wanted[j] && name == get_column_header(j)) {
+        col = j;
+        wanted[j] = false;
+        batch_columns.push_back(j);
+        break;
+      }
+    }
+    file_columns.push_back(col);
+  }
+
+  PSMBatch* batch = new PSMBatch(batch_columns);
+  unsigned int rows;
+  while ((rows = readValue<unsigned int>(in)) > 0) {
+    unsigned int new_strings = readValue<unsigned int>(in);
+    for (unsigned int i = 0; i < new_strings; i++) {
+      string text = readString(in);
+      batch->pool_index_[text] = batch->pool_.size();
+      batch->pool_.push_back(text);
+    }
+    for (vector<int>::const_iterator i = file_columns.begin(); i != file_columns.end(); ++i) {
+      readColumn(in, rows, *i, batch);
+    }
+    batch->size_ += rows;
+  }
+  carp(CARP_DEBUG, "Read %d rows of %d columns from %s.",
+       (int)batch->size(), (int)batch_columns.size(), file_path.c_str());
+  return batch;
+}
+
+void PSMBatchFile::readColumn(
+  istream& in,
+  unsigned int rows,
+  int col,
+  PSMBatch* batch
+) {
+  Encoding encoding = (Encoding)readValue<unsigned char>(in);
+  bool is_index = encoding == INDEX8_ENCODING || encoding == INDEX16_ENCODING ||
+                  encoding == INDEX32_ENCODING;
+  if (encoding > INDEX32_ENCODING ||
+      (col >= 0 && is_index != PSMBatch::isTextColumn((MATCH_COLUMNS_T)col))) {
+    carp(CARP_FATAL, "Binary PSM file is corrupt.");
+  }
+  if (col < 0) {
+    in.seekg(encodingSize(encoding) * rows, ios::cur);
+    return;
+  }
+  if (is_index) {
+    vector<unsigned int>& indices = batch->texts_[col];
+    indices.reserve(indices.size() + rows);
+    for (unsigned int row = 0; row < rows; row++) {
+      unsigned int index;
+      switch (encoding) {
+      case INDEX8_ENCODING: index = readValue<unsigned char>(in); break;
+      case INDEX16_ENCODING: index = readValue<unsigned short>(in); break;
+      default: index = readValue<unsigned int>(in); break;
+      }
+      if (index >= batch->pool_.size()) {
+        carp(CARP_FATAL, "Binary PSM file is corrupt.");
+      }
+      indices.push_back(index);
+    }
+    return;
+  }
+  vector<double>& values = batch->numbers_[col];
+  values.reserve(values.size() + rows);
+  for (unsigned int row = 0; row < rows; row++) {
+    switch (encoding) {
+    case EMPTY_ENCODING: values.push_back(numeric_limits<double>::quiet_NaN()); break;
+    case INT8_ENCODING: values.push_back(readValue<signed char>(in)); break;
+    case INT16_ENCODING: values.push_back(readValue<short>(in)); break;
+    case INT32_ENCODING: values.push_back(readValue<int>(in)); break;
+    case FLOAT_ENCODING: values.push_back(readValue<float>(in)); break;
+    default: values.push_back(readValue<double>(in)); break;
+    }
+  }
+}
+
+PSMBatchFile::Encoding PSMBatchFile::numberEncoding(
+  const vector<double>& values,
+  size_t begin,
+  size_t end
+) {
+  bool all_empty = true;
+  bool integral = true;
+  double low = 0, high = 0;
+  for (size_t row = begin; row < end; row++) {
+    double value = values[row];
+    if (isnan(value)) {
+      integral = false;
+      continue;
+    }
+    if (all_empty) {
+      low = high = value;
+      all_empty = false;
+    }
+    if (isinf(value) || value != floor(value)) {
+      integral = false;
+    }
+    low = min(low, value);
+    high = max(high, value);
+  }
+  if (all_empty) {
+    return EMPTY_ENCODING;
+  } else if (integral && low >= numeric_limits<signed char>::min() &&
+             high <= numeric_limits<signed char>::max()) {
+    return INT8_ENCODING;
+  } else if (integral && low >= numeric_limits<short>::min() &&
+             high <= numeric_limits<short>::max()) {
+    return INT16_ENCODING;
+  } else if (integral && low >= numeric_limits<int>::min() &&
+             high <= numeric_limits<int>::max()) {
+    return INT32_ENCODING;
+  }
+  // Readers hold scores and masses as FLOAT_T, so no more is written.
+  return sizeof(FLOAT_T) <= sizeof(float) ? FLOAT_ENCODING : DOUBLE_ENCODING;
+}
+
+PSMBatchFile::Encoding PSMBatchFile::indexEncoding(
+  const vector<unsigned int>& indices,
+  size_t begin,
+  size_t end
+) {
+  unsigned int high = 0;
+  for (size_t row = begin; row < end; row++) {
+    high = max(high, indices[row]);
+  }
+  if (high <= numeric_limits<unsigned char>::max()) {
+    return INDEX8_ENCODING;
+  } else if (high <= numeric_limits<unsigned short>::max()) {
+    return INDEX16_ENCODING;
+  }
+  return INDEX32_ENCODING;
+}
+
+size_t PSMBatchFile::encodingSize(Encoding encoding) {
+  switch (encoding) {
+  case INT8_ENCODING:
+  case INDEX8_ENCODING:
+    return 1;
+  case INT16_ENCODING:
+  case INDEX16_ENCODING:
+    return 2;
+  case INT32_ENCODING:
+  case FLOAT_ENCODING:
+  case INDEX32_ENCODING:
+    return 4;
+  case DOUBLE_ENCODING:
+    return 8;
+  default:
+    return 0;
+  }
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
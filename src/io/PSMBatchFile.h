@@ -0,0 +1,169 @@
+/**
+ * \file PSMBatchFile.h
+ * \brief Reads and writes a PSMBatch as a binary file of PSMs.
+ * The file holds the same columns as a tab-delimited results file, stored
+ * column by column in chunks of rows:
+ *
+ *   file   := magic version column-count name* chunk* end
+ *   name   := length bytes               (the column's header text)
+ *   chunk  := row-count string-count string* column*
+ *   string := length bytes               (new entries of the string pool)
+ *   column := encoding value*
+ *   end    := 0                          (a chunk of no rows)
+ *
+ * Counts and lengths are 32-bit unsigned integers and encodings are single
+ * bytes. Each column of a chunk is written in the narrowest encoding that
+ * holds its values: small integers such as ranks, charges and scans in
+ * 1, 2 or 4 bytes, other numbers at the precision of FLOAT_T, and text as
+ * indices into a pool of distinct strings that is extended chunk by chunk.
+ * Values are written in the byte order of the machine; a file from a
+ * machine of the other byte order is rejected by its magic number.
+ */
+
+#ifndef PSMBATCHFILE_H
+#define PSMBATCHFILE_H
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
+#include "PSMBatch.h"
+
+class PSMBatchFile {
+
+ public:
+  /**
+   * Extension of binary PSM files, such as tide-search.target.psm.
+   */
+  static const std::string EXTENSION;
+
+  /**
+   * Most rows in a chunk.
+   */
+  static const size_t CHUNK_ROWS;
+
+  /**
+   * Writes a binary PSM file as rows come in, a chunk at a time, so that a
+   * search need not hold all of its results until the end.
+   */
+  class Writer {
+   public:
+    /**
+     * Creates the file and writes its header. Dies if the file exists and
+     * may not be overwritten, or cannot be opened.
+     */
+    Writer(
+      const std::string& file_path,
+      const std::vector<int>& columns, ///< MATCH_COLUMNS_T, in file order
+      bool overwrite ///< replace an existing file (T) or die (F)
+    );
+
+    /**
+     * Closes the file if close() has not been called.
+     */
+    ~Writer();
+
+    /**
+     * Adds the rows of a batch with the writer's columns. Rows are written
+     * as soon as CHUNK_ROWS of them have come in. May be called from
+     * several threads.
+     */
+    void add(const PSMBatch& rows);
+
+    /**
+     * Writes the rows that are left and ends the file. Dies if anything
+     * could not be written.
+     */
+    void close();
+
+    const std::vector<int>& columns() const;
+
+   protected:
+    friend class PSMBatchFile;
+
+    std::string file_path_;
+    std::ofstream out_;
+    PSMBatch pending_; ///< rows added but not written yet
+    /// strings of the file's pool, with their index in it; "" is 0
+    boost::unordered_map<std::string, unsigned int> pool_index_;
+    size_t rows_written_;
+    bool closed_;
+    boost::mutex mutex_;
+
+    void writeChunks(const PSMBatch& batch); ///< all rows of batch
+    void writeChunk(const PSMBatch& batch, size_t begin, size_t end);
+  };
+
+  /**
+   * Writes the batch to the given path. Dies if the file exists and may
+   * not be overwritten, or cannot be opened.
+   */
+  static void write(
+    const std::string& file_path,
+    const PSMBatch& batch,
+    bool overwrite ///< replace an existing file (T) or die (F)
+  );
+
+  /**
+   * \returns Whether the file starts with the magic number of a binary PSM
+   * file.
+   */
+  static bool isBinary(const std::string& file_path);
+
+  /**
+   * \returns A batch holding those of the given columns that the file has,
+   * or NULL if the file cannot be opened or is not a binary PSM file. The
+   * caller owns the batch.
+   */
+  static PSMBatch* read(
+    const std::string& file_path,
+    const std::vector<int>& columns ///< MATCH_COLUMNS_T to keep
+  );
+
+  /**
+   * \returns All the columns of the file; see read().
+   */
+  static PSMBatch* read(const std::string& file_path);
+
+ protected:
+  /**
+   * Ways a column of a chunk may be stored.
+   */
+  enum Encoding {
+    EMPTY_ENCODING = 0, ///< every cell empty; no values follow
+    INT8_ENCODING,
+    INT16_ENCODING,
+    INT32_ENCODING,
+    FLOAT_ENCODING,
+    DOUBLE_ENCODING,
+    INDEX8_ENCODING, ///< string pool indices
+    INDEX16_ENCODING,
+    INDEX32_ENCODING
+  };
+
+  /**
+   * Reads the values of one column of a chunk into batch, or skips them if
+   * col is -1.
+   */
+  static void readColumn(
+    std::istream& in,
+    unsigned int rows,
+    int col,
+    PSMBatch* batch
+  );
+
+  static Encoding numberEncoding(const std::vector<double>& values, size_t begin, size_t end);
+  static Encoding indexEncoding(const std::vector<unsigned int>& indices, size_t begin, size_t end);
+  static size_t encodingSize(Encoding encoding);
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
@@ -0,0 +1,218 @@
+/*************************************************************************
+ * \file PSMBatchReader.cpp
+ * \brief Reads selected columns of a tab-delimited results file into a
+ * PSMBatch; see PSMBatchReader.h.
+ *************************************************************************/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef _MSC_VER
+#include <io.h>
+#include "app/tide/mman.h"
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <cmath>
+#include <limits>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include "io/carp.h"
+#include "PSMBatchReader.h"
+#include "util/StringUtils.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+using namespace std;
+
+PSMBatch* PSMBatchReader::read(
+  const string& file_path,
+  const vector<int>& columns,
+  int max_rank,
+  int num_threads
+) {
+  int fd = open(file_path.c_str(), O_RDONLY | O_BINARY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  size_t length = (size_t)st.st_size;
+  void* base = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd); // the mapping stays valid
+  if (base == MAP_FAILED) {
+    return NULL;
+  }
+  const char* data = (const char*)base;
+  const char* data_end = data + length;
+
+  // The header decides which cells of a line go to which columns; as in
+  // MatchFileReader, a column is read from the first cell with its name.
+  const char* header_end = (const char*)memchr(data, '\n', length);
+  if (header_end == NULL) {
+    header_end = data_end;
+  }
+  vector<string> names = StringUtils::Split(
+    StringUtils::Trim(string(data, header_end)), '\t');
+  vector<vector<int> > file_columns(names.size());
+  vector<int> batch_columns;
+  int rank_column = -1;
+  for (vector<int>::const_iterator i = columns.begin(); i != columns.end(); ++i) {
+    const char* name = get_column_header(*i);
+    for (size_t j = 0; j < names.size(); j++) {
+      if (names[j] == name) {
+        file_columns[j].push_back(*i);
+        batch_columns.push_back(*i);
+        if (*i == XCORR_RANK_COL) {
+          rank_column = j;
+        }
+        break;
+      }
+    }
+  }
+
+  // Split the lines after the header into parts of about the same size.
+  const char* lines = header_end < data_end ? header_end + 1 : data_end;
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+  vector<const char*> bounds(1, lines);
+  for (int t = 1; t < num_threads; t++) {
+    const char* bound = lines + (size_t)(data_end - lines) * t / num_threads;
+    if (bound < bounds.back()) {
+      bound = bounds.back();
+    }
+    const char* newline = (const char*)memchr(bound, '\n', data_end - bound);
+    bounds.push_back(newline ? newline + 1 : data_end);
+  }
+  bounds.push_back(data_end);
+
+  vector<PSMBatch*> parts;
+  boost::thread_group threads;
+  for (int t = 0; t < num_threads; t++) {
+    parts.push_back(new PSMBatch(batch_columns));
+    if (t > 0) {
+      threads.create_thread(boost::bind(&PSMBatchReader::parseLines,
+        bounds[t], bounds[t + 1], &file_columns, rank_column, max_rank, parts[t]));
+    }
+  }
+  parseLines(bounds[0], bounds[1], &file_columns, rank_column, max_rank, parts[0]);
+  threads.join_all();
+  munmap(base, length);
+
+  // Parts are appended in file order, each freed as soon as it is copied.
+  PSMBatch* batch = parts[0];
+  for (int t = 1; t < num_threads; t++) {
+    batch->append(*parts[t]);
+    delete parts[t];
+  }
+  carp(CARP_DEBUG, "Read %d rows of %d columns from %s.",
+       (int)batch->size(), (int)batch_columns.size(), file_path.c_str());
+  return batch;
+}
+
+void PSMBatchReader::parseLines(
+  const char* begin,
+  const char* end,
+  const vector<vector<int> >* file_columns,
+  int rank_column,
+  int max_rank,
+  PSMBatch* batch
+) {
+  PSMBatch::Row row;
+  const char* line = begin;
+  while (line < end) {
+    const char* line_end = (const char*)memchr(line, '\n', end - line);
+    if (line_end == NULL) {
+      line_end = end;
+    }
+    const char* next_line = line_end < end ? line_end + 1 : end;
+    if (line_end > line && *(line_end - 1) == '\r') {
+      --line_end;
+    }
+    if (line_end == line) {
+      line = next_line;
+      continue;
+    }
+
+    row.clear();
+    bool keep = true;
+    const char* cell = line;
+    for (size_t i = 0; i < file_columns->size() && cell <= line_end; i++) {
+      const char* cell_end = (const char*)memchr(cell, '\t', line_end - cell);
+      if (cell_end == NULL) {
+        cell_end = line_end;
+      }
+      const vector<int>& targets = (*file_columns)[i];
+      if (!targets.empty()) {
+        if (PSMBatch::isTextColumn((MATCH_COLUMNS_T)targets.front())) {
+          string text(cell, cell_end);
+          for (vector<int>::const_iterator j = targets.begin(); j != targets.end(); ++j) {
+            row.setText((MATCH_COLUMNS_T)*j, text);
+          }
+        } else {
+          double value = parseNumber(cell, cell_end, targets.front());
+          for (vector<int>::const_iterator j = targets.begin(); j != targets.end(); ++j) {
+            row.setNumber((MATCH_COLUMNS_T)*j, value);
+          }
+          if ((int)i == rank_column && max_rank > 0 && value > max_rank) {
+            keep = false;
+            break;
+          }
+        }
+      }
+      cell = cell_end + 1;
+    }
+    if (keep) {
+      batch->add(row);
+    }
+    line = next_line;
+  }
+}
+
+double PSMBatchReader::parseNumber(const char* begin, const char* end, int col) {
+  if (begin == end) {
+    return numeric_limits<double>::quiet_NaN();
+  }
+  // strtod needs a terminated string, and the mapped file is not
+  // terminated, so cells are copied into a buffer on the stack; the rare
+  // cell too long for it is copied into a string.
+  size_t length = end - begin;
+  char buffer[64];
+  string long_cell;
+  const char* cell = buffer;
+  if (length < sizeof(buffer)) {
+    memcpy(buffer, begin, length);
+    buffer[length] = '\0';
+  } else {
+    long_cell.assign(begin, end);
+    cell = long_cell.c_str();
+  }
+  if (strcmp(cell, "Inf") == 0) {
+    return numeric_limits<double>::infinity();
+  } else if (strcmp(cell, "-Inf") == 0) {
+    return -numeric_limits<double>::infinity();
+  }
+  char* parsed_end;
+  double value = strtod(cell, &parsed_end);
+  if (parsed_end != cell + length) {
+    carp(CARP_FATAL, "Could not convert '%s' in column '%s' to a number.",
+         cell, get_column_header(col));
+  }
+  return value;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
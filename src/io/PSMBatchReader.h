@@ -0,0 +1,66 @@
+/**
+ * \file PSMBatchReader.h
+ * \brief Reads selected columns of a tab-delimited results file into a
+ * PSMBatch.
+ * The file is mapped into memory and split into line-aligned parts, which
+ * are parsed on separate threads. Only the requested columns are kept, as
+ * numbers or interned strings (see PSMBatch), so that post-processing
+ * tools need not hold every cell of a large file as a string.
+ */
+
+#ifndef PSMBATCHREADER_H
+#define PSMBATCHREADER_H
+
+#include <string>
+#include <vector>
+#include "PSMBatch.h"
+
+class PSMBatchReader {
+
+ public:
+  /**
+   * \returns A batch holding those of the given columns that the file has,
+   * or NULL if the file cannot be mapped. Unless max_rank is 0, rows whose
+   * xcorr rank is above max_rank are left out. The caller owns the batch.
+   */
+  static PSMBatch* read(
+    const std::string& file_path, ///< tab-delimited file with a header
+    const std::vector<int>& columns, ///< MATCH_COLUMNS_T to keep
+    int max_rank, ///< highest xcorr rank to keep, or 0 for all
+    int num_threads ///< number of threads to parse with
+  );
+
+ protected:
+  /**
+   * Parses the lines in [begin, end) into batch. file_columns[i] lists the
+   * batch columns read from the i-th cell of a line.
+   */
+  static void parseLines(
+    const char* begin,
+    const char* end,
+    const std::vector<std::vector<int> >* file_columns,
+    int rank_column, ///< cell holding the xcorr rank, or -1
+    int max_rank,
+    PSMBatch* batch
+  );
+
+  /**
+   * \returns The number in [begin, end), infinite for "Inf" or "-Inf", or
+   * NaN (an empty cell) if the cell is empty. Dies if the cell holds
+   * anything else.
+   */
+  static double parseNumber(
+    const char* begin,
+    const char* end,
+    int col ///< MATCH_COLUMNS_T of the cell, for the error message
+  );
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
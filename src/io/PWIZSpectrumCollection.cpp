@@ -146,6 +146,29 @@ bool PWIZSpectrumCollection::parse() {
     return false;
   }
 
+  parseSpectra(NULL);
+  is_parsed_ = true;
+
+  return true;
+}
+
+/**
+ * Parses the spectra one at a time, passing each to handler as it is read.
+ * \returns True if the spectra are parsed successfully. False if otherwise.
+ */
+bool PWIZSpectrumCollection::parseEach(
+  Crux::SpectrumHandler* handler ///< receives each spectrum -in
+  ) {
+  return parseSpectra(handler);
+}
+
+/**
+ * Parses the spectra in the requested scan range, handing each to handler
+ * or, if handler is NULL, adding it to the collection.
+ */
+bool PWIZSpectrumCollection::parseSpectra(
+  Crux::SpectrumHandler* handler ///< receives each spectrum, or NULL -in
+  ) {
   carp(CARP_DEBUG, "Using proteowizard to parse spectra.");
 
   // todo see getFilters() below
@@ -238,16 +261,19 @@ bool PWIZSpectrumCollection::parse() {
     }
 
     Crux::Spectrum* crux_spectrum = new Crux::Spectrum();
-    if (crux_spectrum->parsePwizSpecInfo(spectrum, scan_number_begin, scan_number_end)) {
-      addSpectrumToEnd(crux_spectrum);
-      spectraByScan_[scan_number_begin] = crux_spectrum;
-    } else {
+    if (!crux_spectrum->parsePwizSpecInfo(spectrum, scan_number_begin, scan_number_end)) {
+      delete crux_spectrum;
+    } else if (handler) {
+      bool more = handler->handle(crux_spectrum);
       delete crux_spectrum;
+      if (!more) {
+        return false;
+      }
+    } else {
+      addSpectrumToEnd(crux_spectrum);
     }
   }
 
-  is_parsed_ = true;
-
   return true;
 }
 
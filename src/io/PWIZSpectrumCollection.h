@@ -30,7 +30,17 @@ class PWIZSpectrumCollection : public Crux::SpectrumCollection {
     int& first_scan, ///< first scan -out
     int& last_scan ///< last scan -out
   );
-  
+
+  /**
+   * Parses the spectra in the requested scan range. Each one is passed to
+   * handler and then deleted or, if handler is NULL, added to the
+   * collection.
+   * \returns FALSE if handler stopped parsing, TRUE otherwise.
+   */
+  bool parseSpectra(
+    Crux::SpectrumHandler* handler ///< receives each spectrum, or NULL -in
+  );
+
  public:
   /**
    * Constructor sets filename and initializes member variables.
@@ -51,6 +61,16 @@ class PWIZSpectrumCollection : public Crux::SpectrumCollection {
    */
   virtual bool parse();
 
+  /**
+   * Parses the spectra one at a time, passing each to handler as it is
+   * read, so that memory use is bounded by a single spectrum.
+   * \returns TRUE if the spectra are parsed successfully and handler did
+   * not stop parsing. FALSE if otherwise.
+   */
+  virtual bool parseEach(
+    Crux::SpectrumHandler* handler ///< receives each spectrum -in
+  );
+
   /**
    * Parses a single spectrum from a spectrum_collection with first scan
    * number equal to first_scan.
@@ -12,6 +12,7 @@
 #include "unistd.h"
 #endif
 #include "parameter.h"
+#include <algorithm>
 #include <cerrno>
 #include <cstring>
 #include "io/carp.h"
@@ -128,22 +129,32 @@ bool SpectrumCollection::getSpectrum(
   Spectrum* spectrum   ///< Put the spectrum info here
 ) {
   map<int, Spectrum*>::const_iterator i = spectraByScan_.find(first_scan);
-  if (i != spectraByScan_.end()) {
-    spectrum->copyFrom(i->second);
-    return true;
+  if (i == spectraByScan_.end()) {
+    return false;
   }
-  for (SpectrumIterator spectrum_iterator = this->begin();
-       spectrum_iterator != this->end();
-       ++spectrum_iterator) {
-    if ((*spectrum_iterator)->getFirstScan() == first_scan) {
-      spectrum->copyFrom(*spectrum_iterator);
-      return true;
+  spectrum->copyFrom(i->second);
+  return true;
+}
+
+
+/**
+ * Parses the spectra from the file one at a time, passing each to
+ * handler. Parses the whole file first; see the header.
+ */
+bool SpectrumCollection::parseEach(
+  SpectrumHandler* handler ///< receives each spectrum -in
+  ) {
+  if (!is_parsed_ && !parse()) {
+    return false;
+  }
+  for (SpectrumIterator i = begin(); i != end(); ++i) {
+    if (!handler->handle(*i)) {
+      return false;
     }
   }
-  return false;
+  return true;
 }
 
-
 /**
  * Adds a spectrum to the spectrum_collection.
  * adds the spectrum to the end of the spectra array
@@ -156,9 +167,21 @@ void SpectrumCollection::addSpectrumToEnd(
   ) {
   // set spectrum
   spectra_.push_back(spectrum);
+  // of spectra with the same first scan, the last one added is looked up
+  spectraByScan_[spectrum->getFirstScan()] = spectrum;
   num_charged_spectra_ += spectrum->getNumZStates();
 }
 
+/**
+ * Orders spectra by first scan, for addSpectrum().
+ */
+static bool compareFirstScan(
+  int first_scan,  ///< first scan of the spectrum being added
+  const Spectrum* spectrum  ///< spectrum already in the collection
+  ) {
+  return first_scan < spectrum->getFirstScan();
+}
+
 /**
  * Adds a spectrum to the spectrum_collection.
  * adds the spectrum in correct order into the spectra array
@@ -167,19 +190,13 @@ void SpectrumCollection::addSpectrumToEnd(
 void SpectrumCollection::addSpectrum(
   Spectrum* spectrum ///< spectrum to add to spectrum_collection -in
   ) {
-    
-  unsigned int add_index = 0;
-
-  // find correct location
-  // TODO -- replace with binary search if necessary.
-  for(; add_index < spectra_.size(); ++add_index) {
-    if(spectra_[add_index]->getFirstScan() >
-       spectrum->getFirstScan()) {
-      break;
-    }
-  }
+  // find correct location: after any spectra with the same first scan
+  deque<Spectrum*>::iterator position = upper_bound(
+    spectra_.begin(), spectra_.end(), spectrum->getFirstScan(),
+    compareFirstScan);
 
-  spectra_.insert(spectra_.begin()+add_index, spectrum);
+  spectra_.insert(position, spectrum);
+  spectraByScan_[spectrum->getFirstScan()] = spectrum;
 
   num_charged_spectra_ += spectrum->getNumZStates();
 }
@@ -204,9 +221,24 @@ void SpectrumCollection::removeSpectrum(
   
   num_charged_spectra_ -= spectrum->getNumZStates();
 
+  map<int, Spectrum*>::iterator by_scan = spectraByScan_.find(scan_num);
+  bool unmapped = by_scan != spectraByScan_.end() &&
+    by_scan->second == spectra_[spectrum_index];
+  if (unmapped) {
+    spectraByScan_.erase(by_scan);
+  }
   delete spectra_[spectrum_index];
   spectra_[spectrum_index] = NULL;
   spectra_.erase(spectra_.begin() + spectrum_index);
+  if (unmapped) {
+    // fall back to the last remaining spectrum with the same first scan
+    for (deque<Spectrum*>::reverse_iterator i = spectra_.rbegin(); i != spectra_.rend(); ++i) {
+      if ((*i)->getFirstScan() == scan_num) {
+        spectraByScan_[scan_num] = *i;
+        break;
+      }
+    }
+  }
 } 
 
 /**
@@ -13,11 +13,31 @@
 
 #include <deque>
 
+namespace Crux {
+
+/**
+ * \class SpectrumHandler
+ * \brief Receives the spectra of a file one at a time; see
+ * SpectrumCollection::parseEach().
+ */
+class SpectrumHandler {
+ public:
+  virtual ~SpectrumHandler() {}
+
+  /**
+   * Called for each spectrum, in file order. The spectrum remains owned by
+   * the caller and is only valid during the call.
+   * \returns FALSE to stop parsing.
+   */
+  virtual bool handle(
+    Crux::Spectrum* spectrum ///< the next spectrum -in
+  ) = 0;
+};
+
 /**
  * \class SpectrumCollection
  * \brief An abstract class for accessing spectra from a file.
  */
-namespace Crux {
 
 class SpectrumCollection {
 
@@ -25,7 +45,7 @@ class SpectrumCollection {
 
  protected:
   std::deque<Crux::Spectrum*> spectra_;  ///< spectra from the file
-  std::map<int, Crux::Spectrum*> spectraByScan_;
+  std::map<int, Crux::Spectrum*> spectraByScan_; ///< spectra_ by first scan
   std::string filename_;                  ///< filename
   bool is_parsed_;      ///< file has been read and spectra_ populated 
   int num_charged_spectra_;  ///< sum of all charge states from all spectra
@@ -88,6 +108,19 @@ class SpectrumCollection {
    */
   virtual bool parse() = 0;
 
+  /**
+   * Parses the spectra from the file one at a time, passing each to
+   * handler, without keeping them in the collection. This base version
+   * parses the whole file first; parsers that can read spectra
+   * incrementally override it so that memory use is bounded by a single
+   * spectrum.
+   * \returns TRUE if the spectra are parsed successfully and handler did
+   * not stop parsing. FALSE if otherwise.
+   */
+  virtual bool parseEach(
+    SpectrumHandler* handler ///< receives each spectrum -in
+  );
+
   /**
    * Parses a single spectrum from a spectrum_collection with first scan
    * number equal to first_scan.
@@ -8,6 +8,7 @@
 #include "SpectrumRecordWriter.h"
 #include "io/carp.h"
 #include "util/crux-utils.h"
+#include "util/FileUtils.h"
 
 // For printing uint64_t values
 #define __STDC_FORMAT_MACROS
@@ -17,6 +18,30 @@
 
 int SpectrumRecordWriter::scanCounter_ = 0;
 
+/**
+ * Writes each spectrum it is handed to a spectrumrecords file.
+ */
+class SpectrumRecordWriter::PbSpectrumWriter : public Crux::SpectrumHandler {
+ public:
+  explicit PbSpectrumWriter(HeadedRecordWriter* writer) : writer_(writer) {}
+
+  virtual bool handle(Crux::Spectrum* spectrum) {
+    spectrum->sortPeaks(_PEAK_LOCATION); // Sort by m/z
+    vector<pb::Spectrum> pb_spectra = getPbSpectra(spectrum);
+    for (vector<pb::Spectrum>::const_iterator j = pb_spectra.begin();
+         j != pb_spectra.end();
+         ++j) {
+      if (!writer_->Write(&*j)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+ private:
+  HeadedRecordWriter* writer_;
+};
+
 /**
  * Converts a spectra file to spectrumrecords format for use with tide-search.
  * Spectra file is read by pwiz. Returns true on successful conversion.
@@ -27,18 +52,6 @@ bool SpectrumRecordWriter::convert(
 ) {
   auto_ptr<Crux::SpectrumCollection> spectra(SpectrumCollectionFactory::create(infile.c_str()));
 
-  // Open infile
-  try {
-    if (!spectra->parse()) {
-      return false;
-    }
-  } catch (const std::exception& e) {
-    carp(CARP_ERROR, "%s", e.what());
-    return false;
-  } catch (...) {
-    return false;
-  }
-
   // Write outfile
   pb::Header header;
   header.set_file_type(pb::Header::SPECTRA);
@@ -51,6 +64,27 @@ bool SpectrumRecordWriter::convert(
 
   header.mutable_spectra_header()->set_sorted(false);
 
+  // Write to a temporary file that only replaces outfile once every
+  // spectrum is written, so that a failed conversion leaves no truncated
+  // spectrumrecords file behind
+  string tmpfile = outfile + ".tmp";
+  if (!writeSpectra(spectra.get(), tmpfile, header)) {
+    FileUtils::Remove(tmpfile);
+    return false;
+  }
+  FileUtils::Rename(tmpfile, outfile);
+  return true;
+}
+
+/**
+ * Writes the header and then each spectrum to a spectrumrecords file.
+ * Returns true on success.
+ */
+bool SpectrumRecordWriter::writeSpectra(
+  Crux::SpectrumCollection* spectra,  ///< spectra to write
+  const string& outfile,  ///< spectrumrecords file to output
+  const pb::Header& header  ///< header of the file
+) {
   HeadedRecordWriter writer(outfile, header);
   if (!writer.OK()) {
     return false;
@@ -58,15 +92,18 @@ bool SpectrumRecordWriter::convert(
 
   scanCounter_ = 0;
 
-  // Go through the spectrum list and write each spectrum
-  for (SpectrumIterator i = spectra->begin(); i != spectra->end(); ++i) {
-    (*i)->sortPeaks(_PEAK_LOCATION); // Sort by m/z
-    vector<pb::Spectrum> pb_spectra = getPbSpectra(*i);
-    for (vector<pb::Spectrum>::const_iterator j = pb_spectra.begin();
-         j != pb_spectra.end();
-         ++j) { 
-      writer.Write(&*j);
+  // Go through the spectra as they are parsed and write each one, rather
+  // than parsing the whole file into memory first
+  PbSpectrumWriter spectrum_writer(&writer);
+  try {
+    if (!spectra->parseEach(&spectrum_writer)) {
+      return false;
     }
+  } catch (const std::exception& e) {
+    carp(CARP_ERROR, "%s", e.what());
+    return false;
+  } catch (...) {
+    return false;
   }
 
   return true;
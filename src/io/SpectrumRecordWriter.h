@@ -2,10 +2,15 @@
 #define SPECTRUM_RECORD_WRITER_H
 
 #include "model/Spectrum.h"
+#include "header.pb.h"
 #include "spectrum.pb.h"
 
 using namespace std;
 
+namespace Crux {
+  class SpectrumCollection;
+}
+
 /**
  * A class for converting spectra file to the spectrumrecords format for use
  * with tide-search.
@@ -16,7 +21,9 @@ class SpectrumRecordWriter {
 
   /**
    * Converts a spectra file to spectrumrecords format for use with tide-search.
-   * Spectra file is read by pwiz. Returns true on successful conversion.
+   * Spectra file is read by pwiz. Spectra are converted and written one at a
+   * time as they are parsed, into a temporary file that replaces outfile
+   * only on success. Returns true on successful conversion.
    */
   static bool convert(
     const string& infile, ///< spectra file to convert
@@ -25,8 +32,20 @@ class SpectrumRecordWriter {
 
  protected:
 
+  class PbSpectrumWriter;
+
   static int scanCounter_;
 
+  /**
+   * Writes the header and then each spectrum to a spectrumrecords file.
+   * Returns true on success.
+   */
+  static bool writeSpectra(
+    Crux::SpectrumCollection* spectra,  ///< spectra to write
+    const string& outfile,  ///< spectrumrecords file to output
+    const pb::Header& header  ///< header of the file
+  );
+
   /**
    * Return a pb::Spectrum from a Crux::Spectrum
    * Returns a default instance if there is a problem
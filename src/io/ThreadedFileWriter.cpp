@@ -0,0 +1,107 @@
+/**
+ * \file ThreadedFileWriter.cpp
+ * \brief Object for writing to one file from several threads.
+ */
+
+#include "ThreadedFileWriter.h"
+
+using namespace std;
+
+ThreadedFileWriter::ThreadedFileWriter(
+  ofstream* file,
+  int num_threads,
+  size_t buffer_size
+) : file_(file), buffer_size_(buffer_size), max_pending_(2 * num_threads + 2),
+    closing_(false), writer_(NULL) {
+  for (int i = 0; i < num_threads; i++) {
+    ostringstream* buffer = new ostringstream();
+    if (file_) {
+      buffer->copyfmt(*file_);
+    }
+    buffers_.push_back(buffer);
+  }
+  writer_ = new boost::thread(boost::bind(&ThreadedFileWriter::writeLoop, this));
+}
+
+ThreadedFileWriter::~ThreadedFileWriter() {
+  close();
+  for (vector<ostringstream*>::iterator i = buffers_.begin(); i != buffers_.end(); i++) {
+    delete *i;
+  }
+}
+
+void ThreadedFileWriter::commit(int thread) {
+  if ((size_t)buffers_[thread]->tellp() >= buffer_size_) {
+    handOff(thread);
+  }
+}
+
+void ThreadedFileWriter::close() {
+  if (!writer_) {
+    return;
+  }
+  for (size_t i = 0; i < buffers_.size(); i++) {
+    handOff(i);
+  }
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    closing_ = true;
+  }
+  pending_cond_.notify_one();
+  writer_->join();
+  delete writer_;
+  writer_ = NULL;
+  if (file_) {
+    file_->flush();
+  }
+}
+
+/**
+ * Moves the thread's buffer to the queue of pending writes. Blocks while
+ * the writer thread is too far behind, so memory use stays bounded.
+ */
+void ThreadedFileWriter::handOff(int thread) {
+  ostringstream* buffer = buffers_[thread];
+  if (buffer->tellp() <= 0) {
+    return;
+  }
+  string contents = buffer->str();
+  buffer->str("");
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    while (pending_.size() >= max_pending_) {
+      space_cond_.wait(lock);
+    }
+    pending_.push_back(string());
+    pending_.back().swap(contents);
+  }
+  pending_cond_.notify_one();
+}
+
+void ThreadedFileWriter::writeLoop() {
+  while (true) {
+    string contents;
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      while (pending_.empty() && !closing_) {
+        pending_cond_.wait(lock);
+      }
+      if (pending_.empty()) {
+        return;
+      }
+      contents.swap(pending_.front());
+      pending_.pop_front();
+    }
+    space_cond_.notify_all();
+    if (file_) {
+      file_->write(contents.data(), contents.size());
+    }
+  }
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
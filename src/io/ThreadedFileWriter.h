@@ -0,0 +1,83 @@
+/**
+ * \file ThreadedFileWriter.h
+ * \brief Object for writing to one file from several threads.
+ * Each thread formats its output into a private buffer, without taking
+ * any lock.  When a buffer has grown past a threshold the thread hands
+ * it over to a background thread, which is the only one that writes to
+ * the file.  Output from one thread stays in the order it was written;
+ * output from different threads is interleaved in whole buffers.
+ */
+
+#ifndef THREADED_FILE_WRITER_H
+#define THREADED_FILE_WRITER_H
+
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/thread.hpp>
+
+class ThreadedFileWriter {
+
+ public:
+  /**
+   * \returns A ThreadedFileWriter appending to the given file on behalf
+   * of num_threads threads. Buffers are handed off once they hold
+   * buffer_size bytes.
+   */
+  ThreadedFileWriter(
+    std::ofstream* file, ///< the file to write to
+    int num_threads, ///< number of threads that will write
+    size_t buffer_size = 1 << 20 ///< hand-off threshold in bytes
+  );
+
+  /**
+   * Destructor. Calls close().
+   */
+  ~ThreadedFileWriter();
+
+  /**
+   * \returns The private buffer of the given thread. Only that thread may
+   * write to it. The buffer is formatted like the underlying file.
+   */
+  std::ostream* buffer(int thread) {
+    return buffers_[thread];
+  }
+
+  /**
+   * Called by a thread between records; hands its buffer to the writer
+   * thread if it is full.
+   */
+  void commit(int thread);
+
+  /**
+   * Writes out all buffers and waits until everything is in the file.
+   * The writer may not be used afterwards.
+   */
+  void close();
+
+ protected:
+  void handOff(int thread);
+  void writeLoop();
+
+  std::ofstream* file_; ///< the file to write to
+  std::vector<std::ostringstream*> buffers_; ///< one per thread
+  size_t buffer_size_; ///< hand-off threshold
+  std::deque<std::string> pending_; ///< buffers waiting to be written
+  size_t max_pending_; ///< writers block while this many are waiting
+  bool closing_;
+  boost::mutex mutex_;
+  boost::condition_variable pending_cond_; ///< signalled on new work
+  boost::condition_variable space_cond_; ///< signalled when work is taken
+  boost::thread* writer_;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
@@ -12,6 +12,23 @@ double MathUtil::Round(double x, int decimals) {
     : ceil(x * shift - 0.5) / shift;
 }
 
+double MathUtil::RoundSignificant(double x, int digits) {
+  if (x == 0 || std::isinf(x) || std::isnan(x)) {
+    return x;
+  }
+  int decimals = digits - 1 - (int)floor(log10(fabs(x)));
+  if (abs(decimals) > 300) {
+    return x; // 10^decimals would overflow or underflow
+  } else if (decimals >= 0) {
+    return Round(x, decimals);
+  }
+  // 10^decimals is inexact for negative decimals, so divide by its inverse
+  double shift = pow(10.0, -decimals);
+  return (x >= 0)
+    ? floor(x / shift + 0.5) * shift
+    : ceil(x / shift - 0.5) * shift;
+}
+
 bool MathUtil::AlmostEqual(double x, double y, int precision) {
   return abs(x - y) < 5*pow(10.0, -(precision + 1));
 }
@@ -9,6 +9,9 @@
 class MathUtil {
  public:
   static double Round(double x, int decimals = 0);
+  // Rounds x to the given number of significant digits; halfway cases
+  // are rounded away from zero, as in Round().
+  static double RoundSignificant(double x, int digits);
   static bool AlmostEqual(double x, double y, int precision);
 
   template<typename T>
@@ -0,0 +1,93 @@
+/**
+ * \file ParallelSort.h
+ * \brief Sorts a vector on several threads.
+ * The vector is cut into equal parts, which are sorted on their own
+ * threads and then merged pairwise, the merges of each level also running
+ * side by side. Both steps are stable, so elements that compare equal keep
+ * their original order and the result is the sequence std::stable_sort
+ * would give, whatever the number of threads.
+ */
+
+#ifndef PARALLELSORT_H
+#define PARALLELSORT_H
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+class ParallelSort {
+ public:
+  /**
+   * Stably sorts values by less, using up to num_threads threads. Vectors
+   * too small to be worth splitting are sorted on the calling thread.
+   */
+  template<typename T, typename Compare>
+  static void Sort(std::vector<T>& values, Compare less, int num_threads) {
+    size_t parts = num_threads > 1 ? (size_t)num_threads : 1;
+    parts = std::min(parts, values.size() / MIN_PART_SIZE);
+    if (parts < 2) {
+      std::stable_sort(values.begin(), values.end(), less);
+      return;
+    }
+    std::vector<size_t> bounds;
+    for (size_t i = 0; i <= parts; i++) {
+      bounds.push_back(values.size() * i / parts);
+    }
+
+    boost::thread_group threads;
+    for (size_t i = 1; i < parts; i++) {
+      threads.create_thread(boost::bind(&ParallelSort::SortRange<T, Compare>,
+        &values, bounds[i], bounds[i + 1], less));
+    }
+    SortRange<T, Compare>(&values, bounds[0], bounds[1], less);
+    threads.join_all();
+
+    for (size_t width = 1; width < parts; width *= 2) {
+      boost::thread_group merges;
+      for (size_t i = 0; i + width < parts; i += 2 * width) {
+        merges.create_thread(boost::bind(&ParallelSort::MergeRanges<T, Compare>,
+          &values, bounds[i], bounds[i + width],
+          bounds[std::min(i + 2 * width, parts)], less));
+      }
+      merges.join_all();
+    }
+  }
+
+  /**
+   * Sorts values in their natural order; see above.
+   */
+  template<typename T>
+  static void Sort(std::vector<T>& values, int num_threads) {
+    Sort(values, std::less<T>(), num_threads);
+  }
+
+ private:
+  static const size_t MIN_PART_SIZE = 16384;
+
+  template<typename T, typename Compare>
+  static void SortRange(std::vector<T>* values, size_t begin, size_t end, Compare less) {
+    std::stable_sort(values->begin() + begin, values->begin() + end, less);
+  }
+
+  // Equal elements of the left part come first, as in std::stable_sort.
+  template<typename T, typename Compare>
+  static void MergeRanges(std::vector<T>* values, size_t begin, size_t middle, size_t end,
+                          Compare less) {
+    std::inplace_merge(values->begin() + begin, values->begin() + middle,
+                       values->begin() + end, less);
+  }
+
+  ParallelSort();
+  ~ParallelSort();
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
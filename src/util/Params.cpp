@@ -293,10 +293,29 @@ Params::Params() : finalized_(false) {
     "then a second file will be created containing the decoy peptides. Decoys that also "
     "appear in the target database are marked with an asterisk in a third column.",
     "Available for tide-index.", true);
+  InitBoolParam("mmap-index", false,
+    "Also store the peptides in a fixed-layout file (pepix.mmap) in the index "
+    "directory. tide-search maps this file into memory and reads the peptides "
+    "in place, which is faster than decoding them from pepix. The file is "
+    "specific to the platform on which it was created.",
+    "Available for tide-index.", true);
+  InitBoolParam("precompute-peaks", false,
+    "Store the theoretical peaks of every peptide in the index, binned according to "
+    "mz-bin-width and mz-bin-offset. tide-search then skips computing the peaks when "
+    "it is run with the same mz-bin-width and mz-bin-offset. This makes the index "
+    "several times larger.",
+    "Available for tide-index.", true);
   InitIntParam("modsoutputter-threshold", 1000, 0, BILLION,
     "Maximum number of temporary files that would be opened by ModsOutputter "
-    "before switching to ModsOutputterAlt.",
+    "before switching to ModsOutputterAlt. Also the most temporary files "
+    "ModsOutputterAlt merges at once.",
     "Available for tide-index.", false);
+  InitIntParam("modsoutputter-memory", 1024, 2, BILLION,
+    "Memory, in megabytes, that tide-index may use to sort modified peptides when "
+    "there are too many combinations of modifications to sort them by count "
+    "(see modsoutputter-threshold). Peptides beyond this are sorted in batches "
+    "written to temporary files and merged afterwards.",
+    "Available for tide-index.", true);
   // print-processed-spectra option
   InitStringParam("stop-after", "xcorr", "remove-precursor|square-root|"
     "remove-grass|ten-bin|xcorr",
@@ -325,8 +344,18 @@ Params::Params() : finalized_(false) {
     "Output a pepXML results file to the output directory.",
     "Available for tide-search, percolator.", true);
   InitBoolParam("txt-output", true,
-    "Output a tab-delimited results file to the output directory.",
+    "Output a tab-delimited results file to the output directory. In tide-search, "
+    "this is independent of binary-output; the tab-delimited file is also written "
+    "when pin-output, pepxml-output, mzid-output or sqt-output is T, since those "
+    "formats are converted from it.",
     "Available for tide-search, percolator.", true);
+  InitBoolParam("binary-output", false,
+    "Output a binary results file (tide-search.target.psm) to the output directory. "
+    "It holds the columns of the tab-delimited file in a compact, columnar form "
+    "that psm-convert, assign-confidence and make-pin read in place of the "
+    "tab-delimited file. Whether the tab-delimited file is also written is "
+    "decided by txt-output alone.",
+    "Available for tide-search.", true);
   InitStringParam("prelim-score-type", "sp", "sp|xcorr",
     "Initial scoring (sp, xcorr).",
     "The score applied to all possible psms for a given spectrum. Typically "
@@ -358,13 +387,13 @@ Params::Params() : finalized_(false) {
     "formula for computing the discretized m/z value is floor((x/mz-bin-width) + 1.0 - mz-bin-offset), where x is the observed m/z "
     "value. For low resolution ion trap ms/ms data 1.0005079 and for high resolution ms/ms "
     "0.02 is recommended.",
-    "Available for tide-search.", true);
+    "Available for tide-search, and for tide-index with precompute-peaks=T.", true);
   InitDoubleParam("mz-bin-offset", 0.40, 0.0, 1.0,
     "In the discretization of the m/z axes of the observed and theoretical spectra, this "
     "parameter specifies the location of the left edge of the first bin, relative to "
     "mass = 0 (i.e., mz-bin-offset = 0.xx means the left edge of the first bin will be "
     "located at +0.xx Da).",
-    "Available for tide-search.", true);
+    "Available for tide-search, and for tide-index with precompute-peaks=T.", true);
   InitStringParam("auto-mz-bin-width", "false", "false|warn|fail",
     "Automatically estimate optimal value for the mz-bin-width parameter "
     "from the spectra themselves. false=no estimation, warn=try to estimate "
@@ -869,7 +898,37 @@ Params::Params() : finalized_(false) {
                   "Available for tide-search", true);
   InitIntParam("num-threads", 1, 0, 64,
                "0=poll CPU to set num threads; else specify num threads directly.",
-               "Available for tide-search tab-delimited files only.", true);
+               "Available for tide-search tab-delimited files only, for the protein "
+               "digestion, target deduplication and protein-reverse decoys of "
+               "tide-index (shuffled decoys are always generated on one thread, so "
+               "that --seed gives the same decoys), for reading tab-delimited results in "
+               "assign-confidence, make-pin and spectral-counts, and for sorting "
+               "scores in assign-confidence. Scores that tie keep their input order, "
+               "so assign-confidence reports the same results for any number of "
+               "threads.", true);
+  InitBoolParam("shared-peptide-queue", false,
+    "When searching with multiple threads, decode the peptide index, compute theoretical "
+    "peaks and compile scoring programs once, in a single window of candidate peptides "
+    "shared by all threads, rather than once per thread. Applies only to XCorr searches "
+    "without exact p-values.",
+    "Available for tide-search.", true);
+  InitStringParam("scoring-kernel", "auto", "auto|compiled|simd|scalar",
+    "How tide-search computes the dot products of theoretical and observed peaks. "
+    "<code>compiled</code> generates a machine-code program for every candidate peptide "
+    "and is only available on x86 processors. <code>simd</code> scores plain arrays "
+    "of peaks, using AVX2 instructions where the processor supports them, and needs "
+    "no executable memory. <code>scalar</code> is as <code>simd</code> without SIMD "
+    "instructions. <code>auto</code> selects <code>compiled</code> on x86 and "
+    "<code>simd</code> elsewhere. All kernels give identical scores.",
+    "Available for tide-search.", true);
+  InitIntParam("spectrum-block-size", 1, 1, 16,
+    "Score up to this many neighboring spectra together against a single window of "
+    "candidate peptides covering all of them, so that each candidate's theoretical peaks "
+    "are read once per block rather than once per spectrum. With the <code>simd</code> "
+    "and <code>scalar</code> scoring kernels the blocked spectra are laid out side by side "
+    "and scored in one pass. Most useful with wide precursor windows. Applies only to "
+    "XCorr searches without exact p-values or Tailor calibration; results are unchanged.",
+    "Available for tide-search.", true);
   InitBoolParam("brief-output", false,
     "Output in tab-delimited text only the file name, scan number, charge, score and peptide.",
     "Available for tide-search", true);
@@ -1410,8 +1469,9 @@ Params::Params() : finalized_(false) {
       "given amount.", "", visible);
   }
   /* psm-convert options */
-  InitStringParam("input-format", "auto", "auto|tsv|sqt|pepxml|mzidentml",
-    "Legal values are auto, tsv, sqt, pepxml or mzidentml format.",
+  InitStringParam("input-format", "auto", "auto|tsv|psm|sqt|pepxml|mzidentml",
+    "Legal values are auto, tsv, psm (binary tide-search results), sqt, pepxml or "
+    "mzidentml format.",
     "option, for psm-convert", true);
   InitBoolParam("distinct-matches", true,
     "Whether matches/ion are distinct (as opposed to total).",
@@ -1653,6 +1713,11 @@ Params::Params() : finalized_(false) {
   InitStringParam("post-processor", "percolator", "percolator|assign-confidence|none",
     "Specify which post-processor to apply to the search results.",
     "Available for crux pipeline", true);
+  InitBoolParam("write-search-results", false,
+    "Write the tab-delimited results of tide-search to files. By default, they are "
+    "passed to the post-processor in memory and not written, unless another search "
+    "output format is requested or no post-processor is run.",
+    "Available for crux pipeline", true);
   // create-docs
   InitArgParam("tool-name",
     "Specifies the Crux tool to generate documentation for. If the value is "
@@ -2080,6 +2145,7 @@ void Params::Categorize() {
   items.insert("max-mods");
   items.insert("min-mods");
   items.insert("mod-precision");
+  items.insert("modsoutputter-memory");
   items.insert("mods-spec");
   items.insert("nterm-peptide-mods-spec");
   items.insert("nterm-protein-mods-spec");
@@ -2133,10 +2199,13 @@ void Params::Categorize() {
   items.insert("mz-bin-offset");
   items.insert("mz-bin-width");
   items.insert("peptide-centric-search");
+  items.insert("precompute-peaks");
   items.insert("remove-precursor-peak");
   items.insert("remove-precursor-tolerance");
   items.insert("scan-number");
+  items.insert("scoring-kernel");
   items.insert("skip-preprocessing");
+  items.insert("spectrum-block-size");
   items.insert("spectrum-charge");
   items.insert("spectrum-max-mz");
   items.insert("spectrum-min-mz");
@@ -2189,6 +2258,7 @@ void Params::Categorize() {
 
   items.clear();
   items.insert("num-threads");
+  items.insert("shared-peptide-queue");
   items.insert("num_threads");
   items.insert("threads");
   AddCategory("CPU threads", items);
@@ -2348,6 +2418,7 @@ void Params::Categorize() {
   AddCategory("param-medic options", items);
 
   items.clear();
+  items.insert("binary-output");
   items.insert("concat");
   items.insert("decoy-prefix");
   items.insert("decoy-xml-output");
@@ -2357,6 +2428,7 @@ void Params::Categorize() {
   items.insert("brief-output");
   items.insert("list-of-files");
   items.insert("mass-precision");
+  items.insert("mmap-index");
   items.insert("mzid-output");
   items.insert("num_output_lines");
   items.insert("output-dir");
@@ -20,4 +20,8 @@ Examples:
   |sidak            |--score "exact p-value" --sidak T                        |assign-exactpval.target.txt|assign-confidence.target.txt|assign-confidence-sidak.target.txt       |
   |peptide-level    |--score "exact p-value" --estimation-method peptide-level|assign-exactpval.target.txt|assign-confidence.target.txt|assign-confidence-peptidelevel.target.txt|
   |atdc             |                                                         |tide-5d.target.txt         |assign-confidence.target.txt|assign-confidence-atdc.target.txt        |
+  # Tab-delimited inputs are parsed by several threads
+  |xcorr-threads    |--num-threads 4                                          |assign-default.target.txt  |assign-confidence.target.txt|assign-confidence-default.target.txt     |
+  |concat-threads   |--num-threads 4                                          |assign-concat.txt          |assign-confidence.target.txt|assign-confidence-concat.target.txt      |
+  |atdc-threads     |--num-threads 4                                          |tide-5d.target.txt         |assign-confidence.target.txt|assign-confidence-atdc.target.txt        |
 
@@ -31,3 +31,9 @@ Examples:
   |cascade-comb-cs|--estimation-method peptide-level --combine-charge-states T     |small_yeast_index,small_yeast_index_mc1|demo.ms2|cascade-search.target.txt|cascade-comb-cs.txt |
   |cascade-comb-mp|--estimation-method peptide-level --combine-modified-peptides T |small_yeast_index,small_yeast_index_mc1|demo.ms2|cascade-search.target.txt|cascade-comb-mp.txt |
   |cascade-file-column|--file-column F                                             |small_yeast_index                      |demo.ms2|cascade-search.target.txt|cascade-file-column.txt|
+  # Rounds reuse the spectra and PSMs held in memory; results match those of
+  # the file-based rounds the expected outputs were made with
+  |cascade-default-threads|--num-threads 4                                           |small_yeast_index                      |demo.ms2|cascade-search.target.txt|cascade-default.txt |
+  |cascade-2-index-threads|--num-threads 4                                           |small_yeast_index,small_yeast_index_mc1|demo.ms2|cascade-search.target.txt|cascade-2-index.txt |
+  |cascade-pep-lvl-threads|--estimation-method peptide-level --num-threads 4        |small_yeast_index,small_yeast_index_mc1|demo.ms2|cascade-search.target.txt|cascade-pep-lvl.txt |
+  |cascade-extpval-threads|--score "exact p-value" --exact-p-value T --mz-bin-width 1.0005079 --num-threads 4|small_yeast_index,small_yeast_index_mc1|demo.ms2|cascade-search.target.txt|cascade-extpval.txt |
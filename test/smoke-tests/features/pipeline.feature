@@ -0,0 +1,24 @@
+Feature: tide-index / pipeline
+  pipeline should run a search engine and a post-processor on a collection of
+    spectra, reporting the same PSMs whether the search results are passed to
+    the post-processor in memory or through files
+
+Scenario Outline: User runs pipeline with and without writing search results
+  Given the path to Crux is ../../src/crux
+  And I want to run a test named <test_name>
+  And I pass the arguments --overwrite T small-yeast.fasta small_yeast_index
+  When I run tide-index as an intermediate step
+  Then the return value should be 0
+  And I pass the arguments --overwrite T --output-dir crux-output/<test_name>-files --write-search-results T <pipeline_args> demo.ms2 small_yeast_index
+  When I run pipeline as an intermediate step
+  Then the return value should be 0
+  And I pass the arguments --overwrite T --output-dir crux-output/<test_name>-memory <pipeline_args> demo.ms2 small_yeast_index
+  When I run pipeline
+  Then the return value should be 0
+  And crux-output/<test_name>-memory/<actual_output> should contain the same lines as crux-output/<test_name>-files/<actual_output>
+
+Examples:
+  |test_name           |pipeline_args                                                                          |actual_output               |
+  |pipeline-assign     |--post-processor assign-confidence                                                     |assign-confidence.target.txt|
+  |pipeline-assign-sp  |--post-processor assign-confidence --compute-sp T --num-threads 4                       |assign-confidence.target.txt|
+  |pipeline-percolator |--post-processor percolator --seed 7                                                   |percolator.target.psms.txt  |
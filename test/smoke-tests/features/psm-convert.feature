@@ -47,3 +47,26 @@ Examples:
   |psmconv-mzid-to-txt1|results1.mzid   |tsv       |psm-convert.txt    |psmconv-from-mzid1.txt   |
   |psmconv-mzid-to-txt2|results2.mzid   |tsv       |psm-convert.txt    |psmconv-from-mzid2.txt   |
 
+Scenario Outline: User converts a binary tide-search results file
+  Given the path to Crux is ../../src/crux
+  And I want to run a test named <test_name>
+  And I pass the arguments --overwrite T --seed 7 small-yeast.fasta tide_test_index
+  When I run tide-index as an intermediate step
+  Then the return value should be 0
+  And I pass the arguments --overwrite T --output-dir crux-output/<test_name> --binary-output T <search_args> demo.ms2 tide_test_index
+  When I run tide-search as an intermediate step
+  Then the return value should be 0
+  And I pass the arguments --overwrite T --output-dir crux-output/<test_name>-txt crux-output/<test_name>/<results>.txt tsv
+  When I run psm-convert as an intermediate step
+  Then the return value should be 0
+  And I pass the arguments --overwrite T crux-output/<test_name>/<results>.psm tsv
+  When I run psm-convert
+  Then the return value should be 0
+  And crux-output/psm-convert.txt should match crux-output/<test_name>-txt/psm-convert.txt with 7 digits precision
+
+Examples:
+  |test_name            |search_args                                                                                             |results                |
+  |psmconv-psm-default  |--precursor-window 3 --precursor-window-type mass --mz-bin-width 1.0005079                              |tide-search.target     |
+  |psmconv-psm-decoy    |--precursor-window 3 --precursor-window-type mass --mz-bin-width 1.0005079 --compute-sp T               |tide-search.decoy      |
+  |psmconv-psm-concat   |--precursor-window 3 --precursor-window-type mass --mz-bin-width 1.0005079 --concat T                   |tide-search            |
+  |psmconv-psm-exactpval|--precursor-window 3 --precursor-window-type mass --mz-bin-width 1.0005079 --exact-p-value T            |tide-search.target     |
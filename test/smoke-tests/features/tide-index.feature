@@ -16,9 +16,30 @@ Examples:
   |tide-default   |                                                                            |small-yeast.fasta|tide_test_index|tide-index.peptides.target.txt|tide-default.target.txt    |tide-index.peptides.decoy.txt|tide-default.decoy.txt    |
   |tide-dups      |--allow-dups T                                                              |small-yeast.fasta|tide_test_index|tide-index.peptides.target.txt|tide-dups.target.txt       |tide-index.peptides.decoy.txt|tide-dups.decoy.txt       |
   |tide-proteinReverse|--decoy-format PROTEIN-REVERSE                                          |small-yeast.fasta|tide_test_index|tide-index.peptides.target.txt|tide-reverse.target.txt    |tide-index.peptides.decoy.txt|tide-reverse.decoy.txt    |
+  |tide-default-threads|--num-threads 4                                                        |small-yeast.fasta|tide_test_index|tide-index.peptides.target.txt|tide-default.target.txt    |tide-index.peptides.decoy.txt|tide-default.decoy.txt    |
   |tide-temp-dir  |--temp-dir .                                                                |small-yeast.fasta|tide_test_index|tide-index.peptides.target.txt|tide-default.target.txt    |tide-index.peptides.decoy.txt|tide-default.decoy.txt    |
   |tide-no-enzyme |--enzyme no-enzyme                                                          |test.fasta       |tide_test_index|tide-index.peptides.target.txt|tide-no-enzyme.target.txt  |tide-index.peptides.decoy.txt|tide-no-enzyme.decoy.txt  |
   |tide-mods      |--mods-spec 2M+15.9949,2STY+79.9663 --max-mods 2                            |small-yeast.fasta|tide_test_index|tide-index.peptides.target.txt|tide-index-mods1.target.txt|tide-index.peptides.decoy.txt|tide-index-mods1.decoy.txt|
   |tide-mods-alt  |--mods-spec 2M+15.9949,2STY+79.9663 --max-mods 2 --modsoutputter-threshold 1|small-yeast.fasta|tide_test_index|tide-index.peptides.target.txt|tide-index-mods1.target.txt|tide-index.peptides.decoy.txt|tide-index-mods1.decoy.txt|
+  |tide-mods-merge|--mods-spec 2M+15.9949,2STY+79.9663 --max-mods 2 --modsoutputter-threshold 1 --modsoutputter-memory 2|small-yeast.fasta|tide_test_index|tide-index.peptides.target.txt|tide-index-mods1.target.txt|tide-index.peptides.decoy.txt|tide-index-mods1.decoy.txt|
   |tide-multidecoy|--num-decoys-per-target 5                                                   |small-yeast.fasta|tide_test_index|tide-index.peptides.target.txt|tide-default.target.txt    |tide-index.peptides.decoy.txt|tide-index-multi.decoy.txt|
 
+
+Scenario Outline: User runs tide-index on several threads
+  Given the path to Crux is ../../src/crux
+  And I want to run a test named <test_name>
+  And I pass the arguments --overwrite T --peptide-list T --output-dir crux-output/<test_name>-serial <index_args> <fasta> <test_name>_serial_index
+  When I run tide-index as an intermediate step
+  Then the return value should be 0
+  And I pass the arguments --overwrite T --peptide-list T --output-dir crux-output/<test_name>-threads --num-threads 4 <index_args> <fasta> <test_name>_threads_index
+  When I run tide-index
+  Then the return value should be 0
+  And crux-output/<test_name>-threads/tide-index.peptides.target.txt should match crux-output/<test_name>-serial/tide-index.peptides.target.txt
+  And crux-output/<test_name>-threads/tide-index.peptides.decoy.txt should match crux-output/<test_name>-serial/tide-index.peptides.decoy.txt
+
+Examples:
+  |test_name             |index_args                                      |fasta            |
+  |tide-threads          |                                                |small-yeast.fasta|
+  |tide-threads-semi     |--digestion partial-digest                      |small-yeast.fasta|
+  |tide-threads-no-enzyme|--enzyme no-enzyme                              |test.fasta       |
+  |tide-threads-mods     |--mods-spec 2M+15.9949,2STY+79.9663 --max-mods 2|small-yeast.fasta|
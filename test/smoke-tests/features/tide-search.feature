@@ -28,6 +28,8 @@ Examples:
   |tide-mods1min  |--mods-spec C+57.02146,2M+15.9949,1STY+79.966331 --min-mods 1|--precursor-window 3 --precursor-window-type mass --mz-bin-width 1.0005079|small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-mods1min.txt  |
   |tide-modsn     |--nterm-peptide-mods-spec 1E-18.0106,C-17.0265               |--precursor-window 3 --precursor-window-type mass --mz-bin-width 1.0005079|small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-modsn.txt     |
   |tide-modsc     |--cterm-peptide-mods-spec X+21.9819                          |--precursor-window 3 --precursor-window-type mass --mz-bin-width 1.0005079|small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-modsc.txt     |
+  |tide-stored-peaks|--precompute-peaks T --mz-bin-width 1.0005079              |--precursor-window 3 --precursor-window-type mass --mz-bin-width 1.0005079|small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default.txt   |
+  |tide-mmap-mods |--mods-spec C+57.02146,2M+15.9949,1STY+79.966331 --mmap-index T|--precursor-window 3 --precursor-window-type mass --mz-bin-width 1.0005079|small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-mods1.txt     |
   |tide-chymo     |--enzyme chymotrypsin                                        |--precursor-window 3 --precursor-window-type mass --mz-bin-width 1.0005079|small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-chymo.txt     |
   |tide-partial   |--digestion partial-digest                                   |--precursor-window 3 --precursor-window-type mass --mz-bin-width 1.0005079|small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-partial.txt   |
   |tide-misscleave|--missed-cleavages 2                                         |--precursor-window 3 --precursor-window-type mass --mz-bin-width 1.0005079|small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-misscleave.txt|
@@ -53,6 +55,9 @@ Examples:
   |tide-mzbins    |                                                             |--precursor-window 3 --precursor-window-type mass --mz-bin-width 0.02 --mz-bin-offset 0.34                                        |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-mzbins.txt    |
   |tide-1thread   |                                                             |--precursor-window 3 --precursor-window-type mass --num-threads 1 --mz-bin-width 1.0005079                                        |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default-1.txt   |
   |tide-7thread   |                                                             |--precursor-window 3 --precursor-window-type mass --num-threads 7 --mz-bin-width 1.0005079                                        |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default-7.txt   |
+  |tide-shared-queue|                                                           |--precursor-window 3 --precursor-window-type mass --num-threads 7 --mz-bin-width 1.0005079 --shared-peptide-queue T              |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default-7.txt   |
+  |tide-simd-kernel|                                                            |--precursor-window 3 --precursor-window-type mass --scoring-kernel simd --mz-bin-width 1.0005079                                 |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default.txt   |
+  |tide-spectrum-block|                                                         |--precursor-window 3 --precursor-window-type mass --scoring-kernel simd --spectrum-block-size 8 --mz-bin-width 1.0005079       |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default.txt   |
   |tide-exact-pval-1thread|                                                     |--precursor-window 3 --precursor-window-type mass --exact-p-value T --num-threads 1 --mz-bin-width 1.0005079                      |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-exact-pval-1.txt|
   |tide-exact-pval-7thread|                                                     |--precursor-window 3 --precursor-window-type mass --exact-p-value T --num-threads 7 --mz-bin-width 1.0005079                      |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-exact-pval-7.txt|
   |tide-concat    |                                                             |--precursor-window 3 --precursor-window-type mass --concat T --mz-bin-width 1.0005079                                             |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.txt       |tide-concat.txt    |
@@ -67,3 +72,33 @@ Examples:
   |tide-tailor|                                                                 |--precursor-window 3 --precursor-window-type mass --num-threads 1 --mz-bin-width 1.0005079 --use-tailor-calibration T             |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-tailor.txt|
   |tide-brief|                                                                  |--precursor-window 3 --precursor-window-type mass --num-threads 1 --mz-bin-width 1.0005079 --brief-output T                       |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-brief-output.txt|
   |tide-brief-centric|                                                          |--precursor-window 3 --precursor-window-type mass --num-threads 1 --mz-bin-width 1.0005079 --brief-output T --peptide-centric-search T |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-brief-peptide-centric.txt|
+  # Multithreaded runs must match the expected output of the serial ones
+  |tide-4thread  |                                                             |--precursor-window 3 --precursor-window-type mass --num-threads 4 --mz-bin-width 1.0005079|small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default.txt   |
+  |tide-multidecoy-7thread|--num-decoys-per-target 5                                    |--precursor-window 3 --precursor-window-type mass --num-threads 7 --mz-bin-width 1.0005079|small-yeast.fasta|tide_test_index|demo.ms2|tide-search.decoy.txt |tide-5decoys.txt   |
+  |tide-concat-7thread|                                                             |--precursor-window 3 --precursor-window-type mass --concat T --num-threads 7 --mz-bin-width 1.0005079|small-yeast.fasta|tide_test_index|demo.ms2|tide-search.txt       |tide-concat.txt    |
+  |tide-deiso-7thread|                                                             |--precursor-window 3 --precursor-window-type mass --deisotope 10 --num-threads 7 --mz-bin-width 1.0005079|small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-deiso.txt     |
+  |tide-tailor-7thread|                                                             |--precursor-window 3 --precursor-window-type mass --num-threads 7 --use-tailor-calibration T --mz-bin-width 1.0005079|small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-tailor.txt|
+  |tide-computesp-7thread|                                                             |--precursor-window 3 --precursor-window-type mass --compute-sp T --num-threads 7 --mz-bin-width 1.0005079|small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-computesp.txt |
+  |tide-mods1-7thread|--mods-spec C+57.02146,2M+15.9949,1STY+79.966331             |--precursor-window 3 --precursor-window-type mass --num-threads 7 --mz-bin-width 1.0005079|small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-mods1.txt     |
+
+Scenario Outline: User searches many spectra per thread and a single spectrum
+  Given the path to Crux is ../../src/crux
+  And I want to run a test named <test_name>
+  And I pass the arguments --overwrite T --seed 7 small-yeast.fasta tide_test_index
+  When I run tide-index as an intermediate step
+  Then the return value should be 0
+  And I pass the arguments --overwrite T --file-column F --output-dir crux-output/<test_name>-all --precursor-window 3 --precursor-window-type mass --mz-bin-width 1.0005079 --num-threads 1 <search_args> demo.ms2 tide_test_index
+  When I run tide-search as an intermediate step
+  Then the return value should be 0
+  And I pass the arguments --overwrite T --file-column F --output-dir crux-output/<test_name>-one --precursor-window 3 --precursor-window-type mass --mz-bin-width 1.0005079 --num-threads 1 --scan-number <scan> <search_args> demo.ms2 tide_test_index
+  When I run tide-search
+  Then the return value should be 0
+  And All lines in crux-output/<test_name>-one/tide-search.target.txt should be in crux-output/<test_name>-all/tide-search.target.txt with 5 digits precision
+
+Examples:
+  |test_name           |search_args                                        |scan|
+  |tide-one-xcorr      |                                                   |35  |
+  |tide-one-block      |--scoring-kernel simd --spectrum-block-size 8      |35  |
+  |tide-one-tailor     |--use-tailor-calibration T                         |35  |
+  |tide-one-exact-pval |--exact-p-value T                                  |35  |
+  |tide-one-resev      |--score-function residue-evidence --exact-p-value T|35  |